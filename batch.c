@@ -0,0 +1,370 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Make many albums in one process for --batch.
+ *
+ * The manifest has a section for each album:
+ *
+ *   [holiday]
+ *   output_dir = albums/holiday
+ *   input      = photos/holiday
+ *   input      = photos/extra/beach.jpg
+ *   title      = Holiday 2004
+ *
+ * "input" is a photo or a directory of photos, and may be
+ * repeated.  The other keys are those of the configuration
+ * file, and override the command line for the album.  Keys
+ * before the first section apply to all the albums.
+ * output_dir defaults to the name of the section, and the
+ * title is made from output_dir unless given.
+ *
+ * The albums are made concurrently by --batch-jobs threads,
+ * among which the memory limit is divided unless given for
+ * the album.  They share the
+ * image library, the parsed configuration and the templates
+ * read; the Flash movies are made one at a time since Ming
+ * is not thread-safe (see flash.c).  An error that would
+ * stop zphoto, rather than skip a photo, stops the batch.
+ *
+ * The files written for an album (the trace, the metrics,
+ * the failure report, ...) must not be shared with another
+ * album.  The profile and the codec and memory reports are
+ * of the process, so they are made once for the whole
+ * batch if any album asks for them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zphoto.h>
+#include "config.h"
+
+typedef struct {
+    char         *name;
+    ZphotoConfig *config;
+    char         **file_names;
+    int          nfiles;
+    int          output_dir_p;  /* given in the manifest */
+    int          title_p;
+    int          memory_limit_p;
+    double       seconds;
+} Album;
+
+typedef struct {
+    Album       *albums;
+    int         nalbums;
+    int         njobs;
+    int         quiet_p;
+    char        *profile;  /* NULL for none */
+    int         codec_report_p;
+    int         memory_report_p;
+} Batch;
+
+static Album *
+add_album (Batch *batch, const char *name, ZphotoConfig *defaults,
+           int title_p)
+{
+    Album *album;
+
+    batch->albums = zphoto_erealloc(batch->albums,
+                                    sizeof(Album) * (batch->nalbums + 1));
+    album = batch->albums + batch->nalbums++;
+    album->name       = zphoto_strdup(name);
+    album->config     = zphoto_config_copy(defaults);
+    album->file_names = NULL;
+    album->nfiles     = 0;
+    album->output_dir_p = 0;
+    album->title_p    = title_p;
+    album->memory_limit_p = 0;
+    album->seconds    = 0.0;
+    return album;
+}
+
+static void
+add_file (Album *album, char *file_name)
+{
+    album->file_names = zphoto_erealloc(album->file_names, sizeof(char *) *
+                                        (album->nfiles + 1));
+    album->file_names[album->nfiles++] = file_name;
+}
+
+static void
+add_input (Album *album, const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == -1)
+        zphoto_eprintf("%s:", path);
+    if (S_ISDIR(st.st_mode)) {
+        int i, nfiles;
+        char **file_names = zphoto_list_supported_files(path, &nfiles);
+
+        for (i = 0; i < nfiles; i++)
+            add_file(album, file_names[i]);
+        free(file_names);
+    } else {
+        add_file(album, zphoto_strdup(path));
+    }
+}
+
+static void
+read_manifest (Batch *batch, ZphotoConfig *config, const char *file_name)
+{
+    FILE *fp = zphoto_efopen(file_name, "r");
+    ZphotoConfig *defaults = zphoto_config_copy(config);
+    Album *album = NULL;
+    char line[BUFSIZ];
+    int lineno = 0, title_p = 0;
+
+    while (fgets(line, BUFSIZ, fp)) {
+        char *key, *value;
+        lineno++;
+
+        if (!zphoto_complete_line_p(line))
+            zphoto_eprintf("too long line in %s:%d", file_name, lineno);
+        zphoto_chomp(line);
+        if (line[0] == '#' || zphoto_blank_line_p(line))
+            continue;
+
+        if (line[0] == '[') {
+            char *end = strchr(line, ']');
+            if (end == NULL || end == line + 1 || !zphoto_blank_line_p(end + 1))
+                zphoto_eprintf("syntax error in %s:%d", file_name, lineno);
+            *end = '\0';
+            album = add_album(batch, line + 1, defaults, title_p);
+            continue;
+        }
+
+        if (!zphoto_config_split_line(line, &key, &value))
+            zphoto_eprintf("syntax error in %s:%d", file_name, lineno);
+        if (strcmp(key, "input") == 0) {
+            if (album == NULL)
+                zphoto_eprintf("input out of albums in %s:%d",
+                               file_name, lineno);
+            add_input(album, value);
+            continue;
+        }
+        if (!zphoto_config_set(album ? album->config : defaults, key, value))
+            zphoto_eprintf("invalid parameter \"%s = %s\" in %s:%d",
+                           key, value, file_name, lineno);
+        if (strcmp(key, "title") == 0) {
+            if (album)
+                album->title_p = 1;
+            else
+                title_p = 1;
+        } else if (strcmp(key, "output_dir") == 0 && album) {
+            album->output_dir_p = 1;
+        } else if (strcmp(key, "memory_limit") == 0 && album) {
+            album->memory_limit_p = 1;
+        }
+    }
+    fclose(fp);
+    zphoto_config_destroy(defaults);
+}
+
+/*
+ * The memory limit for all the albums, or the default of
+ * zphoto_new().  0 if unknown.
+ */
+static size_t
+get_memory_limit (ZphotoConfig *config)
+{
+    size_t memory_limit;
+
+    if (config->memory_limit[0] == '\0')
+        return zphoto_get_physical_memory() / 2;
+    memory_limit = zphoto_parse_size(config->memory_limit);
+    if (memory_limit == 0)
+        zphoto_eprintf("invalid memory limit: %s", config->memory_limit);
+    return memory_limit;
+}
+
+static void
+check_output (Album *album, Album *other, const char *what,
+              const char *file_name, const char *other_file_name)
+{
+    if (file_name[0] != '\0' && strcmp(file_name, other_file_name) == 0)
+        zphoto_eprintf("%s: %s of [%s] and [%s]",
+                       file_name, what, other->name, album->name);
+}
+
+/*
+ * Move the settings of the process from the album to the
+ * batch.
+ */
+static void
+take_process_settings (Batch *batch, Album *album)
+{
+    ZphotoConfig *config = album->config;
+
+    if (config->profile[0] != '\0') {
+        if (batch->profile == NULL)
+            batch->profile = zphoto_strdup(config->profile);
+        else if (strcmp(batch->profile, config->profile) != 0)
+            zphoto_eprintf("[%s]: one profile is made for the whole batch",
+                           album->name);
+        zphoto_config_set(config, "profile", "");
+    }
+    if (config->codec_report)
+        batch->codec_report_p = 1;
+    if (config->memory_report)
+        batch->memory_report_p = 1;
+    config->codec_report  = 0;
+    config->memory_report = 0;
+}
+
+/*
+ * Settings that follow from the manifest and the batch.
+ */
+static void
+prepare_album (Batch *batch, Album *album)
+{
+    ZphotoConfig *config = album->config;
+    int i;
+
+    if (!album->output_dir_p)
+        zphoto_config_set(config, "output_dir", album->name);
+    for (i = 0; i < album - batch->albums; i++) {
+        Album *other = batch->albums + i;
+
+        check_output(album, other, "output directory",
+                     config->output_dir, other->config->output_dir);
+        check_output(album, other, "output tar",
+                     config->output_tar, other->config->output_tar);
+        check_output(album, other, "trace",
+                     config->trace, other->config->trace);
+        check_output(album, other, "metrics",
+                     config->metrics, other->config->metrics);
+        check_output(album, other, "metrics JSON",
+                     config->metrics_json, other->config->metrics_json);
+        check_output(album, other, "failure report",
+                     config->failure_report, other->config->failure_report);
+    }
+    if (strcmp(config->output_tar, "-") == 0)
+        zphoto_eprintf("[%s]: albums cannot share the standard output",
+                       album->name);
+    take_process_settings(batch, album);
+    if (!album->title_p) {
+        free(config->title);
+        zphoto_config_reset_title(config);
+    }
+    if (!album->memory_limit_p) {
+        size_t memory_limit = get_memory_limit(config) / batch->njobs;
+
+        if (memory_limit > 0) {
+            char value[32];
+            snprintf(value, sizeof(value), "%lu", (unsigned long)memory_limit);
+            zphoto_config_set(config, "memory_limit", value);
+        }
+    }
+    if (strcmp(config->progress_format, "jsonl") != 0)
+        config->quiet = 1;  /* the bars of the albums would mix */
+}
+
+static void
+make_album (int i, void *data)
+{
+    Batch *batch = data;
+    Album *album = batch->albums + i;
+    double start_time = zphoto_get_time();
+    Zphoto *zphoto;
+
+    zphoto = zphoto_new(album->config);
+    zphoto_add_file_names(zphoto, album->file_names, album->nfiles);
+    zphoto_make_all(zphoto);
+    zphoto_destroy(zphoto);
+    album->seconds = zphoto_get_time() - start_time;
+}
+
+static int
+make_album_done (int i, void *data)
+{
+    Batch *batch = data;
+    Album *album = batch->albums + i;
+
+    if (!batch->quiet_p) {
+        printf("%s: %d files, %.1f seconds\n", album->config->output_dir,
+               album->nfiles, album->seconds);
+        fflush(stdout);
+    }
+    return 1;
+}
+
+void
+zphoto_batch (ZphotoConfig *config)
+{
+    Batch batch;
+    ZphotoScheduler *scheduler;
+    size_t *costs;
+    int i, j;
+
+    batch.albums  = NULL;
+    batch.nalbums = 0;
+    batch.quiet_p = config->quiet;
+    batch.profile = NULL;
+    batch.codec_report_p  = 0;
+    batch.memory_report_p = 0;
+    read_manifest(&batch, config, config->batch);
+    if (batch.nalbums == 0)
+        return;
+
+    batch.njobs = config->batch_jobs > 0 ?
+        config->batch_jobs : zphoto_get_ncpus();
+    if (batch.njobs > batch.nalbums)
+        batch.njobs = batch.nalbums;
+    for (i = 0; i < batch.nalbums; i++)
+        prepare_album(&batch, batch.albums + i);
+
+    costs = zphoto_emalloc(sizeof(size_t) * batch.nalbums);
+    memset(costs, 0, sizeof(size_t) * batch.nalbums);
+    if (batch.profile != NULL)
+        zphoto_profile_start();
+    scheduler = zphoto_scheduler_new(batch.njobs, 0);
+    zphoto_scheduler_run(scheduler, batch.nalbums, costs,
+                         make_album, make_album_done, &batch);
+    zphoto_scheduler_destroy(scheduler);
+    free(costs);
+
+    if (batch.codec_report_p)
+        zphoto_codec_write_report(stderr);
+    if (batch.memory_report_p)
+        zphoto_memstat_write_report(stderr);
+    if (batch.profile != NULL) {
+        zphoto_profile_write(batch.profile);
+        zphoto_profile_stop();
+        free(batch.profile);
+    }
+
+    for (i = 0; i < batch.nalbums; i++) {
+        Album *album = batch.albums + i;
+
+        for (j = 0; j < album->nfiles; j++)
+            free(album->file_names[j]);
+        free(album->file_names);
+        free(album->name);
+        zphoto_config_destroy(album->config);
+    }
+    free(batch.albums);
+}
@@ -0,0 +1,758 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * zphoto-bench: time libzphoto on a synthetic corpus.
+ *
+ * The corpus is generated from a seed, so that the same
+ * options always give the same files: JPEG and PNG photos
+ * in three size classes, half of the JPEG files with EXIF,
+ * a few Motion JPEG AVI movies and a caption file.  Files
+ * already there are reused.  Each run scans the corpus and
+ * makes the steps one by one with zphoto_make_step(), then
+ * makes a whole album with zphoto_make_all().  The report
+ * is JSON with the percentiles of each step over the runs,
+ * the throughput, the peak RSS and the per-photo metrics.
+ * Given the report of an earlier run with --baseline, the
+ * median of each step is compared with it and the exit
+ * status is 1 if any is slower beyond --threshold.
+ *
+ * Options after "--" are passed to zphoto.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include <zphoto.h>
+#include "config.h"
+
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#define MAX_RUNS   100
+#define MAX_STAGES 16
+
+typedef struct {
+    int         nphotos;
+    int         nmovies;
+    unsigned long seed;
+    double      scale;
+    int         nruns;
+    double      threshold;  /* in percent */
+    const char  *work_dir;
+    const char  *output_file_name;
+    const char  *baseline_file_name;
+    char        **zphoto_args;
+    int         nzphoto_args;
+} Options;
+
+typedef struct {
+    const char  *name;
+    double      seconds[MAX_RUNS];
+    int         nruns;
+} StageTimes;
+
+typedef struct {
+    char        **file_names;
+    int         nfiles;
+    char        *caption_file_name;
+    double      size;     /* in bytes */
+} Corpus;
+
+/*
+ * The steps of zphoto_make_step() in order, after "scan"
+ * (zphoto_add_file_names()).  "all" is zphoto_make_all().
+ */
+static const char *stage_names[] = {
+    "scan", "copy", "include", "thumbnail", "check", "flash", "html",
+    "index", "zip", "all", NULL
+};
+
+static const struct {
+    int width, height;
+} size_classes[] = {
+    {  640,  480 },
+    { 1600, 1200 },
+    { 3264, 2448 }
+};
+
+/*
+ * Photos are dated a minute apart from here.
+ */
+#define CORPUS_TIME 1072915200  /* 2004-01-01 00:00:00 UTC */
+
+static unsigned long random_state;
+
+static int
+next_random (void)
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 16) & 0x7fff;
+}
+
+static void
+show_usage (void)
+{
+    printf("Usage: zphoto-bench [OPTION...] [-- ZPHOTO-OPTION...]\n"
+           "  --photos NUM      number of photos (default: 30)\n"
+           "  --movies NUM      number of AVI movies (default: 2)\n"
+           "  --seed NUM        seed of the corpus (default: 1)\n"
+           "  --scale NUM       scale of the photo sizes (default: 1.0)\n"
+           "  --runs NUM        number of runs (default: 3)\n"
+           "  --work-dir DIR    put the corpus and albums in DIR\n"
+           "                    (default: zphoto-bench.d)\n"
+           "  --output FILE     write the report to FILE (default: stdout)\n"
+           "  --baseline FILE   compare with the report in FILE\n"
+           "  --threshold PCT   slowdown taken as a regression "
+           "(default: 10)\n");
+    exit(0);
+}
+
+static void
+parse_options (Options *options, int argc, char **argv)
+{
+    int i;
+
+    options->nphotos   = 30;
+    options->nmovies   = 2;
+    options->seed      = 1;
+    options->scale     = 1.0;
+    options->nruns     = 3;
+    options->threshold = 10.0;
+    options->work_dir  = "zphoto-bench.d";
+    options->output_file_name   = NULL;
+    options->baseline_file_name = NULL;
+    options->zphoto_args  = NULL;
+    options->nzphoto_args = 0;
+
+    for (i = 1; i < argc; i++) {
+        const char *option = argv[i];
+
+        if (strcmp(option, "--") == 0) {
+            options->zphoto_args  = argv + i + 1;
+            options->nzphoto_args = argc - i - 1;
+            break;
+        }
+        if (strcmp(option, "--help") == 0)
+            show_usage();
+        if (i + 1 == argc)
+            zphoto_eprintf("%s: unknown option or missing argument", option);
+
+        if (strcmp(option, "--photos") == 0)
+            options->nphotos = atoi(argv[++i]);
+        else if (strcmp(option, "--movies") == 0)
+            options->nmovies = atoi(argv[++i]);
+        else if (strcmp(option, "--seed") == 0)
+            options->seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(option, "--scale") == 0)
+            options->scale = atof(argv[++i]);
+        else if (strcmp(option, "--runs") == 0)
+            options->nruns = atoi(argv[++i]);
+        else if (strcmp(option, "--work-dir") == 0)
+            options->work_dir = argv[++i];
+        else if (strcmp(option, "--output") == 0)
+            options->output_file_name = argv[++i];
+        else if (strcmp(option, "--baseline") == 0)
+            options->baseline_file_name = argv[++i];
+        else if (strcmp(option, "--threshold") == 0)
+            options->threshold = atof(argv[++i]);
+        else
+            zphoto_eprintf("%s: unknown option", option);
+    }
+    if (options->nphotos < 1 || options->nmovies < 0 || options->scale <= 0)
+        zphoto_eprintf("invalid corpus options");
+    if (options->nruns < 1 || options->nruns > MAX_RUNS)
+        zphoto_eprintf("--runs must be 1 to %d", MAX_RUNS);
+}
+
+/*
+ * Gradients with noise, which compress like photos rather
+ * than like flat colors.
+ */
+static ZphotoBitmap *
+make_bitmap (int width, int height)
+{
+    ZphotoBitmap *bitmap = zphoto_bitmap_new(width, height, 3);
+    int phase = next_random() % 256;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        unsigned char *p = bitmap->data + (size_t)y * width * 3;
+        for (x = 0; x < width; x++) {
+            int noise = next_random() % 32 - 16;
+            int r = x * 255 / width + noise;
+            int g = y * 255 / height + noise;
+            int b = (phase + (x + y) / 8) % 256 + noise;
+            *p++ = r < 0 ? 0 : r > 255 ? 255 : r;
+            *p++ = g < 0 ? 0 : g > 255 ? 255 : g;
+            *p++ = b < 0 ? 0 : b > 255 ? 255 : b;
+        }
+    }
+    return bitmap;
+}
+
+static void
+put16 (unsigned char *p, unsigned int x)
+{
+    p[0] = x & 0xff;
+    p[1] = (x >> 8) & 0xff;
+}
+
+static void
+put32 (unsigned char *p, unsigned long x)
+{
+    put16(p, x & 0xffff);
+    put16(p + 2, (x >> 16) & 0xffff);
+}
+
+/*
+ * Insert an APP1 segment with DateTimeOriginal right after
+ * SOI, where exif.c looks for it.
+ */
+static void
+add_exif (const char *file_name, time_t time)
+{
+    unsigned char app1[4 + 6 + 64];
+    unsigned char *tiff = app1 + 10;
+    unsigned char *data, *new_data;
+    size_t size;
+    struct tm *t = gmtime(&time);
+
+    memset(app1, 0, sizeof(app1));
+    app1[0] = 0xff;
+    app1[1] = 0xe1;
+    app1[2] = (sizeof(app1) - 2) >> 8;
+    app1[3] = (sizeof(app1) - 2) & 0xff;
+    memcpy(app1 + 4, "Exif\0\0", 6);
+
+    memcpy(tiff, "II*\0", 4);
+    put32(tiff + 4, 8);          /* IFD0 */
+    put16(tiff + 8, 1);
+    put16(tiff + 10, 0x8769);    /* Exif IFD pointer */
+    put16(tiff + 12, 4);         /* LONG */
+    put32(tiff + 14, 1);
+    put32(tiff + 18, 26);
+    put16(tiff + 26, 1);         /* Exif IFD */
+    put16(tiff + 28, 0x9003);    /* DateTimeOriginal */
+    put16(tiff + 30, 2);         /* ASCII */
+    put32(tiff + 32, 20);
+    put32(tiff + 36, 44);
+    strftime((char *)tiff + 44, 20, "%Y:%m:%d %H:%M:%S", t);
+
+    data = zphoto_map_file(file_name, &size);
+    new_data = zphoto_emalloc(size + sizeof(app1));
+    memcpy(new_data, data, 2);   /* SOI */
+    memcpy(new_data + 2, app1, sizeof(app1));
+    memcpy(new_data + 2 + sizeof(app1), data + 2, size - 2);
+    zphoto_unmap_file(data, size);
+    zphoto_write_file(file_name, new_data, size + sizeof(app1));
+    free(new_data);
+}
+
+static void
+set_time (const char *file_name, time_t time)
+{
+    struct utimbuf times;
+
+    times.actime  = time;
+    times.modtime = time;
+    utime(file_name, &times);
+}
+
+static void
+make_photo (const char *file_name, int i, double scale)
+{
+    int k = i % 3;
+    int width  = size_classes[k].width  * scale;
+    int height = size_classes[k].height * scale;
+    time_t time = CORPUS_TIME + i * 60;
+    ZphotoBitmap *bitmap;
+
+    bitmap = make_bitmap(width > 16 ? width : 16, height > 16 ? height : 16);
+    zphoto_codec_encode(bitmap, file_name);
+    zphoto_bitmap_destroy(bitmap);
+    if (zphoto_strsuffixcasecmp(file_name, ".jpg") == 0 && i % 2 == 0)
+        add_exif(file_name, time);
+    set_time(file_name, time);
+}
+
+/*
+ * Growable buffer for the AVI writer.
+ */
+typedef struct {
+    unsigned char *data;
+    size_t      size;
+} Buffer;
+
+static unsigned char *
+buffer_grow (Buffer *buffer, size_t n)
+{
+    unsigned char *p;
+
+    buffer->data = zphoto_erealloc(buffer->data, buffer->size + n);
+    p = buffer->data + buffer->size;
+    memset(p, 0, n);
+    buffer->size += n;
+    return p;
+}
+
+static size_t
+buffer_chunk (Buffer *buffer, const char *fourcc, const char *type)
+{
+    unsigned char *p = buffer_grow(buffer, type ? 12 : 8);
+    memcpy(p, fourcc, 4);
+    if (type)
+        memcpy(p + 8, type, 4);
+    return buffer->size - (type ? 12 : 8);  /* to fix the size later */
+}
+
+static void
+buffer_close (Buffer *buffer, size_t start)
+{
+    put32(buffer->data + start + 4, buffer->size - start - 8);
+}
+
+/*
+ * A Motion JPEG AVI of nframes frames at 10 fps.
+ */
+static void
+make_movie (const char *file_name, const char *frame_file_name,
+            int nframes, double scale)
+{
+    int width = 320 * scale, height = 240 * scale;
+    Buffer buffer = { NULL, 0 };
+    size_t riff, hdrl, strl, movi, idx1, *offsets, *sizes, max_size = 0;
+    unsigned char *p;
+    int i;
+
+    width  = width  > 16 ? width  : 16;
+    height = height > 16 ? height : 16;
+    offsets = zphoto_emalloc(sizeof(size_t) * nframes);
+    sizes   = zphoto_emalloc(sizeof(size_t) * nframes);
+
+    riff = buffer_chunk(&buffer, "RIFF", "AVI ");
+    hdrl = buffer_chunk(&buffer, "LIST", "hdrl");
+    buffer_chunk(&buffer, "avih", NULL);
+    p = buffer_grow(&buffer, 56);
+    put32(p, 100000);                 /* microseconds per frame */
+    put32(p + 12, 0x10);              /* AVIF_HASINDEX */
+    put32(p + 16, nframes);
+    put32(p + 24, 1);                 /* streams */
+    put32(p + 32, width);
+    put32(p + 36, height);
+    buffer_close(&buffer, buffer.size - 64);
+    strl = buffer_chunk(&buffer, "LIST", "strl");
+    buffer_chunk(&buffer, "strh", NULL);
+    p = buffer_grow(&buffer, 56);
+    memcpy(p, "vidsMJPG", 8);
+    put32(p + 20, 1);                 /* scale */
+    put32(p + 24, 10);                /* rate */
+    put32(p + 32, nframes);
+    put32(p + 40, 0xffffffff);        /* quality */
+    put16(p + 52, width);
+    put16(p + 54, height);
+    buffer_close(&buffer, buffer.size - 64);
+    buffer_chunk(&buffer, "strf", NULL);
+    p = buffer_grow(&buffer, 40);
+    put32(p, 40);
+    put32(p + 4, width);
+    put32(p + 8, height);
+    put16(p + 12, 1);
+    put16(p + 14, 24);
+    memcpy(p + 16, "MJPG", 4);
+    put32(p + 20, width * height * 3);
+    buffer_close(&buffer, buffer.size - 48);
+    buffer_close(&buffer, strl);
+    buffer_close(&buffer, hdrl);
+
+    movi = buffer_chunk(&buffer, "LIST", "movi");
+    for (i = 0; i < nframes; i++) {
+        ZphotoBitmap *bitmap = make_bitmap(width, height);
+        unsigned char *frame;
+        size_t size, chunk;
+
+        zphoto_codec_encode(bitmap, frame_file_name);
+        zphoto_bitmap_destroy(bitmap);
+        frame = zphoto_map_file(frame_file_name, &size);
+        chunk = buffer_chunk(&buffer, "00dc", NULL);
+        memcpy(buffer_grow(&buffer, size), frame, size);
+        buffer_close(&buffer, chunk);
+        if (size % 2 == 1)
+            buffer_grow(&buffer, 1);
+        zphoto_unmap_file(frame, size);
+        offsets[i] = chunk - (movi + 8);  /* from "movi" */
+        sizes[i] = size;
+        if (size > max_size)
+            max_size = size;
+    }
+    remove(frame_file_name);
+    buffer_close(&buffer, movi);
+
+    idx1 = buffer_chunk(&buffer, "idx1", NULL);
+    for (i = 0; i < nframes; i++) {
+        p = buffer_grow(&buffer, 16);
+        memcpy(p, "00dc", 4);
+        put32(p + 4, 0x10);           /* AVIIF_KEYFRAME */
+        put32(p + 8, offsets[i]);
+        put32(p + 12, sizes[i]);
+    }
+    buffer_close(&buffer, idx1);
+    buffer_close(&buffer, riff);
+    put32(buffer.data + hdrl + 12 + 8 + 28, max_size);  /* buffer size */
+
+    zphoto_write_file(file_name, buffer.data, buffer.size);
+    free(buffer.data);
+    free(offsets);
+    free(sizes);
+}
+
+static double
+get_file_size (const char *file_name)
+{
+    struct stat st;
+
+    if (stat(file_name, &st) == -1)
+        zphoto_eprintf("%s:", file_name);
+    return st.st_size;
+}
+
+static void
+add_file (Corpus *corpus, char *file_name)
+{
+    corpus->file_names = zphoto_erealloc(corpus->file_names, sizeof(char *) *
+                                         (corpus->nfiles + 1));
+    corpus->file_names[corpus->nfiles++] = file_name;
+    corpus->size += get_file_size(file_name);
+}
+
+/*
+ * Every fifth photo is PNG.  Every third file has a
+ * caption.  Movies are left out if zphoto cannot handle
+ * them in this build.  MPEG files are not made; there is
+ * no encoder at hand.
+ */
+static void
+make_corpus (Corpus *corpus, Options *options)
+{
+    char *dir_name = zphoto_asprintf("%s/corpus", options->work_dir);
+    FILE *captions;
+    int i;
+
+    corpus->file_names = NULL;
+    corpus->nfiles = 0;
+    corpus->size = 0;
+    corpus->caption_file_name = zphoto_asprintf("%s/captions.txt", dir_name);
+
+    zphoto_mkdir(options->work_dir);
+    zphoto_mkdir(dir_name);
+    captions = zphoto_efopen(corpus->caption_file_name, "w");
+    for (i = 0; i < options->nphotos + options->nmovies; i++) {
+        int movie_p = i >= options->nphotos;
+        char *file_name;
+
+        if (movie_p)
+            file_name = zphoto_asprintf("%s/movie%05d.avi", dir_name, i);
+        else
+            file_name = zphoto_asprintf("%s/photo%05d.%s", dir_name, i,
+                                        i % 5 == 4 ? "png" : "jpg");
+
+        if (!zphoto_file_p(file_name)) {
+            random_state = options->seed * 100003 + i;
+            if (movie_p) {
+                char *frame_file_name = zphoto_asprintf("%s/frame.jpg",
+                                                        dir_name);
+                make_movie(file_name, frame_file_name, 8, options->scale);
+                free(frame_file_name);
+            } else {
+                make_photo(file_name, i, options->scale);
+            }
+        }
+        if (i % 3 == 0)
+            fprintf(captions, "%s\tCaption of %s #%d\n",
+                    zphoto_basename(file_name),
+                    movie_p ? "movie" : "photo", i);
+        if (zphoto_supported_file_p(file_name))
+            add_file(corpus, file_name);
+        else
+            free(file_name);
+    }
+    if (fclose(captions) == EOF)
+        zphoto_eprintf("%s:", corpus->caption_file_name);
+    free(dir_name);
+}
+
+static long
+get_max_rss (void)
+{
+#ifdef HAVE_SYS_RESOURCE_H
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss;
+#endif
+    return 0;
+}
+
+static void
+record (StageTimes *stages, const char *name, double seconds)
+{
+    StageTimes *stage;
+
+    for (stage = stages; stage->name != NULL; stage++) {
+        if (strcmp(stage->name, name) == 0)
+            break;
+    }
+    if (stage->name == NULL) {
+        stage->name  = name;
+        stage->nruns = 0;
+        (stage + 1)->name = NULL;
+    }
+    stage->seconds[stage->nruns++] = seconds;
+}
+
+/*
+ * Made from the options of a run as zphoto's command line
+ * would be, so that the options after "--" act the same.
+ */
+static Zphoto *
+new_zphoto (Options *options, Corpus *corpus, ZphotoConfig **config)
+{
+    int argc = 0, i;
+    char **argv = zphoto_emalloc(sizeof(char *) *
+                                 (options->nzphoto_args + corpus->nfiles + 6));
+    char *output_dir = zphoto_asprintf("%s/album", options->work_dir);
+
+    argv[argc++] = "zphoto";
+    argv[argc++] = "--quiet";
+    argv[argc++] = "--output-dir";
+    argv[argc++] = output_dir;
+    argv[argc++] = "--caption-file";
+    argv[argc++] = corpus->caption_file_name;
+    for (i = 0; i < options->nzphoto_args; i++)
+        argv[argc++] = options->zphoto_args[i];
+    for (i = 0; i < corpus->nfiles; i++)
+        argv[argc++] = corpus->file_names[i];
+
+    *config = zphoto_config_new();
+    zphoto_config_parse(*config, argc, argv);
+    free(argv);
+    free(output_dir);
+    return zphoto_new(*config);
+}
+
+static void
+run_steps (StageTimes *stages, Options *options, Corpus *corpus,
+           ZphotoMetrics *metrics)
+{
+    ZphotoConfig *config;
+    Zphoto *zphoto = new_zphoto(options, corpus, &config);
+    double start_time = zphoto_get_time();
+    int i;
+
+    zphoto_add_file_names(zphoto, config->args, config->nargs);
+    record(stages, "scan", zphoto_get_time() - start_time);
+    for (i = 1; strcmp(stage_names[i], "all") != 0; i++) {
+        start_time = zphoto_get_time();
+        if (zphoto_make_step(zphoto, stage_names[i]))
+            record(stages, stage_names[i], zphoto_get_time() - start_time);
+    }
+    zphoto_metrics_merge(metrics, zphoto_get_metrics(zphoto));
+    zphoto_destroy(zphoto);
+    zphoto_config_destroy(config);
+}
+
+static void
+run_all (StageTimes *stages, Options *options, Corpus *corpus)
+{
+    ZphotoConfig *config;
+    Zphoto *zphoto = new_zphoto(options, corpus, &config);
+    double start_time = zphoto_get_time();
+
+    zphoto_add_file_names(zphoto, config->args, config->nargs);
+    zphoto_make_all(zphoto);
+    record(stages, "all", zphoto_get_time() - start_time);
+    zphoto_destroy(zphoto);
+    zphoto_config_destroy(config);
+}
+
+static double
+get_median (StageTimes *stage)
+{
+    double sorted[MAX_RUNS];
+
+    memcpy(sorted, stage->seconds, sizeof(double) * stage->nruns);
+    zphoto_sort_doubles(sorted, stage->nruns);
+    return zphoto_percentile(sorted, stage->nruns, 50);
+}
+
+/*
+ * One line per stage; read_baseline() depends on it.
+ */
+static void
+write_stage (FILE *fp, StageTimes *stage, int nfiles)
+{
+    double sorted[MAX_RUNS];
+    int n = stage->nruns;
+    double median;
+
+    memcpy(sorted, stage->seconds, sizeof(double) * n);
+    zphoto_sort_doubles(sorted, n);
+    median = zphoto_percentile(sorted, n, 50);
+    fprintf(fp, "    \"%s\": {\"runs\": %d, \"p50\": %.6f, \"p95\": %.6f, "
+            "\"p99\": %.6f, \"min\": %.6f, \"max\": %.6f, "
+            "\"throughput\": %.3f}",
+            stage->name, n, median, zphoto_percentile(sorted, n, 95),
+            zphoto_percentile(sorted, n, 99), sorted[0], sorted[n - 1],
+            median > 0 ? nfiles / median : 0.0);
+}
+
+/*
+ * Returns the median of stage in the baseline report, or
+ * a negative value if it is not there.
+ */
+static double
+read_baseline (const char *file_name, const char *stage)
+{
+    FILE *fp = zphoto_efopen(file_name, "r");
+    char line[BUFSIZ], name[64];
+    double median = -1.0;
+    int nruns;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, " \"%63[^\"]\": {\"runs\": %d, \"p50\": %lf",
+                   name, &nruns, &median) == 3 &&
+            strcmp(name, stage) == 0)
+            break;
+        median = -1.0;
+    }
+    fclose(fp);
+    return median;
+}
+
+/*
+ * Returns the number of regressions.
+ */
+static int
+write_comparison (FILE *fp, StageTimes *stages, Options *options)
+{
+    char *escaped = zphoto_escape_json(options->baseline_file_name);
+    StageTimes *stage;
+    int nregressions = 0, first_p = 1;
+
+    fprintf(fp, "  \"baseline\": {\"file\": %s, \"threshold\": %.1f, "
+            "\"stages\": {", escaped, options->threshold);
+    for (stage = stages; stage->name != NULL; stage++) {
+        double baseline = read_baseline(options->baseline_file_name,
+                                        stage->name);
+        double current = get_median(stage);
+        double change;
+        int regressed_p;
+
+        if (baseline <= 0)
+            continue;
+        change = (current - baseline) / baseline * 100;
+        regressed_p = change > options->threshold;
+        nregressions += regressed_p;
+        fprintf(fp, "%s\n    \"%s\": {\"baseline\": %.6f, \"current\": %.6f, "
+                "\"change\": %.1f, \"regressed\": %s}",
+                first_p ? "" : ",", stage->name, baseline, current, change,
+                regressed_p ? "true" : "false");
+        fprintf(stderr, "%-10s %10.3fs -> %10.3fs %+7.1f%%%s\n",
+                stage->name, baseline, current, change,
+                regressed_p ? "  REGRESSED" : "");
+        first_p = 0;
+    }
+    fprintf(fp, "\n  }, \"regressions\": %d},\n", nregressions);
+    free(escaped);
+    return nregressions;
+}
+
+static int
+write_report (FILE *fp, StageTimes *stages, Options *options,
+              Corpus *corpus, ZphotoMetrics *metrics)
+{
+    StageTimes *stage;
+    int nregressions = 0;
+
+    fprintf(fp, "{\n  \"version\": \"%s\",\n", VERSION);
+    fprintf(fp, "  \"corpus\": {\"photos\": %d, \"movies\": %d, "
+            "\"files\": %d, \"bytes\": %.0f, \"seed\": %lu, "
+            "\"scale\": %.3f},\n",
+            options->nphotos, options->nmovies, corpus->nfiles,
+            corpus->size, options->seed, options->scale);
+    fprintf(fp, "  \"runs\": %d,\n", options->nruns);
+    fprintf(fp, "  \"stages\": {\n");
+    for (stage = stages; stage->name != NULL; stage++) {
+        write_stage(fp, stage, corpus->nfiles);
+        fprintf(fp, (stage + 1)->name ? ",\n" : "\n");
+    }
+    fprintf(fp, "  },\n");
+    if (options->baseline_file_name != NULL)
+        nregressions = write_comparison(fp, stages, options);
+    fprintf(fp, "  \"peak_rss_kb\": %ld,\n", get_max_rss());
+    fprintf(fp, "  \"metrics\": ");
+    zphoto_metrics_write_json(metrics, fp, 10);
+    fprintf(fp, "}\n");
+    return nregressions;
+}
+
+int
+main (int argc, char **argv)
+{
+    Options options;
+    Corpus corpus;
+    StageTimes stages[MAX_STAGES];
+    ZphotoMetrics *metrics;
+    FILE *fp = stdout;
+    int i, nregressions;
+
+    zphoto_init_magick();
+    parse_options(&options, argc, argv);
+    make_corpus(&corpus, &options);
+
+    stages[0].name = NULL;
+    metrics = zphoto_metrics_new();
+    for (i = 0; i < options.nruns; i++) {
+        run_steps(stages, &options, &corpus, metrics);
+        run_all(stages, &options, &corpus);
+    }
+
+    if (options.output_file_name != NULL)
+        fp = zphoto_efopen(options.output_file_name, "w");
+    nregressions = write_report(fp, stages, &options, &corpus, metrics);
+    if (fp != stdout && fclose(fp) == EOF)
+        zphoto_eprintf("%s:", options.output_file_name);
+
+    zphoto_metrics_destroy(metrics);
+    for (i = 0; i < corpus.nfiles; i++)
+        free(corpus.file_names[i]);
+    free(corpus.file_names);
+    free(corpus.caption_file_name);
+    zphoto_finalize_magick();
+    return nregressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * In-memory bitmaps used by the direct codec backend.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zphoto.h>
+#include "config.h"
+
+ZphotoBitmap *
+zphoto_bitmap_new (int width, int height, int channels)
+{
+    ZphotoBitmap *bitmap;
+
+    assert(width > 0 && height > 0);
+    assert(channels >= 1 && channels <= 4);
+
+    bitmap = zphoto_emalloc(sizeof(ZphotoBitmap));
+    bitmap->width    = width;
+    bitmap->height   = height;
+    bitmap->channels = channels;
+    bitmap->data     = zphoto_pool_alloc((size_t)width * height * channels);
+    return bitmap;
+}
+
+void
+zphoto_bitmap_destroy (ZphotoBitmap *bitmap)
+{
+    zphoto_pool_free(bitmap->data);
+    free(bitmap);
+}
+
+static void
+store_row (const unsigned char *row, int y, void *data)
+{
+    ZphotoBitmap *bitmap = data;
+    size_t rowlen = (size_t)bitmap->width * bitmap->channels;
+
+    memcpy(bitmap->data + rowlen * y, row, rowlen);
+}
+
+/*
+ * Returns a new bitmap resized to width x height with the
+ * gamma correction applied, or NULL if the job is to stop.
+ */
+ZphotoBitmap *
+zphoto_bitmap_resize (ZphotoBitmap *bitmap, int width, int height,
+                      double gamma)
+{
+    int y;
+    size_t rowlen = (size_t)bitmap->width * bitmap->channels;
+    ZphotoBitmap *new_bitmap = zphoto_bitmap_new(width, height,
+                                                 bitmap->channels);
+    ZphotoResampler *resampler = 
+        zphoto_resampler_new(bitmap->width, bitmap->height,
+                             width, height, bitmap->channels,
+                             store_row, new_bitmap);
+
+    if (gamma != 1.0)
+        zphoto_resampler_set_gamma(resampler, gamma);
+    for (y = 0; y < bitmap->height; y++) {
+        if (zphoto_limit_pending_p())
+            break;
+        zphoto_resampler_push_row(resampler, bitmap->data + rowlen * y);
+    }
+    zphoto_resampler_destroy(resampler);
+
+    if (y < bitmap->height) {  /* stopped */
+        zphoto_bitmap_destroy(new_bitmap);
+        return NULL;
+    }
+    return new_bitmap;
+}
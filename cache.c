@@ -0,0 +1,384 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Cache of rendered previews and thumbnails shared by
+ * albums.
+ *
+ * Entries are named by a key made from the content hash of
+ * the input and the copier's settings (see
+ * zphoto_image_copier_describe()), and stored as
+ * DIR/xx/KEY.SUFFIX where xx is the first byte of the key.
+ * They are written to a temporary file and renamed, so
+ * that concurrent albums, even in other processes, never
+ * see a partial entry.  Outputs are placed into the album
+ * by reflink where the file system supports it, by hard
+ * link, or by copying.  The last use of an entry is its
+ * access time, and zphoto_cache_trim() removes the least
+ * recently used entries beyond the size limit.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#include <zphoto.h>
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>  /* for FICLONE */
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifdef __MINGW32__
+#  define mkdir(dir_name, mode) mkdir(dir_name)
+#endif
+
+/*
+ * Temporary files older than this are left over by
+ * crashed processes.
+ */
+#define STALE_SECONDS (24 * 60 * 60)
+
+struct _ZphotoCache {
+    char        *dir_name;
+    size_t      max_size;  /* 0 for no limit */
+};
+
+typedef struct {
+    char        *file_name;
+    time_t      atime;
+    size_t      size;
+} Entry;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t serial_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static unsigned long serial = 0;
+
+static unsigned long
+next_serial (void)
+{
+    unsigned long n;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&serial_mutex);
+#endif
+    n = serial++;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&serial_mutex);
+#endif
+    return n;
+}
+
+/*
+ * Unlike zphoto_mkdir(), another album may have made it.
+ */
+static int
+make_dir (const char *dir_name)
+{
+    return mkdir(dir_name, 0777) == 0 || errno == EEXIST;
+}
+
+static char *
+entry_file_name (ZphotoCache *cache, uint64_t key, const char *suffix)
+{
+    return zphoto_asprintf("%s/%02x/%08lx%08lx.%s", cache->dir_name,
+                           (unsigned int)(key >> 56),
+                           (unsigned long)(key >> 32),
+                           (unsigned long)(key & 0xffffffff),
+                           suffix);
+}
+
+static int
+copy_fd (int in, int out)
+{
+    char buf[BUFSIZ * 8];
+    ssize_t n;
+
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        ssize_t done = 0;
+        while (done < n) {
+            ssize_t nn = write(out, buf + done, n - done);
+            if (nn <= 0)
+                return 0;
+            done += nn;
+        }
+    }
+    return n == 0;
+}
+
+/*
+ * Make dest a file of the same contents as src without
+ * reporting errors.  Returns 0 on failure.
+ */
+static int
+place_file (const char *src, const char *dest)
+{
+    int in, out, ok;
+
+    in = open(src, O_RDONLY | O_BINARY);
+    if (in == -1)
+        return 0;
+    remove(dest);
+
+#ifdef FICLONE
+    out = open(dest, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+    if (out != -1 && ioctl(out, FICLONE, in) == 0) {
+        close(in);
+        return close(out) == 0;
+    }
+    if (out != -1) {
+        close(out);
+        remove(dest);
+    }
+#endif
+#ifndef __MINGW32__
+    if (link(src, dest) == 0) {
+        close(in);
+        return 1;
+    }
+#endif
+
+    out = open(dest, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+    if (out == -1) {
+        close(in);
+        return 0;
+    }
+    ok = copy_fd(in, out);
+    close(in);
+    if (close(out) == -1)
+        ok = 0;
+    if (!ok)
+        remove(dest);
+    return ok;
+}
+
+/*
+ * max_size is in bytes, or 0 for no limit.
+ */
+ZphotoCache *
+zphoto_cache_new (const char *dir_name, size_t max_size)
+{
+    ZphotoCache *cache = zphoto_emalloc(sizeof(ZphotoCache));
+
+    if (!make_dir(dir_name))
+        zphoto_eprintf("%s:", dir_name);
+    cache->dir_name = zphoto_strdup(dir_name);
+    cache->max_size = max_size;
+    return cache;
+}
+
+void
+zphoto_cache_destroy (ZphotoCache *cache)
+{
+    free(cache->dir_name);
+    free(cache);
+}
+
+/*
+ * Returns true if the entry exists.
+ */
+int
+zphoto_cache_lookup (ZphotoCache *cache, uint64_t key, const char *suffix)
+{
+    char *file_name = entry_file_name(cache, key, suffix);
+    int found_p = zphoto_file_p(file_name);
+
+    free(file_name);
+    return found_p;
+}
+
+/*
+ * Mark the entry as recently used.  Only the access time is
+ * set: the entry may be the same file as outputs of albums
+ * that keep the time of the photo as the mtime.
+ */
+static void
+touch_entry (const char *file_name)
+{
+#ifdef UTIME_OMIT
+    struct timespec times[2];
+
+    times[0].tv_sec  = 0;
+    times[0].tv_nsec = UTIME_NOW;
+    times[1].tv_sec  = 0;
+    times[1].tv_nsec = UTIME_OMIT;
+    utimensat(AT_FDCWD, file_name, times, 0);
+#else
+    struct stat st;
+    struct utimbuf times;
+
+    if (stat(file_name, &st) == -1)
+        return;
+    times.actime  = time(NULL);
+    times.modtime = st.st_mtime;
+    utime(file_name, &times);
+#endif
+}
+
+/*
+ * Place the entry at dest.  Returns 0 if it is not cached.
+ */
+int
+zphoto_cache_fetch (ZphotoCache *cache, uint64_t key, const char *suffix,
+                    const char *dest)
+{
+    char *file_name = entry_file_name(cache, key, suffix);
+    int ok = place_file(file_name, dest);
+
+    if (ok)
+        touch_entry(file_name);
+    free(file_name);
+    return ok;
+}
+
+/*
+ * Add the file src as the entry.  Failures are not errors;
+ * the entry is just not cached.
+ */
+void
+zphoto_cache_store (ZphotoCache *cache, uint64_t key, const char *suffix,
+                    const char *src)
+{
+    char *file_name, *dir_name, *temporary_file_name;
+
+    file_name = entry_file_name(cache, key, suffix);
+    dir_name  = zphoto_dirname(file_name);
+    temporary_file_name = zphoto_asprintf("%s.%ld-%lu.tmp", file_name,
+                                          (long)getpid(), next_serial());
+
+    if (make_dir(dir_name) && place_file(src, temporary_file_name)) {
+        if (rename(temporary_file_name, file_name) == -1)
+            remove(temporary_file_name);
+    }
+    free(temporary_file_name);
+    free(dir_name);
+    free(file_name);
+}
+
+static int
+compare_by_atime (const void *a, const void *b)
+{
+    const Entry *x = a, *y = b;
+
+    if (x->atime != y->atime)
+        return x->atime < y->atime ? -1 : 1;
+    return 0;
+}
+
+static void
+collect_entries (const char *dir_name, Entry **entries, int *nentries,
+                 size_t *total)
+{
+    DIR *dir = opendir(dir_name);
+    struct dirent *d;
+    time_t now = time(NULL);
+
+    if (dir == NULL)
+        return;
+    while ((d = readdir(dir))) {
+        char *d_name = zphoto_d_name_workaround(d);
+        char *file_name;
+        struct stat st;
+
+        if (d_name[0] == '.')
+            continue;
+        file_name = zphoto_asprintf("%s/%s", dir_name, d_name);
+        if (stat(file_name, &st) == -1 || !S_ISREG(st.st_mode)) {
+            free(file_name);
+            continue;
+        }
+        if (zphoto_strsuffixcasecmp(d_name, ".tmp") == 0) {
+            if (now - st.st_mtime > STALE_SECONDS)
+                remove(file_name);
+            free(file_name);
+            continue;
+        }
+        *entries = zphoto_erealloc(*entries, sizeof(Entry) * (*nentries + 1));
+        (*entries)[*nentries].file_name = file_name;
+        (*entries)[*nentries].atime = st.st_atime;
+        (*entries)[*nentries].size  = st.st_size;
+        (*nentries)++;
+        *total += st.st_size;
+    }
+    closedir(dir);
+}
+
+/*
+ * Remove the least recently used entries until the cache
+ * fits in the size limit.
+ */
+void
+zphoto_cache_trim (ZphotoCache *cache)
+{
+    DIR *dir;
+    struct dirent *d;
+    Entry *entries = NULL;
+    int i, nentries = 0;
+    size_t total = 0;
+
+    if (cache->max_size == 0)
+        return;
+
+    dir = opendir(cache->dir_name);
+    if (dir == NULL)
+        return;
+    while ((d = readdir(dir))) {
+        char *d_name = zphoto_d_name_workaround(d);
+        char *dir_name;
+
+        if (d_name[0] == '.')
+            continue;
+        dir_name = zphoto_asprintf("%s/%s", cache->dir_name, d_name);
+        collect_entries(dir_name, &entries, &nentries, &total);
+        free(dir_name);
+    }
+    closedir(dir);
+
+    qsort(entries, nentries, sizeof(Entry), compare_by_atime);
+    for (i = 0; i < nentries; i++) {
+        if (total > cache->max_size) {
+            remove(entries[i].file_name);
+            total -= entries[i].size;
+        }
+        free(entries[i].file_name);
+    }
+    free(entries);
+}
@@ -0,0 +1,362 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Registry of image codec backends.
+ *
+ * Backends are registered in order of preference: the
+ * native libjpeg and libpng codecs first, then the generic
+ * imaging library (Imlib2 or ImageMagick) as the fallback
+ * for the other formats.  For each file the first backend
+ * whose probe accepts it is used.  If decoding or encoding
+ * fails (e.g. CMYK JPEG for libjpeg, or a PNG file named
+ * .jpg) the next capable backend is tried, and the error is
+ * reported only when none is left.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zphoto.h>
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+enum {
+    MAX_NCODECS = 8
+};
+
+typedef struct _Stat {
+    char        *codec;
+    char        *format;
+    char        *operation;
+    int         count;
+    double      total;  /* in seconds */
+    struct _Stat *next;
+} Stat;
+
+static const ZphotoCodec *codecs[MAX_NCODECS];
+static int ncodecs = 0;
+static Stat *stats = NULL;
+
+#ifdef HAVE_PTHREAD
+static pthread_once_t  init_once     = PTHREAD_ONCE_INIT;
+static pthread_mutex_t stats_mutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t backend_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#if defined(HAVE_LIBJPEG) || defined(HAVE_LIBPNG)
+static int
+has_suffix_p (const char *file_name, const char *suffix)
+{
+    return zphoto_strsuffixcasecmp(file_name, suffix) == 0;
+}
+#endif
+
+/*
+ * Native codecs.
+ */
+#ifdef HAVE_LIBJPEG
+
+static int
+libjpeg_probe (const char *file_name, int mode)
+{
+    return has_suffix_p(file_name, ".jpg") || has_suffix_p(file_name, ".jpeg");
+}
+
+static ZphotoBitmap *
+libjpeg_decode (const char *file_name)
+{
+    return zphoto_jpeg_decode(file_name, 0);
+}
+
+static const ZphotoCodec libjpeg_codec = {
+    "libjpeg",
+    1,
+    libjpeg_probe,
+    libjpeg_decode,
+    zphoto_jpeg_decode,
+    zphoto_jpeg_encode
+};
+
+#endif
+
+#ifdef HAVE_LIBPNG
+
+static int
+libpng_probe (const char *file_name, int mode)
+{
+    return has_suffix_p(file_name, ".png");
+}
+
+static const ZphotoCodec libpng_codec = {
+    "libpng",
+    1,
+    libpng_probe,
+    zphoto_png_decode,
+    NULL,
+    zphoto_png_encode
+};
+
+#endif
+
+static void
+register_builtin_codecs (void)
+{
+    const ZphotoCodec *generic_codec;
+
+#ifdef HAVE_LIBJPEG
+    zphoto_codec_register(&libjpeg_codec);
+#endif
+#ifdef HAVE_LIBPNG
+    zphoto_codec_register(&libpng_codec);
+#endif
+    generic_codec = zphoto_image_get_codec();
+    if (generic_codec != NULL)
+        zphoto_codec_register(generic_codec);
+}
+
+static void
+init_codecs (void)
+{
+#ifdef HAVE_PTHREAD
+    pthread_once(&init_once, register_builtin_codecs);
+#else
+    static int initialized_p = 0;
+    if (!initialized_p) {
+        initialized_p = 1;
+        register_builtin_codecs();
+    }
+#endif
+}
+
+static char *
+get_format (const char *file_name)
+{
+    char *p, *format;
+    const char *suffix = zphoto_get_suffix(file_name);
+
+    format = zphoto_strdup(suffix ? suffix : "");
+    for (p = format; *p != '\0'; p++)
+        *p = tolower((unsigned char)*p);
+    if (strcmp(format, "jpg") == 0) {
+        free(format);
+        format = zphoto_strdup("jpeg");
+    }
+    return format;
+}
+
+/*
+ * Record the time spent by a codec for --codec-report.
+ * codec_name should be a static string.
+ */
+void
+zphoto_codec_record (const char *codec_name,
+                     const char *file_name,
+                     const char *operation,
+                     double seconds)
+{
+    Stat *stat;
+    char *format = get_format(file_name);
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&stats_mutex);
+#endif
+    for (stat = stats; stat != NULL; stat = stat->next) {
+        if (strcmp(stat->codec, codec_name) == 0 &&
+            strcmp(stat->format, format) == 0 &&
+            strcmp(stat->operation, operation) == 0)
+            break;
+    }
+    if (stat == NULL) {
+        stat = zphoto_emalloc(sizeof(Stat));
+        stat->codec     = zphoto_strdup(codec_name);
+        stat->format    = zphoto_strdup(format);
+        stat->operation = zphoto_strdup(operation);
+        stat->count     = 0;
+        stat->total     = 0.0;
+        stat->next      = stats;
+        stats = stat;
+    }
+    stat->count++;
+    stat->total += seconds;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&stats_mutex);
+#endif
+    free(format);
+
+    zphoto_metrics_note_backend(codec_name);
+}
+
+void
+zphoto_codec_write_report (FILE *fp)
+{
+    Stat *stat;
+
+    fprintf(fp, "%-10s %-6s %-10s %8s %10s %10s\n",
+            "codec", "format", "operation", "count", "total(s)", "avg(ms)");
+    for (stat = stats; stat != NULL; stat = stat->next) {
+        fprintf(fp, "%-10s %-6s %-10s %8d %10.3f %10.2f\n",
+                stat->codec, stat->format, stat->operation, stat->count,
+                stat->total, stat->total * 1000 / stat->count);
+    }
+}
+
+/*
+ * Imlib2 and ImageMagick have global state.  Their codecs
+ * and every other use of them from concurrent jobs must be
+ * serialized with these.  zphoto's own Imlib2 context is
+ * current while locked.
+ */
+void
+zphoto_backend_lock (void)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&backend_mutex);
+#endif
+    zphoto_limit_note_lock(1);
+    zphoto_image_push_context();
+}
+
+void
+zphoto_backend_unlock (void)
+{
+    zphoto_image_pop_context();
+    zphoto_limit_note_lock(-1);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&backend_mutex);
+#endif
+}
+
+/*
+ * Codecs registered earlier are preferred.
+ */
+void
+zphoto_codec_register (const ZphotoCodec *codec)
+{
+    if (ncodecs == MAX_NCODECS)
+        zphoto_eprintf("too many codecs: %s", codec->name);
+    codecs[ncodecs++] = codec;
+}
+
+/*
+ * Returns the preferred codec for the file or NULL.  mode
+ * is ZPHOTO_CODEC_READ or ZPHOTO_CODEC_WRITE.
+ */
+const ZphotoCodec *
+zphoto_codec_find (const char *file_name, int mode)
+{
+    int i;
+
+    init_codecs();
+    for (i = 0; i < ncodecs; i++) {
+        if (codecs[i]->probe(file_name, mode))
+            return codecs[i];
+    }
+    return NULL;
+}
+
+/*
+ * Decode the file with the first capable codec that
+ * succeeds.  If min_width is positive, codecs that support
+ * it may scale the image down but not below min_width.
+ * Returns NULL if no codec can decode it or if the job is
+ * to stop.
+ */
+ZphotoBitmap *
+zphoto_codec_decode (const char *file_name, int min_width)
+{
+    int i;
+
+    init_codecs();
+    for (i = 0; i < ncodecs; i++) {
+        const ZphotoCodec *codec = codecs[i];
+        ZphotoBitmap *bitmap;
+        double start_time;
+
+        if (!codec->probe(file_name, ZPHOTO_CODEC_READ))
+            continue;
+
+        start_time = zphoto_get_time();
+        zphoto_trace_begin("codec", "decode", file_name);
+        if (!codec->reentrant_p)
+            zphoto_backend_lock();
+        if (min_width > 0 && codec->decode_scaled != NULL)
+            bitmap = codec->decode_scaled(file_name, min_width);
+        else
+            bitmap = codec->decode(file_name);
+        if (!codec->reentrant_p)
+            zphoto_backend_unlock();
+        zphoto_trace_end();
+        zphoto_codec_record(codec->name, file_name, "decode",
+                            zphoto_get_time() - start_time);
+
+        /*
+         * The backend may have given up because the job is
+         * to stop.
+         */
+        if (bitmap != NULL || zphoto_limit_pending_p())
+            return bitmap;
+    }
+    return NULL;
+}
+
+/*
+ * Encode the bitmap with the first capable codec that
+ * succeeds.  Nothing is written if the job is to stop.
+ */
+void
+zphoto_codec_encode (ZphotoBitmap *bitmap, const char *file_name)
+{
+    int i, capable_p = 0;
+
+    init_codecs();
+    for (i = 0; i < ncodecs; i++) {
+        const ZphotoCodec *codec = codecs[i];
+        double start_time;
+        int done_p;
+
+        if (!codec->probe(file_name, ZPHOTO_CODEC_WRITE))
+            continue;
+
+        capable_p = 1;
+        start_time = zphoto_get_time();
+        zphoto_trace_begin("codec", "encode", file_name);
+        if (!codec->reentrant_p)
+            zphoto_backend_lock();
+        done_p = codec->encode(bitmap, file_name);
+        if (!codec->reentrant_p)
+            zphoto_backend_unlock();
+        zphoto_trace_end();
+        zphoto_codec_record(codec->name, file_name, "encode",
+                            zphoto_get_time() - start_time);
+        if (done_p || zphoto_limit_pending_p())
+            return;
+    }
+    if (capable_p)
+        zphoto_eprintf("%s: encoding failed", file_name);
+    zphoto_eprintf("%s: unsupported format", file_name);
+}
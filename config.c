@@ -192,6 +192,8 @@ zphoto_config_new (void)
     char *template_dir, *flash_font;
     ZphotoConfig *config = zphoto_emalloc(sizeof(ZphotoConfig));
     config->meta = NULL;
+    config->popcon = NULL;
+    config->copy_p = 0;
 
     template_dir = choose_path(3, 
                                getenv("ZPHOTO_TEMPLATE_DIR"), 
@@ -239,6 +241,65 @@ zphoto_config_new (void)
                '\0', "set the output zip file name to FILE", "FILE");
     set_config(config, zip_command, "zip -qjg", string,
                '\0', "set zip command to COMMAND", "COMMAND");
+    set_config(config, memory_limit, "", string,
+               '\0', "limit memory for concurrent image jobs to SIZE (e.g. 8G)",
+               "SIZE");
+    set_config(config, max_pixels, 0, int,
+               '\0', "skip images larger than NUM pixels (0: no limit)",
+               "NUM");
+    set_config(config, max_decode_time, 0.0, float,
+               '\0', "give up files that take more than SEC to convert",
+               "SEC");
+    set_config(config, max_movie_frames, 0, int,
+               '\0', "skip movies of more than NUM frames (0: no limit)",
+               "NUM");
+    set_config(config, quarantine_dir, "", string,
+               '\0', "link skipped files into DIR", "DIR");
+    set_config(config, failure_report, "", string,
+               '\0', "write skipped files and the reasons to FILE in JSON",
+               "FILE");
+    set_config(config, cache_dir, "", string,
+               '\0', "share previews and thumbnails among albums in DIR",
+               "DIR");
+    set_config(config, cache_size, "", string,
+               '\0', "limit the cache to SIZE (e.g. 20G)", "SIZE");
+    set_config(config, trace, "", string,
+               '\0', "write a timeline of the stages and photos to FILE "
+               "(Chrome trace format)", "FILE");
+    set_config(config, metrics, "", string,
+               '\0', "write per-operation latencies to FILE "
+               "(Prometheus text format)", "FILE");
+    set_config(config, metrics_json, "", string,
+               '\0', "write latency percentiles and the slowest photos "
+               "to FILE in JSON", "FILE");
+    set_config(config, slowest, 10, int,
+               '\0', "list NUM slowest photos in --metrics-json", "NUM");
+    set_config(config, profile, "", string,
+               '\0', "sample the stacks and write them to FILE "
+               "(folded for flamegraph.pl)", "FILE");
+    set_config(config, watch, "", string,
+               '\0', "keep the album of the photos in DIR up to date",
+               "DIR");
+    set_config(config, watch_delay, 2.0, float,
+               '\0', "update the album SEC after the last change", "SEC");
+    set_config(config, batch, "", string,
+               '\0', "make the albums listed in FILE", "FILE");
+    set_config(config, batch_jobs, 0, int,
+               '\0', "make NUM albums of --batch at once "
+               "(default: the number of CPUs)", "NUM");
+    set_config(config, output_tar, "", string,
+               '\0', "write the album to FILE as a tar archive instead "
+               "of the output directory (- for stdout)", "FILE");
+    set_config(config, serve, 0, int,
+               '\0', "serve the album at http://127.0.0.1:PORT/, "
+               "making the files when requested", "PORT");
+    set_config(config, progress_fd, 2, int,
+               '\0', "write the progress to file descriptor N", "N");
+    set_config(config, progress_format, "bar", string,
+               '\0', "show the progress as FORMAT (bar or jsonl)", "FORMAT");
+    set_config(config, progress_interval, 0.5, float,
+               '\0', "write at most one jsonl progress event per SEC",
+               "SEC");
 
     /*
      * Boolean flags
@@ -263,6 +324,26 @@ zphoto_config_new (void)
                '\0', "do not use fade effect for a movie thumbnail",NULL);
     set_config(config, quiet, 0, bool,
                'q', "suppress all normal output", NULL);
+    set_config(config, huge_pages, 0, bool,
+               '\0', "use transparent huge pages for image buffers", NULL);
+    set_config(config, codec_report, 0, bool,
+               '\0', "report which codec handled each format and its time",
+               NULL);
+    set_config(config, memory_report, 0, bool,
+               '\0', "report memory use per stage (needs --enable-memstat)",
+               NULL);
+    set_config(config, optimize_jpeg, 0, bool,
+               '\0', "losslessly optimize JPEG files that are not resized",
+               NULL);
+    set_config(config, progressive_jpeg, 0, bool,
+               '\0', "make them progressive (implies --optimize-jpeg)", NULL);
+    set_config(config, strip_metadata, 0, bool,
+               '\0', "strip metadata but ICC profiles from them "
+               "(implies --optimize-jpeg)", NULL);
+    set_config(config, no_dedup, 0, bool,
+               '\0', "process photos of the same contents separately", NULL);
+    set_config(config, collapse_duplicates, 0, bool,
+               '\0', "show photos of the same contents only once", NULL);
     set_config(config, art, 0, bool,
                '\0', "art mode (not for practical use)", NULL);
 
@@ -400,31 +481,27 @@ config_options (ZphotoConfig *config)
     return options;
 }
 
-static void
-set_config_value (MetaConfig *item, const char *key, const char *value,
-                  const char *file_name, int lineno)
+/*
+ * Returns 0 if value is invalid for item.
+ */
+static int
+set_value (MetaConfig *item, const char *value)
 {
     char *err;
-    if (item == NULL) {
-        zphoto_eprintf("unknown parameter \"%s\" in %s:%d", 
-                       key, file_name, lineno);
-    } else if (strcmp(item->type, "int") == 0) {
-        *(int *)item->storage = strtol(value, &err, 10);
+    if (strcmp(item->type, "int") == 0) {
+        long n = strtol(value, &err, 10);
         if (*err != '\0')
-            zphoto_eprintf("invalid integer value \"%s\" in %s:%d", 
-                           value, file_name, lineno);
+            return 0;
+        *(int *)item->storage = n;
     } else if (strcmp(item->type, "float") == 0) {
-        *(float *)item->storage = strtod(value, &err);
+        double x = strtod(value, &err);
         if (*err != '\0')
-            zphoto_eprintf("invalid float value \"%s\" in %s:%d", 
-                           value, file_name, lineno);
+            return 0;
+        *(float *)item->storage = x;
     } else if (strcmp(item->type, "string") == 0) {
-        if (zphoto_strsuffixcasecmp(key, "_color") == 0 &&
+        if (zphoto_strsuffixcasecmp(item->key, "_color") == 0 &&
             ! zphoto_valid_color_string_p(value)) 
-        {
-            zphoto_eprintf("invalid color value \"%s\" in %s:%d", 
-                           value, file_name, lineno);
-        }
+            return 0;
         /*
          * FIXME: this string will never be freed.
          */
@@ -435,11 +512,63 @@ set_config_value (MetaConfig *item, const char *key, const char *value,
         } else if (strcmp(value, "false") == 0) {
             *(int *)item->storage = 0;
         } else {
-            assert(0);
+            return 0;
         }
     } else {
         assert(0);
     }
+    return 1;
+}
+
+static void
+set_config_value (MetaConfig *item, const char *key, const char *value,
+                  const char *file_name, int lineno)
+{
+    if (item == NULL) {
+        zphoto_eprintf("unknown parameter \"%s\" in %s:%d", 
+                       key, file_name, lineno);
+    } else if (!set_value(item, value)) {
+        const char *type = item->type;
+
+        if (strcmp(type, "int") == 0)
+            type = "integer";
+        else if (strcmp(type, "string") == 0)
+            type = "color";
+        zphoto_eprintf("invalid %s value \"%s\" in %s:%d", 
+                       type, value, file_name, lineno);
+    }
+}
+
+/*
+ * Split line of a configuration file, "key = value", into
+ * key and value in place.  Returns 0 on a syntax error.
+ */
+int
+zphoto_config_split_line (char *line, char **key, char **value)
+{
+    char *sep = line;
+
+    sep += strcspn(sep, "\t =");
+    if (*sep == '=') {  /* '=' found. ex. key=... */
+        *sep = '\0';
+    } else if (*sep == '\0') {
+        return 0;
+    } else { /* ex. key =... */
+        *sep = '\0';
+        sep++; /* skip the first space */
+        sep += strspn(sep, "\t "); /* skip preceding spaces */
+        if (*sep != '=')
+            return 0;
+    }
+    sep++; /* skip = character */
+    sep += strspn(sep, "\t "); /* skip following spaces */
+
+    *key = line;
+    if (*sep == '\0')
+        *value = ""; /* empty value */
+    else
+        *value = sep;
+    return 1;
 }
 
 static ZphotoConfig *
@@ -453,7 +582,7 @@ config_read (ZphotoConfig *config, const char* file_name)
     fp = zphoto_efopen(file_name, "r");
 
     while (fgets(line, BUFSIZ, fp)) {
-        char *sep, *key, *value;
+        char *key, *value;
         MetaConfig *item;
         lineno++;
 
@@ -463,27 +592,8 @@ config_read (ZphotoConfig *config, const char* file_name)
         if (line[0] == '#' || zphoto_blank_line_p(line))
             continue;
 
-        sep = line;
-        sep += strcspn(sep, "\t =");
-        if (*sep == '=') {  /* '=' found. ex. key=... */
-            *sep = '\0';
-        } else if (*sep == '\0') {
+        if (!zphoto_config_split_line(line, &key, &value))
             zphoto_eprintf("syntax error in %s:%d", file_name, lineno);
-        } else { /* ex. key =... */
-            *sep = '\0';
-            sep++; /* skip the first space */
-            sep += strspn(sep, "\t "); /* skip preceding spaces */
-            if (*sep != '=')
-                zphoto_eprintf("syntax error in %s:%d", file_name, lineno);
-        }
-        sep++; /* skip = character */
-        sep += strspn(sep, "\t "); /* skip following spaces */
-
-        key = line;
-        if (*sep == '\0')
-            value = ""; /* empty value */
-        else
-            value = sep;
         item = meta_config_get(config->meta, key);
         set_config_value(item, key, value, file_name, lineno);
     }
@@ -491,6 +601,29 @@ config_read (ZphotoConfig *config, const char* file_name)
     return config;
 }
 
+/*
+ * Set the parameter key to value as in a configuration
+ * file.  Returns 0 if there is no such parameter or the
+ * value is invalid.  A copy frees the string replaced.
+ */
+int
+zphoto_config_set (ZphotoConfig *config, const char *key, const char *value)
+{
+    MetaConfig *item = meta_config_get(config->meta, key);
+    char *old_value;
+
+    if (item == NULL)
+        return 0;
+    if (!config->copy_p || strcmp(item->type, "string") != 0)
+        return set_value(item, value);
+
+    old_value = *(char **)item->storage;
+    if (!set_value(item, value))
+        return 0;
+    free(old_value);
+    return 1;
+}
+
 static char *
 tokenize (const char *str)
 {
@@ -620,7 +753,7 @@ zphoto_config_parse (ZphotoConfig *config, int argc, char **argv)
     }
 
     if (strcmp(config->title, "") == 0)
-        config->title = tokenize(zphoto_basename(config->output_dir));
+        zphoto_config_reset_title(config);
     else
         config->title = zphoto_strdup(config->title);
 
@@ -671,13 +804,62 @@ zphoto_config_reset_css_colors (ZphotoConfig *config)
     reset_colors(config, "css-colors.txt");
 }
 
+/*
+ * Make the title from the output directory as without
+ * --title.
+ */
+void
+zphoto_config_reset_title (ZphotoConfig *config)
+{
+    config->title = tokenize(zphoto_basename(config->output_dir));
+}
+
+/*
+ * A copy of config to be changed apart from it, e.g. for
+ * an album of --batch.  The arguments are shared; the
+ * strings of the parameters are copied and owned by the
+ * copy.
+ */
+ZphotoConfig *
+zphoto_config_copy (ZphotoConfig *config)
+{
+    ZphotoConfig *copy = zphoto_emalloc(sizeof(ZphotoConfig));
+    MetaConfig *p;
+
+    *copy = *config;
+    copy->meta = NULL;
+    for (p = config->meta; p != NULL; p = p->next) {
+        void *storage = (char *)copy + ((char *)p->storage - (char *)config);
+        copy->meta = meta_config_add(copy->meta, p->key, storage, p->type,
+                                     p->long_option, p->short_option,
+                                     p->help, p->help_arg);
+        if (strcmp(p->type, "string") == 0 && *(char **)storage != NULL)
+            *(char **)storage = zphoto_strdup(*(char **)storage);
+    }
+    copy->meta = meta_config_reverse(copy->meta, NULL);
+    copy->popcon = NULL;
+    copy->copy_p = 1;
+    return copy;
+}
+
 void
 zphoto_config_destroy (ZphotoConfig *config)
 {
-    free(config->title);
-    free(config->template_dir);
-    free(config->flash_font);
+    MetaConfig *p;
+
+    if (config->copy_p) {
+        for (p = config->meta; p != NULL; p = p->next) {
+            if (strcmp(p->type, "string") == 0)
+                free(*(char **)p->storage);
+        }
+    } else {
+        free(config->title);
+        free(config->template_dir);
+        free(config->flash_font);
+    }
     meta_config_destroy(config->meta);
-    poptFreeContext(config->popcon);
+    if (config->popcon != NULL)
+        poptFreeContext(config->popcon);
+    free(config);
 }
 
@@ -47,21 +47,12 @@ enum {
 static int 
 is_little_endian ()
 {
-    static long retval = -1;
-
-    if (retval == -1) {
-	uint32_t n = 1;
-	char *p = (char *)&n;
-	char x[] = {1, 0, 0, 0};
-
-	assert(sizeof(uint32_t) == 4);
-	if (memcmp(p, x, 4) == 0) {
-	    retval = 1;
-	} else {
-	    retval = 0;
-	}
-    }
-    return retval;
+    uint32_t n = 1;
+    char *p = (char *)&n;
+    char x[] = {1, 0, 0, 0};
+
+    assert(sizeof(uint32_t) == 4);
+    return memcmp(p, x, 4) == 0;
 }
 
 static unsigned long
@@ -29,8 +29,45 @@
 #include <errno.h>
 #include <zphoto.h>
 #include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "config.h"
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+
+static pthread_mutex_t ming_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void
+release_ming (void *unused)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&ming_mutex);
+#endif
+}
+
+/*
+ * Ming keeps global state (e.g. the character id counter),
+ * so movies are made one at a time.  The lock is released
+ * if an error abandons the job making the movie.
+ */
+static void
+lock_ming (void)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&ming_mutex);
+#endif
+    zphoto_limit_push_cleanup(release_ming, NULL);
+}
+
+static void
+unlock_ming (void)
+{
+    zphoto_limit_pop_cleanup();
+    release_ming(NULL);
+}
+
 typedef struct {
     float width;
     float height;
@@ -69,8 +106,10 @@ typedef struct {
     char	*html_file_name;
     char	*caption;
     time_t	time;
-    FILE	*file;
+    FILE	*file;      /* NULL if the bitmap is shared */
     SWFBitmap	bitmap;
+    dev_t	device;     /* of the thumbnail */
+    ino_t	inode;
     Size	size;
     int		id;
     SWFBitmap	*sample_bitmaps;
@@ -129,6 +168,7 @@ struct _ZphotoFlashMaker {
     int disable_captions;
 
     char *flash_font_name;
+    SWFFont font;  /* loaded for the movie being made */
 
     Photo **photos;
     int nphotos;
@@ -233,13 +273,48 @@ get_samples (Photo *photo, int nsamples)
     photo->nsamples = i;
 }
 
+/*
+ * Returns a loaded photo whose thumbnail is the same file
+ * (duplicates are hard linked) or NULL.
+ */
+static Photo *
+find_same_thumbnail (ZphotoFlashMaker *maker, Photo *photo)
+{
+    int i;
+
+    for (i = 0; i < maker->nphotos; i++) {
+        Photo *other = maker->photos[i];
+        if (other != photo && other->loaded_p && other->file != NULL &&
+            other->device == photo->device && other->inode == photo->inode)
+            return other;
+    }
+    return NULL;
+}
+
 static void 
 load_photo (ZphotoFlashMaker *maker, Photo *photo)
 {
+    struct stat st;
+    Photo *same;
+
     assert(photo->loaded_p == 0);
 
-    photo->file  = zphoto_efopen(photo->thumbnail_file_name, "rb");
-    photo->bitmap = newSWFJpegBitmap(photo->file);
+    zphoto_trace_begin("flash", "load", photo->full_size_file_name);
+    if (stat(photo->thumbnail_file_name, &st) == -1)
+        zphoto_eprintf("%s:", photo->thumbnail_file_name);
+    photo->device = st.st_dev;
+    photo->inode  = st.st_ino;
+
+    /*
+     * The bitmap is embedded in the movie only once.
+     */
+    same = zphoto_platform_w32_p() ? NULL : find_same_thumbnail(maker, photo);
+    if (same != NULL) {
+        photo->bitmap = same->bitmap;
+    } else {
+        photo->file   = zphoto_efopen(photo->thumbnail_file_name, "rb");
+        photo->bitmap = newSWFJpegBitmap(photo->file);
+    }
     photo->size.width  = SWFBitmap_getWidth(photo->bitmap);
     photo->size.height = SWFBitmap_getHeight(photo->bitmap);
 
@@ -248,11 +323,12 @@ load_photo (ZphotoFlashMaker *maker, Photo *photo)
         zphoto_support_movie_p())
     {
         get_samples(photo, maker->nsamples);
-        if (photo->nsamples < 1)
+        if (photo->nsamples < 1 && !zphoto_limit_pending_p())
             zphoto_eprintf("broken movie file: %s",
                            photo->full_size_file_name);
     }
     photo->loaded_p = 1;
+    zphoto_trace_end();
 }
 
 static Photo *
@@ -270,6 +346,7 @@ create_photo (const char *full_size_file_name,
     photo->thumbnail_file_name  = zphoto_strdup(thumbnail_file_name);
     photo->time  = time;
     photo->id = id;
+    photo->file = NULL;
     photo->sample_files = NULL;
     photo->sample_file_names = NULL;
     photo->sample_bitmaps = NULL;
@@ -291,7 +368,8 @@ destroy_photo (Photo *photo)
      * after calling SWFMovie_setRate(). Otherwise, we get
      * fatal errors such as a bus error...
      */
-    fclose(photo->file);
+    if (photo->file != NULL)
+        fclose(photo->file);
     if (photo->nsamples > 0) {
         int i;
         for (i = 0; i < photo->nsamples; i++) {
@@ -448,6 +526,20 @@ create_shadowed_photo_active (ZphotoFlashMaker *maker, Photo *photo)
 }
 
 
+/*
+ * The font is loaded once for a movie, not for each text.
+ */
+static SWFFont
+get_font (ZphotoFlashMaker *maker)
+{
+    if (maker->font == NULL) {
+        FILE *fp = zphoto_efopen(maker->flash_font_name, "rb");
+        maker->font = loadSWFFontFromFile(fp);
+        fclose(fp);
+    }
+    return maker->font;
+}
+
 static Text
 create_text (ZphotoFlashMaker *maker, 
 	     const char *str, 
@@ -455,18 +547,15 @@ create_text (ZphotoFlashMaker *maker,
 	     Color color)
 {
     Text text;
-    FILE *fp = zphoto_efopen(maker->flash_font_name, "rb");
-    SWFFont font = loadSWFFontFromFile(fp);
 	
     text.text = newSWFText2();
-    SWFText_setFont(text.text, font);
+    SWFText_setFont(text.text, get_font(maker));
     SWFText_setColor(text.text, color.r, color.g, color.b, color.a);
     SWFText_setHeight(text.text, height);
     SWFText_addString(text.text, str,NULL);
 
     text.size.width  = SWFText_getStringWidth(text.text, str);
     text.size.height = SWFText_getAscent(text.text);
-    fclose(fp);
 
     return text;
 }
@@ -912,7 +1001,10 @@ typedef void	(*ArrangeEachFunc)	(ZphotoFlashMaker *maker,
 					 int x,
 					 int y,
 					 Point point);
-static void
+/*
+ * Returns 0 if aborted.
+ */
+static int
 arrange_each (ZphotoFlashMaker *maker, 
 	      SWFMovie movie, 
 	      ArrangeEachFunc arrange_each_func,
@@ -929,11 +1021,13 @@ arrange_each (ZphotoFlashMaker *maker,
         point.x = origin.x + x * maker->photo_x_unit;
         point.y = origin.y + y * maker->photo_y_unit;
 
-	zphoto_progress_set(progress, i,
-			    zphoto_basename(maker->photos[i]->full_size_file_name));
+	if (!zphoto_progress_set(progress, i,
+                                 zphoto_basename(maker->photos[i]->full_size_file_name)))
+            break;
 	arrange_each_func(maker, movie, maker->photos[i], x, y, point);
     }
     zphoto_progress_finish(progress);
+    return i == maker->nphotos;
 }
 
 static void
@@ -1203,15 +1297,25 @@ zphoto_flash_maker_make (ZphotoFlashMaker *maker,
 			 const char *file_name,
 			 ZphotoProgress *progress)
 {
-    SWFMovie movie = newSWFMovie();
+    SWFMovie movie;
+
+    lock_ming();
+    movie = newSWFMovie();
     define_keys(maker, movie);
 
     add_preload_anim(maker, movie);
-    arrange_each(maker, movie, arrange_anim, progress);
-    terminate_movie(maker, movie);
-    save_movie(maker, movie, file_name);
+    zphoto_trace_begin("flash", "arrange", NULL);
+    if (arrange_each(maker, movie, arrange_anim, progress)) {
+        zphoto_trace_end();
+        zphoto_trace_begin("flash", "save", file_name);
+        terminate_movie(maker, movie);
+        save_movie(maker, movie, file_name);
+    }
+    zphoto_trace_end();
 
     destroySWFMovie(movie);
+    maker->font = NULL;
+    unlock_ming();
 }
 
 void
@@ -1285,9 +1389,11 @@ zphoto_flash_maker_destroy (ZphotoFlashMaker *maker)
 {
     int i;
 
+    lock_ming();
     for (i = 0; i < maker->nphotos; i++) {
 	destroy_photo(maker->photos[i]);
     }
+    unlock_ming();
     free(maker->photos);
     free(maker);
 }
@@ -1312,6 +1418,7 @@ zphoto_flash_maker_new (char **full_size_file_names,
     maker->flash_size.width       = flash_width;
     maker->flash_size.height      = flash_height;
     maker->flash_font_name   = zphoto_strdup(flash_font_name);
+    maker->font              = NULL;
 
     /*
      * Default values.
@@ -0,0 +1,165 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Content hash of input files for finding duplicates.
+ *
+ * This is XXH64 by Yann Collet: fast enough that hashing a
+ * photo costs far less than reading it, and 64 bits are
+ * plenty for an album.  The result is the same on every
+ * platform.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zphoto.h>
+#include "config.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t
+rotate_left (uint64_t x, int n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+/*
+ * Little endian regardless of the host.
+ */
+static uint64_t
+read64 (const unsigned char *p)
+{
+    return (uint64_t)p[0]       | (uint64_t)p[1] << 8  |
+           (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+           (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+           (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint32_t
+read32 (const unsigned char *p)
+{
+    return (uint32_t)p[0]       | (uint32_t)p[1] << 8 |
+           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t
+round64 (uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotate_left(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t
+merge_round (uint64_t acc, uint64_t value)
+{
+    acc ^= round64(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+uint64_t
+zphoto_hash (const void *data, size_t size, uint64_t seed)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        const unsigned char *limit = end - 32;
+        uint64_t v1 = seed + PRIME1 + PRIME2;
+        uint64_t v2 = seed + PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME1;
+
+        do {
+            v1 = round64(v1, read64(p));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = rotate_left(v1, 1) + rotate_left(v2, 7) +
+            rotate_left(v3, 12) + rotate_left(v4, 18);
+        h = merge_round(h, v1);
+        h = merge_round(h, v2);
+        h = merge_round(h, v3);
+        h = merge_round(h, v4);
+    } else {
+        h = seed + PRIME5;
+    }
+    h += size;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= round64(0, read64(p));
+        h = rotate_left(h, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * PRIME1;
+        h = rotate_left(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * PRIME5;
+        h = rotate_left(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t
+zphoto_hash_file (const char *file_name)
+{
+    size_t size;
+    void *data = zphoto_map_file(file_name, &size);
+    uint64_t h = zphoto_hash(data, size, 0);
+
+    zphoto_unmap_file(data, size);
+    return h;
+}
+
+/*
+ * Returns true if the two files have the same contents.
+ * Used to confirm what the hashes suggest.
+ */
+int
+zphoto_same_contents_p (const char *file_name1, const char *file_name2)
+{
+    size_t size1, size2;
+    void *data1 = zphoto_map_file(file_name1, &size1);
+    void *data2 = zphoto_map_file(file_name2, &size2);
+    int same_p = size1 == size2 && memcmp(data1, data2, size1) == 0;
+
+    zphoto_unmap_file(data1, size1);
+    zphoto_unmap_file(data2, size2);
+    return same_p;
+}
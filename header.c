@@ -0,0 +1,186 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Read image dimensions from file headers without decoding
+ * the pixels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zphoto.h>
+#include "config.h"
+
+static unsigned int
+be16 (const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static unsigned long
+be32 (const unsigned char *p)
+{
+    return ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static unsigned int
+le16 (const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static long
+le32 (const unsigned char *p)
+{
+    unsigned long x = p[0] | (p[1] << 8) | (p[2] << 16) |
+        ((unsigned long)p[3] << 24);
+    if (x & 0x80000000UL)
+        return -(long)(0xffffffffUL - x + 1);
+    return x;
+}
+
+static int
+sof_marker_p (int marker)
+{
+    /*
+     * SOF0-SOF15 except DHT, JPG and DAC.
+     */
+    return marker >= 0xc0 && marker <= 0xcf &&
+        marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+}
+
+static int
+read_jpeg_header (FILE *fp, int *width, int *height)
+{
+    unsigned char buf[8];
+
+    if (fseek(fp, 2, SEEK_SET) != 0)
+        return 0;
+
+    while (1) {
+        int c, marker;
+        unsigned int length;
+
+        c = fgetc(fp);
+        if (c != 0xff)
+            return 0;
+        do {
+            marker = fgetc(fp);  /* skip fill bytes */
+        } while (marker == 0xff);
+        if (marker == EOF || marker == 0xd9 || marker == 0xda)
+            return 0;  /* EOI or SOS before SOF */
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7))
+            continue;  /* markers without length */
+
+        if (fread(buf, 1, 2, fp) != 2)
+            return 0;
+        length = be16(buf);
+        if (length < 2)
+            return 0;
+
+        if (sof_marker_p(marker)) {
+            if (fread(buf, 1, 5, fp) != 5)
+                return 0;
+            *height = be16(buf + 1);
+            *width  = be16(buf + 3);
+            return 1;
+        }
+        if (fseek(fp, length - 2, SEEK_CUR) != 0)
+            return 0;
+    }
+}
+
+static int
+read_png_header (FILE *fp, int *width, int *height)
+{
+    unsigned char buf[24];
+
+    if (fseek(fp, 0, SEEK_SET) != 0 || fread(buf, 1, 24, fp) != 24)
+        return 0;
+    if (memcmp(buf + 12, "IHDR", 4) != 0)
+        return 0;
+    *width  = be32(buf + 16);
+    *height = be32(buf + 20);
+    return 1;
+}
+
+static int
+read_gif_header (FILE *fp, int *width, int *height)
+{
+    unsigned char buf[10];
+
+    if (fseek(fp, 0, SEEK_SET) != 0 || fread(buf, 1, 10, fp) != 10)
+        return 0;
+    *width  = le16(buf + 6);
+    *height = le16(buf + 8);
+    return 1;
+}
+
+static int
+read_bmp_header (FILE *fp, int *width, int *height)
+{
+    unsigned char buf[26];
+
+    if (fseek(fp, 0, SEEK_SET) != 0 || fread(buf, 1, 26, fp) != 26)
+        return 0;
+    *width  = labs(le32(buf + 18));
+    *height = labs(le32(buf + 22));  /* negative for top-down bitmaps */
+    return 1;
+}
+
+/*
+ * Returns 1 and sets width and height if the dimensions are
+ * found in the header of the file.  Returns 0 for unknown
+ * formats and broken files.
+ */
+int
+zphoto_image_read_header (const char *file_name, int *width, int *height)
+{
+    unsigned char magic[8];
+    unsigned char png_magic[] = { 0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a };
+    int ok = 0;
+    FILE *fp = zphoto_memfile_open(file_name);
+
+    if (fp == NULL)
+        fp = fopen(file_name, "rb");
+    if (fp == NULL)
+        return 0;
+
+    if (fread(magic, 1, 8, fp) == 8) {
+        if (magic[0] == 0xff && magic[1] == 0xd8) {
+            ok = read_jpeg_header(fp, width, height);
+        } else if (memcmp(magic, png_magic, 8) == 0) {
+            ok = read_png_header(fp, width, height);
+        } else if (memcmp(magic, "GIF87a", 6) == 0 ||
+                   memcmp(magic, "GIF89a", 6) == 0) {
+            ok = read_gif_header(fp, width, height);
+        } else if (magic[0] == 'B' && magic[1] == 'M') {
+            ok = read_bmp_header(fp, width, height);
+        }
+    }
+    fclose(fp);
+
+    if (ok && (*width <= 0 || *height <= 0))
+        ok = 0;
+    return ok;
+}
@@ -37,8 +37,25 @@ struct _ZphotoImageCopier {
     double	gamma;
     int		resize_p;
     int		effect_p;
+    int		optimize_p;
+    int		jpeg_flags;
 };
 
+/*
+ * Name and bytes per pixel of the decoded images of the
+ * generic imaging library.
+ */
+#ifdef HAVE_IMLIB2
+#define BACKEND_NAME       "imlib2"
+#define BACKEND_PIXEL_SIZE 4  /* DATA32 */
+#elif HAVE_MAGICK
+#define BACKEND_NAME       "magick"
+#define BACKEND_PIXEL_SIZE 8  /* PixelPacket in Q16 */
+#else
+#define BACKEND_NAME       "none"
+#define BACKEND_PIXEL_SIZE 4
+#endif
+
 static void	get_new_image_size (ZphotoImageCopier *copier, 
                                     int old_width,  int old_height, 
                                     int *new_width, int *new_height);
@@ -67,11 +84,18 @@ static int
 avifile_count_nframes (avm::IReadStream *stream)
 {
     int nframes = 0;
+    int max_nframes = zphoto_limit_get_movie_frames();
     while (1) {
         int status = stream->ReadFrame(false);
         if (status == -1) 
             break;
         nframes++;
+        if (max_nframes > 0 && nframes > max_nframes) {
+            zphoto_limit_violate("too many frames");
+            break;
+        }
+        if (zphoto_limit_pending_p())
+            break;
     }
     if (stream->Seek(0) != 0) 
         zphoto_eprintf("avifile_count_nframes: Seek failed");
@@ -86,7 +110,9 @@ avifile_new (const char *file_name)
 
     Avifile *avifile = (Avifile *)zphoto_emalloc(sizeof(Avifile));
 
-    avifile->file = avm::CreateReadFile(file_name);
+    char *real_file_name = zphoto_memfile_spill(file_name);
+    avifile->file = avm::CreateReadFile(real_file_name);
+    free(real_file_name);
     if (avifile->file == NULL)
         return NULL;
     avifile->stream = avifile->file->GetStream(0, avm::IStream::Video);
@@ -132,6 +158,8 @@ avifile_seek (Avifile *avifile, int pos)
         avifile->stream->Seek(pos);
     } else {
         for (int i = 0; i < (pos - avifile->pos); i++) {
+            if (zphoto_limit_pending_p())
+                break;
             int status = avifile->stream->ReadFrame(false);
             if (status == -1)
                 zphoto_eprintf("avifile_get_frame: ReadFrame failed");
@@ -153,14 +181,9 @@ avifile_convert_to_imlib_image (Avifile *avifile, CImage *cimage)
     imlib_context_set_image(imlib_image);
     DATA32* canvas = imlib_image_get_data();
 
-    int bpp = new_cimage->Bpp();
-    int pixels = new_cimage->Pixels();
-    uint8_t* data = new_cimage->Data();
-    for (int i = 0; i < pixels; i++) {
-        canvas[i] = (data[i * bpp +0] << 0) |
-            (data[i * bpp + 1] << 8) |
-            (data[i * bpp + 2] << 16);
-    }
+    assert(new_cimage->Bpp() == 3);
+    zphoto_pixel_bgr_to_argb(new_cimage->Data(), canvas,
+                             new_cimage->Pixels());
     new_cimage->Release();
     return imlib_image;
 }
@@ -205,6 +228,8 @@ loader_load_samples (const char *file_name, int nsamples)
         images = (Imlib_Image *)
             zphoto_emalloc(sizeof(Imlib_Image) * (avifile->nframes + 1));
         for (int i = 0; i < avifile->nframes; i++) {
+            if (zphoto_limit_pending_p())
+                break;
             images[i] = avifile_get_frame(avifile, i);
             nframes++;
         }
@@ -214,6 +239,8 @@ loader_load_samples (const char *file_name, int nsamples)
         images[0] = avifile_get_frame(avifile, 0);
         nframes++;
         for (int i = 1; i < nsamples; i++) {
+            if (zphoto_limit_pending_p())
+                break;
             int x = (int)((avifile->nframes - 1) * 
                           ((float)i / (nsamples - 1)));
             images[i] = avifile_get_frame(avifile, x);
@@ -234,11 +261,14 @@ zphoto_image_save_samples (const char *file_name,
     char **sample_file_names;
     char *sans_suffix = 
         zphoto_suppress_suffix(zphoto_strdup(sample_file_name));
-    Imlib_Image *images = loader_load_samples(file_name, nsamples);
 
-    if (images == NULL) 
+    zphoto_backend_lock();
+    Imlib_Image *images = loader_load_samples(file_name, nsamples);
+    if (images == NULL) {
+        zphoto_backend_unlock();
         zphoto_eprintf("loader_load_samples failed: %s", 
                        file_name);
+    }
 
     for (i = 0; images[i] != NULL; i++);  /* count actual samples */
     nsamples = i;
@@ -252,6 +282,7 @@ zphoto_image_save_samples (const char *file_name,
         sample_file_names[i] = sample_file_name;
     }
     sample_file_names[i] = NULL;
+    zphoto_backend_unlock();
     free(images);
     free(sans_suffix);
     return sample_file_names;
@@ -260,13 +291,16 @@ zphoto_image_save_samples (const char *file_name,
 extern "C" unsigned char *
 zphoto_image_get_bitmap (const char* file_name, int *width, int *height)
 {
+    zphoto_backend_lock();
     Avifile *avifile = avifile_new(file_name);
     avifile_seek(avifile, 0);
 
     CImage *cimage = avifile->stream->GetFrame(true);
     avifile_destroy(avifile);
-    if (cimage == NULL) 
+    if (cimage == NULL) {
+        zphoto_backend_unlock();
         return NULL;
+    }
 
     BitmapInfo info(cimage->Width(), cimage->Height(), 24);
     CImage *new_cimage = new CImage(cimage, &info);
@@ -274,19 +308,15 @@ zphoto_image_get_bitmap (const char* file_name, int *width, int *height)
     int pixels    = new_cimage->Pixels();
     uint8_t* data = new_cimage->Data();
     unsigned char *bitmap = (unsigned char *)zphoto_emalloc(pixels * bpp);
-    memmove(bitmap, data, pixels * bpp);
 
-    for (int i = 0; i < pixels * bpp; i += bpp) {
-        // Swap red and blue values.
-        uint8_t tmp = bitmap[i];
-        bitmap[i] = bitmap[i + 2];
-        bitmap[i + 2] = tmp;
-    }
+    assert(bpp == 3);
+    zphoto_pixel_swap_rb(data, bitmap, pixels);  // BGR to RGB
     *width  = cimage->Width();
     *height = cimage->Height();
 
     new_cimage->Release();
     cimage->Release();
+    zphoto_backend_unlock();
    
     return bitmap;
 }
@@ -318,12 +348,61 @@ zphoto_image_get_bitmap (const char* file_name, int *width, int *height)
 #include <X11/Xlib.h>
 #include <Imlib2.h>
 
+static Imlib_Context context = NULL;
+
+/*
+ * Make zphoto's own context current so that the settings
+ * of an application using Imlib2 itself are left alone.
+ * Called with the backend lock held.
+ */
+extern "C" void
+zphoto_image_push_context (void)
+{
+    if (context == NULL)
+        context = imlib_context_new();
+    imlib_context_push(context);
+}
+
+extern "C" void
+zphoto_image_pop_context (void)
+{
+    imlib_context_pop();
+}
+
+/*
+ * Let Imlib2 give up loading when the decoding time limit
+ * is exceeded.  The caller checks the limit after
+ * releasing the backend lock.
+ */
+static int
+check_limit (Imlib_Image image, char percent,
+             int update_x, int update_y, int update_width, int update_height)
+{
+    return !zphoto_limit_pending_p();
+}
+
+/*
+ * Imlib2 reads files by names only; in-memory files are
+ * spilled.
+ */
+static Imlib_Image
+load_image_with_limit (const char* file_name)
+{
+    char *real_file_name = zphoto_memfile_spill(file_name);
+    imlib_context_set_progress_function(check_limit);
+    imlib_context_set_progress_granularity(1);
+    Imlib_Image image = imlib_load_image(real_file_name);
+    imlib_context_set_progress_function(NULL);
+    free(real_file_name);
+    return image;
+}
+
 static Imlib_Image
 load_image (const char* file_name)
 {
     assert(file_name != NULL);
     if (zphoto_image_file_p(file_name)) {
-        return imlib_load_image(file_name);
+        return load_image_with_limit(file_name);
     } else if (zphoto_support_movie_p() &&
                zphoto_movie_file_p(file_name)) 
     {
@@ -359,6 +438,8 @@ advanced_copy_image (ZphotoImageCopier *copier,
     int old_width, old_height, new_width, new_height;
 
     input_image = load_image(input_file_name);
+    if (input_image == NULL && zphoto_limit_pending_p())
+        return;
     if (input_image == NULL)
 	zphoto_eprintf("load_image: %s is not a supported file",
 		       input_file_name);
@@ -369,12 +450,26 @@ advanced_copy_image (ZphotoImageCopier *copier,
 
     old_width  = imlib_image_get_width();
     old_height = imlib_image_get_height();
+    zphoto_metrics_note_input(0, old_width, old_height);
 
     get_new_image_size(copier, old_width, old_height, &new_width, &new_height);
 
-    output_image = imlib_create_image(new_width, new_height);
-    if (output_image == NULL)
-	zphoto_eprintf("%s:", output_image);
+    /*
+     * The output pixels are borrowed from the buffer pool
+     * instead of being allocated by Imlib2 for every photo.
+     */
+    size_t output_size = sizeof(DATA32) * new_width * new_height;
+    DATA32 *output_data = (DATA32 *)zphoto_pool_alloc(output_size);
+    memset(output_data, 0, output_size);
+    output_image = imlib_create_image_using_data(new_width, new_height,
+                                                 output_data);
+    if (output_image == NULL) {
+        imlib_context_set_image(input_image);
+        imlib_free_image();
+        zphoto_pool_free(output_data);
+	zphoto_eprintf("%s: imlib_create_image_using_data failed",
+                       output_file_name);
+    }
 
     imlib_context_set_image(output_image);
     imlib_blend_image_onto_image(input_image, 0, 0, 0,
@@ -391,19 +486,102 @@ advanced_copy_image (ZphotoImageCopier *copier,
     imlib_free_image();
     imlib_context_set_image(output_image);
     imlib_free_image();
+    zphoto_pool_free(output_data);
 }
 
 extern "C" void
 zphoto_image_get_size (const char *file_name, int *width, int *height)
 {
+    zphoto_backend_lock();
     Imlib_Image image = load_image(file_name);
+    if (image != NULL) {
+        imlib_context_set_image(image);
+        *width  = imlib_image_get_width();
+        *height = imlib_image_get_height();
+        imlib_free_image();
+    }
+    zphoto_backend_unlock();
     if (image == NULL)
 	zphoto_eprintf("load_image: %s is not a supported file",
 		       file_name);
+}
+
+static int
+imlib2_probe (const char *file_name, int mode)
+{
+    return zphoto_image_file_p(file_name);
+}
+
+static ZphotoBitmap *
+imlib2_decode (const char *file_name)
+{
+    Imlib_Image image = load_image_with_limit(file_name);
+    if (image == NULL)
+        return NULL;
+
     imlib_context_set_image(image);
-    *width  = imlib_image_get_width();
-    *height = imlib_image_get_height();
+    int width  = imlib_image_get_width();
+    int height = imlib_image_get_height();
+    int channels = imlib_image_has_alpha() ? 4 : 3;
+    DATA32 *data = imlib_image_get_data_for_reading_only();
+    ZphotoBitmap *bitmap = zphoto_bitmap_new(width, height, channels);
+
+    if (channels == 4)
+        zphoto_pixel_argb_to_rgba(data, bitmap->data, (size_t)width * height);
+    else
+        zphoto_pixel_argb_to_rgb(data, bitmap->data, (size_t)width * height);
     imlib_free_image();
+    return bitmap;
+}
+
+static int
+imlib2_encode (ZphotoBitmap *bitmap, const char *file_name)
+{
+    int npixels = bitmap->width * bitmap->height;
+    int channels = bitmap->channels;
+    int alpha_p = channels == 2 || channels == 4;
+    DATA32 *data = (DATA32 *)zphoto_pool_alloc(sizeof(DATA32) * npixels);
+
+    if (channels == 3) {
+        zphoto_pixel_rgb_to_argb(bitmap->data, data, npixels);
+    } else if (channels == 4) {
+        zphoto_pixel_rgba_to_argb(bitmap->data, data, npixels);
+    } else {
+        const unsigned char *p = bitmap->data;
+        for (int i = 0; i < npixels; i++, p += channels) {
+            DATA32 v = p[0];
+            DATA32 a = alpha_p ? p[1] : 0xff;
+            data[i] = (a << 24) | (v << 16) | (v << 8) | v;
+        }
+    }
+
+    Imlib_Image image = imlib_create_image_using_data(bitmap->width,
+                                                      bitmap->height, data);
+    if (image == NULL) {
+        zphoto_pool_free(data);
+        zphoto_eprintf("%s: imlib_create_image_using_data failed", file_name);
+    }
+    imlib_context_set_image(image);
+    imlib_image_set_has_alpha(alpha_p);
+    imlib_save_image(file_name);
+    imlib_free_image();
+    zphoto_pool_free(data);
+    return 1;
+}
+
+static const ZphotoCodec imlib2_codec = {
+    "imlib2",
+    0,
+    imlib2_probe,
+    imlib2_decode,
+    NULL,
+    imlib2_encode
+};
+
+extern "C" const ZphotoCodec *
+zphoto_image_get_codec (void)
+{
+    return &imlib2_codec;
 }
 
 /*
@@ -412,6 +590,22 @@ zphoto_image_get_size (const char *file_name, int *width, int *height)
 #elif HAVE_MAGICK
 #include <magick/api.h>
 
+/*
+ * In-memory files are read from their bytes.
+ */
+static Image *
+read_image (ImageInfo *image_info, const char *file_name,
+            ExceptionInfo *exception)
+{
+    const void *data;
+    size_t size;
+
+    strcpy(image_info->filename, file_name);
+    if (zphoto_memfile_get(file_name, &data, &size, NULL))
+        return BlobToImage(image_info, data, size, exception);
+    return ReadImage(image_info, exception);
+}
+
 static void
 advanced_copy_image (ZphotoImageCopier *copier,
 		     const char *input_file_name, 
@@ -424,19 +618,26 @@ advanced_copy_image (ZphotoImageCopier *copier,
 
     GetExceptionInfo(&exception);
     image_info = CloneImageInfo(NULL);
-    strcpy(image_info->filename, input_file_name);
-    image = ReadImage(image_info, &exception);
-    if (image == NULL)
+    image = read_image(image_info, input_file_name, &exception);
+    if (image == NULL) {
+        DestroyImageInfo(image_info);
+        DestroyExceptionInfo(&exception);
         zphoto_eprintf("%s is not supported by ImageMagick", input_file_name);
+    }
 
     old_width  = image->columns;
     old_height = image->rows;
+    zphoto_metrics_note_input(0, old_width, old_height);
     get_new_image_size(copier, old_width, old_height, &new_width, &new_height);
         
     resized_image = ResizeImage(image, new_width, new_height, 
                                 LanczosFilter, 1.0, &exception);
-    if (resized_image == NULL)
+    if (resized_image == NULL) {
+        DestroyImage(image);
+        DestroyImageInfo(image_info);
+        DestroyExceptionInfo(&exception);
         zphoto_eprintf("%s is not supported by ImageMagick", input_file_name);
+    }
 
     if (copier->gamma != 1.0) {
         char *gamma = zphoto_asprintf("%f", copier->gamma);
@@ -459,12 +660,18 @@ zphoto_image_get_size (const char *file_name, int *width, int *height)
     ExceptionInfo exception;
     ImageInfo *image_info;
 
+    zphoto_backend_lock();
     GetExceptionInfo(&exception);
     image_info = CloneImageInfo(NULL);
-    strcpy(image_info->filename, file_name);
-    image = ReadImage(image_info, &exception);
-    if (exception.severity != UndefinedException || image == NULL)
+    image = read_image(image_info, file_name, &exception);
+    if (exception.severity != UndefinedException || image == NULL) {
+        if (image != NULL)
+            DestroyImage(image);
+        DestroyImageInfo(image_info);
+        DestroyExceptionInfo(&exception);
+        zphoto_backend_unlock();
         zphoto_eprintf("%s is not supported by ImageMagick", file_name);
+    }
 
     *width  = image->columns;
     *height = image->rows;
@@ -472,6 +679,93 @@ zphoto_image_get_size (const char *file_name, int *width, int *height)
     DestroyImage(image);
     DestroyImageInfo(image_info);
     DestroyExceptionInfo(&exception);
+    zphoto_backend_unlock();
+}
+
+static int
+magick_probe (const char *file_name, int mode)
+{
+    return zphoto_image_file_p(file_name);
+}
+
+static ZphotoBitmap *
+magick_decode (const char *file_name)
+{
+    Image *image;
+    ExceptionInfo exception;
+    ImageInfo *image_info;
+    ZphotoBitmap *bitmap = NULL;
+
+    GetExceptionInfo(&exception);
+    image_info = CloneImageInfo(NULL);
+    image = read_image(image_info, file_name, &exception);
+    if (image != NULL) {
+        int channels = image->matte ? 4 : 3;
+        bitmap = zphoto_bitmap_new(image->columns, image->rows, channels);
+        if (!DispatchImage(image, 0, 0, image->columns, image->rows,
+                           channels == 4 ? "RGBA" : "RGB", CharPixel,
+                           bitmap->data, &exception))
+        {
+            zphoto_bitmap_destroy(bitmap);
+            bitmap = NULL;
+        }
+        DestroyImage(image);
+    }
+    DestroyImageInfo(image_info);
+    DestroyExceptionInfo(&exception);
+    return bitmap;
+}
+
+static int
+magick_encode (ZphotoBitmap *bitmap, const char *file_name)
+{
+    static const char *maps[] = { "I", "IA", "RGB", "RGBA" };
+    Image *image;
+    ExceptionInfo exception;
+    ImageInfo *image_info;
+
+    GetExceptionInfo(&exception);
+    image = ConstituteImage(bitmap->width, bitmap->height,
+                            maps[bitmap->channels - 1], CharPixel,
+                            bitmap->data, &exception);
+    if (image == NULL) {
+        DestroyExceptionInfo(&exception);
+        zphoto_eprintf("%s: ConstituteImage failed", file_name);
+    }
+
+    image_info = CloneImageInfo(NULL);
+    strcpy(image->filename, file_name);
+    WriteImage(image_info, image);
+    DestroyImage(image);
+    DestroyImageInfo(image_info);
+    DestroyExceptionInfo(&exception);
+    return 1;
+}
+
+static const ZphotoCodec magick_codec = {
+    "magick",
+    0,
+    magick_probe,
+    magick_decode,
+    NULL,
+    magick_encode
+};
+
+extern "C" const ZphotoCodec *
+zphoto_image_get_codec (void)
+{
+    return &magick_codec;
+}
+
+extern "C" void
+zphoto_image_push_context (void)
+{
+    /* ImageMagick has no context */
+}
+
+extern "C" void
+zphoto_image_pop_context (void)
+{
 }
 
 /*
@@ -479,12 +773,15 @@ zphoto_image_get_size (const char *file_name, int *width, int *height)
  */
 #else
 
+/*
+ * Reached when the codecs could not convert the file.
+ */
 static void
 advanced_copy_image (ZphotoImageCopier *copier,
 		     const char *input_file_name, 
 		     const char *output_file_name) 
 {
-    assert(0); /* unsupported */
+    zphoto_eprintf("%s: unsupported or broken file", input_file_name);
 }
 
 extern "C" void
@@ -493,6 +790,22 @@ zphoto_image_get_size (const char *file_name, int *width, int *height)
     assert(0); /* unsupported */
 }
 
+extern "C" const ZphotoCodec *
+zphoto_image_get_codec (void)
+{
+    return NULL;
+}
+
+extern "C" void
+zphoto_image_push_context (void)
+{
+}
+
+extern "C" void
+zphoto_image_pop_context (void)
+{
+}
+
 #endif
 
 
@@ -512,43 +825,163 @@ get_new_image_size (ZphotoImageCopier *copier,
         assert(copier->width != 0);
         *new_width = copier->width;
         *new_height = (int)((double)*new_width / old_width * old_height);
+        if (*new_height < 1)
+            *new_height = 1;
     } else {
         *new_width  = old_width;
         *new_height = old_height;
     }
 }
 
+static void
+close_stream (void *fp)
+{
+    fclose((FILE *)fp);
+}
+
+/*
+ * The streams are closed by the trap as well if the job is
+ * abandoned on an error.
+ */
 static void
 simple_copy_image (ZphotoImageCopier *copier,
 		   const char *input_file_name, 
 		   const char *output_file_name)
 {
     int n;
+    size_t total = 0;
     char buf[BUFSIZ];
-    FILE *in  = zphoto_efopen(input_file_name,  "rb");
-    FILE *out = zphoto_efopen(output_file_name, "wb");
+    FILE *in, *out;
+
+    in = zphoto_efopen(input_file_name,  "rb");
+    zphoto_limit_push_cleanup(close_stream, in);
+    out = zphoto_efopen(output_file_name, "wb");
+    zphoto_limit_push_cleanup(close_stream, out);
 
     while ((n = fread(buf, 1, BUFSIZ, in)) > 0) {
 	int nn = fwrite(buf, 1, n, out);
 	if (n != nn)
 	    zphoto_eprintf("%s:", output_file_name);
+        total += n;
     }
     if (ferror(in))
 	zphoto_eprintf("%s:", input_file_name);
+    zphoto_metrics_note_input(total, 0, 0);
+    zphoto_metrics_note_output(total);
 
+    zphoto_limit_pop_cleanup();
+    zphoto_limit_pop_cleanup();
     fclose(in);
     fclose(out);
 }
 
-static void
-restore_mtime (const char *file_name, time_t mtime)
+static int
+jpeg_file_p (const char *file_name)
 {
-    struct utimbuf tb;
+    return zphoto_strsuffixcasecmp(file_name, ".jpg")  == 0 ||
+           zphoto_strsuffixcasecmp(file_name, ".jpeg") == 0;
+}
 
-    tb.actime  = time(NULL);
-    tb.modtime = mtime;
-    if (utime(file_name, &tb))
-	zphoto_eprintf("%s:", file_name);
+/*
+ * JPEG to JPEG conversions are streamed scanline by
+ * scanline through libjpeg so that huge images such as
+ * stitched panoramas are never held in memory as a whole.
+ * Returns 0 if the streaming path is not available.
+ */
+static int
+stream_copy_image (ZphotoImageCopier *copier,
+                   const char *input_file_name, 
+                   const char *output_file_name)
+{
+    int ok;
+    double start_time = zphoto_get_time();
+
+    if (!jpeg_file_p(input_file_name) || !jpeg_file_p(output_file_name))
+        return 0;
+
+    zphoto_trace_begin("image", "stream", input_file_name);
+    ok = zphoto_jpeg_stream_copy(input_file_name, output_file_name,
+                                 copier->resize_p ? copier->width : 0,
+                                 copier->gamma);
+    zphoto_trace_end();
+    if (ok)
+        zphoto_codec_record("libjpeg", input_file_name, "stream",
+                            zphoto_get_time() - start_time);
+    return ok;
+}
+
+/*
+ * JPEG files copied without changes are recompressed in
+ * the DCT domain if requested.  Returns 0 if libjpeg
+ * cannot read the file.
+ */
+static int
+optimize_copy_image (ZphotoImageCopier *copier,
+                     const char *input_file_name,
+                     const char *output_file_name)
+{
+    int ok;
+    double start_time = zphoto_get_time();
+
+    zphoto_trace_begin("image", "optimize", input_file_name);
+    ok = zphoto_jpeg_optimize(input_file_name, output_file_name,
+                              copier->jpeg_flags);
+    zphoto_trace_end();
+    if (ok)
+        zphoto_codec_record("libjpeg", input_file_name, "optimize",
+                            zphoto_get_time() - start_time);
+    return ok;
+}
+
+/*
+ * Image files are decoded and encoded by the codecs in the
+ * registry (see codec.c), which picks the preferred
+ * backend for each format.  Returns 0 if no codec can
+ * decode the input.
+ */
+static int
+codec_copy_image (ZphotoImageCopier *copier,
+                  const char *input_file_name, 
+                  const char *output_file_name)
+{
+    int old_width, old_height, new_width, new_height;
+    ZphotoBitmap *bitmap;
+
+    if (zphoto_image_read_header(input_file_name, &old_width, &old_height)) {
+        zphoto_metrics_note_input(0, old_width, old_height);
+        get_new_image_size(copier, old_width, old_height, 
+                           &new_width, &new_height);
+        bitmap = zphoto_codec_decode(input_file_name,
+                                     new_width < old_width ? new_width : 0);
+    } else {
+        bitmap = zphoto_codec_decode(input_file_name, 0);
+        if (bitmap != NULL) {
+            zphoto_metrics_note_input(0, bitmap->width, bitmap->height);
+            get_new_image_size(copier, bitmap->width, bitmap->height,
+                               &new_width, &new_height);
+        }
+    }
+    if (bitmap == NULL)
+        return 0;
+
+    if (bitmap->width != new_width || bitmap->height != new_height ||
+        copier->gamma != 1.0) 
+    {
+        ZphotoBitmap *resized_bitmap;
+
+        zphoto_trace_begin("image", "resize", input_file_name);
+        resized_bitmap = 
+            zphoto_bitmap_resize(bitmap, new_width, new_height, copier->gamma);
+        zphoto_trace_end();
+        zphoto_bitmap_destroy(bitmap);
+        bitmap = resized_bitmap;
+        if (bitmap == NULL)  /* cancelled */
+            return 0;
+    }
+
+    zphoto_codec_encode(bitmap, output_file_name);
+    zphoto_bitmap_destroy(bitmap);
+    return 1;
 }
 
 static int
@@ -560,22 +993,183 @@ convert_needed_p (const char *src, const char *dest)
     return strcmp(suffix1, suffix2) != 0;
 }
 
+/*
+ * Neither Imlib2 nor ImageMagick is known to be safe with
+ * concurrent jobs.  The generic path is serialized while
+ * other copies run in parallel.
+ */
+static void
+locked_advanced_copy_image (ZphotoImageCopier *copier,
+                            const char *input_file_name, 
+                            const char *output_file_name) 
+{
+    double start_time = zphoto_get_time();
+
+    zphoto_trace_begin("image", "convert", input_file_name);
+    zphoto_backend_lock();
+    advanced_copy_image(copier, input_file_name, output_file_name);
+    zphoto_backend_unlock();
+    zphoto_trace_end();
+    zphoto_codec_record(BACKEND_NAME, input_file_name, "convert",
+                        zphoto_get_time() - start_time);
+}
+
+enum {
+    COPY_SIMPLE,
+    COPY_OPTIMIZE,
+    COPY_STREAM,
+    COPY_CODEC,
+    COPY_ADVANCED
+};
+
+static int
+choose_copy_method (ZphotoImageCopier *copier,
+                    const char *src, const char *dest)
+{
+    if (zphoto_movie_file_p(dest))
+        return COPY_SIMPLE;
+    else if (copier->effect_p || copier->resize_p || 
+             convert_needed_p(src, dest))
+    {
+        if (jpeg_file_p(src) && jpeg_file_p(dest))
+            return COPY_STREAM;
+        else if (!zphoto_movie_file_p(src) &&
+                 zphoto_codec_find(src,  ZPHOTO_CODEC_READ) &&
+                 zphoto_codec_find(dest, ZPHOTO_CODEC_WRITE))
+            return COPY_CODEC;
+        else
+            return COPY_ADVANCED;
+    }
+#ifdef HAVE_LIBJPEG
+    else if (copier->optimize_p && jpeg_file_p(src) && jpeg_file_p(dest))
+        return COPY_OPTIMIZE;
+#endif
+    else
+        return COPY_SIMPLE;
+}
+
 extern "C" void
 zphoto_image_copier_copy (ZphotoImageCopier *copier,
 			  const char *src,
 			  const char *dest,
                           time_t time)
 {
-    int convert_p = convert_needed_p(src, dest);
+    /*
+     * dest may be a link to a cache entry or to another
+     * output.  Do not write through it.
+     */
+    remove(dest);
 
-    if (zphoto_movie_file_p(dest))
-	simple_copy_image(copier, src, dest);
-    else if (copier->effect_p || copier->resize_p || convert_p)
-	advanced_copy_image(copier, src, dest);
-    else
+    /*
+     * A method that stopped because the job is to stop
+     * returns 0 as well.  Do not fall back then.
+     */
+    switch (choose_copy_method(copier, src, dest)) {
+    case COPY_STREAM:
+        if (stream_copy_image(copier, src, dest) || zphoto_limit_pending_p())
+            break;
+        /* fall through */
+    case COPY_CODEC:
+        if (codec_copy_image(copier, src, dest) || zphoto_limit_pending_p())
+            break;
+        /* fall through */
+    case COPY_ADVANCED:
+        locked_advanced_copy_image(copier, src, dest);
+        break;
+    case COPY_OPTIMIZE:
+        if (optimize_copy_image(copier, src, dest))
+            break;
+        /* fall through */
+    default:
+        zphoto_trace_begin("image", "copy", src);
 	simple_copy_image(copier, src, dest);
+        zphoto_trace_end();
+        break;
+    }
 
-    restore_mtime(dest, time);
+    if (zphoto_limit_pending_p()) {
+        remove(dest);  /* may be incomplete */
+        return;
+    }
+    zphoto_restore_mtime(dest, time);
+}
+
+/*
+ * Returns a description of what the copier does to src to
+ * make dest, for the cache key, or NULL if dest is a plain
+ * copy of src.
+ */
+extern "C" char *
+zphoto_image_copier_describe (ZphotoImageCopier *copier,
+                              const char *src,
+                              const char *dest)
+{
+    if (choose_copy_method(copier, src, dest) == COPY_SIMPLE)
+        return NULL;
+    return zphoto_asprintf("%s width=%d gamma=%.4f jpeg=%d:%d",
+                           VERSION,
+                           copier->resize_p ? copier->width : 0,
+                           copier->effect_p ? copier->gamma : 1.0,
+                           copier->optimize_p, copier->jpeg_flags);
+}
+
+
+/*
+ * Assumed size of images whose dimensions cannot be read
+ * from the header (e.g. movies).
+ */
+#define DEFAULT_IMAGE_WIDTH   4000
+#define DEFAULT_IMAGE_HEIGHT  3000
+
+/*
+ * Estimate the peak memory in bytes needed to copy src to
+ * dest.  Only the image header is read.
+ */
+extern "C" size_t
+zphoto_image_copier_estimate_memory (ZphotoImageCopier *copier,
+                                     const char *src,
+                                     const char *dest)
+{
+    int width, height, new_width, new_height, ring_size;
+    const ZphotoCodec *codec;
+    double scale;
+
+    if (!zphoto_image_read_header(src, &width, &height)) {
+        width  = DEFAULT_IMAGE_WIDTH;
+        height = DEFAULT_IMAGE_HEIGHT;
+    }
+    get_new_image_size(copier, width, height, &new_width, &new_height);
+
+    switch (choose_copy_method(copier, src, dest)) {
+    case COPY_SIMPLE:
+        return BUFSIZ;
+    case COPY_OPTIMIZE:
+        /*
+         * The whole coefficient arrays (two bytes each, 1.5
+         * per pixel with 4:2:0 subsampling) and the output.
+         */
+        return (size_t)width * height * 4;
+    case COPY_STREAM:
+        /*
+         * A scanline and libjpeg's MCU row buffers on input,
+         * and the resampler's ring of float rows on output.
+         * Large outputs are encoded in parallel, holding the
+         * rows of a group of strips and the compressed strips.
+         */
+        scale = (double)height / new_height;
+        ring_size = (int)(6 * (scale > 1.0 ? scale : 1.0)) + 2;
+        return (size_t)width * 3 * 17 +
+            (size_t)ring_size * new_width * 3 * sizeof(float) +
+            zphoto_jpeg_estimate_parallel_memory(new_width, new_height);
+    case COPY_CODEC:
+        codec = zphoto_codec_find(src, ZPHOTO_CODEC_READ);
+        return ((size_t)width * height + (size_t)new_width * new_height) * 4 +
+            (codec->reentrant_p ? 0 : (size_t)width * height * 
+             BACKEND_PIXEL_SIZE);
+    default:
+        return ((size_t)width * height + (size_t)new_width * new_height) *
+            BACKEND_PIXEL_SIZE;
+    }
 }
 
 extern "C" void
@@ -593,16 +1187,30 @@ zphoto_image_copier_set_gamma (ZphotoImageCopier *copier, double gamma)
     copier->gamma = gamma;
 }
 
+/*
+ * Losslessly optimize JPEG files that are copied without
+ * changes.  flags are passed to zphoto_jpeg_optimize().
+ */
+extern "C" void
+zphoto_image_copier_set_jpeg_optimization (ZphotoImageCopier *copier,
+                                           int flags)
+{
+    copier->optimize_p = 1;
+    copier->jpeg_flags = flags;
+}
+
 extern "C" ZphotoImageCopier *
 zphoto_image_copier_new (void)
 {
     ZphotoImageCopier *copier;
 
     copier = (ZphotoImageCopier*)zphoto_emalloc(sizeof(ZphotoImageCopier));
-    copier->effect_p  = 0;
-    copier->resize_p  = 0;
-    copier->width     = 0;
-    copier->gamma     = 1.0;
+    copier->effect_p   = 0;
+    copier->resize_p   = 0;
+    copier->width      = 0;
+    copier->gamma      = 1.0;
+    copier->optimize_p = 0;
+    copier->jpeg_flags = 0;
     return copier;
 }
 
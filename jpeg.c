@@ -0,0 +1,1137 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <zphoto.h>
+#include "config.h"
+
+/*
+ * libjpeg depended codes.
+ */
+#ifdef HAVE_LIBJPEG
+#include <jpeglib.h>
+
+enum {
+    JPEG_QUALITY = 75,  /* same as the default of Imlib2 */
+    INITIAL_OUTPUT_SIZE = 64 * 1024
+};
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmpbuf;
+} ErrorManager;
+
+typedef struct _Strips Strips;
+
+typedef struct {
+    struct jpeg_compress_struct *cinfo;
+    Strips                      *strips;  /* used instead if not NULL */
+} Writer;
+
+/*
+ * A destination growing in memory like jpeg_mem_dest(),
+ * but allocated by zphoto_emalloc() so that the buffer is
+ * ours to free however the compression ends.
+ */
+typedef struct {
+    struct jpeg_destination_mgr pub;
+    unsigned char       *buffer;
+    size_t              size;
+    size_t              length;  /* written, when finished */
+} Destination;
+
+/*
+ * What a job holds, released by release_state() when it
+ * returns, on a libjpeg error, and by the trap if the job
+ * is abandoned by zphoto_eprintf() on the way.
+ */
+typedef struct {
+    struct jpeg_decompress_struct *dinfo;  /* NULL until created */
+    struct jpeg_compress_struct   *cinfo;
+    unsigned char       *input;
+    size_t              input_size;
+    ZphotoResampler     *resampler;
+    ZphotoBitmap        *bitmap;
+    Strips              *strips;
+    unsigned char       *row;  /* from the pool */
+    Destination         dest;
+} State;
+
+#ifdef HAVE_PTHREAD
+static Strips   *stream_strips_new      (int width, int height, int channels);
+static void     strips_destroy          (void *data);
+static void     push_strip_row          (Strips *strips,
+                                         const unsigned char *row);
+static int      strips_stopped_p        (Strips *strips);
+static int      finish_strips           (Strips *strips, const char *file_name);
+#endif
+
+static void
+error_exit (j_common_ptr cinfo)
+{
+    ErrorManager *err = (ErrorManager *)cinfo->err;
+    longjmp(err->jmpbuf, 1);
+}
+
+static void
+output_message (j_common_ptr cinfo)
+{
+    /* suppress warnings on corrupt data */
+}
+
+static void
+init_error_manager (ErrorManager *err)
+{
+    jpeg_std_error(&err->pub);
+    err->pub.error_exit = error_exit;
+    err->pub.output_message = output_message;
+}
+
+static void
+init_destination (j_compress_ptr cinfo)
+{
+    Destination *dest = (Destination *)cinfo->dest;
+
+    if (dest->buffer == NULL) {
+        dest->size   = INITIAL_OUTPUT_SIZE;
+        dest->buffer = zphoto_emalloc(dest->size);
+    }
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer   = dest->size;
+    dest->length = 0;
+}
+
+/*
+ * Called when the buffer is full.
+ */
+static boolean
+empty_output_buffer (j_compress_ptr cinfo)
+{
+    Destination *dest = (Destination *)cinfo->dest;
+    size_t used = dest->size;
+
+    dest->size  *= 2;
+    dest->buffer = zphoto_erealloc(dest->buffer, dest->size);
+    dest->pub.next_output_byte = dest->buffer + used;
+    dest->pub.free_in_buffer   = dest->size - used;
+    return TRUE;
+}
+
+static void
+term_destination (j_compress_ptr cinfo)
+{
+    Destination *dest = (Destination *)cinfo->dest;
+    dest->length = dest->size - dest->pub.free_in_buffer;
+}
+
+static void
+set_destination (struct jpeg_compress_struct *cinfo, Destination *dest)
+{
+    dest->pub.init_destination    = init_destination;
+    dest->pub.empty_output_buffer = empty_output_buffer;
+    dest->pub.term_destination    = term_destination;
+    cinfo->dest = &dest->pub;
+}
+
+/*
+ * Pushed as a cleanup of the trap as well.
+ */
+static void
+release_state (void *data)
+{
+    State *state = data;
+
+    if (state->dinfo != NULL)
+        jpeg_destroy_decompress(state->dinfo);
+    if (state->cinfo != NULL)
+        jpeg_destroy_compress(state->cinfo);
+    if (state->input != NULL)
+        zphoto_unmap_file(state->input, state->input_size);
+    if (state->resampler != NULL)
+        zphoto_resampler_destroy(state->resampler);
+    if (state->bitmap != NULL)
+        zphoto_bitmap_destroy(state->bitmap);
+#ifdef HAVE_PTHREAD
+    if (state->strips != NULL)
+        strips_destroy(state->strips);
+#endif
+    zphoto_pool_free(state->row);
+    free(state->dest.buffer);
+}
+
+static void
+enter_state (State *state)
+{
+    memset(state, 0, sizeof(State));
+    zphoto_limit_push_cleanup(release_state, state);
+}
+
+static void
+leave_state (State *state)
+{
+    zphoto_limit_pop_cleanup();
+    release_state(state);
+}
+
+static void
+write_row (const unsigned char *row, int y, void *data)
+{
+    Writer *writer = data;
+    JSAMPROW rows[1];
+
+#ifdef HAVE_PTHREAD
+    if (writer->strips != NULL) {
+        push_strip_row(writer->strips, row);
+        return;
+    }
+#endif
+    rows[0] = (JSAMPROW)row;
+    jpeg_write_scanlines(writer->cinfo, rows, 1);
+}
+
+static void
+calc_new_size (int max_width, int old_width, int old_height,
+               int *new_width, int *new_height)
+{
+    /*
+     * Keep it consistent with get_new_image_size() in image.cpp.
+     */
+    if (max_width > 0 && old_width > max_width) {
+        *new_width  = max_width;
+        *new_height = (int)((double)*new_width / old_width * old_height);
+        if (*new_height < 1)
+            *new_height = 1;
+    } else {
+        *new_width  = old_width;
+        *new_height = old_height;
+    }
+}
+
+/*
+ * Only plain RGB and grayscale images are handled.  Returns
+ * 0 for others such as CMYK so that the caller can fall back
+ * to the generic path.
+ */
+static int
+set_out_color_space (struct jpeg_decompress_struct *dinfo, int *channels)
+{
+    if (dinfo->jpeg_color_space == JCS_GRAYSCALE) {
+        dinfo->out_color_space = JCS_GRAYSCALE;
+        *channels = 1;
+    } else if (dinfo->jpeg_color_space == JCS_YCbCr ||
+               dinfo->jpeg_color_space == JCS_RGB) {
+        dinfo->out_color_space = JCS_RGB;
+        *channels = 3;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Let the IDCT scale the image down by 1/2, 1/4 or 1/8 as
+ * long as it stays at least min_width wide.  This skips
+ * most of the decoding work for thumbnails.
+ */
+static void
+set_scale (struct jpeg_decompress_struct *dinfo, int min_width)
+{
+    int denom;
+
+    dinfo->scale_num   = 1;
+    dinfo->scale_denom = 1;
+    if (min_width <= 0)
+        return;
+    for (denom = 8; denom > 1; denom /= 2) {
+        if (((int)dinfo->image_width + denom - 1) / denom >= min_width) {
+            dinfo->scale_denom = denom;
+            return;
+        }
+    }
+}
+
+static void
+start_compress (struct jpeg_compress_struct *cinfo, Destination *dest,
+                int width, int height, int channels, int restart_p)
+{
+    set_destination(cinfo, dest);
+    cinfo->image_width      = width;
+    cinfo->image_height     = height;
+    cinfo->input_components = channels;
+    cinfo->in_color_space   = channels == 1 ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, JPEG_QUALITY, TRUE);
+    if (restart_p)
+        cinfo->restart_in_rows = 1;
+    jpeg_start_compress(cinfo, TRUE);
+}
+
+/*
+ * Errors of libjpeg are not reported here: the functions
+ * below release what they hold and return 0 (or NULL) so
+ * that the caller tries the next backend, which may read
+ * what libjpeg cannot (e.g. a PNG file named .jpg, or a
+ * 12-bit or arithmetic coded JPEG).  The last backend
+ * reports the error.
+ */
+
+/*
+ * Returns 0 if libjpeg cannot read the input or if the
+ * job is to stop.
+ */
+int
+zphoto_jpeg_stream_copy (const char *input_file_name,
+                         const char *output_file_name,
+                         int max_width,
+                         double gamma)
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_compress_struct   cinfo;
+    ErrorManager err;
+    State state;
+    Writer writer;
+    int new_width, new_height, channels, done_p;
+
+    enter_state(&state);
+    state.input = zphoto_map_file(input_file_name, &state.input_size);
+
+    init_error_manager(&err);
+    dinfo.err = cinfo.err = &err.pub;
+    jpeg_create_decompress(&dinfo);
+    state.dinfo = &dinfo;
+    jpeg_create_compress(&cinfo);
+    state.cinfo = &cinfo;
+
+    if (setjmp(err.jmpbuf)) {
+        leave_state(&state);
+        return 0;
+    }
+
+    jpeg_mem_src(&dinfo, state.input, state.input_size);
+    jpeg_read_header(&dinfo, TRUE);
+    zphoto_metrics_note_input(state.input_size,
+                              dinfo.image_width, dinfo.image_height);
+
+    if (!set_out_color_space(&dinfo, &channels)) {
+        leave_state(&state);
+        return 0;
+    }
+
+    /*
+     * The output size is calculated from the original size,
+     * not from the size scaled by the IDCT.
+     */
+    calc_new_size(max_width, dinfo.image_width, dinfo.image_height,
+                  &new_width, &new_height);
+    if (new_width < (int)dinfo.image_width)
+        set_scale(&dinfo, new_width);
+    jpeg_start_decompress(&dinfo);
+
+    /*
+     * Large outputs are collected into strips to be encoded
+     * in parallel a group at a time.  Otherwise output rows
+     * are compressed as soon as they are resampled.
+     */
+#ifdef HAVE_PTHREAD
+    state.strips = stream_strips_new(new_width, new_height, channels);
+#endif
+    if (state.strips == NULL)
+        start_compress(&cinfo, &state.dest,
+                       new_width, new_height, channels, 0);
+    writer.cinfo  = &cinfo;
+    writer.strips = state.strips;
+
+    state.resampler = zphoto_resampler_new(dinfo.output_width,
+                                           dinfo.output_height,
+                                           new_width, new_height, channels,
+                                           write_row, &writer);
+    if (gamma != 1.0)
+        zphoto_resampler_set_gamma(state.resampler, gamma);
+
+    /*
+     * Only one input scanline is held at a time.
+     */
+    state.row = zphoto_pool_alloc(dinfo.output_width * channels);
+    while (dinfo.output_scanline < dinfo.output_height) {
+        JSAMPROW rows[1];
+        if (zphoto_limit_pending_p())
+            break;
+#ifdef HAVE_PTHREAD
+        if (state.strips != NULL && strips_stopped_p(state.strips))
+            break;
+#endif
+        rows[0] = state.row;
+        jpeg_read_scanlines(&dinfo, rows, 1);
+        zphoto_resampler_push_row(state.resampler, state.row);
+    }
+
+    done_p = 0;
+    if (dinfo.output_scanline < dinfo.output_height) {  /* stopped */
+        jpeg_abort_decompress(&dinfo);
+        jpeg_abort_compress(&cinfo);
+    } else {
+        jpeg_finish_decompress(&dinfo);
+        if (state.strips == NULL) {
+            jpeg_finish_compress(&cinfo);
+            zphoto_write_file(output_file_name,
+                              state.dest.buffer, state.dest.length);
+            done_p = 1;
+        }
+    }
+#ifdef HAVE_PTHREAD
+    /*
+     * The strips are written if all of them are done.  An
+     * error in a strip is raised here.
+     */
+    if (state.strips != NULL)
+        done_p = finish_strips(state.strips, output_file_name);
+#endif
+
+    leave_state(&state);
+    return done_p;
+}
+
+/*
+ * Copy the markers saved from the source, except those
+ * that libjpeg writes by itself.  With strip_p, only the
+ * ICC profile is kept; Exif (including maker notes), XMP,
+ * IPTC and comments are dropped.
+ */
+static void
+copy_markers (struct jpeg_decompress_struct *dinfo,
+              struct jpeg_compress_struct *cinfo,
+              int strip_p)
+{
+    jpeg_saved_marker_ptr marker;
+
+    for (marker = dinfo->marker_list; marker != NULL; marker = marker->next) {
+        if (cinfo->write_JFIF_header &&
+            marker->marker == JPEG_APP0 && marker->data_length >= 5 &&
+            memcmp(marker->data, "JFIF", 5) == 0)
+            continue;
+        if (cinfo->write_Adobe_marker &&
+            marker->marker == JPEG_APP0 + 14 && marker->data_length >= 5 &&
+            memcmp(marker->data, "Adobe", 5) == 0)
+            continue;
+        if (strip_p &&
+            !(marker->marker == JPEG_APP0 + 2 && marker->data_length >= 12 &&
+              memcmp(marker->data, "ICC_PROFILE", 12) == 0))
+            continue;
+        jpeg_write_marker(cinfo, marker->marker,
+                          marker->data, marker->data_length);
+    }
+}
+
+/*
+ * Losslessly recompress a JPEG file in the DCT domain:
+ * the Huffman tables are optimized for the image and,
+ * depending on flags, the scans are made progressive and
+ * the metadata are stripped.  The pixels are never
+ * decoded.  If the result is not smaller, the input is
+ * copied as is.  Returns 0 if the input cannot be read so
+ * that the caller can copy it by other means.
+ */
+int
+zphoto_jpeg_optimize (const char *input_file_name,
+                      const char *output_file_name,
+                      int flags)
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_compress_struct   cinfo;
+    ErrorManager err;
+    State state;
+    jvirt_barray_ptr *coefficients;
+    int i;
+
+    enter_state(&state);
+    state.input = zphoto_map_file(input_file_name, &state.input_size);
+
+    init_error_manager(&err);
+    dinfo.err = cinfo.err = &err.pub;
+    jpeg_create_decompress(&dinfo);
+    state.dinfo = &dinfo;
+    jpeg_create_compress(&cinfo);
+    state.cinfo = &cinfo;
+
+    if (setjmp(err.jmpbuf)) {
+        leave_state(&state);
+        return 0;
+    }
+
+    jpeg_mem_src(&dinfo, state.input, state.input_size);
+    jpeg_save_markers(&dinfo, JPEG_COM, 0xffff);
+    for (i = 0; i < 16; i++)
+        jpeg_save_markers(&dinfo, JPEG_APP0 + i, 0xffff);
+    jpeg_read_header(&dinfo, TRUE);
+    zphoto_metrics_note_input(state.input_size,
+                              dinfo.image_width, dinfo.image_height);
+    coefficients = jpeg_read_coefficients(&dinfo);
+
+    jpeg_copy_critical_parameters(&dinfo, &cinfo);
+    cinfo.optimize_coding = TRUE;
+    if (flags & ZPHOTO_JPEG_PROGRESSIVE)
+        jpeg_simple_progression(&cinfo);
+    set_destination(&cinfo, &state.dest);
+    jpeg_write_coefficients(&cinfo, coefficients);
+    copy_markers(&dinfo, &cinfo, flags & ZPHOTO_JPEG_STRIP_METADATA);
+    jpeg_finish_compress(&cinfo);
+    jpeg_finish_decompress(&dinfo);
+
+    if (state.dest.length < state.input_size)
+        zphoto_write_file(output_file_name,
+                          state.dest.buffer, state.dest.length);
+    else
+        zphoto_write_file(output_file_name, state.input, state.input_size);
+
+    leave_state(&state);
+    return 1;
+}
+
+/*
+ * Decode the whole image into a bitmap.  If min_width is
+ * positive the image may be scaled down while decoding but
+ * never below min_width.  Returns NULL for color spaces
+ * other than RGB and grayscale, if libjpeg cannot read the
+ * file or if the job is to stop.
+ */
+ZphotoBitmap *
+zphoto_jpeg_decode (const char *file_name, int min_width)
+{
+    struct jpeg_decompress_struct dinfo;
+    ErrorManager err;
+    State state;
+    ZphotoBitmap *bitmap;
+    size_t rowlen;
+    int channels;
+
+    enter_state(&state);
+    state.input = zphoto_map_file(file_name, &state.input_size);
+
+    init_error_manager(&err);
+    dinfo.err = &err.pub;
+    jpeg_create_decompress(&dinfo);
+    state.dinfo = &dinfo;
+
+    if (setjmp(err.jmpbuf)) {
+        leave_state(&state);
+        return NULL;
+    }
+
+    jpeg_mem_src(&dinfo, state.input, state.input_size);
+    jpeg_read_header(&dinfo, TRUE);
+    zphoto_metrics_note_input(state.input_size,
+                              dinfo.image_width, dinfo.image_height);
+    if (!set_out_color_space(&dinfo, &channels)) {
+        leave_state(&state);
+        return NULL;
+    }
+    set_scale(&dinfo, min_width);
+    jpeg_start_decompress(&dinfo);
+
+    state.bitmap = zphoto_bitmap_new(dinfo.output_width, dinfo.output_height,
+                                     channels);
+    rowlen = (size_t)state.bitmap->width * channels;
+    while (dinfo.output_scanline < dinfo.output_height) {
+        JSAMPROW rows[1];
+        if (zphoto_limit_pending_p())
+            break;
+        rows[0] = state.bitmap->data + rowlen * dinfo.output_scanline;
+        jpeg_read_scanlines(&dinfo, rows, 1);
+    }
+
+    bitmap = NULL;
+    if (dinfo.output_scanline < dinfo.output_height) {  /* stopped */
+        jpeg_abort_decompress(&dinfo);
+    } else {
+        jpeg_finish_decompress(&dinfo);
+        bitmap = state.bitmap;  /* handed to the caller */
+        state.bitmap = NULL;
+    }
+    leave_state(&state);
+    return bitmap;
+}
+
+/*
+ * Compress rows [y, y + height) of the bitmap into memory.
+ * The alpha channel, if any, is dropped.  If restart_p is
+ * true, a restart marker is put after every MCU row.
+ * *output is set to NULL if libjpeg fails or the job is to
+ * stop.
+ */
+static void
+encode_rows (ZphotoBitmap *bitmap, int y, int height, int restart_p,
+             unsigned char **output, unsigned long *output_size)
+{
+    struct jpeg_compress_struct cinfo;
+    ErrorManager err;
+    State state;
+    size_t rowlen = (size_t)bitmap->width * bitmap->channels;
+    int channels = bitmap->channels == 1 || bitmap->channels == 2 ? 1 : 3;
+    int i;
+
+    *output = NULL;
+    *output_size = 0;
+    enter_state(&state);
+
+    init_error_manager(&err);
+    cinfo.err = &err.pub;
+    jpeg_create_compress(&cinfo);
+    state.cinfo = &cinfo;
+
+    if (setjmp(err.jmpbuf)) {
+        leave_state(&state);
+        return;
+    }
+
+    start_compress(&cinfo, &state.dest,
+                   bitmap->width, height, channels, restart_p);
+    if (channels != bitmap->channels)
+        state.row = zphoto_pool_alloc(bitmap->width * channels);
+
+    for (i = y; i < y + height; i++) {
+        JSAMPROW rows[1];
+        unsigned char *p = bitmap->data + rowlen * i;
+
+        if (state.row != NULL) {
+            int x, c;
+            for (x = 0; x < bitmap->width; x++) {
+                for (c = 0; c < channels; c++)
+                    state.row[x * channels + c] = p[x * bitmap->channels + c];
+            }
+            p = state.row;
+        }
+        rows[0] = p;
+        jpeg_write_scanlines(&cinfo, rows, 1);
+        if (zphoto_limit_pending_p())
+            break;
+    }
+
+    if (i < y + height) {  /* stopped */
+        jpeg_abort_compress(&cinfo);
+    } else {
+        jpeg_finish_compress(&cinfo);
+        *output = state.dest.buffer;  /* handed to the caller */
+        *output_size = state.dest.length;
+        state.dest.buffer = NULL;
+    }
+    leave_state(&state);
+}
+
+/*
+ * A cleanup for a buffer held across zphoto_eprintf().
+ */
+static void
+free_buffer (void *buffer)
+{
+    free(buffer);
+}
+
+/*
+ * Write and free the output, which is freed by the trap
+ * as well if the writing fails.
+ */
+static void
+write_output (const char *file_name, unsigned char *output, size_t size)
+{
+    zphoto_limit_push_cleanup(free_buffer, output);
+    zphoto_write_file(file_name, output, size);
+    zphoto_limit_pop_cleanup();
+    free(output);
+}
+
+#ifdef HAVE_PTHREAD
+
+/*
+ * Parallel encoding.
+ *
+ * The image is cut into horizontal strips at MCU row
+ * boundaries and each strip is compressed as a separate
+ * JPEG stream on its own thread, with a restart marker
+ * after every MCU row.  Since the strips share the same
+ * (default) quantization and Huffman tables, their entropy
+ * coded segments can be concatenated with restart markers
+ * in between.  The headers of the first strip are reused
+ * with the image height patched in the SOF segment, and the
+ * restart markers are renumbered modulo 8.
+ *
+ * The strips are compressed a group at a time, at most one
+ * per idle CPU.  A streamed image is cut into strips of
+ * about STRIP_PIXELS, and only the rows of one group are
+ * held: the group is compressed as soon as its last row
+ * comes from the resampler.
+ */
+enum {
+    PARALLEL_MIN_PIXELS = 4 * 1024 * 1024,
+    STRIP_PIXELS        = 1024 * 1024
+};
+
+struct _Strips {
+    int                 height;  /* of the image */
+    int                 strip_height;
+    int                 nstrips;
+    int                 group_size;
+    ZphotoBitmap        *bitmap;  /* rows of the current group */
+    int                 own_bitmap_p;
+    int                 first;  /* the first strip in the bitmap */
+    int                 nrows;  /* collected into the bitmap */
+    int                 stopped_p;
+    double              max_seconds;  /* left to the caller's job */
+    unsigned char       **outputs;
+    unsigned long       *output_sizes;
+    char                **failures;  /* of the group */
+    char                *failure;  /* the first one */
+    size_t              *costs;
+    ZphotoScheduler     *scheduler;
+};
+
+/*
+ * MCU height with the sampling factors set by
+ * jpeg_set_defaults(): 2x2 for YCbCr, 1x1 for grayscale.
+ */
+static int
+get_mcu_height (int channels)
+{
+    return channels <= 2 ? DCTSIZE : DCTSIZE * 2;
+}
+
+static int
+get_nstrips (int width, int height, int mcu_height, int ncpus)
+{
+    int nmcu_rows = (height + mcu_height - 1) / mcu_height;
+
+    if ((double)width * height < PARALLEL_MIN_PIXELS || ncpus < 2)
+        return 1;
+    return ncpus < nmcu_rows ? ncpus : nmcu_rows;
+}
+
+/*
+ * Height of the strips of a streamed image.
+ */
+static int
+get_strip_height (int width, int mcu_height)
+{
+    int nmcu_rows = STRIP_PIXELS / width / mcu_height;
+
+    return (nmcu_rows > 1 ? nmcu_rows : 1) * mcu_height;
+}
+
+/*
+ * The CPUs not taken by the jobs on the other workers, so
+ * that the strips of concurrent copies do not oversubscribe
+ * them.  The caller's own CPU is idle while it waits.
+ */
+static int
+get_idle_cpus (void)
+{
+    int ncpus = zphoto_get_ncpus();
+    int nidle = ncpus - zphoto_scheduler_get_nbusy() + 1;
+
+    if (nidle > ncpus)
+        return ncpus;
+    return nidle < 1 ? 1 : nidle;
+}
+
+/*
+ * If bitmap is NULL, one for the rows of a group is
+ * allocated.
+ */
+static Strips *
+strips_new (ZphotoBitmap *bitmap, int width, int height, int channels,
+            int strip_height, int group_size)
+{
+    Strips *strips = zphoto_emalloc(sizeof(Strips));
+    int nstrips = (height + strip_height - 1) / strip_height;
+
+    if (group_size > nstrips)
+        group_size = nstrips;
+    strips->height       = height;
+    strips->strip_height = strip_height;
+    strips->nstrips      = nstrips;
+    strips->group_size   = group_size;
+    strips->first        = 0;
+    strips->nrows        = 0;
+    strips->stopped_p    = 0;
+    strips->max_seconds  = 0;
+    strips->failure      = NULL;
+    strips->outputs      = zphoto_emalloc(sizeof(unsigned char *) * nstrips);
+    strips->output_sizes = zphoto_emalloc(sizeof(unsigned long) * nstrips);
+    strips->failures     = zphoto_emalloc(sizeof(char *) * group_size);
+    strips->costs        = zphoto_emalloc(sizeof(size_t) * group_size);
+    memset(strips->outputs,  0, sizeof(unsigned char *) * nstrips);
+    memset(strips->failures, 0, sizeof(char *) * group_size);
+    memset(strips->costs,    0, sizeof(size_t) * group_size);
+    strips->scheduler = zphoto_scheduler_new(group_size, (size_t)-1);
+
+    strips->own_bitmap_p = bitmap == NULL;
+    if (bitmap == NULL) {
+        int nrows = strip_height * group_size;
+        bitmap = zphoto_bitmap_new(width, nrows < height ? nrows : height,
+                                   channels);
+    }
+    strips->bitmap = bitmap;
+    return strips;
+}
+
+/*
+ * Pushed as a cleanup of the trap as well.
+ */
+static void
+strips_destroy (void *data)
+{
+    Strips *strips = data;
+    int i;
+
+    for (i = 0; i < strips->nstrips; i++)
+        free(strips->outputs[i]);
+    for (i = 0; i < strips->group_size; i++)
+        free(strips->failures[i]);
+    if (strips->own_bitmap_p)
+        zphoto_bitmap_destroy(strips->bitmap);
+    zphoto_scheduler_destroy(strips->scheduler);
+    free(strips->outputs);
+    free(strips->output_sizes);
+    free(strips->failures);
+    free(strips->failure);
+    free(strips->costs);
+    free(strips);
+}
+
+/*
+ * Strips for a streamed image, or NULL if it is encoded on
+ * one thread.
+ */
+static Strips *
+stream_strips_new (int width, int height, int channels)
+{
+    int mcu_height = get_mcu_height(channels);
+    int ncpus = get_idle_cpus();
+
+    if (get_nstrips(width, height, mcu_height, ncpus) < 2)
+        return NULL;
+    return strips_new(NULL, width, height, channels,
+                      get_strip_height(width, mcu_height), ncpus);
+}
+
+static void
+encode_strip_rows (int i, void *data)
+{
+    Strips *strips = data;
+    int y = strips->strip_height * (strips->first + i);
+    int height = strips->height - y;
+
+    if (height > strips->strip_height)
+        height = strips->strip_height;
+    encode_rows(strips->bitmap, strips->strip_height * i, height, 1,
+                &strips->outputs[strips->first + i],
+                &strips->output_sizes[strips->first + i]);
+}
+
+/*
+ * The trap of the caller's job is not inherited by the
+ * workers, so each strip runs under its own with the time
+ * left to the job.
+ */
+static void
+encode_strip (int i, void *data)
+{
+    Strips *strips = data;
+
+    strips->failures[i] = zphoto_limit_run(strips->max_seconds,
+                                           encode_strip_rows, i, data);
+}
+
+static int
+strip_done (int i, void *data)
+{
+    Strips *strips = data;
+    return strips->failures[i] == NULL;
+}
+
+/*
+ * Compress the strips in the bitmap and move on to the next
+ * group.  The strips are stopped if one of them fails or
+ * the job is to stop.
+ */
+static void
+encode_group (Strips *strips)
+{
+    int i, n = strips->nstrips - strips->first;
+
+    if (n > strips->group_size)
+        n = strips->group_size;
+    strips->max_seconds = zphoto_limit_get_remaining();
+    zphoto_scheduler_run(strips->scheduler, n, strips->costs,
+                         encode_strip, strip_done, strips);
+    for (i = 0; i < n; i++) {
+        if (strips->failures[i] != NULL && strips->failure == NULL)
+            strips->failure = strips->failures[i];
+        else
+            free(strips->failures[i]);
+        strips->failures[i] = NULL;
+        if (strips->outputs[strips->first + i] == NULL)  /* stopped */
+            strips->stopped_p = 1;
+    }
+    strips->first += n;
+    strips->nrows = 0;
+}
+
+/*
+ * Collect a row of a streamed image.  Rows are dropped once
+ * the strips are stopped.
+ */
+static void
+push_strip_row (Strips *strips, const unsigned char *row)
+{
+    ZphotoBitmap *bitmap = strips->bitmap;
+    size_t rowlen = (size_t)bitmap->width * bitmap->channels;
+    int y = strips->strip_height * strips->first + strips->nrows;
+
+    if (strips->stopped_p)
+        return;
+    memcpy(bitmap->data + rowlen * strips->nrows, row, rowlen);
+    strips->nrows++;
+    if (strips->nrows == bitmap->height || y + 1 == strips->height)
+        encode_group(strips);
+}
+
+static int
+strips_stopped_p (Strips *strips)
+{
+    return strips->stopped_p;
+}
+
+/*
+ * Returns the offset just after the SOS segment and sets
+ * the offset of the SOF segment.
+ */
+static size_t
+find_scan (const unsigned char *data, size_t size, size_t *sof)
+{
+    size_t pos = 2;  /* skip SOI */
+
+    while (pos + 4 <= size) {
+        int marker = data[pos + 1];
+        size_t length = (data[pos + 2] << 8) | data[pos + 3];
+
+        assert(data[pos] == 0xff);
+        if (marker == 0xc0)
+            *sof = pos;
+        pos += 2 + length;
+        if (marker == 0xda)
+            return pos;
+    }
+    assert(0);
+    return 0;
+}
+
+static unsigned char *
+stitch_strips (Strips *strips, size_t *size)
+{
+    int i, nrestarts = 0;
+    size_t sof = 0, pos = 0, header_size, total = 2;
+    unsigned char *output;
+
+    for (i = 0; i < strips->nstrips; i++)
+        total += strips->output_sizes[i] + 2;
+    output = zphoto_emalloc(total);
+
+    header_size = find_scan(strips->outputs[0], strips->output_sizes[0], &sof);
+    memcpy(output, strips->outputs[0], header_size);
+    output[sof + 5] = strips->height >> 8;
+    output[sof + 6] = strips->height & 0xff;
+    pos = header_size;
+
+    for (i = 0; i < strips->nstrips; i++) {
+        const unsigned char *data = strips->outputs[i];
+        size_t end = strips->output_sizes[i] - 2;  /* before EOI */
+        size_t j = find_scan(data, strips->output_sizes[i], &sof);
+
+        assert(data[end] == 0xff && data[end + 1] == 0xd9);
+        while (j < end) {
+            if (data[j] == 0xff && data[j + 1] >= 0xd0 && data[j + 1] <= 0xd7) {
+                output[pos++] = 0xff;
+                output[pos++] = 0xd0 + (nrestarts++ & 7);
+                j += 2;
+            } else {
+                output[pos++] = data[j++];
+            }
+        }
+        if (i < strips->nstrips - 1) {
+            output[pos++] = 0xff;
+            output[pos++] = 0xd0 + (nrestarts++ & 7);
+        }
+    }
+    output[pos++] = 0xff;
+    output[pos++] = 0xd9;
+    *size = pos;
+    return output;
+}
+
+/*
+ * Write the image if all the strips are done.  Returns 0
+ * if the job is to stop.  An error in a strip is raised
+ * again on this thread.
+ */
+static int
+finish_strips (Strips *strips, const char *file_name)
+{
+    unsigned char *output;
+    size_t output_size;
+    char *failure = strips->failure;
+    int i;
+
+    if (failure != NULL && !zphoto_limit_pending_p()) {
+        strips->failure = NULL;
+        zphoto_limit_push_cleanup(free_buffer, failure);
+        zphoto_eprintf("%s", failure);
+    }
+    if (strips->stopped_p || strips->first < strips->nstrips)
+        return 0;
+
+    output = stitch_strips(strips, &output_size);
+    for (i = 0; i < strips->nstrips; i++) {
+        free(strips->outputs[i]);
+        strips->outputs[i] = NULL;
+    }
+    write_output(file_name, output, output_size);
+    return 1;
+}
+
+/*
+ * The bitmap is already in memory, so it is cut into one
+ * strip per CPU.
+ */
+static int
+encode_parallel (ZphotoBitmap *bitmap, int nstrips, const char *file_name)
+{
+    int done_p, mcu_height = get_mcu_height(bitmap->channels);
+    int nmcu_rows = (bitmap->height + mcu_height - 1) / mcu_height;
+    Strips *strips = strips_new(bitmap, bitmap->width, bitmap->height,
+                                bitmap->channels,
+                                (nmcu_rows + nstrips - 1) / nstrips *
+                                mcu_height, nstrips);
+
+    zphoto_limit_push_cleanup(strips_destroy, strips);
+    encode_group(strips);
+    done_p = finish_strips(strips, file_name);
+    zphoto_limit_pop_cleanup();
+    strips_destroy(strips);
+    return done_p;
+}
+
+#endif
+
+/*
+ * Returns the bytes held by zphoto_jpeg_stream_copy() to
+ * encode an RGB output of the size in parallel: the rows of
+ * a group of strips, and up to a byte per pixel for the
+ * compressed strips.  0 if it is encoded on one thread.
+ */
+size_t
+zphoto_jpeg_estimate_parallel_memory (int width, int height)
+{
+#ifdef HAVE_PTHREAD
+    int ncpus = zphoto_get_ncpus();
+    int mcu_height = get_mcu_height(3);
+    size_t nrows = (size_t)get_strip_height(width, mcu_height) * ncpus;
+
+    if (get_nstrips(width, height, mcu_height, ncpus) < 2)
+        return 0;
+    if (nrows > (size_t)height)
+        nrows = height;
+    return nrows * width * 3 + (size_t)width * height;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Large images are encoded on several threads.  Returns 0
+ * if libjpeg fails or the job is to stop, leaving no file.
+ */
+int
+zphoto_jpeg_encode (ZphotoBitmap *bitmap, const char *file_name)
+{
+    unsigned char *output;
+    unsigned long output_size;
+#ifdef HAVE_PTHREAD
+    int nstrips = get_nstrips(bitmap->width, bitmap->height,
+                              get_mcu_height(bitmap->channels),
+                              get_idle_cpus());
+
+    if (nstrips > 1)
+        return encode_parallel(bitmap, nstrips, file_name);
+#endif
+    encode_rows(bitmap, 0, bitmap->height, 0, &output, &output_size);
+    if (output == NULL)
+        return 0;
+    write_output(file_name, output, output_size);
+    return 1;
+}
+
+/*
+ * libjpeg is not available.
+ */
+#else
+
+int
+zphoto_jpeg_stream_copy (const char *input_file_name,
+                         const char *output_file_name,
+                         int max_width,
+                         double gamma)
+{
+    return 0;
+}
+
+ZphotoBitmap *
+zphoto_jpeg_decode (const char *file_name, int min_width)
+{
+    assert(0); /* unsupported */
+    return NULL;
+}
+
+int
+zphoto_jpeg_encode (ZphotoBitmap *bitmap, const char *file_name)
+{
+    assert(0); /* unsupported */
+    return 0;
+}
+
+size_t
+zphoto_jpeg_estimate_parallel_memory (int width, int height)
+{
+    return 0;
+}
+
+int
+zphoto_jpeg_optimize (const char *input_file_name,
+                      const char *output_file_name,
+                      int flags)
+{
+    return 0;
+}
+
+#endif
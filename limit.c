@@ -0,0 +1,387 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Per-file resource limits, cancellation and error
+ * trapping.
+ *
+ * A job is run with zphoto_limit_run(), which arms a trap
+ * for the calling thread with a deadline.  The long loops
+ * (decoding, resampling, encoding, reading movie frames)
+ * poll zphoto_limit_pending_p(), which becomes true once
+ * the deadline has passed, a limit has been reported with
+ * zphoto_limit_violate() or the cancellation flag of the
+ * thread has been raised.  They then release what they
+ * hold and return, and zphoto_limit_run() returns the
+ * reason.  The flag is inherited by the jobs and by the
+ * worker threads of the job scheduler.
+ *
+ * zphoto_eprintf() jumps to the trap instead of exiting,
+ * so that an error in one photo fails only the job for
+ * it.  The backend lock is released if it was held, the
+ * open trace spans are closed and the cleanups pushed with
+ * zphoto_limit_push_cleanup() are run, which release the
+ * other locks and resources held across calls that may
+ * fail.
+ */
+
+#include <assert.h>
+#include <float.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zphoto.h>
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * Enough for a job holding a lock and a codec's state.
+ */
+#define MAX_CLEANUPS 8
+
+typedef struct {
+    ZphotoCleanupFunc func;
+    void        *data;
+} Cleanup;
+
+typedef struct {
+    jmp_buf     jmpbuf;
+    double      deadline;  /* 0 for no deadline */
+    char        *reason;   /* set when the job is to stop */
+    int         nlocks;    /* backend locks held */
+    Cleanup     cleanups[MAX_CLEANUPS];
+    int         ncleanups;
+    volatile int *cancel_flag;
+} Trap;
+
+#ifdef HAVE_PTHREAD
+
+static pthread_key_t  trap_key;
+static pthread_key_t  cancel_key;
+static pthread_key_t  frames_key;
+static pthread_once_t trap_key_once = PTHREAD_ONCE_INIT;
+
+static void
+create_trap_key (void)
+{
+    pthread_key_create(&trap_key, NULL);
+    pthread_key_create(&cancel_key, NULL);
+    pthread_key_create(&frames_key, NULL);
+}
+
+static Trap *
+get_trap (void)
+{
+    pthread_once(&trap_key_once, create_trap_key);
+    return pthread_getspecific(trap_key);
+}
+
+static void
+set_trap (Trap *trap)
+{
+    pthread_once(&trap_key_once, create_trap_key);
+    pthread_setspecific(trap_key, trap);
+}
+
+static volatile int *
+get_cancel_flag (void)
+{
+    pthread_once(&trap_key_once, create_trap_key);
+    return pthread_getspecific(cancel_key);
+}
+
+static void
+set_cancel_flag (volatile int *flag)
+{
+    pthread_once(&trap_key_once, create_trap_key);
+    pthread_setspecific(cancel_key, (void *)flag);
+}
+
+static int
+get_max_movie_frames (void)
+{
+    pthread_once(&trap_key_once, create_trap_key);
+    return (long)pthread_getspecific(frames_key);
+}
+
+static void
+set_max_movie_frames (int nframes)
+{
+    pthread_once(&trap_key_once, create_trap_key);
+    pthread_setspecific(frames_key, (void *)(long)nframes);
+}
+
+#else
+
+static Trap *current_trap = NULL;
+static volatile int *current_cancel_flag = NULL;
+static int max_movie_frames = 0;
+
+static Trap *
+get_trap (void)
+{
+    return current_trap;
+}
+
+static void
+set_trap (Trap *trap)
+{
+    current_trap = trap;
+}
+
+static volatile int *
+get_cancel_flag (void)
+{
+    return current_cancel_flag;
+}
+
+static void
+set_cancel_flag (volatile int *flag)
+{
+    current_cancel_flag = flag;
+}
+
+static int
+get_max_movie_frames (void)
+{
+    return max_movie_frames;
+}
+
+static void
+set_max_movie_frames (int nframes)
+{
+    max_movie_frames = nframes;
+}
+
+#endif
+
+static int
+cancelled_p (volatile int *cancel_flag)
+{
+    return cancel_flag != NULL && *cancel_flag;
+}
+
+/*
+ * Run func with the limits armed and errors trapped.
+ * max_seconds is the wall time allowed, or 0 for no limit.
+ * Returns NULL on completion or the reason why it failed,
+ * which should be freed by the caller.
+ */
+char *
+zphoto_limit_run (double max_seconds, ZphotoJobFunc func, int id, void *data)
+{
+    Trap trap;
+    Trap *saved_trap = get_trap();
+    int trace_depth = zphoto_trace_get_depth();
+
+    trap.deadline = max_seconds > 0 ? zphoto_get_time() + max_seconds : 0;
+    trap.reason   = NULL;
+    trap.nlocks   = 0;
+    trap.ncleanups = 0;
+    trap.cancel_flag = get_cancel_flag();
+
+    set_trap(&trap);
+    if (setjmp(trap.jmpbuf) == 0) {
+        func(id, data);
+    } else {
+        while (trap.nlocks > 0)
+            zphoto_backend_unlock();
+        zphoto_trace_unwind(trace_depth);
+    }
+    set_trap(saved_trap);
+    return trap.reason;
+}
+
+/*
+ * Record that a limit is exceeded.  Ignored if the limits
+ * are not armed.
+ */
+void
+zphoto_limit_violate (const char *reason)
+{
+    Trap *trap = get_trap();
+
+    if (trap != NULL && trap->reason == NULL)
+        trap->reason = zphoto_strdup(reason);
+}
+
+/*
+ * Returns true if errors are trapped on this thread.
+ */
+int
+zphoto_limit_trapped_p (void)
+{
+    return get_trap() != NULL;
+}
+
+/*
+ * Abandon the current job because of an error.  Must be
+ * trapped.  message is malloc'ed and is returned by
+ * zphoto_limit_run().  The cleanups are run before the
+ * jump, while what they release on the stack of the job
+ * is still there.
+ */
+void
+zphoto_limit_fail (char *message)
+{
+    Trap *trap = get_trap();
+
+    assert(trap != NULL);
+    free(trap->reason);
+    trap->reason = message;
+    while (trap->ncleanups > 0) {
+        Cleanup *cleanup = trap->cleanups + --trap->ncleanups;
+        cleanup->func(cleanup->data);
+    }
+    longjmp(trap->jmpbuf, 1);
+}
+
+/*
+ * Called by zphoto_backend_lock() and _unlock() with 1 and
+ * -1 respectively.
+ */
+void
+zphoto_limit_note_lock (int delta)
+{
+    Trap *trap = get_trap();
+
+    if (trap != NULL)
+        trap->nlocks += delta;
+}
+
+/*
+ * Returns the seconds left to the current job, or 0 if it
+ * has no deadline, for the jobs it runs on other threads,
+ * which do not inherit the trap.
+ */
+double
+zphoto_limit_get_remaining (void)
+{
+    Trap *trap = get_trap();
+    double remaining;
+
+    if (trap == NULL || trap->deadline == 0)
+        return 0;
+    remaining = trap->deadline - zphoto_get_time();
+    return remaining > 0 ? remaining : DBL_MIN;
+}
+
+/*
+ * Have func(data) called if the current job is abandoned,
+ * in the reverse order of pushing.  Ignored outside a job.
+ */
+void
+zphoto_limit_push_cleanup (ZphotoCleanupFunc func, void *data)
+{
+    Trap *trap = get_trap();
+
+    if (trap == NULL)
+        return;
+    assert(trap->ncleanups < MAX_CLEANUPS);
+    trap->cleanups[trap->ncleanups].func = func;
+    trap->cleanups[trap->ncleanups].data = data;
+    trap->ncleanups++;
+}
+
+/*
+ * Drop the cleanup pushed last without calling it, when
+ * the job has released the resource by itself.
+ */
+void
+zphoto_limit_pop_cleanup (void)
+{
+    Trap *trap = get_trap();
+
+    if (trap == NULL)
+        return;
+    assert(trap->ncleanups > 0);
+    trap->ncleanups--;
+}
+
+/*
+ * Returns true if the current job should stop.  Outside a
+ * job, returns true if the thread has been cancelled.
+ */
+int
+zphoto_limit_pending_p (void)
+{
+    Trap *trap = get_trap();
+
+    if (trap == NULL)
+        return cancelled_p(get_cancel_flag());
+    if (trap->reason == NULL) {
+        if (cancelled_p(trap->cancel_flag))
+            trap->reason = zphoto_strdup("cancelled");
+        else if (trap->deadline > 0 && zphoto_get_time() > trap->deadline)
+            trap->reason = zphoto_strdup("decoding took too long");
+    }
+    return trap->reason != NULL;
+}
+
+/*
+ * Jump out of the current job if it should stop.  Must not
+ * be called with a lock held or with resources to release
+ * but those of the cleanups.
+ */
+void
+zphoto_limit_check (void)
+{
+    if (zphoto_limit_pending_p() && get_trap() != NULL)
+        longjmp(get_trap()->jmpbuf, 1);
+}
+
+/*
+ * Set the flag checked by the jobs run on this thread.
+ * Another thread cancels them by setting *flag to nonzero.
+ * flag is NULL for none.
+ */
+void
+zphoto_limit_set_cancel_flag (volatile int *flag)
+{
+    set_cancel_flag(flag);
+}
+
+volatile int *
+zphoto_limit_get_cancel_flag (void)
+{
+    return get_cancel_flag();
+}
+
+/*
+ * Set the maximum number of frames read from a movie on
+ * this thread, or 0 for no limit.
+ */
+void
+zphoto_limit_set_movie_frames (int nframes)
+{
+    set_max_movie_frames(nframes);
+}
+
+int
+zphoto_limit_get_movie_frames (void)
+{
+    return get_max_movie_frames();
+}
@@ -45,14 +45,22 @@ main (int argc, char **argv)
     zphoto_config_read_rcfile(config);
     zphoto_config_parse(config, argc, argv);
 
-    if (config->nargs == 0)
-        show_mini_help();
+    if (config->watch[0] != '\0')
+        zphoto_watch(config);
+    if (config->serve > 0)
+        zphoto_serve(config);
+    if (config->batch[0] != '\0') {
+        zphoto_batch(config);
+    } else {
+        if (config->nargs == 0)
+            show_mini_help();
 
-    zphoto = zphoto_new(config);
-    zphoto_add_file_names(zphoto, config->args, config->nargs);
+        zphoto = zphoto_new(config);
+        zphoto_add_file_names(zphoto, config->args, config->nargs);
 
-    zphoto_make_all(zphoto);
-    zphoto_destroy(zphoto);
+        zphoto_make_all(zphoto);
+        zphoto_destroy(zphoto);
+    }
     
     zphoto_config_destroy(config);
 
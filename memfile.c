@@ -0,0 +1,469 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Input files held in memory, for zphoto_add_buffers() and
+ * zphoto_add_fds().
+ *
+ * An album has a table of them, which is current on the
+ * threads working for it like the trace and the metrics.
+ * zphoto_map_file() returns their bytes as they are and
+ * zphoto_efopen() reads them through fmemopen(), so the
+ * EXIF reader, the header reader, the hash and the codecs
+ * of libjpeg and libpng read them without copying.  The
+ * libraries that take only file names (Imlib2 and avifile)
+ * are given a copy written in a temporary directory by
+ * zphoto_memfile_spill(), once per file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zphoto.h>
+#include "config.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+typedef struct {
+    char        *file_name;
+    const void  *data;
+    size_t      size;
+    time_t      mtime;
+    int         mapped_p;      /* by mmap() of an fd */
+    int         allocated_p;   /* read from an fd into malloc'ed memory */
+    char        *spill_file_name;  /* NULL if not spilled */
+} Entry;
+
+/*
+ * Entries are sorted by file name, and by_data by the
+ * address of the data for zphoto_memfile_data_p().
+ */
+struct _ZphotoMemfiles {
+    Entry       **entries;
+    Entry       **by_data;
+    int         nentries;
+    char        *spill_dir;    /* NULL if nothing spilled */
+    int         nspilled;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t mutex;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+
+static pthread_key_t  thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+static void
+create_thread_key (void)
+{
+    pthread_key_create(&thread_key, NULL);
+}
+
+/*
+ * Set the table of in-memory files looked up on this
+ * thread, or none if NULL.
+ */
+void
+zphoto_memfiles_set_current (ZphotoMemfiles *memfiles)
+{
+    pthread_once(&thread_key_once, create_thread_key);
+    pthread_setspecific(thread_key, memfiles);
+}
+
+ZphotoMemfiles *
+zphoto_memfiles_get_current (void)
+{
+    pthread_once(&thread_key_once, create_thread_key);
+    return pthread_getspecific(thread_key);
+}
+
+#else
+
+static ZphotoMemfiles *current_memfiles = NULL;
+
+void
+zphoto_memfiles_set_current (ZphotoMemfiles *memfiles)
+{
+    current_memfiles = memfiles;
+}
+
+ZphotoMemfiles *
+zphoto_memfiles_get_current (void)
+{
+    return current_memfiles;
+}
+
+#endif
+
+ZphotoMemfiles *
+zphoto_memfiles_new (void)
+{
+    ZphotoMemfiles *memfiles = zphoto_emalloc(sizeof(ZphotoMemfiles));
+
+    memfiles->entries   = NULL;
+    memfiles->by_data   = NULL;
+    memfiles->nentries  = 0;
+    memfiles->spill_dir = NULL;
+    memfiles->nspilled  = 0;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&memfiles->mutex, NULL);
+#endif
+    return memfiles;
+}
+
+void
+zphoto_memfiles_destroy (ZphotoMemfiles *memfiles)
+{
+    int i;
+
+    for (i = 0; i < memfiles->nentries; i++) {
+        Entry *entry = memfiles->entries[i];
+
+#ifdef HAVE_SYS_MMAN_H
+        if (entry->mapped_p)
+            munmap((void *)entry->data, entry->size);
+#endif
+        if (entry->allocated_p)
+            free((void *)entry->data);
+        if (entry->spill_file_name != NULL) {
+            remove(entry->spill_file_name);
+            free(entry->spill_file_name);
+        }
+        free(entry->file_name);
+        free(entry);
+    }
+    if (memfiles->spill_dir != NULL) {
+        rmdir(memfiles->spill_dir);
+        free(memfiles->spill_dir);
+    }
+    free(memfiles->entries);
+    free(memfiles->by_data);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&memfiles->mutex);
+#endif
+    free(memfiles);
+}
+
+/*
+ * Returns the index of the first entry not less than key
+ * in the order of cmp.
+ */
+static int
+lower_bound (Entry **entries, int n, const void *key,
+             int (*cmp) (const Entry *entry, const void *key))
+{
+    int low = 0, high = n;
+
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (cmp(entries[middle], key) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+static int
+compare_name (const Entry *entry, const void *key)
+{
+    return strcmp(entry->file_name, key);
+}
+
+static int
+compare_data (const Entry *entry, const void *key)
+{
+    if ((const char *)entry->data < (const char *)key)
+        return -1;
+    return (const char *)entry->data > (const char *)key;
+}
+
+static void
+insert_entry (Entry **entries, int n, int i, Entry *entry)
+{
+    memmove(entries + i + 1, entries + i, sizeof(Entry *) * (n - i));
+    entries[i] = entry;
+}
+
+static Entry *
+add_entry (ZphotoMemfiles *memfiles, const char *file_name,
+           const void *data, size_t size, time_t mtime)
+{
+    int n = memfiles->nentries;
+    int i = lower_bound(memfiles->entries, n, file_name, compare_name);
+    Entry *entry;
+
+    if (i < n && strcmp(memfiles->entries[i]->file_name, file_name) == 0)
+        zphoto_eprintf("%s: added twice", file_name);
+
+    entry = zphoto_emalloc(sizeof(Entry));
+    entry->file_name   = zphoto_strdup(file_name);
+    entry->data        = data;
+    entry->size        = size;
+    entry->mtime       = mtime;
+    entry->mapped_p    = 0;
+    entry->allocated_p = 0;
+    entry->spill_file_name = NULL;
+
+    memfiles->entries = zphoto_erealloc(memfiles->entries,
+                                        sizeof(Entry *) * (n + 1));
+    memfiles->by_data = zphoto_erealloc(memfiles->by_data,
+                                        sizeof(Entry *) * (n + 1));
+    insert_entry(memfiles->entries, n, i, entry);
+    insert_entry(memfiles->by_data, n,
+                 lower_bound(memfiles->by_data, n, data, compare_data), entry);
+    memfiles->nentries++;
+    return entry;
+}
+
+/*
+ * Add size bytes at data as the file file_name modified at
+ * mtime.  The bytes are not copied and must be kept until
+ * the table is destroyed.
+ */
+void
+zphoto_memfiles_add (ZphotoMemfiles *memfiles, const char *file_name,
+                     const void *data, size_t size, time_t mtime)
+{
+    add_entry(memfiles, file_name, data, size, mtime);
+}
+
+/*
+ * Add the contents of fd as file_name.  Regular files are
+ * mapped, and the others (pipes and sockets) are read up
+ * to the end.  fd is not closed.
+ */
+void
+zphoto_memfiles_add_fd (ZphotoMemfiles *memfiles, const char *file_name,
+                        int fd)
+{
+    struct stat st;
+    Entry *entry;
+    char *data = NULL;
+    size_t size = 0, capacity = 0;
+
+    if (fstat(fd, &st) == -1)
+        zphoto_eprintf("%s:", file_name);
+
+#ifdef HAVE_SYS_MMAN_H
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (mapped != MAP_FAILED) {
+            entry = add_entry(memfiles, file_name, mapped, st.st_size,
+                              st.st_mtime);
+            entry->mapped_p = 1;
+            return;
+        }
+    }
+#endif
+
+    for (;;) {
+        ssize_t n;
+
+        if (size == capacity) {
+            capacity = capacity ? capacity * 2 : BUFSIZ * 16;
+            data = zphoto_erealloc(data, capacity);
+        }
+        n = read(fd, data + size, capacity - size);
+        if (n == -1)
+            zphoto_eprintf("%s:", file_name);
+        if (n == 0)
+            break;
+        size += n;
+    }
+    entry = add_entry(memfiles, file_name, data, size,
+                      S_ISREG(st.st_mode) ? st.st_mtime : time(NULL));
+    entry->allocated_p = 1;
+}
+
+static Entry *
+find_entry (const char *file_name)
+{
+    ZphotoMemfiles *memfiles = zphoto_memfiles_get_current();
+    int i;
+
+    if (memfiles == NULL)
+        return NULL;
+    i = lower_bound(memfiles->entries, memfiles->nentries, file_name,
+                    compare_name);
+    if (i < memfiles->nentries &&
+        strcmp(memfiles->entries[i]->file_name, file_name) == 0)
+        return memfiles->entries[i];
+    return NULL;
+}
+
+/*
+ * Returns 1 and sets data, size and mtime (each if not
+ * NULL) if file_name is an in-memory file of the current
+ * table.
+ */
+int
+zphoto_memfile_get (const char *file_name, const void **data, size_t *size,
+                    time_t *mtime)
+{
+    Entry *entry = find_entry(file_name);
+
+    if (entry == NULL)
+        return 0;
+    if (data != NULL)
+        *data = entry->data;
+    if (size != NULL)
+        *size = entry->size;
+    if (mtime != NULL)
+        *mtime = entry->mtime;
+    return 1;
+}
+
+/*
+ * Returns true if data is the bytes of an in-memory file,
+ * i.e. returned by zphoto_map_file() without mapping.
+ */
+int
+zphoto_memfile_data_p (const void *data)
+{
+    ZphotoMemfiles *memfiles = zphoto_memfiles_get_current();
+    int i;
+
+    if (memfiles == NULL || memfiles->nentries == 0)
+        return 0;
+    i = lower_bound(memfiles->by_data, memfiles->nentries, data,
+                    compare_data);
+    return i < memfiles->nentries && memfiles->by_data[i]->data == data;
+}
+
+/*
+ * Open an in-memory file for reading, or returns NULL if
+ * file_name is not one.
+ */
+FILE *
+zphoto_memfile_open (const char *file_name)
+{
+    Entry *entry = find_entry(file_name);
+    FILE *fp;
+
+    if (entry == NULL)
+        return NULL;
+#ifdef HAVE_FMEMOPEN
+    if (entry->size > 0)
+        return fmemopen((void *)entry->data, entry->size, "rb");
+#endif
+    fp = tmpfile();
+    if (fp == NULL)
+        return NULL;
+    if (fwrite(entry->data, 1, entry->size, fp) != entry->size) {
+        fclose(fp);
+        return NULL;
+    }
+    rewind(fp);
+    return fp;
+}
+
+static void
+release_memfiles (void *data)
+{
+#ifdef HAVE_PTHREAD
+    ZphotoMemfiles *memfiles = data;
+    pthread_mutex_unlock(&memfiles->mutex);
+#endif
+}
+
+/*
+ * The lock is released if an error abandons the job
+ * spilling a file.
+ */
+static void
+lock_memfiles (ZphotoMemfiles *memfiles)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&memfiles->mutex);
+#endif
+    zphoto_limit_push_cleanup(release_memfiles, memfiles);
+}
+
+static void
+unlock_memfiles (ZphotoMemfiles *memfiles)
+{
+    zphoto_limit_pop_cleanup();
+    release_memfiles(memfiles);
+}
+
+/*
+ * Remove a copy failing to be written.
+ */
+static void
+discard_spill (void *data)
+{
+    char *spill_file_name = data;
+
+    remove(spill_file_name);
+    free(spill_file_name);
+}
+
+/*
+ * Returns the name of a real file of the contents of
+ * file_name for libraries that open files by themselves:
+ * file_name itself unless it is an in-memory file.  Free
+ * the result.  The copy is removed with the table.
+ */
+char *
+zphoto_memfile_spill (const char *file_name)
+{
+    ZphotoMemfiles *memfiles = zphoto_memfiles_get_current();
+    Entry *entry = find_entry(file_name);
+    char *spill_file_name;
+
+    if (entry == NULL)
+        return zphoto_strdup(file_name);
+
+    lock_memfiles(memfiles);
+    if (entry->spill_file_name == NULL) {
+        if (memfiles->spill_dir == NULL)
+            memfiles->spill_dir = zphoto_make_temp_dir();
+        /*
+         * The number keeps the names unique and the base
+         * name keeps the suffix.  The entry gets the name
+         * only once the copy is written.
+         */
+        spill_file_name =
+            zphoto_asprintf("%s/%d-%s", memfiles->spill_dir,
+                            memfiles->nspilled++, zphoto_basename(file_name));
+        zphoto_limit_push_cleanup(discard_spill, spill_file_name);
+        zphoto_write_file(spill_file_name, entry->data, entry->size);
+        zphoto_limit_pop_cleanup();
+        entry->spill_file_name = spill_file_name;
+    }
+    spill_file_name = zphoto_strdup(entry->spill_file_name);
+    unlock_memfiles(memfiles);
+    return spill_file_name;
+}
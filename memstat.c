@@ -0,0 +1,328 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Memory use per stage for --memory-report.
+ *
+ * Built with --enable-memstat (ZPHOTO_MEMSTAT), the
+ * allocations by zphoto_emalloc(), zphoto_strdup(),
+ * zphoto_asprintf() and the pixel buffer pool are counted
+ * into the stage current on the calling thread, which is
+ * inherited by the worker threads of the job scheduler.
+ * free() in the C sources of libzphoto is replaced with
+ * zphoto_memstat_free() by config.h.  Sizes are those
+ * reported by malloc_usable_size(), so that frees need no
+ * bookkeeping of their own.
+ *
+ * For the same reason a free is counted into the stage
+ * current when it is freed, not the one that allocated it.
+ * The net size of a stage is thus what it allocated less
+ * what it freed, and goes below zero for a stage that
+ * frees what an earlier stage left behind; only the total
+ * is the memory live.  Memory must not be passed to free()
+ * in the C sources unless it was counted, so buffers
+ * handed out by the libraries are released with their own
+ * functions or copied.  Memory allocated and freed inside
+ * the libraries (libjpeg, Ming, ...) and by the C++ sources
+ * is not seen.  Otherwise the functions here do nothing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zphoto.h>
+#include "config.h"
+
+#ifdef ZPHOTO_MEMSTAT
+
+#undef free  /* the real one */
+
+#include <malloc.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#define MAX_STAGES 16
+
+typedef struct {
+    const char  *name;          /* static, NULL for none */
+    int64_t     nallocs;
+    int64_t     allocated;      /* bytes in total */
+    int64_t     net;            /* bytes allocated less freed */
+    int64_t     peak;           /* of all live bytes in the stage */
+    long        max_rss;        /* in kilobytes */
+} Stage;
+
+/*
+ * stages[0] is for the allocations out of any stage.
+ */
+static Stage stages[MAX_STAGES];
+static int   nstages = 1;
+static int64_t live = 0;        /* bytes of all stages */
+static int64_t peak = 0;
+
+#ifdef HAVE_PTHREAD
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t   thread_key;
+static pthread_once_t  thread_key_once = PTHREAD_ONCE_INIT;
+
+static void
+create_thread_key (void)
+{
+    pthread_key_create(&thread_key, NULL);
+}
+
+/*
+ * The key holds a Stage pointer; nothing is allocated
+ * for it.
+ */
+static Stage *
+get_thread_stage (void)
+{
+    Stage *stage;
+
+    pthread_once(&thread_key_once, create_thread_key);
+    stage = pthread_getspecific(thread_key);
+    return stage ? stage : stages;
+}
+
+static void
+set_thread_stage (Stage *stage)
+{
+    pthread_once(&thread_key_once, create_thread_key);
+    pthread_setspecific(thread_key, stage);
+}
+
+static void
+lock (void)
+{
+    pthread_mutex_lock(&mutex);
+}
+
+static void
+unlock (void)
+{
+    pthread_mutex_unlock(&mutex);
+}
+
+#else
+
+static Stage *thread_stage = NULL;
+
+static Stage *
+get_thread_stage (void)
+{
+    return thread_stage ? thread_stage : stages;
+}
+
+static void
+set_thread_stage (Stage *stage)
+{
+    thread_stage = stage;
+}
+
+static void
+lock (void)
+{
+}
+
+static void
+unlock (void)
+{
+}
+
+#endif
+
+static long
+get_max_rss (void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == -1)
+        return 0;
+    return usage.ru_maxrss;
+}
+
+/*
+ * Called with the lock held.  Stages beyond MAX_STAGES
+ * are counted as none.
+ */
+static Stage *
+find_stage (const char *name)
+{
+    int i;
+
+    if (name == NULL)
+        return stages;
+    for (i = 1; i < nstages; i++) {
+        if (strcmp(stages[i].name, name) == 0)
+            return stages + i;
+    }
+    if (nstages == MAX_STAGES)
+        return stages;
+    stages[nstages].name = name;
+    return stages + nstages++;
+}
+
+static void
+account (Stage *stage, int64_t size)
+{
+    lock();
+    if (size > 0) {
+        stage->nallocs++;
+        stage->allocated += size;
+    }
+    stage->net += size;
+    live += size;
+    if (live > peak)
+        peak = live;
+    if (live > stage->peak)
+        stage->peak = live;
+    unlock();
+}
+
+/*
+ * Count the allocations on this thread into stage, or
+ * into none if NULL.  stage should be a static string.
+ */
+void
+zphoto_memstat_set_stage (const char *stage)
+{
+    Stage *old_stage = get_thread_stage();
+    long max_rss = get_max_rss();
+
+    lock();
+    if (max_rss > old_stage->max_rss)
+        old_stage->max_rss = max_rss;
+    set_thread_stage(find_stage(stage));
+    unlock();
+}
+
+const char *
+zphoto_memstat_get_stage (void)
+{
+    return get_thread_stage()->name;
+}
+
+/*
+ * Count ptr allocated by malloc() and friends.
+ */
+void
+zphoto_memstat_note_alloc (void *ptr)
+{
+    if (ptr != NULL)
+        account(get_thread_stage(), malloc_usable_size(ptr));
+}
+
+/*
+ * Uncount ptr before it is freed or reallocated.
+ */
+void
+zphoto_memstat_note_free (void *ptr)
+{
+    if (ptr != NULL)
+        account(get_thread_stage(), -(int64_t)malloc_usable_size(ptr));
+}
+
+void
+zphoto_memstat_free (void *ptr)
+{
+    zphoto_memstat_note_free(ptr);
+    free(ptr);
+}
+
+static double
+megabytes (int64_t bytes)
+{
+    return bytes / (1024.0 * 1024.0);
+}
+
+void
+zphoto_memstat_write_report (FILE *fp)
+{
+    int i;
+    long max_rss = get_max_rss();
+
+    fprintf(fp, "%-10s %10s %12s %12s %12s %12s\n",
+            "stage", "allocs", "alloc(MB)", "net(MB)", "peak(MB)",
+            "maxrss(MB)");
+    lock();
+    for (i = 0; i < nstages; i++) {
+        Stage *stage = stages + i;
+
+        if (stage->nallocs == 0)
+            continue;
+        fprintf(fp, "%-10s %10lld %12.1f %12.1f %12.1f %12.1f\n",
+                stage->name ? stage->name : "-",
+                (long long)stage->nallocs, megabytes(stage->allocated),
+                megabytes(stage->net), megabytes(stage->peak),
+                stage->max_rss / 1024.0);
+    }
+    fprintf(fp, "%-10s %10s %12s %12.1f %12.1f %12.1f\n",
+            "total", "", "", megabytes(live), megabytes(peak),
+            max_rss / 1024.0);
+    unlock();
+}
+
+/*
+ * Built without --enable-memstat.
+ */
+#else
+
+void
+zphoto_memstat_set_stage (const char *stage)
+{
+}
+
+const char *
+zphoto_memstat_get_stage (void)
+{
+    return NULL;
+}
+
+void
+zphoto_memstat_note_alloc (void *ptr)
+{
+}
+
+void
+zphoto_memstat_note_free (void *ptr)
+{
+}
+
+void
+zphoto_memstat_free (void *ptr)
+{
+    free(ptr);
+}
+
+void
+zphoto_memstat_write_report (FILE *fp)
+{
+    zphoto_wprintf("memory report is not available; "
+                   "configure with --enable-memstat");
+}
+
+#endif
@@ -0,0 +1,752 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Per-operation latencies and per-photo records.
+ *
+ * Every span closed with zphoto_trace_end() is timed into
+ * the metrics current on the thread, which is inherited by
+ * the worker threads of the job scheduler.  Each photo job
+ * is bracketed by zphoto_metrics_begin_photo() and _end_photo(),
+ * and the decode, resize, encode and write spans within it
+ * are also added to the photo's record along with its
+ * backend and the sizes and pixels noted by the codecs as
+ * they read and write the files.  The results are written as a
+ * Prometheus text file and as a JSON summary with
+ * percentiles and the slowest files.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zphoto.h>
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * Steps broken down in the photo records.
+ */
+enum {
+    STEP_DECODE,
+    STEP_RESIZE,
+    STEP_ENCODE,
+    STEP_WRITE,
+    NSTEPS
+};
+
+static const char *step_names[NSTEPS] = {
+    "decode", "resize", "encode", "write"
+};
+
+/*
+ * Upper bounds of the histogram buckets in seconds.
+ */
+static const double bucket_bounds[] = {
+    0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 30
+};
+#define NBUCKETS (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]))
+
+typedef struct _Operation {
+    const char  *category;  /* static */
+    const char  *name;      /* static */
+    double      *samples;   /* in seconds */
+    int         count;
+    int         capacity;
+    double      total;
+    struct _Operation *next;
+} Operation;
+
+typedef struct {
+    char        *file_name;
+    const char  *stage;     /* static */
+    const char  *backend;   /* static, NULL if unknown */
+    double      start_time;
+    double      seconds;
+    double      step_seconds[NSTEPS];
+    double      input_bytes;
+    double      output_bytes;
+    double      pixels;
+    int         failed_p;
+} Photo;
+
+struct _ZphotoMetrics {
+    Operation   *operations;
+    Photo       *photos;
+    int         nphotos;
+    int         capacity;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t mutex;
+#endif
+};
+
+typedef struct {
+    ZphotoMetrics *metrics;
+    Photo       photo;
+    int         in_photo_p;
+} ThreadMetrics;
+
+#ifdef HAVE_PTHREAD
+
+static pthread_key_t  thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+static void
+destroy_thread_metrics (void *data)
+{
+    ThreadMetrics *thread = data;
+
+    if (thread->in_photo_p)
+        free(thread->photo.file_name);
+    free(thread);
+}
+
+static void
+create_thread_key (void)
+{
+    pthread_key_create(&thread_key, destroy_thread_metrics);
+}
+
+static ThreadMetrics *
+get_thread_metrics (void)
+{
+    ThreadMetrics *thread;
+
+    pthread_once(&thread_key_once, create_thread_key);
+    thread = pthread_getspecific(thread_key);
+    if (thread == NULL) {
+        thread = zphoto_emalloc(sizeof(ThreadMetrics));
+        thread->metrics    = NULL;
+        thread->in_photo_p = 0;
+        pthread_setspecific(thread_key, thread);
+    }
+    return thread;
+}
+
+static void
+lock (ZphotoMetrics *metrics)
+{
+    pthread_mutex_lock(&metrics->mutex);
+}
+
+static void
+unlock (ZphotoMetrics *metrics)
+{
+    pthread_mutex_unlock(&metrics->mutex);
+}
+
+#else
+
+static ThreadMetrics *
+get_thread_metrics (void)
+{
+    static ThreadMetrics thread;
+    return &thread;
+}
+
+static void
+lock (ZphotoMetrics *metrics)
+{
+}
+
+static void
+unlock (ZphotoMetrics *metrics)
+{
+}
+
+#endif
+
+ZphotoMetrics *
+zphoto_metrics_new (void)
+{
+    ZphotoMetrics *metrics = zphoto_emalloc(sizeof(ZphotoMetrics));
+
+    metrics->operations = NULL;
+    metrics->photos     = NULL;
+    metrics->nphotos    = 0;
+    metrics->capacity   = 0;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&metrics->mutex, NULL);
+#endif
+    return metrics;
+}
+
+void
+zphoto_metrics_destroy (ZphotoMetrics *metrics)
+{
+    Operation *operation, *next;
+    int i;
+
+    for (operation = metrics->operations; operation; operation = next) {
+        next = operation->next;
+        free(operation->samples);
+        free(operation);
+    }
+    for (i = 0; i < metrics->nphotos; i++)
+        free(metrics->photos[i].file_name);
+    free(metrics->photos);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&metrics->mutex);
+#endif
+    free(metrics);
+}
+
+/*
+ * Record into metrics on this thread, or nowhere if NULL.
+ */
+void
+zphoto_metrics_set_current (ZphotoMetrics *metrics)
+{
+    get_thread_metrics()->metrics = metrics;
+}
+
+ZphotoMetrics *
+zphoto_metrics_get_current (void)
+{
+    return get_thread_metrics()->metrics;
+}
+
+static Operation *
+find_operation (ZphotoMetrics *metrics, const char *category, const char *name)
+{
+    Operation *operation;
+
+    for (operation = metrics->operations; operation;
+         operation = operation->next) {
+        if (strcmp(operation->category, category) == 0 &&
+            strcmp(operation->name, name) == 0)
+            return operation;
+    }
+    return NULL;
+}
+
+static Operation *
+add_operation (ZphotoMetrics *metrics, const char *category, const char *name)
+{
+    Operation *operation = zphoto_emalloc(sizeof(Operation));
+    Operation **p;
+
+    operation->category = category;
+    operation->name     = name;
+    operation->samples  = NULL;
+    operation->count    = 0;
+    operation->capacity = 0;
+    operation->total    = 0.0;
+    operation->next     = NULL;
+
+    /*
+     * Appended to keep the order of first appearance.
+     */
+    for (p = &metrics->operations; *p != NULL; p = &(*p)->next);
+    *p = operation;
+    return operation;
+}
+
+static int
+find_step (const char *category, const char *name)
+{
+    int i;
+
+    if (strcmp(category, "stage") == 0 || strcmp(category, "photo") == 0)
+        return -1;
+    for (i = 0; i < NSTEPS; i++) {
+        if (strcmp(name, step_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Called with the lock held.
+ */
+static void
+add_sample (ZphotoMetrics *metrics, const char *category, const char *name,
+            double seconds)
+{
+    Operation *operation = find_operation(metrics, category, name);
+
+    if (operation == NULL)
+        operation = add_operation(metrics, category, name);
+    if (operation->count == operation->capacity) {
+        operation->capacity = operation->capacity ? operation->capacity * 2 : 64;
+        operation->samples = zphoto_erealloc(operation->samples,
+                                             sizeof(double) *
+                                             operation->capacity);
+    }
+    operation->samples[operation->count++] = seconds;
+    operation->total += seconds;
+}
+
+static void
+add_photo (ZphotoMetrics *metrics, Photo *photo)
+{
+    if (metrics->nphotos == metrics->capacity) {
+        metrics->capacity = metrics->capacity ? metrics->capacity * 2 : 256;
+        metrics->photos = zphoto_erealloc(metrics->photos, sizeof(Photo) *
+                                          metrics->capacity);
+    }
+    metrics->photos[metrics->nphotos++] = *photo;
+}
+
+/*
+ * Called by zphoto_trace_end().  category and name should
+ * be static strings.
+ */
+void
+zphoto_metrics_record_span (const char *category, const char *name,
+                            double seconds)
+{
+    ThreadMetrics *thread = get_thread_metrics();
+    ZphotoMetrics *metrics = thread->metrics;
+    int step;
+
+    if (metrics == NULL)
+        return;
+
+    step = find_step(category, name);
+    if (thread->in_photo_p && step >= 0)
+        thread->photo.step_seconds[step] += seconds;
+
+    lock(metrics);
+    add_sample(metrics, category, name, seconds);
+    unlock(metrics);
+}
+
+/*
+ * Add what src has recorded to metrics, e.g. to summarize
+ * several albums.
+ */
+void
+zphoto_metrics_merge (ZphotoMetrics *metrics, ZphotoMetrics *src)
+{
+    Operation *operation;
+    int i;
+
+    assert(metrics != src);
+    lock(src);
+    lock(metrics);
+    for (operation = src->operations; operation;
+         operation = operation->next) {
+        for (i = 0; i < operation->count; i++)
+            add_sample(metrics, operation->category, operation->name,
+                       operation->samples[i]);
+    }
+    for (i = 0; i < src->nphotos; i++) {
+        Photo photo = src->photos[i];
+        photo.file_name = zphoto_strdup(photo.file_name);
+        add_photo(metrics, &photo);
+    }
+    unlock(metrics);
+    unlock(src);
+}
+
+/*
+ * Called by zphoto_codec_record().  The first backend of a
+ * photo is the one that decoded it.
+ */
+void
+zphoto_metrics_note_backend (const char *backend)
+{
+    ThreadMetrics *thread = get_thread_metrics();
+
+    if (thread->in_photo_p && thread->photo.backend == NULL)
+        thread->photo.backend = backend;
+}
+
+/*
+ * Start the record of a photo job on this thread.  stage
+ * should be a static string.
+ */
+void
+zphoto_metrics_begin_photo (const char *file_name, const char *stage)
+{
+    ThreadMetrics *thread = get_thread_metrics();
+    Photo *photo = &thread->photo;
+    int i;
+
+    if (thread->metrics == NULL)
+        return;
+    if (thread->in_photo_p)
+        free(photo->file_name);
+
+    photo->file_name  = zphoto_strdup(file_name);
+    photo->stage      = stage;
+    photo->backend    = NULL;
+    photo->start_time = zphoto_get_time();
+    photo->input_bytes  = 0;
+    photo->output_bytes = 0;
+    photo->pixels       = 0;
+    for (i = 0; i < NSTEPS; i++)
+        photo->step_seconds[i] = 0.0;
+    thread->in_photo_p = 1;
+}
+
+/*
+ * Called by the codecs when they have read the input of
+ * the photo.  bytes, or width and height, are 0 if not
+ * known; the first known values are kept, since later
+ * reads are of the outputs or of fallbacks.
+ */
+void
+zphoto_metrics_note_input (size_t bytes, int width, int height)
+{
+    ThreadMetrics *thread = get_thread_metrics();
+
+    if (!thread->in_photo_p)
+        return;
+    if (thread->photo.input_bytes == 0)
+        thread->photo.input_bytes = bytes;
+    if (thread->photo.pixels == 0)
+        thread->photo.pixels = (double)width * height;
+}
+
+/*
+ * Called by zphoto_write_file() and the backends that
+ * write the output of the photo themselves.
+ */
+void
+zphoto_metrics_note_output (size_t bytes)
+{
+    ThreadMetrics *thread = get_thread_metrics();
+
+    if (thread->in_photo_p)
+        thread->photo.output_bytes = bytes;
+}
+
+/*
+ * Finish the record.  Photos served from the cache have no
+ * sizes, since nothing is read or written.
+ */
+void
+zphoto_metrics_end_photo (int failed_p)
+{
+    ThreadMetrics *thread = get_thread_metrics();
+    ZphotoMetrics *metrics = thread->metrics;
+    Photo *photo = &thread->photo;
+
+    if (metrics == NULL || !thread->in_photo_p)
+        return;
+
+    photo->seconds  = zphoto_get_time() - photo->start_time;
+    photo->failed_p = failed_p;
+    if (failed_p)
+        photo->output_bytes = 0;
+
+    lock(metrics);
+    add_photo(metrics, photo);  /* takes file_name */
+    unlock(metrics);
+    thread->in_photo_p = 0;
+}
+
+static double *
+sorted_copy (const double *values, int n)
+{
+    double *sorted = zphoto_emalloc(sizeof(double) * (n > 0 ? n : 1));
+
+    memcpy(sorted, values, sizeof(double) * n);
+    zphoto_sort_doubles(sorted, n);
+    return sorted;
+}
+
+/*
+ * Returns the p-th percentile (0-100) of the time of the
+ * operation in seconds, or 0 if it has not been run.
+ */
+double
+zphoto_metrics_get_percentile (ZphotoMetrics *metrics,
+                               const char *category, const char *name,
+                               double p)
+{
+    Operation *operation;
+    double *sorted, value = 0.0;
+
+    lock(metrics);
+    operation = find_operation(metrics, category, name);
+    if (operation != NULL) {
+        sorted = sorted_copy(operation->samples, operation->count);
+        value = zphoto_percentile(sorted, operation->count, p);
+        free(sorted);
+    }
+    unlock(metrics);
+    return value;
+}
+
+int
+zphoto_metrics_get_count (ZphotoMetrics *metrics,
+                          const char *category, const char *name)
+{
+    Operation *operation;
+    int count;
+
+    lock(metrics);
+    operation = find_operation(metrics, category, name);
+    count = operation ? operation->count : 0;
+    unlock(metrics);
+    return count;
+}
+
+int
+zphoto_metrics_get_nphotos (ZphotoMetrics *metrics)
+{
+    return metrics->nphotos;
+}
+
+static void
+write_histogram (FILE *fp, Operation *operation)
+{
+    double *sorted = sorted_copy(operation->samples, operation->count);
+    int i, n = 0;
+
+    for (i = 0; i < NBUCKETS; i++) {
+        while (n < operation->count && sorted[n] <= bucket_bounds[i])
+            n++;
+        fprintf(fp, "zphoto_operation_seconds_bucket{category=\"%s\","
+                "operation=\"%s\",le=\"%g\"} %d\n",
+                operation->category, operation->name, bucket_bounds[i], n);
+    }
+    fprintf(fp, "zphoto_operation_seconds_bucket{category=\"%s\","
+            "operation=\"%s\",le=\"+Inf\"} %d\n",
+            operation->category, operation->name, operation->count);
+    fprintf(fp, "zphoto_operation_seconds_sum{category=\"%s\","
+            "operation=\"%s\"} %.6f\n",
+            operation->category, operation->name, operation->total);
+    fprintf(fp, "zphoto_operation_seconds_count{category=\"%s\","
+            "operation=\"%s\"} %d\n",
+            operation->category, operation->name, operation->count);
+    free(sorted);
+}
+
+static char *
+escape_label (const char *value)
+{
+    char *escaped = zphoto_emalloc(strlen(value) * 2 + 1), *q;
+    const char *p;
+
+    for (p = value, q = escaped; *p != '\0'; p++) {
+        if (*p == '\\' || *p == '"')
+            *q++ = '\\';
+        if (*p == '\n') {
+            *q++ = '\\';
+            *q++ = 'n';
+            continue;
+        }
+        *q++ = *p;
+    }
+    *q = '\0';
+    return escaped;
+}
+
+enum {
+    NCOUNTERS = 5
+};
+
+/*
+ * Sums of the photos of a stage and backend.
+ */
+typedef struct {
+    const char  *stage;    /* static */
+    const char  *backend;  /* static */
+    double      sums[NCOUNTERS];
+} Group;
+
+/*
+ * Photo counters are written per stage and backend.  There
+ * are only a few of them, so the photos are summed up in
+ * one pass with a linear search for the group.
+ */
+static void
+write_photo_counters (FILE *fp, ZphotoMetrics *metrics)
+{
+    static const char *names[NCOUNTERS] = {
+        "photos_total", "photos_failed_total", "input_bytes_total",
+        "output_bytes_total", "pixels_total"
+    };
+    Group *groups = zphoto_emalloc(sizeof(Group) * (metrics->nphotos + 1));
+    int i, k, ngroups = 0;
+
+    for (i = 0; i < metrics->nphotos; i++) {
+        Photo *photo = metrics->photos + i;
+        const char *backend = photo->backend ? photo->backend : "none";
+        Group *group;
+
+        for (group = groups; group < groups + ngroups; group++) {
+            if (strcmp(group->stage, photo->stage) == 0 &&
+                strcmp(group->backend, backend) == 0)
+                break;
+        }
+        if (group == groups + ngroups) {
+            group->stage   = photo->stage;
+            group->backend = backend;
+            memset(group->sums, 0, sizeof(group->sums));
+            ngroups++;
+        }
+        group->sums[0] += 1;
+        group->sums[1] += photo->failed_p;
+        group->sums[2] += photo->input_bytes;
+        group->sums[3] += photo->output_bytes;
+        group->sums[4] += photo->pixels;
+    }
+
+    for (k = 0; k < NCOUNTERS; k++) {
+        fprintf(fp, "# TYPE zphoto_%s counter\n", names[k]);
+        for (i = 0; i < ngroups; i++) {
+            char *escaped = escape_label(groups[i].backend);
+            fprintf(fp, "zphoto_%s{stage=\"%s\",backend=\"%s\"} %.0f\n",
+                    names[k], groups[i].stage, escaped, groups[i].sums[k]);
+            free(escaped);
+        }
+    }
+    free(groups);
+}
+
+/*
+ * Write the metrics in the Prometheus text format (e.g.
+ * for the textfile collector of node_exporter).
+ */
+void
+zphoto_metrics_write_prometheus (ZphotoMetrics *metrics, FILE *fp)
+{
+    Operation *operation;
+
+    lock(metrics);
+    fprintf(fp, "# HELP zphoto_operation_seconds "
+            "Time spent in each operation.\n");
+    fprintf(fp, "# TYPE zphoto_operation_seconds histogram\n");
+    for (operation = metrics->operations; operation;
+         operation = operation->next)
+        write_histogram(fp, operation);
+    write_photo_counters(fp, metrics);
+    unlock(metrics);
+}
+
+static void
+write_summary (FILE *fp, const double *values, int n)
+{
+    double *sorted = sorted_copy(values, n);
+    double total = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        total += values[i];
+    fprintf(fp, "{\"count\": %d, \"total\": %.6f, \"p50\": %.6f, "
+            "\"p95\": %.6f, \"p99\": %.6f, \"max\": %.6f}",
+            n, total, zphoto_percentile(sorted, n, 50),
+            zphoto_percentile(sorted, n, 95), zphoto_percentile(sorted, n, 99),
+            n > 0 ? sorted[n - 1] : 0.0);
+    free(sorted);
+}
+
+static int
+compare_by_seconds (const void *a, const void *b)
+{
+    const Photo *x = *(Photo *const *)a, *y = *(Photo *const *)b;
+
+    if (x->seconds != y->seconds)
+        return x->seconds > y->seconds ? -1 : 1;
+    return 0;
+}
+
+static void
+write_photo (FILE *fp, Photo *photo)
+{
+    char *file_name = zphoto_escape_json(photo->file_name);
+    int i;
+
+    fprintf(fp, "{\"file\": %s, \"stage\": \"%s\", \"backend\": \"%s\", "
+            "\"seconds\": %.6f, \"failed\": %s, \"input_bytes\": %.0f, "
+            "\"output_bytes\": %.0f, \"pixels\": %.0f",
+            file_name, photo->stage,
+            photo->backend ? photo->backend : "none",
+            photo->seconds, photo->failed_p ? "true" : "false",
+            photo->input_bytes, photo->output_bytes, photo->pixels);
+    for (i = 0; i < NSTEPS; i++)
+        fprintf(fp, ", \"%s\": %.6f", step_names[i], photo->step_seconds[i]);
+    fprintf(fp, "}");
+    free(file_name);
+}
+
+/*
+ * Write the percentiles of the operations and of the photo
+ * jobs of each stage, and the ntop slowest photo jobs, in
+ * JSON.
+ */
+void
+zphoto_metrics_write_json (ZphotoMetrics *metrics, FILE *fp, int ntop)
+{
+    Operation *operation;
+    Photo **order;
+    double *seconds;
+    int i, j, n, nfailed = 0;
+
+    lock(metrics);
+    for (i = 0; i < metrics->nphotos; i++)
+        nfailed += metrics->photos[i].failed_p;
+    fprintf(fp, "{\n  \"photos\": %d,\n  \"failed\": %d,\n",
+            metrics->nphotos, nfailed);
+
+    fprintf(fp, "  \"operations\": {");
+    for (operation = metrics->operations; operation;
+         operation = operation->next) {
+        fprintf(fp, "%s\n    \"%s/%s\": ",
+                operation == metrics->operations ? "" : ",",
+                operation->category, operation->name);
+        write_summary(fp, operation->samples, operation->count);
+    }
+    fprintf(fp, "\n  },\n");
+
+    fprintf(fp, "  \"stages\": {");
+    seconds = zphoto_emalloc(sizeof(double) * (metrics->nphotos + 1));
+    for (i = 0; i < metrics->nphotos; i++) {
+        const char *stage = metrics->photos[i].stage;
+
+        for (j = 0; j < i; j++) {
+            if (strcmp(metrics->photos[j].stage, stage) == 0)
+                break;
+        }
+        if (j < i)  /* already written */
+            continue;
+        for (j = i, n = 0; j < metrics->nphotos; j++) {
+            if (strcmp(metrics->photos[j].stage, stage) == 0)
+                seconds[n++] = metrics->photos[j].seconds;
+        }
+        fprintf(fp, "%s\n    \"%s\": ", i == 0 ? "" : ",", stage);
+        write_summary(fp, seconds, n);
+    }
+    free(seconds);
+    fprintf(fp, "\n  },\n");
+
+    order = zphoto_emalloc(sizeof(Photo *) * (metrics->nphotos + 1));
+    for (i = 0; i < metrics->nphotos; i++)
+        order[i] = metrics->photos + i;
+    qsort(order, metrics->nphotos, sizeof(Photo *), compare_by_seconds);
+    fprintf(fp, "  \"slowest\": [");
+    for (i = 0; i < ntop && i < metrics->nphotos; i++) {
+        fprintf(fp, "%s\n    ", i == 0 ? "" : ",");
+        write_photo(fp, order[i]);
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    free(order);
+    unlock(metrics);
+}
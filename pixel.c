@@ -0,0 +1,369 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Pixel format conversion kernels.
+ *
+ * ARGB pixels are native-endian 32-bit words as used by
+ * Imlib2 (DATA32).  RGB, BGR and RGBA pixels are byte
+ * sequences.  On x86 the kernels are vectorized with SSSE3
+ * or AVX2 byte shuffles, chosen at run time with the CPU
+ * features; elsewhere and for the remaining pixels the
+ * plain C loops are used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zphoto.h>
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#if (defined(__i386__) || defined(__x86_64__)) && \
+    (defined(__clang__) || \
+     __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_SIMD 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Shuffle masks for 4 pixels.  With x86 being
+ * little-endian, an ARGB word is B, G, R, A in memory.
+ * 0x80 clears the byte.
+ */
+#define Z 0x80
+static const unsigned char bgr_to_argb_mask[16] = {
+    0, 1, 2, Z,  3, 4, 5, Z,  6, 7, 8, Z,  9, 10, 11, Z
+};
+static const unsigned char rgb_to_argb_mask[16] = {
+    2, 1, 0, Z,  5, 4, 3, Z,  8, 7, 6, Z,  11, 10, 9, Z
+};
+static const unsigned char argb_to_rgb_mask[16] = {
+    2, 1, 0,  6, 5, 4,  10, 9, 8,  14, 13, 12,  Z, Z, Z, Z
+};
+static const unsigned char swap_rb32_mask[16] = {
+    2, 1, 0, 3,  6, 5, 4, 7,  10, 9, 8, 11,  14, 13, 12, 15
+};
+/* 5 pixels; the 16th byte is left as is */
+static const unsigned char swap_rb24_mask[16] = {
+    2, 1, 0,  5, 4, 3,  8, 7, 6,  11, 10, 9,  14, 13, 12,  15
+};
+#undef Z
+
+/*
+ * Each kernel converts as many pixels as it can without
+ * reading or writing out of bounds and returns the number
+ * of pixels done.
+ */
+typedef size_t (*Kernel)(const unsigned char *src, unsigned char *dest,
+                         size_t n, const unsigned char *mask);
+
+#ifdef USE_SIMD
+
+__attribute__((target("ssse3")))
+static size_t
+expand3_ssse3 (const unsigned char *src, unsigned char *dest,
+               size_t n, const unsigned char *mask)
+{
+    size_t i = 0;
+    __m128i m = _mm_loadu_si128((const __m128i *)mask);
+    __m128i alpha = _mm_set1_epi32((int)0xff000000);
+
+    for (; i + 6 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i * 3));
+        x = _mm_or_si128(_mm_shuffle_epi8(x, m), alpha);
+        _mm_storeu_si128((__m128i *)(dest + i * 4), x);
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t
+shrink4_ssse3 (const unsigned char *src, unsigned char *dest,
+               size_t n, const unsigned char *mask)
+{
+    size_t i = 0;
+    __m128i m = _mm_loadu_si128((const __m128i *)mask);
+
+    /* 16 bytes are stored for 12 */
+    for (; i + 6 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        _mm_storeu_si128((__m128i *)(dest + i * 3), _mm_shuffle_epi8(x, m));
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t
+shuffle4_ssse3 (const unsigned char *src, unsigned char *dest,
+                size_t n, const unsigned char *mask)
+{
+    size_t i = 0;
+    __m128i m = _mm_loadu_si128((const __m128i *)mask);
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        _mm_storeu_si128((__m128i *)(dest + i * 4), _mm_shuffle_epi8(x, m));
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t
+shuffle3_ssse3 (const unsigned char *src, unsigned char *dest,
+                size_t n, const unsigned char *mask)
+{
+    size_t i = 0;
+    __m128i x, m = _mm_loadu_si128((const __m128i *)mask);
+
+    /*
+     * 5 pixels per 16 bytes.  Each block is loaded before
+     * the previous one, which overlaps it by a byte, is
+     * stored.  This avoids store forwarding stalls and lets
+     * it work in place.
+     */
+    if (n * 3 < 16)
+        return 0;
+    x = _mm_loadu_si128((const __m128i *)src);
+    for (; (i + 5) * 3 + 16 <= n * 3; i += 5) {
+        __m128i next = _mm_loadu_si128((const __m128i *)(src + i * 3 + 15));
+        _mm_storeu_si128((__m128i *)(dest + i * 3), _mm_shuffle_epi8(x, m));
+        x = next;
+    }
+    _mm_storeu_si128((__m128i *)(dest + i * 3), _mm_shuffle_epi8(x, m));
+    return i + 5;
+}
+
+/*
+ * AVX2 shuffles do not cross the 128-bit lanes, so each
+ * lane is loaded or stored separately for 3-byte pixels.
+ */
+__attribute__((target("avx2")))
+static size_t
+expand3_avx2 (const unsigned char *src, unsigned char *dest,
+              size_t n, const unsigned char *mask)
+{
+    size_t i = 0;
+    __m256i m = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)mask));
+    __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+
+    for (; i + 10 <= n; i += 8) {
+        const unsigned char *p = src + i * 3;
+        __m256i x = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+            _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+        x = _mm256_or_si256(_mm256_shuffle_epi8(x, m), alpha);
+        _mm256_storeu_si256((__m256i *)(dest + i * 4), x);
+    }
+    return i + expand3_ssse3(src + i * 3, dest + i * 4, n - i, mask);
+}
+
+__attribute__((target("avx2")))
+static size_t
+shrink4_avx2 (const unsigned char *src, unsigned char *dest,
+              size_t n, const unsigned char *mask)
+{
+    size_t i = 0;
+    __m256i m = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)mask));
+
+    for (; i + 10 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+        x = _mm256_shuffle_epi8(x, m);
+        _mm_storeu_si128((__m128i *)(dest + i * 3),
+                         _mm256_castsi256_si128(x));
+        _mm_storeu_si128((__m128i *)(dest + i * 3 + 12),
+                         _mm256_extracti128_si256(x, 1));
+    }
+    return i + shrink4_ssse3(src + i * 4, dest + i * 3, n - i, mask);
+}
+
+__attribute__((target("avx2")))
+static size_t
+shuffle4_avx2 (const unsigned char *src, unsigned char *dest,
+               size_t n, const unsigned char *mask)
+{
+    size_t i = 0;
+    __m256i m = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)mask));
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+        _mm256_storeu_si256((__m256i *)(dest + i * 4),
+                            _mm256_shuffle_epi8(x, m));
+    }
+    return i + shuffle4_ssse3(src + i * 4, dest + i * 4, n - i, mask);
+}
+
+#endif /* USE_SIMD */
+
+static size_t
+no_kernel (const unsigned char *src, unsigned char *dest,
+           size_t n, const unsigned char *mask)
+{
+    return 0;
+}
+
+static Kernel expand3  = no_kernel;  /* 3 bytes to ARGB */
+static Kernel shrink4  = no_kernel;  /* ARGB to 3 bytes */
+static Kernel shuffle4 = no_kernel;  /* 4 bytes to 4 bytes */
+static Kernel shuffle3 = no_kernel;  /* 3 bytes to 3 bytes */
+
+static void
+choose_kernels (void)
+{
+#ifdef USE_SIMD
+    if (__builtin_cpu_supports("ssse3")) {
+        expand3  = expand3_ssse3;
+        shrink4  = shrink4_ssse3;
+        shuffle4 = shuffle4_ssse3;
+        shuffle3 = shuffle3_ssse3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        expand3  = expand3_avx2;
+        shrink4  = shrink4_avx2;
+        shuffle4 = shuffle4_avx2;
+    }
+#endif
+}
+
+static void
+init_kernels (void)
+{
+#ifdef HAVE_PTHREAD
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, choose_kernels);
+#else
+    static int initialized_p = 0;
+    if (!initialized_p) {
+        initialized_p = 1;
+        choose_kernels();
+    }
+#endif
+}
+
+/*
+ * BGR (e.g. DIB frames of movies) to opaque ARGB.
+ */
+void
+zphoto_pixel_bgr_to_argb (const unsigned char *src, unsigned int *dest,
+                          size_t n)
+{
+    size_t i;
+
+    init_kernels();
+    i = expand3(src, (unsigned char *)dest, n, bgr_to_argb_mask);
+    for (src += i * 3; i < n; i++, src += 3)
+        dest[i] = 0xff000000 | (src[2] << 16) | (src[1] << 8) | src[0];
+}
+
+/*
+ * RGB to opaque ARGB.
+ */
+void
+zphoto_pixel_rgb_to_argb (const unsigned char *src, unsigned int *dest,
+                          size_t n)
+{
+    size_t i;
+
+    init_kernels();
+    i = expand3(src, (unsigned char *)dest, n, rgb_to_argb_mask);
+    for (src += i * 3; i < n; i++, src += 3)
+        dest[i] = 0xff000000 | (src[0] << 16) | (src[1] << 8) | src[2];
+}
+
+/*
+ * RGBA to ARGB.
+ */
+void
+zphoto_pixel_rgba_to_argb (const unsigned char *src, unsigned int *dest,
+                           size_t n)
+{
+    size_t i;
+
+    init_kernels();
+    i = shuffle4(src, (unsigned char *)dest, n, swap_rb32_mask);
+    for (src += i * 4; i < n; i++, src += 4)
+        dest[i] = ((unsigned int)src[3] << 24) |
+            (src[0] << 16) | (src[1] << 8) | src[2];
+}
+
+/*
+ * ARGB to RGB.  The alpha channel is dropped.
+ */
+void
+zphoto_pixel_argb_to_rgb (const unsigned int *src, unsigned char *dest,
+                          size_t n)
+{
+    size_t i;
+
+    init_kernels();
+    i = shrink4((const unsigned char *)src, dest, n, argb_to_rgb_mask);
+    for (dest += i * 3; i < n; i++) {
+        *dest++ = (src[i] >> 16) & 0xff;
+        *dest++ = (src[i] >>  8) & 0xff;
+        *dest++ = src[i] & 0xff;
+    }
+}
+
+/*
+ * ARGB to RGBA.
+ */
+void
+zphoto_pixel_argb_to_rgba (const unsigned int *src, unsigned char *dest,
+                           size_t n)
+{
+    size_t i;
+
+    init_kernels();
+    i = shuffle4((const unsigned char *)src, dest, n, swap_rb32_mask);
+    for (dest += i * 4; i < n; i++) {
+        *dest++ = (src[i] >> 16) & 0xff;
+        *dest++ = (src[i] >>  8) & 0xff;
+        *dest++ = src[i] & 0xff;
+        *dest++ = src[i] >> 24;
+    }
+}
+
+/*
+ * Swap red and blue of 3-byte pixels, i.e. BGR to RGB and
+ * vice versa.  src and dest may be the same.
+ */
+void
+zphoto_pixel_swap_rb (const unsigned char *src, unsigned char *dest,
+                      size_t n)
+{
+    size_t i;
+
+    init_kernels();
+    i = shuffle3(src, dest, n, swap_rb24_mask);
+    for (; i < n; i++) {
+        unsigned char r = src[i * 3];
+        dest[i * 3 + 1] = src[i * 3 + 1];
+        dest[i * 3]     = src[i * 3 + 2];
+        dest[i * 3 + 2] = r;
+    }
+}
@@ -0,0 +1,260 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zphoto.h>
+#include "config.h"
+
+/*
+ * libpng depended codes.
+ */
+#ifdef HAVE_LIBPNG
+#include <png.h>
+
+typedef struct {
+    const unsigned char *data;
+    size_t              size;
+    size_t              pos;
+} Reader;
+
+typedef struct {
+    unsigned char       *data;
+    size_t              size;
+    size_t              capacity;
+} Writer;
+
+static void
+read_data (png_structp png, png_bytep data, png_size_t length)
+{
+    Reader *reader = png_get_io_ptr(png);
+
+    if (reader->size - reader->pos < length)
+        png_error(png, "unexpected end of file");
+    memcpy(data, reader->data + reader->pos, length);
+    reader->pos += length;
+}
+
+static void
+write_data (png_structp png, png_bytep data, png_size_t length)
+{
+    Writer *writer = png_get_io_ptr(png);
+
+    if (writer->capacity - writer->size < length) {
+        unsigned char *new_data;
+        size_t capacity = writer->capacity * 2;
+
+        if (capacity < writer->size + length)
+            capacity = writer->size + length;
+#ifdef ZPHOTO_MEMSTAT
+        zphoto_memstat_note_free(writer->data);
+#endif
+        new_data = realloc(writer->data, capacity);
+        if (new_data == NULL)
+            png_error(png, "out of memory");
+#ifdef ZPHOTO_MEMSTAT
+        zphoto_memstat_note_alloc(new_data);
+#endif
+        writer->data     = new_data;
+        writer->capacity = capacity;
+    }
+    memcpy(writer->data + writer->size, data, length);
+    writer->size += length;
+}
+
+static void
+flush_data (png_structp png)
+{
+    /* nothing to do */
+}
+
+/*
+ * Called after each row is decoded or encoded.
+ */
+static void
+check_row (png_structp png, png_uint_32 row, int pass)
+{
+    if (zphoto_limit_pending_p())
+        png_error(png, "interrupted");
+}
+
+static void
+warning (png_structp png, png_const_charp message)
+{
+    /* suppress warnings on ancillary chunks */
+}
+
+/*
+ * Palette, low bit depth and 16-bit images are converted
+ * to 8-bit gray, gray+alpha, RGB or RGBA.  Returns NULL if
+ * the file is not a PNG or broken, so that the next codec
+ * is tried, or if the job is to stop.
+ */
+ZphotoBitmap *
+zphoto_png_decode (const char *file_name)
+{
+    png_structp png;
+    png_infop info;
+    ZphotoBitmap *volatile bitmap = NULL;
+    Reader reader;
+    png_bytep *volatile rows = NULL;
+    size_t size, rowlen;
+    unsigned char *input;
+    int y, color_type;
+
+    input = zphoto_map_file(file_name, &size);
+    if (size < 8 || png_sig_cmp(input, 0, 8) != 0) {
+        zphoto_unmap_file(input, size);
+        return NULL;
+    }
+
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, warning);
+    info = png_create_info_struct(png);
+    if (png == NULL || info == NULL)
+        zphoto_eprintf("%s: png_create_read_struct failed", file_name);
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        zphoto_unmap_file(input, size);
+        if (bitmap != NULL)
+            zphoto_bitmap_destroy(bitmap);
+        free(rows);
+        return NULL;
+    }
+
+    reader.data = input;
+    reader.size = size;
+    reader.pos  = 0;
+    png_set_read_fn(png, &reader, read_data);
+    png_set_read_status_fn(png, check_row);
+    png_read_info(png, info);
+    zphoto_metrics_note_input(size, png_get_image_width(png, info),
+                              png_get_image_height(png, info));
+
+    color_type = png_get_color_type(png, info);
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png);
+    if (color_type == PNG_COLOR_TYPE_GRAY &&
+        png_get_bit_depth(png, info) < 8)
+        png_set_expand_gray_1_2_4_to_8(png);
+    if (png_get_valid(png, info, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(png);
+    if (png_get_bit_depth(png, info) == 16)
+        png_set_strip_16(png);
+    png_set_packing(png);
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+
+    bitmap = zphoto_bitmap_new(png_get_image_width(png, info),
+                               png_get_image_height(png, info),
+                               png_get_channels(png, info));
+    rowlen = (size_t)bitmap->width * bitmap->channels;
+    assert(png_get_rowbytes(png, info) == rowlen);
+
+    rows = zphoto_emalloc(sizeof(png_bytep) * bitmap->height);
+    for (y = 0; y < bitmap->height; y++)
+        rows[y] = bitmap->data + rowlen * y;
+    png_read_image(png, rows);
+    png_read_end(png, NULL);
+
+    png_destroy_read_struct(&png, &info, NULL);
+    zphoto_unmap_file(input, size);
+    free(rows);
+    return bitmap;
+}
+
+/*
+ * Returns 0 if libpng fails or the job is to stop, leaving
+ * no file.
+ */
+int
+zphoto_png_encode (ZphotoBitmap *bitmap, const char *file_name)
+{
+    static const int color_types[] = {
+        PNG_COLOR_TYPE_GRAY,
+        PNG_COLOR_TYPE_GRAY_ALPHA,
+        PNG_COLOR_TYPE_RGB,
+        PNG_COLOR_TYPE_RGB_ALPHA
+    };
+    png_structp png;
+    png_infop info;
+    png_bytep *volatile rows = NULL;
+    Writer writer;
+    size_t rowlen = (size_t)bitmap->width * bitmap->channels;
+    int y;
+
+    writer.data     = NULL;
+    writer.size     = 0;
+    writer.capacity = 0;
+
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, warning);
+    info = png_create_info_struct(png);
+    if (png == NULL || info == NULL)
+        zphoto_eprintf("%s: png_create_write_struct failed", file_name);
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        free(writer.data);
+        free(rows);
+        return 0;  /* nothing is written */
+    }
+
+    png_set_write_fn(png, &writer, write_data, flush_data);
+    png_set_write_status_fn(png, check_row);
+    png_set_IHDR(png, info, bitmap->width, bitmap->height, 8,
+                 color_types[bitmap->channels - 1],
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+
+    rows = zphoto_emalloc(sizeof(png_bytep) * bitmap->height);
+    for (y = 0; y < bitmap->height; y++)
+        rows[y] = bitmap->data + rowlen * y;
+    png_set_rows(png, info, rows);
+    png_write_png(png, info, PNG_TRANSFORM_IDENTITY, NULL);
+
+    zphoto_write_file(file_name, writer.data, writer.size);
+    png_destroy_write_struct(&png, &info);
+    free(writer.data);
+    free(rows);
+    return 1;
+}
+
+/*
+ * libpng is not available.
+ */
+#else
+
+ZphotoBitmap *
+zphoto_png_decode (const char *file_name)
+{
+    assert(0); /* unsupported */
+    return NULL;
+}
+
+int
+zphoto_png_encode (ZphotoBitmap *bitmap, const char *file_name)
+{
+    assert(0); /* unsupported */
+    return 0;
+}
+
+#endif
@@ -0,0 +1,308 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Pool of page-aligned pixel buffers.
+ *
+ * Decoding and resizing thousands of photos of similar
+ * sizes allocates and frees the same large buffers over
+ * and over, and every fresh buffer has to be faulted in
+ * page by page.  Freed buffers are kept in a small
+ * per-thread cache instead and handed out again for
+ * requests of a similar size.  Sizes are rounded up to
+ * size classes (at most 25% apart) so that buffers are
+ * reused across photos whose sizes differ slightly.
+ *
+ * The cache is bounded in bytes as well, since the buffers
+ * it holds are not counted by the job scheduler: a bitmap
+ * of a large photo is cached, but not several of them, and
+ * an idle worker releases its cache.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zphoto.h>
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+enum {
+    POOL_NFREE      = 4,                  /* cached buffers per thread */
+    POOL_MAX_BYTES  = 64 * 1024 * 1024,   /* cached bytes per thread */
+    HUGE_PAGE_SIZE  = 2 * 1024 * 1024
+};
+
+/*
+ * Stored just before the data in the first page of each
+ * buffer.
+ */
+typedef struct {
+    void        *base;
+    size_t      size;  /* usable size */
+} BufferHeader;
+
+typedef struct {
+    BufferHeader *free_buffers[POOL_NFREE];
+    int          nfree;
+    size_t       nbytes;  /* cached */
+    int          huge_pages_p;
+} Pool;
+
+static size_t
+get_page_size (void)
+{
+    static size_t page_size = 0;
+
+    if (page_size == 0) {
+#ifdef _SC_PAGESIZE
+        long n = sysconf(_SC_PAGESIZE);
+        page_size = n > 0 ? n : 4096;
+#else
+        page_size = 4096;
+#endif
+    }
+    return page_size;
+}
+
+static size_t
+round_up (size_t n, size_t unit)
+{
+    return (n + unit - 1) / unit * unit;
+}
+
+/*
+ * Round size up to a size class.  Classes are multiples of
+ * the page size and at most 25% apart.
+ */
+static size_t
+size_class (size_t size)
+{
+    size_t step = get_page_size();
+
+    while (step * 8 <= size)
+        step *= 2;
+    return round_up(size, step);
+}
+
+static BufferHeader *
+buffer_new (Pool *pool, size_t size)
+{
+    void *base;
+    BufferHeader *header;
+    size_t page_size = get_page_size();
+    size_t alignment = page_size;
+
+    size = size_class(size);
+#ifdef MADV_HUGEPAGE
+    if (pool->huge_pages_p && size >= HUGE_PAGE_SIZE)
+        alignment = HUGE_PAGE_SIZE;
+#endif
+
+    /*
+     * The header occupies a page of its own so that the data
+     * are page aligned.
+     */
+#ifdef HAVE_POSIX_MEMALIGN
+    if (posix_memalign(&base, alignment, size + alignment) != 0)
+        zphoto_eprintf("posix_memalign failed: %lu bytes",
+                       (unsigned long)size);
+    header = (BufferHeader *)((char *)base + alignment) - 1;
+#ifdef ZPHOTO_MEMSTAT
+    zphoto_memstat_note_alloc(base);
+#endif
+#else
+    base = zphoto_emalloc(size + alignment * 2);
+    header = (BufferHeader *)
+        ((size_t)base + alignment * 2 - (size_t)base % alignment) - 1;
+#endif
+#ifdef MADV_HUGEPAGE
+    if (pool->huge_pages_p && size >= HUGE_PAGE_SIZE)
+        madvise(header + 1, size, MADV_HUGEPAGE);
+#endif
+
+    header->base = base;
+    header->size = size;
+    return header;
+}
+
+static void
+buffer_destroy (BufferHeader *header)
+{
+    free(header->base);
+}
+
+static void *
+buffer_data (BufferHeader *header)
+{
+    return header + 1;
+}
+
+static void
+pool_trim (Pool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->nfree; i++)
+        buffer_destroy(pool->free_buffers[i]);
+    pool->nfree = 0;
+    pool->nbytes = 0;
+}
+
+#ifdef HAVE_PTHREAD
+
+static pthread_key_t  pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+static void
+pool_destroy (void *data)
+{
+    Pool *pool = data;
+    pool_trim(pool);
+    free(pool);
+}
+
+static void
+create_pool_key (void)
+{
+    pthread_key_create(&pool_key, pool_destroy);
+}
+
+static Pool *
+get_pool (void)
+{
+    Pool *pool;
+
+    pthread_once(&pool_key_once, create_pool_key);
+    pool = pthread_getspecific(pool_key);
+    if (pool == NULL) {
+        pool = zphoto_emalloc(sizeof(Pool));
+        pool->nfree = 0;
+        pool->nbytes = 0;
+        pool->huge_pages_p = 0;
+        pthread_setspecific(pool_key, pool);
+    }
+    return pool;
+}
+
+#else
+
+static Pool *
+get_pool (void)
+{
+    static Pool pool = { { NULL }, 0, 0, 0 };
+    return &pool;
+}
+
+#endif
+
+/*
+ * Returns a page-aligned buffer of at least size bytes.
+ * The contents are undefined.  Release it with
+ * zphoto_pool_free().
+ */
+void *
+zphoto_pool_alloc (size_t size)
+{
+    int i, best = -1;
+    size_t wanted = size_class(size);
+    Pool *pool = get_pool();
+
+    /*
+     * Take the smallest cached buffer that fits without
+     * wasting more than half of it.
+     */
+    for (i = 0; i < pool->nfree; i++) {
+        size_t n = pool->free_buffers[i]->size;
+        if (n >= wanted && n - wanted <= n / 2 &&
+            (best < 0 || n < pool->free_buffers[best]->size))
+            best = i;
+    }
+    if (best >= 0) {
+        BufferHeader *header = pool->free_buffers[best];
+        pool->nbytes -= header->size;
+        pool->nfree--;
+        pool->free_buffers[best] = pool->free_buffers[pool->nfree];
+        return buffer_data(header);
+    }
+    return buffer_data(buffer_new(pool, size));
+}
+
+void
+zphoto_pool_free (void *ptr)
+{
+    BufferHeader *header;
+    Pool *pool;
+
+    if (ptr == NULL)
+        return;
+
+    header = (BufferHeader *)ptr - 1;
+    if (header->size > POOL_MAX_BYTES) {
+        buffer_destroy(header);
+        return;
+    }
+    pool = get_pool();
+    while (pool->nfree == POOL_NFREE ||
+           pool->nbytes + header->size > POOL_MAX_BYTES)
+    {
+        /* evict the oldest */
+        pool->nbytes -= pool->free_buffers[0]->size;
+        buffer_destroy(pool->free_buffers[0]);
+        memmove(pool->free_buffers, pool->free_buffers + 1,
+                sizeof(BufferHeader *) * (pool->nfree - 1));
+        pool->nfree--;
+    }
+    pool->free_buffers[pool->nfree++] = header;
+    pool->nbytes += header->size;
+}
+
+/*
+ * Release the buffers cached for the calling thread.
+ */
+void
+zphoto_pool_trim (void)
+{
+    pool_trim(get_pool());
+}
+
+/*
+ * Back large buffers allocated on this thread with
+ * transparent huge pages where available.
+ */
+void
+zphoto_pool_set_huge_pages (int huge_pages_p)
+{
+    get_pool()->huge_pages_p = huge_pages_p;
+}
+
+int
+zphoto_pool_get_huge_pages (void)
+{
+    return get_pool()->huge_pages_p;
+}
@@ -0,0 +1,372 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Sampling profiler for --profile.
+ *
+ * SIGPROF is delivered every 1/FREQUENCY second of CPU time
+ * used by the process, and the handler stores the stack of
+ * the interrupted thread with backtrace() into a buffer
+ * allocated beforehand, together with the task of the
+ * progress running then on that thread (see
+ * zphoto_progress_start()), which the workers of the job
+ * scheduler inherit.  Without __thread the task is of the
+ * whole process, so that samples of concurrent albums of
+ * --batch may be tagged with the task of another album.
+ * Nothing is allocated or locked in the handler.  The
+ * stacks are symbolized with dladdr() when written, as
+ * folded stacks for flamegraph.pl:
+ *
+ *   flash;main;zphoto_make_all;...;compileSWFActionCode 42
+ *
+ * Functions not exported (static ones, or those in the
+ * executable linked without -rdynamic) are written as
+ * FILE+0xOFFSET, which addr2line resolves.
+ */
+
+#define _GNU_SOURCE  /* for dladdr() */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zphoto.h>
+#include "config.h"
+
+#if defined(HAVE_EXECINFO_H) && defined(HAVE_BACKTRACE) && \
+    defined(HAVE_SETITIMER)
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <execinfo.h>
+#ifdef HAVE_DLADDR
+#include <dlfcn.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#define FREQUENCY    99         /* samples per second */
+#define MAX_DEPTH    64
+#define MAX_WORDS    (1 << 20)  /* 8MB on 64-bit hosts */
+#define MAX_STAGES   32
+#define STAGE_LENGTH 32
+
+/*
+ * Frames of the handler and the signal trampoline.
+ */
+#define SKIPPED_FRAMES 2
+
+/*
+ * A sample takes the stage, the depth and the frames,
+ * innermost first.  The depth is stored last, so that a
+ * sample is complete once its depth is set.  Samples are
+ * dropped when the buffer is full.
+ */
+static void  **words = NULL;
+static volatile int nwords = 0;
+static volatile int ndropped = 0;
+static volatile sig_atomic_t running_p = 0;
+static volatile int nhandlers = 0;  /* in the handler now */
+
+static char  stage_names[MAX_STAGES][STAGE_LENGTH];
+static int   nstages = 0;
+
+/*
+ * The initial-exec model keeps the handler from allocating
+ * the variable on the first access of a thread.
+ */
+#ifdef HAVE_TLS
+static __thread volatile sig_atomic_t current_stage
+    __attribute__((tls_model("initial-exec"))) = -1;  /* none */
+#else
+static volatile sig_atomic_t current_stage = -1;
+#endif
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t stage_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void
+handle_sigprof (int signum)
+{
+    void *frames[MAX_DEPTH + SKIPPED_FRAMES];
+    int saved_errno = errno;
+    int depth, start;
+
+    __sync_fetch_and_add(&nhandlers, 1);
+    if (running_p) {
+        depth = backtrace(frames, MAX_DEPTH + SKIPPED_FRAMES);
+        depth -= SKIPPED_FRAMES;
+        if (depth > 0) {
+            start = __sync_fetch_and_add(&nwords, depth + 2);
+            if (start + depth + 2 <= MAX_WORDS) {
+                words[start] = (void *)(long)current_stage;
+                memcpy(words + start + 2, frames + SKIPPED_FRAMES,
+                       sizeof(void *) * depth);
+                __atomic_store_n(&words[start + 1], (void *)(long)depth,
+                                 __ATOMIC_RELEASE);
+            } else {
+                __sync_fetch_and_add(&ndropped, 1);
+            }
+        }
+    }
+    __sync_fetch_and_sub(&nhandlers, 1);
+    errno = saved_errno;
+}
+
+static void
+set_timer (long usec)
+{
+    struct itimerval timer;
+
+    timer.it_interval.tv_sec  = 0;
+    timer.it_interval.tv_usec = usec;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) == -1)
+        zphoto_eprintf("setitimer:");
+}
+
+/*
+ * Start sampling the whole process.  Does nothing if
+ * already started.
+ */
+void
+zphoto_profile_start (void)
+{
+    struct sigaction action;
+    void *frame;
+
+    if (running_p)
+        return;
+    if (words == NULL)
+        words = zphoto_emalloc(sizeof(void *) * MAX_WORDS);
+    memset(words, 0, sizeof(void *) * MAX_WORDS);
+    nwords   = 0;
+    ndropped = 0;
+
+    /*
+     * The first call of backtrace() loads libgcc, which must
+     * not happen in the handler.
+     */
+    backtrace(&frame, 1);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_sigprof;
+    action.sa_flags   = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) == -1)
+        zphoto_eprintf("sigaction:");
+    running_p = 1;
+    set_timer(1000000 / FREQUENCY);
+}
+
+/*
+ * Returns after the handlers running on other threads are
+ * done with the buffer.
+ */
+void
+zphoto_profile_stop (void)
+{
+    if (!running_p)
+        return;
+    set_timer(0);
+    running_p = 0;
+    signal(SIGPROF, SIG_IGN);
+    __sync_synchronize();
+    while (nhandlers > 0)
+        sched_yield();
+}
+
+/*
+ * Tag the samples of this thread from now on with stage,
+ * or none if NULL.  Called with the task of the progress.
+ */
+void
+zphoto_profile_set_stage (const char *stage)
+{
+    int i;
+
+    if (stage == NULL) {
+        current_stage = -1;
+        return;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&stage_mutex);
+#endif
+    for (i = 0; i < nstages; i++) {
+        if (strcmp(stage_names[i], stage) == 0)
+            break;
+    }
+    if (i == nstages && nstages < MAX_STAGES) {
+        strncpy(stage_names[i], stage, STAGE_LENGTH - 1);
+        stage_names[i][STAGE_LENGTH - 1] = '\0';
+        nstages++;
+    }
+    current_stage = i < nstages ? i : -1;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&stage_mutex);
+#endif
+}
+
+/*
+ * The stage of this thread, or NULL for none.
+ */
+const char *
+zphoto_profile_get_stage (void)
+{
+    return current_stage >= 0 ? stage_names[current_stage] : NULL;
+}
+
+/*
+ * Return addresses but the innermost are looked up one
+ * byte back so that they fall in the calling function.
+ */
+static char *
+symbolize (void *address, int innermost_p)
+{
+    char *pc = (char *)address - (innermost_p ? 0 : 1);
+#ifdef HAVE_DLADDR
+    Dl_info info;
+
+    if (dladdr(pc, &info) != 0) {
+        if (info.dli_sname != NULL)
+            return zphoto_strdup(info.dli_sname);
+        if (info.dli_fname != NULL)
+            return zphoto_asprintf("%s+0x%lx",
+                                   zphoto_basename(info.dli_fname),
+                                   (unsigned long)(pc -
+                                                   (char *)info.dli_fbase));
+    }
+#endif
+    return zphoto_asprintf("%p", (void *)pc);
+}
+
+static char *
+fold_sample (void **sample, int depth, int stage)
+{
+    char *line = zphoto_strdup(stage >= 0 && stage < nstages ?
+                               stage_names[stage] : "none");
+    int i;
+
+    for (i = depth - 1; i >= 0; i--) {
+        char *name = symbolize(sample[i], i == 0);
+        char *tmp = zphoto_asprintf("%s;%s", line, name);
+
+        free(name);
+        free(line);
+        line = tmp;
+    }
+    return line;
+}
+
+static int
+compare_lines (const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Stop sampling and write the samples to file_name as
+ * folded stacks.
+ */
+void
+zphoto_profile_write (const char *file_name)
+{
+    char **lines = NULL;
+    int i, nlines = 0, end;
+    FILE *fp;
+
+    zphoto_profile_stop();
+    if (words == NULL)
+        return;
+
+    end = nwords < MAX_WORDS ? nwords : MAX_WORDS;
+    for (i = 0; i + 2 <= end; ) {
+        int depth = (int)(long)__atomic_load_n(&words[i + 1],
+                                               __ATOMIC_ACQUIRE);
+        int stage = (int)(long)words[i];
+
+        if (depth == 0 || i + 2 + depth > end)
+            break;  /* reserved by a late signal but not written */
+        lines = zphoto_erealloc(lines, sizeof(char *) * (nlines + 1));
+        lines[nlines++] = fold_sample(words + i + 2, depth, stage);
+        i += 2 + depth;
+    }
+    qsort(lines, nlines, sizeof(char *), compare_lines);
+
+    fp = zphoto_efopen(file_name, "w");
+    for (i = 0; i < nlines; ) {
+        int j = i + 1;
+
+        while (j < nlines && strcmp(lines[i], lines[j]) == 0)
+            j++;
+        fprintf(fp, "%s %d\n", lines[i], j - i);
+        i = j;
+    }
+    if (fclose(fp) == EOF)
+        zphoto_eprintf("%s:", file_name);
+
+    if (ndropped > 0)
+        zphoto_wprintf("%s: %d samples dropped; the buffer is full",
+                       file_name, ndropped);
+    for (i = 0; i < nlines; i++)
+        free(lines[i]);
+    free(lines);
+    free(words);
+    words = NULL;
+}
+
+/*
+ * Without backtrace() or setitimer().
+ */
+#else
+
+void
+zphoto_profile_start (void)
+{
+    zphoto_wprintf("profiling is not available on this system");
+}
+
+void
+zphoto_profile_stop (void)
+{
+}
+
+void
+zphoto_profile_set_stage (const char *stage)
+{
+}
+
+const char *
+zphoto_profile_get_stage (void)
+{
+    return NULL;
+}
+
+void
+zphoto_profile_write (const char *file_name)
+{
+}
+
+#endif
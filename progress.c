@@ -23,7 +23,6 @@
 #include <stdlib.h>
 #include <time.h>
 #include <assert.h>
-#include <setjmp.h>
 #include "zphoto.h"
 #include "config.h"
 
@@ -42,10 +41,38 @@ zphoto_progress_new (void)
     progress->func = progress_quiet;
     progress->data = NULL;
     progress->abort_p = 0;
+    progress->task = NULL;
+    progress->task_long = NULL;
+    progress->file_name = "";
+    progress->reason = NULL;
+    progress->current = 0;
+    progress->previous = 0;
+    progress->total = 0;
+    progress->is_finished = 0;
+    progress->start_seconds = zphoto_get_time();
 
     return progress;
 }
 
+/*
+ * The rate is the stage's running average, which the ETA
+ * assumes for the rest.
+ */
+static void
+notify (ZphotoProgress *progress, int event)
+{
+    progress->event   = event;
+    progress->elapsed = zphoto_get_time() - progress->start_seconds;
+    if (progress->elapsed > 0 && progress->current > 0) {
+        progress->rate = progress->current / progress->elapsed;
+        progress->eta  = (progress->total - progress->current) / progress->rate;
+    } else {
+        progress->rate = 0.0;
+        progress->eta  = -1.0;
+    }
+    progress->func(progress);
+}
+
 void
 zphoto_progress_start (ZphotoProgress *progress,
                        const char *task, const char *task_long, int total)
@@ -60,9 +87,11 @@ zphoto_progress_start (ZphotoProgress *progress,
     progress->is_finished = 0;
     progress->start_processer_time =  clock();
     progress->start_time = time(NULL);
+    progress->start_seconds = zphoto_get_time();
     progress->file_name = "";
+    zphoto_profile_set_stage(task);
 
-    zphoto_progress_set(progress, 0, "");
+    notify(progress, ZPHOTO_PROGRESS_START);
 }
 
 void
@@ -72,10 +101,13 @@ zphoto_progress_finish (ZphotoProgress *progress)
 
     progress->current     = progress->total;
     progress->is_finished = 1;
-    progress->func(progress);
+    notify(progress, ZPHOTO_PROGRESS_FINISH);
+    zphoto_profile_set_stage(NULL);
 
     free(progress->task);
     free(progress->task_long);
+    progress->task      = NULL;
+    progress->task_long = NULL;
 }
 
 void
@@ -84,7 +116,11 @@ zphoto_progress_destroy (ZphotoProgress *progress)
     free(progress);
 }
 
-void
+/*
+ * Returns 0 if aborted.  The caller should then release
+ * what it holds and return.
+ */
+int
 zphoto_progress_set (ZphotoProgress *progress, 
 		     int count, const char *file_name)
 {
@@ -92,19 +128,30 @@ zphoto_progress_set (ZphotoProgress *progress,
 
     progress->current = count;
     progress->file_name = file_name;
-    progress->func(progress);
+    notify(progress, ZPHOTO_PROGRESS_STEP);
     progress->previous = count;
 
-    /*
-     * FIXME: No consideration for resource handling.
-     * Some amount of memory will probably be leaked.
-     */
-    if (progress->abort_p) {
-        longjmp(progress->jmpbuf, 1);
-    }
+    return !progress->abort_p;
 }
 
 
+/*
+ * Report a file skipped in the stage (or out of any stage
+ * if progress->task is NULL).
+ */
+void
+zphoto_progress_error (ZphotoProgress *progress,
+                       const char *file_name, const char *reason)
+{
+    const char *saved_file_name = progress->file_name;
+
+    progress->file_name = file_name;
+    progress->reason    = reason;
+    notify(progress, ZPHOTO_PROGRESS_ERROR);
+    progress->file_name = saved_file_name;
+    progress->reason    = NULL;
+}
+
 void
 zphoto_progress_set_func (ZphotoProgress *progress, ZphotoProgressFunc func)
 {
@@ -117,6 +164,10 @@ zphoto_progress_set_data (ZphotoProgress *progress, void *data)
     progress->data = data;
 }
 
+/*
+ * May be called from another thread.  The running jobs
+ * notice it through their cancellation flag.
+ */
 void
 zphoto_progress_abort (ZphotoProgress *progress)
 {
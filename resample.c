@@ -0,0 +1,314 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Streaming (scanline-at-a-time) image resampler.
+ *
+ * Input rows are pushed one by one.  Each row is resampled
+ * horizontally right away and kept in a small ring buffer
+ * that is just large enough to hold the vertical filter
+ * support.  As soon as all the input rows needed for an
+ * output row are available, the output row is computed and
+ * handed to the callback.  Memory usage therefore depends
+ * on the image width only, not on the image height.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zphoto.h>
+#include "config.h"
+
+#define LANCZOS_SUPPORT 3.0
+
+typedef struct {
+    int   first;    /* index of the first source pixel */
+    int   n;        /* number of source pixels */
+    float *weights;
+} Contrib;
+
+struct _ZphotoResampler {
+    int         src_width;
+    int         src_height;
+    int         dst_width;
+    int         dst_height;
+    int         channels;
+
+    Contrib     *h_contribs;
+    Contrib     *v_contribs;
+
+    int         ring_size;
+    float       **ring;
+    int         nrows_in;
+    int         nrows_out;
+
+    unsigned char *out_row;
+    unsigned char gamma_table[256];
+
+    ZphotoResamplerFunc func;
+    void        *data;
+};
+
+static double
+sinc (double x)
+{
+    if (x == 0.0)
+        return 1.0;
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+static double
+lanczos (double x)
+{
+    if (x < 0.0)
+        x = -x;
+    if (x >= LANCZOS_SUPPORT)
+        return 0.0;
+    return sinc(x) * sinc(x / LANCZOS_SUPPORT);
+}
+
+static int
+clamp (int x, int lo, int hi)
+{
+    if (x < lo)
+        return lo;
+    if (x > hi)
+        return hi;
+    return x;
+}
+
+/*
+ * Calculate the filter weights for each destination pixel
+ * along one axis.  Source pixels outside of the image are
+ * folded onto the nearest edge pixel so that every
+ * contribution covers a contiguous range.
+ */
+static Contrib *
+make_contribs (int src_size, int dst_size)
+{
+    int i;
+    double scale   = (double)src_size / dst_size;
+    double fscale  = scale > 1.0 ? scale : 1.0;
+    double support = LANCZOS_SUPPORT * fscale;
+    Contrib *contribs = zphoto_emalloc(sizeof(Contrib) * dst_size);
+
+    for (i = 0; i < dst_size; i++) {
+        double center = (i + 0.5) * scale - 0.5;
+        int left  = (int)ceil(center - support);
+        int right = (int)floor(center + support);
+        int first = clamp(left,  0, src_size - 1);
+        int last  = clamp(right, 0, src_size - 1);
+        double total = 0.0;
+        int j;
+
+        contribs[i].first   = first;
+        contribs[i].n       = last - first + 1;
+        contribs[i].weights = zphoto_emalloc(sizeof(float) * contribs[i].n);
+        memset(contribs[i].weights, 0, sizeof(float) * contribs[i].n);
+
+        for (j = left; j <= right; j++) {
+            double w = lanczos((j - center) / fscale);
+            contribs[i].weights[clamp(j, 0, src_size - 1) - first] += w;
+            total += w;
+        }
+        if (total != 0.0) {
+            for (j = 0; j < contribs[i].n; j++)
+                contribs[i].weights[j] /= total;
+        }
+    }
+    return contribs;
+}
+
+static void
+destroy_contribs (Contrib *contribs, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        free(contribs[i].weights);
+    free(contribs);
+}
+
+static int
+max_contrib_size (Contrib *contribs, int n)
+{
+    int i, max = 0;
+    for (i = 0; i < n; i++) {
+        if (contribs[i].n > max)
+            max = contribs[i].n;
+    }
+    return max;
+}
+
+static void
+resample_row_horizontally (ZphotoResampler *resampler,
+                           const unsigned char *src,
+                           float *dst)
+{
+    int i, j, c;
+    int channels = resampler->channels;
+
+    for (i = 0; i < resampler->dst_width; i++) {
+        Contrib *contrib = &resampler->h_contribs[i];
+        const unsigned char *p = src + contrib->first * channels;
+        float sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+
+        for (j = 0; j < contrib->n; j++) {
+            float w = contrib->weights[j];
+            for (c = 0; c < channels; c++)
+                sum[c] += p[c] * w;
+            p += channels;
+        }
+        for (c = 0; c < channels; c++)
+            dst[i * channels + c] = sum[c];
+    }
+}
+
+static unsigned char
+to_byte (float x)
+{
+    if (x <= 0.0)
+        return 0;
+    if (x >= 255.0)
+        return 255;
+    return (unsigned char)(x + 0.5);
+}
+
+static void
+emit_row (ZphotoResampler *resampler)
+{
+    int i, j;
+    int channels = resampler->channels;
+    int rowlen = resampler->dst_width * channels;
+    int alpha_p = channels == 2 || channels == 4;
+    Contrib *contrib = &resampler->v_contribs[resampler->nrows_out];
+
+    for (i = 0; i < rowlen; i++) {
+        float sum = 0.0;
+        for (j = 0; j < contrib->n; j++) {
+            float *row = resampler->ring[(contrib->first + j) %
+                                         resampler->ring_size];
+            sum += row[i] * contrib->weights[j];
+        }
+        if (alpha_p && i % channels == channels - 1)
+            resampler->out_row[i] = to_byte(sum);  /* no gamma for alpha */
+        else
+            resampler->out_row[i] = resampler->gamma_table[to_byte(sum)];
+    }
+    resampler->func(resampler->out_row, resampler->nrows_out,
+                    resampler->data);
+    resampler->nrows_out++;
+}
+
+ZphotoResampler *
+zphoto_resampler_new (int src_width, int src_height,
+                      int dst_width, int dst_height,
+                      int channels,
+                      ZphotoResamplerFunc func,
+                      void *data)
+{
+    int i;
+    ZphotoResampler *resampler;
+
+    assert(src_width > 0 && src_height > 0);
+    assert(dst_width > 0 && dst_height > 0);
+    assert(channels >= 1 && channels <= 4);
+
+    resampler = zphoto_emalloc(sizeof(ZphotoResampler));
+    resampler->src_width  = src_width;
+    resampler->src_height = src_height;
+    resampler->dst_width  = dst_width;
+    resampler->dst_height = dst_height;
+    resampler->channels   = channels;
+    resampler->func       = func;
+    resampler->data       = data;
+    resampler->nrows_in   = 0;
+    resampler->nrows_out  = 0;
+
+    resampler->h_contribs = make_contribs(src_width,  dst_width);
+    resampler->v_contribs = make_contribs(src_height, dst_height);
+
+    /*
+     * The ring buffer only has to hold the rows covered by
+     * the vertical filter of a single output row.
+     */
+    resampler->ring_size = max_contrib_size(resampler->v_contribs,
+                                            dst_height);
+    resampler->ring = zphoto_emalloc(sizeof(float *) * resampler->ring_size);
+    resampler->ring[0] = zphoto_pool_alloc(sizeof(float) * dst_width *
+                                           channels * resampler->ring_size);
+    for (i = 1; i < resampler->ring_size; i++)
+        resampler->ring[i] = resampler->ring[i - 1] + dst_width * channels;
+    resampler->out_row = zphoto_pool_alloc(dst_width * channels);
+
+    for (i = 0; i < 256; i++)
+        resampler->gamma_table[i] = i;
+
+    return resampler;
+}
+
+void
+zphoto_resampler_set_gamma (ZphotoResampler *resampler, double gamma)
+{
+    int i;
+
+    /*
+     * Same curve as Imlib2's and ImageMagick's gamma
+     * correction.
+     */
+    assert(gamma > 0.0);
+    for (i = 0; i < 256; i++) {
+        double x = pow(i / 255.0, 1.0 / gamma) * 255.0;
+        resampler->gamma_table[i] = to_byte(x);
+    }
+}
+
+void
+zphoto_resampler_push_row (ZphotoResampler *resampler,
+                           const unsigned char *row)
+{
+    assert(resampler->nrows_in < resampler->src_height);
+
+    resample_row_horizontally(resampler, row,
+                              resampler->ring[resampler->nrows_in %
+                                              resampler->ring_size]);
+    resampler->nrows_in++;
+
+    while (resampler->nrows_out < resampler->dst_height) {
+        Contrib *contrib = &resampler->v_contribs[resampler->nrows_out];
+        if (contrib->first + contrib->n > resampler->nrows_in)
+            break;
+        emit_row(resampler);
+    }
+}
+
+void
+zphoto_resampler_destroy (ZphotoResampler *resampler)
+{
+    zphoto_pool_free(resampler->ring[0]);
+    free(resampler->ring);
+    zphoto_pool_free(resampler->out_row);
+    destroy_contribs(resampler->h_contribs, resampler->dst_width);
+    destroy_contribs(resampler->v_contribs, resampler->dst_height);
+    free(resampler);
+}
@@ -0,0 +1,368 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Memory-aware job scheduler.
+ *
+ * Each job comes with an estimate of its peak memory usage.
+ * A job is admitted only while the sum of the estimates of
+ * the running jobs stays within the memory limit.  When the
+ * next job in order does not fit, later (smaller) jobs that
+ * do fit are admitted instead, so small images fill in
+ * around large ones.  A job larger than the limit itself
+ * runs alone.
+ *
+ * Jobs run on worker threads.  The completion callback is
+ * always called on the caller's thread so that progress
+ * callbacks need not be thread-safe.  The jobs running on
+ * the workers of all the schedulers are counted so that a
+ * job can size its own parallelism to the idle CPUs.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zphoto.h>
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+enum {
+    JOB_PENDING,
+    JOB_RUNNING,
+    JOB_DONE
+};
+
+struct _ZphotoScheduler {
+    int         nworkers;
+    size_t      memory_limit;
+};
+
+ZphotoScheduler *
+zphoto_scheduler_new (int nworkers, size_t memory_limit)
+{
+    ZphotoScheduler *scheduler;
+
+    assert(nworkers > 0);
+    scheduler = zphoto_emalloc(sizeof(ZphotoScheduler));
+    scheduler->nworkers     = nworkers;
+    scheduler->memory_limit = memory_limit;
+    return scheduler;
+}
+
+void
+zphoto_scheduler_destroy (ZphotoScheduler *scheduler)
+{
+    free(scheduler);
+}
+
+/*
+ * Threads are not available.  Run the jobs one by one.
+ */
+#ifndef HAVE_PTHREAD
+
+int
+zphoto_scheduler_get_nbusy (void)
+{
+    return 0;
+}
+
+int
+zphoto_scheduler_run (ZphotoScheduler *scheduler,
+                      int njobs,
+                      const size_t *costs,
+                      ZphotoJobFunc func,
+                      ZphotoJobDoneFunc done,
+                      void *data)
+{
+    int i;
+
+    for (i = 0; i < njobs; i++) {
+        func(i, data);
+        if (!done(i, data))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * POSIX threads depended codes.
+ */
+#else
+
+typedef struct {
+    ZphotoScheduler     *scheduler;
+    int                 njobs;
+    const size_t        *costs;
+    char                *states;
+    int                 first_pending;
+    int                 nrunning;
+    size_t              memory_in_use;
+    int                 *finished;  /* queue of finished jobs */
+    int                 nfinished;
+    int                 cancel_p;
+
+    ZphotoJobFunc       func;
+    void                *data;
+    ZphotoMessageFunc   message_func;  /* inherited from the caller */
+    void                *message_data;
+    volatile int        *cancel_flag;
+    ZphotoTrace         *trace;
+    ZphotoMetrics       *metrics;
+    ZphotoMemfiles      *memfiles;
+    const char          *stage;  /* for memstat.c */
+    const char          *profile_stage;
+    int                 max_movie_frames;
+    int                 huge_pages_p;
+
+    pthread_mutex_t     mutex;
+    pthread_cond_t      admit_cond;
+    pthread_cond_t      done_cond;
+} Batch;
+
+static pthread_mutex_t nbusy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int nbusy = 0;
+
+static void
+add_busy (int delta)
+{
+    pthread_mutex_lock(&nbusy_mutex);
+    nbusy += delta;
+    pthread_mutex_unlock(&nbusy_mutex);
+}
+
+/*
+ * Returns the number of jobs running on the workers of all
+ * the schedulers.
+ */
+int
+zphoto_scheduler_get_nbusy (void)
+{
+    int n;
+
+    pthread_mutex_lock(&nbusy_mutex);
+    n = nbusy;
+    pthread_mutex_unlock(&nbusy_mutex);
+    return n;
+}
+
+static int
+has_pending_jobs_p (Batch *batch)
+{
+    while (batch->first_pending < batch->njobs &&
+           batch->states[batch->first_pending] != JOB_PENDING)
+        batch->first_pending++;
+    return batch->first_pending < batch->njobs;
+}
+
+/*
+ * Returns the id of the next job to be admitted or -1 if
+ * no pending job fits in the remaining budget.
+ */
+static int
+admit_job (Batch *batch)
+{
+    int i;
+    size_t limit = batch->scheduler->memory_limit;
+
+    if (batch->cancel_p || !has_pending_jobs_p(batch))
+        return -1;
+
+    for (i = batch->first_pending; i < batch->njobs; i++) {
+        size_t cost = batch->costs[i];
+
+        if (batch->states[i] != JOB_PENDING)
+            continue;
+        if (batch->nrunning == 0 ||
+            (batch->memory_in_use <= limit &&
+             cost <= limit - batch->memory_in_use))
+        {
+            batch->states[i] = JOB_RUNNING;
+            batch->nrunning++;
+            batch->memory_in_use += cost;
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void *
+worker (void *arg)
+{
+    Batch *batch = arg;
+
+    zphoto_set_thread_message_func(batch->message_func, batch->message_data);
+    zphoto_limit_set_cancel_flag(batch->cancel_flag);
+    zphoto_trace_set_current(batch->trace);
+    zphoto_trace_set_thread_name("worker");
+    zphoto_metrics_set_current(batch->metrics);
+    zphoto_memfiles_set_current(batch->memfiles);
+    zphoto_memstat_set_stage(batch->stage);
+    zphoto_profile_set_stage(batch->profile_stage);
+    zphoto_limit_set_movie_frames(batch->max_movie_frames);
+    zphoto_pool_set_huge_pages(batch->huge_pages_p);
+    pthread_mutex_lock(&batch->mutex);
+    while (1) {
+        int id = admit_job(batch);
+
+        if (id >= 0) {
+            pthread_mutex_unlock(&batch->mutex);
+            add_busy(1);
+            batch->func(id, batch->data);
+            add_busy(-1);
+            pthread_mutex_lock(&batch->mutex);
+
+            batch->states[id] = JOB_DONE;
+            batch->nrunning--;
+            batch->memory_in_use -= batch->costs[id];
+            batch->finished[batch->nfinished++] = id;
+            pthread_cond_signal(&batch->done_cond);
+            pthread_cond_broadcast(&batch->admit_cond);
+        } else if (batch->cancel_p || !has_pending_jobs_p(batch)) {
+            break;
+        } else {
+            zphoto_pool_trim();  /* not needed while waiting */
+            pthread_cond_wait(&batch->admit_cond, &batch->mutex);
+        }
+    }
+    pthread_mutex_unlock(&batch->mutex);
+    return NULL;
+}
+
+static void
+destroy_batch (Batch *batch)
+{
+    pthread_mutex_destroy(&batch->mutex);
+    pthread_cond_destroy(&batch->admit_cond);
+    pthread_cond_destroy(&batch->done_cond);
+    free(batch->finished);
+    free(batch->states);
+}
+
+int
+zphoto_scheduler_run (ZphotoScheduler *scheduler,
+                      int njobs,
+                      const size_t *costs,
+                      ZphotoJobFunc func,
+                      ZphotoJobDoneFunc done,
+                      void *data)
+{
+    int i, nreported = 0, nthreads, nworkers;
+    int *finished;
+    pthread_t *threads;
+    Batch batch;
+
+    if (njobs == 0)
+        return 1;
+
+    batch.scheduler     = scheduler;
+    batch.njobs         = njobs;
+    batch.costs         = costs;
+    batch.states        = zphoto_emalloc(njobs);
+    batch.first_pending = 0;
+    batch.nrunning      = 0;
+    batch.memory_in_use = 0;
+    batch.finished      = zphoto_emalloc(sizeof(int) * njobs);
+    batch.nfinished     = 0;
+    batch.cancel_p      = 0;
+    batch.func          = func;
+    batch.data          = data;
+    batch.message_func  = zphoto_get_thread_message_func(&batch.message_data);
+    batch.cancel_flag   = zphoto_limit_get_cancel_flag();
+    batch.trace         = zphoto_trace_get_current();
+    batch.metrics       = zphoto_metrics_get_current();
+    batch.memfiles      = zphoto_memfiles_get_current();
+    batch.stage         = zphoto_memstat_get_stage();
+    batch.profile_stage = zphoto_profile_get_stage();
+    batch.max_movie_frames = zphoto_limit_get_movie_frames();
+    batch.huge_pages_p  = zphoto_pool_get_huge_pages();
+    memset(batch.states, JOB_PENDING, njobs);
+    pthread_mutex_init(&batch.mutex, NULL);
+    pthread_cond_init(&batch.admit_cond, NULL);
+    pthread_cond_init(&batch.done_cond, NULL);
+
+    finished = zphoto_emalloc(sizeof(int) * njobs);
+    nthreads = scheduler->nworkers < njobs ? scheduler->nworkers : njobs;
+    threads  = zphoto_emalloc(sizeof(pthread_t) * nthreads);
+    for (nworkers = 0; nworkers < nthreads; nworkers++) {
+        if (pthread_create(&threads[nworkers], NULL, worker, &batch) != 0)
+            break;
+    }
+
+    /*
+     * The workers started share the jobs.  The batch is on
+     * this stack, so it is not left before they are joined.
+     */
+    if (nworkers == 0) {
+        destroy_batch(&batch);
+        free(threads);
+        free(finished);
+        zphoto_eprintf("pthread_create failed");
+    }
+
+    /*
+     * Report finished jobs on this thread.  Once the
+     * callback asks for cancellation, no more jobs are
+     * admitted and the running ones are waited for.
+     */
+    pthread_mutex_lock(&batch.mutex);
+    while (nreported < njobs) {
+        int n;
+
+        while (batch.nfinished == 0 &&
+               (batch.nrunning > 0 ||
+                (!batch.cancel_p && has_pending_jobs_p(&batch))))
+            pthread_cond_wait(&batch.done_cond, &batch.mutex);
+        if (batch.nfinished == 0)
+            break;  /* cancelled and drained */
+
+        n = batch.nfinished;
+        memcpy(finished, batch.finished, sizeof(int) * n);
+        batch.nfinished = 0;
+        pthread_mutex_unlock(&batch.mutex);
+
+        for (i = 0; i < n; i++) {
+            nreported++;
+            if (!batch.cancel_p && !done(finished[i], data)) {
+                pthread_mutex_lock(&batch.mutex);
+                batch.cancel_p = 1;
+                pthread_cond_broadcast(&batch.admit_cond);
+                pthread_mutex_unlock(&batch.mutex);
+            }
+        }
+        pthread_mutex_lock(&batch.mutex);
+    }
+    pthread_mutex_unlock(&batch.mutex);
+
+    for (i = 0; i < nworkers; i++)
+        pthread_join(threads[i], NULL);
+
+    destroy_batch(&batch);
+    free(threads);
+    free(finished);
+    return !batch.cancel_p;
+}
+
+#endif
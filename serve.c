@@ -0,0 +1,387 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/*
+ * Serve the album at http://127.0.0.1:PORT/ for --serve.
+ *
+ * Nothing is made in advance: each file is made by
+ * zphoto_make_file() on its first request and kept in the
+ * output directory, so the album can be looked at as soon
+ * as the photos are listed.  The Flash movie is made on
+ * its first request, with the previews and thumbnails it
+ * needs, since Ming writes it at once.  The zip file is
+ * not served.  Only GET and HEAD are answered, on the
+ * loopback interface, with a thread for each connection.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <zphoto.h>
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * For a client that stops sending or receiving.
+ */
+#define IO_TIMEOUT 30
+
+typedef struct {
+    Zphoto      *zphoto;
+    int         fd;
+} Connection;
+
+static const struct {
+    const char  *suffix;
+    const char  *type;
+} content_types[] = {
+    { ".html", "text/html" },
+    { ".css",  "text/css" },
+    { ".js",   "application/javascript" },
+    { ".swf",  "application/x-shockwave-flash" },
+    { ".jpg",  "image/jpeg" },
+    { ".jpeg", "image/jpeg" },
+    { ".png",  "image/png" },
+    { ".gif",  "image/gif" },
+    { ".avi",  "video/x-msvideo" },
+    { ".mov",  "video/quicktime" },
+    { ".mpg",  "video/mpeg" },
+    { ".mpeg", "video/mpeg" },
+    { NULL,    NULL }
+};
+
+static const char *
+get_content_type (const char *file_name)
+{
+    int i;
+
+    for (i = 0; content_types[i].suffix != NULL; i++) {
+        if (zphoto_strsuffixcasecmp(file_name, content_types[i].suffix) == 0)
+            return content_types[i].type;
+    }
+    if (strstr(file_name, ".html."))  /* multiview: index.html.ja */
+        return "text/html";
+    if (strstr(file_name, ".js."))
+        return "application/javascript";
+    return "application/octet-stream";
+}
+
+/*
+ * Returns false if the client is gone.
+ */
+static int
+send_all (int fd, const void *data, size_t size)
+{
+    const char *p = data;
+
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+static void
+send_status (int fd, int status, const char *message)
+{
+    char *response = zphoto_asprintf("HTTP/1.0 %d %s\r\n"
+                                     "Content-Type: text/plain\r\n"
+                                     "Content-Length: %lu\r\n"
+                                     "Connection: close\r\n"
+                                     "%s\r\n"
+                                     "%d %s\n",
+                                     status, message,
+                                     (unsigned long)strlen(message) + 5,
+                                     status == 405 ? "Allow: GET, HEAD\r\n" : "",
+                                     status, message);
+    send_all(fd, response, strlen(response));
+    free(response);
+}
+
+static void
+send_file (int fd, const char *file_name, int head_p)
+{
+    FILE *fp = fopen(file_name, "rb");
+    struct stat st;
+    char buf[BUFSIZ], *header;
+    size_t n;
+
+    if (fp == NULL || fstat(fileno(fp), &st) == -1) {
+        if (fp != NULL)
+            fclose(fp);
+        send_status(fd, 500, "Internal Server Error");
+        return;
+    }
+    header = zphoto_asprintf("HTTP/1.0 200 OK\r\n"
+                             "Content-Type: %s\r\n"
+                             "Content-Length: %lu\r\n"
+                             "Connection: close\r\n"
+                             "\r\n",
+                             get_content_type(file_name),
+                             (unsigned long)st.st_size);
+    if (send_all(fd, header, strlen(header)) && !head_p) {
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            if (!send_all(fd, buf, n))
+                break;
+        }
+    }
+    free(header);
+    fclose(fp);
+}
+
+/*
+ * Read the request line and the headers, which are
+ * ignored.  Returns false if they do not fit in buf.
+ */
+static int
+read_request (int fd, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    while (len < size - 1) {
+        ssize_t n = read(fd, buf + len, size - 1 - len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        len += n;
+        buf[len] = '\0';
+        if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n"))
+            return 1;
+    }
+    return 0;
+}
+
+static int
+hex_value (int c)
+{
+    if (isdigit(c))
+        return c - '0';
+    return tolower(c) - 'a' + 10;
+}
+
+/*
+ * Returns the name of the file relative to the output
+ * directory for the path of the URL, or NULL if it is
+ * malformed or goes out of the directory.
+ */
+static char *
+decode_path (const char *path)
+{
+    char *name, *p;
+    const char *segment;
+
+    if (path[0] != '/')
+        return NULL;
+    path++;
+    name = p = zphoto_emalloc(strlen(path) + sizeof("index.html"));
+    for (; *path != '\0' && *path != '?' && *path != '#'; path++) {
+        if (path[0] == '%' && isxdigit((unsigned char)path[1]) &&
+            isxdigit((unsigned char)path[2])) {
+            *p = hex_value((unsigned char)path[1]) * 16 +
+                hex_value((unsigned char)path[2]);
+            path += 2;
+            if (*p++ == '\0') {  /* %00 */
+                free(name);
+                return NULL;
+            }
+        } else {
+            *p++ = *path;
+        }
+    }
+    *p = '\0';
+    if (name[0] == '\0')
+        strcpy(name, "index.html");
+
+    for (segment = name; ; segment = p + 1) {
+        p = strchr(segment, '/');
+        if (strncmp(segment, "..", 2) == 0 &&
+            (segment[2] == '/' || segment[2] == '\0')) {
+            free(name);
+            return NULL;
+        }
+        if (p == NULL)
+            break;
+    }
+    return name;
+}
+
+static void
+serve_connection (Zphoto *zphoto, int fd)
+{
+    char request[BUFSIZ], *method, *path, *end, *name, *file_name;
+
+    if (!read_request(fd, request, sizeof(request))) {
+        send_status(fd, 400, "Bad Request");
+        return;
+    }
+    request[strcspn(request, "\r\n")] = '\0';
+    method = request;
+    path = strchr(method, ' ');
+    if (path == NULL) {
+        send_status(fd, 400, "Bad Request");
+        return;
+    }
+    *path++ = '\0';
+    end = strchr(path, ' ');
+    if (end != NULL)
+        *end = '\0';
+
+    if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) {
+        send_status(fd, 405, "Method Not Allowed");
+        return;
+    }
+    name = decode_path(path);
+    if (name == NULL) {
+        send_status(fd, 400, "Bad Request");
+        return;
+    }
+    file_name = zphoto_make_file(zphoto, name);
+    if (file_name == NULL) {
+        send_status(fd, 404, "Not Found");
+    } else {
+        send_file(fd, file_name, strcmp(method, "HEAD") == 0);
+        free(file_name);
+    }
+    free(name);
+}
+
+static void *
+connection_main (void *data)
+{
+    Connection *connection = data;
+
+    serve_connection(connection->zphoto, connection->fd);
+    close(connection->fd);
+    free(connection);
+    return NULL;
+}
+
+/*
+ * Serve the connection on a thread of its own if possible,
+ * so that a slow file does not hold up the others.
+ */
+static void
+start_connection (Zphoto *zphoto, int fd)
+{
+    Connection *connection = zphoto_emalloc(sizeof(Connection));
+    struct timeval tv;
+
+    tv.tv_sec  = IO_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    connection->zphoto = zphoto;
+    connection->fd     = fd;
+#ifdef HAVE_PTHREAD
+    {
+        pthread_t thread;
+        pthread_attr_t attr;
+        int failed_p;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        failed_p = pthread_create(&thread, &attr, connection_main, connection);
+        pthread_attr_destroy(&attr);
+        if (!failed_p)
+            return;
+    }
+#endif
+    connection_main(connection);
+}
+
+static int
+open_server (int port)
+{
+    struct sockaddr_in addr;
+    int fd, on = 1;
+
+    if (port > 65535)
+        zphoto_eprintf("invalid port: %d", port);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        zphoto_eprintf("socket:");
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        zphoto_eprintf("127.0.0.1:%d:", port);
+    if (listen(fd, SOMAXCONN) == -1)
+        zphoto_eprintf("127.0.0.1:%d:", port);
+    return fd;
+}
+
+/*
+ * Never returns.
+ */
+void
+zphoto_serve (ZphotoConfig *config)
+{
+    Zphoto *zphoto;
+    int fd;
+
+    if (config->nargs == 0)
+        zphoto_eprintf("no photos to serve");
+    if (config->output_tar[0] != '\0')
+        zphoto_eprintf("--output-tar cannot be used with --serve");
+    fd = open_server(config->serve);
+    signal(SIGPIPE, SIG_IGN);  /* from clients gone */
+
+    zphoto = zphoto_new(config);
+    zphoto_add_file_names(zphoto, config->args, config->nargs);
+    if (!config->quiet)
+        printf("%s: serving at http://127.0.0.1:%d/\n", config->output_dir,
+               config->serve);
+    fflush(stdout);
+
+    for (;;) {
+        int client_fd = accept(fd, NULL, NULL);
+
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            zphoto_eprintf("accept:");
+        }
+        start_connection(zphoto, client_fd);
+    }
+}
@@ -0,0 +1,198 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A streaming writer of POSIX ustar archives for
+ * --output-tar.  Files are written in one pass, header and
+ * contents, straight to the descriptor, so the archive can
+ * go to a pipe.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zphoto.h>
+#include "config.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define BLOCK_SIZE 512
+
+struct _ZphotoTar {
+    char        *file_name;
+    int         fd;
+    time_t      mtime;  /* of all the files */
+};
+
+typedef struct {
+    char        name[100];
+    char        mode[8];
+    char        uid[8];
+    char        gid[8];
+    char        size[12];
+    char        mtime[12];
+    char        checksum[8];
+    char        typeflag;
+    char        linkname[100];
+    char        magic[6];
+    char        version[2];
+    char        uname[32];
+    char        gname[32];
+    char        devmajor[8];
+    char        devminor[8];
+    char        prefix[155];
+    char        padding[12];
+} Header;
+
+static void
+write_all (ZphotoTar *tar, const void *data, size_t size)
+{
+    const char *p = data;
+
+    while (size > 0) {
+        ssize_t n = write(tar->fd, p, size);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            zphoto_eprintf("%s:", tar->file_name);
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+/*
+ * "-" is the standard output.
+ */
+ZphotoTar *
+zphoto_tar_new (const char *file_name)
+{
+    ZphotoTar *tar = zphoto_emalloc(sizeof(ZphotoTar));
+
+    if (strcmp(file_name, "-") == 0) {
+        tar->fd = STDOUT_FILENO;
+    } else {
+        tar->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                       0666);
+        if (tar->fd == -1)
+            zphoto_eprintf("%s:", file_name);
+    }
+    tar->file_name = zphoto_strdup(file_name);
+    tar->mtime     = time(NULL);
+    return tar;
+}
+
+/*
+ * Names longer than 100 bytes are split at a slash into
+ * the prefix and the name.
+ */
+static void
+set_name (Header *header, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p;
+
+    if (len <= sizeof(header->name)) {
+        memcpy(header->name, name, len);
+        return;
+    }
+    for (p = name + len - sizeof(header->name) - 1; p + 1 < name + len;
+         p++) {
+        if (*p == '/' && p > name &&
+            (size_t)(p - name) <= sizeof(header->prefix)) {
+            memcpy(header->prefix, name, p - name);
+            memcpy(header->name, p + 1, name + len - p - 1);
+            return;
+        }
+    }
+    zphoto_eprintf("%s: too long name for tar", name);
+}
+
+void
+zphoto_tar_add (ZphotoTar *tar, const char *name, const void *data,
+                size_t size)
+{
+    static const char zeros[BLOCK_SIZE];
+    Header header;
+    unsigned char *p;
+    unsigned int checksum = 0;
+    size_t i;
+
+    if ((unsigned long long)size >= 077777777777ULL)
+        zphoto_eprintf("%s: too large file for tar", name);
+
+    memset(&header, 0, sizeof(header));
+    set_name(&header, name);
+    sprintf(header.mode,  "%07o", 0644);
+    sprintf(header.uid,   "%07o", 0);
+    sprintf(header.gid,   "%07o", 0);
+    sprintf(header.size,  "%011llo", (unsigned long long)size);
+    sprintf(header.mtime, "%011lo", (unsigned long)tar->mtime);
+    header.typeflag = '0';
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+
+    memset(header.checksum, ' ', sizeof(header.checksum));
+    for (p = (unsigned char *)&header, i = 0; i < sizeof(header); i++)
+        checksum += p[i];
+    sprintf(header.checksum, "%06o", checksum);  /* and NUL, space */
+    header.checksum[7] = ' ';
+
+    write_all(tar, &header, sizeof(header));
+    write_all(tar, data, size);
+    if (size % BLOCK_SIZE != 0)
+        write_all(tar, zeros, BLOCK_SIZE - size % BLOCK_SIZE);
+}
+
+/*
+ * A ZphotoSinkFunc adding the files to the ZphotoTar given
+ * as sink_data.
+ */
+void
+zphoto_tar_sink (const char *file_name, const void *data, size_t size,
+                 void *sink_data)
+{
+    zphoto_tar_add(sink_data, file_name, data, size);
+}
+
+/*
+ * Write the end of the archive and close it.
+ */
+void
+zphoto_tar_close (ZphotoTar *tar)
+{
+    static const char zeros[BLOCK_SIZE * 2];
+
+    write_all(tar, zeros, sizeof(zeros));
+    if (tar->fd != STDOUT_FILENO && close(tar->fd) == -1)
+        zphoto_eprintf("%s:", tar->file_name);
+    free(tar->file_name);
+    free(tar);
+}
@@ -30,12 +30,41 @@
 #include <zphoto.h>
 #include "config.h"
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 struct _ZphotoTemplate {
     char *file_name;
     char *content;
     ZphotoAlist *alist;
 };
 
+/*
+ * Templates read so far.  They are read again only when
+ * modified, so that a long-running process (see watch.c)
+ * reads each of them once.
+ */
+typedef struct _Content Content;
+struct _Content {
+    char    *file_name;
+    time_t  mtime;
+    off_t   size;
+    char    *content;
+    Content *next;
+};
+
+static Content *contents = NULL;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t contents_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+typedef struct {
+    char   *data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
 static size_t
 get_file_size (const char *file_name)
 {
@@ -66,11 +95,63 @@ read_file (const char *file_name)
     return content;
 }
 
+/*
+ * Returns a newly created string.
+ */
+static char *
+get_content (const char *file_name)
+{
+    Content *c;
+    struct stat s;
+    char *content;
+
+    if (stat(file_name, &s) == -1)
+	zphoto_eprintf("%s:", file_name);
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&contents_mutex);
+#endif
+    for (c = contents; c != NULL; c = c->next) {
+        if (strcmp(c->file_name, file_name) == 0)
+            break;
+    }
+    if (c == NULL) {
+        c = zphoto_emalloc(sizeof(Content));
+        c->file_name = zphoto_strdup(file_name);
+        c->content   = NULL;
+        c->next      = contents;
+        contents     = c;
+    }
+    if (c->content == NULL || c->mtime != s.st_mtime || c->size != s.st_size) {
+        free(c->content);
+        c->content = read_file(file_name);
+        c->mtime   = s.st_mtime;
+        c->size    = s.st_size;
+    }
+    content = zphoto_strdup(c->content);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&contents_mutex);
+#endif
+    return content;
+}
+
+static void
+buffer_append (Buffer *buffer, const char *str, size_t length)
+{
+    if (buffer->length + length + 1 > buffer->capacity) {
+        while (buffer->length + length + 1 > buffer->capacity)
+            buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        buffer->data = zphoto_erealloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->length, str, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = '\0';
+}
+
 static char *
 substitute_region (ZphotoTemplate *template, 
 		   const char *start, 
-		   const char *end, 
-		   FILE *fp)
+		   const char *end)
 {
     int len;
     char *key, *value;
@@ -86,7 +167,7 @@ substitute_region (ZphotoTemplate *template,
 }
 
 static void
-substituting_print (ZphotoTemplate *template, FILE *fp)
+substituting_print (ZphotoTemplate *template, Buffer *buffer)
 {
     const char *p = template->content;
 
@@ -99,23 +180,56 @@ substituting_print (ZphotoTemplate *template, FILE *fp)
 		zphoto_eprintf("%s: unclosed brace at %d",
 			       template->file_name, p - template->content);
 	    
-	    value = substitute_region(template, p, q, fp);
+	    value = substitute_region(template, p, q);
 	    if (value)
-		fprintf(fp, "%s", value);
+		buffer_append(buffer, value, strlen(value));
 	    p = q + 1;
 	} else {
-	    fputc(*p, fp);
-	    p++;
+	    const char *q = strstr(p, "#{");
+	    size_t length = q ? (size_t)(q - p) : strlen(p);
+
+	    buffer_append(buffer, p, length);
+	    p += length;
 	}
     }
 }
 
+static int
+same_content_p (const char *file_name, const char *data, size_t length)
+{
+    struct stat s;
+    char *content;
+    int same_p;
+
+    if (stat(file_name, &s) == -1 || (size_t)s.st_size != length)
+        return 0;
+    content = read_file(file_name);
+    same_p = memcmp(content, data, length) == 0;
+    free(content);
+    return same_p;
+}
+
+/*
+ * An output file of the same contents is left alone, so
+ * that its modification time tells when it last changed.
+ */
 void
 zphoto_template_write (ZphotoTemplate *template, const char *output_file_name)
 {
-    FILE *fp = zphoto_efopen(output_file_name, "wb");
-    substituting_print(template, fp);
-    fclose(fp);
+    Buffer buffer = { NULL, 0, 0 };
+
+    zphoto_trace_begin("template", "template", output_file_name);
+    buffer_append(&buffer, "", 0);
+    substituting_print(template, &buffer);
+    if (!same_content_p(output_file_name, buffer.data, buffer.length)) {
+        FILE *fp = zphoto_efopen(output_file_name, "wb");
+
+        fwrite(buffer.data, 1, buffer.length, fp);
+        if (ferror(fp) || fclose(fp) == EOF)
+            zphoto_eprintf("%s:", output_file_name);
+    }
+    free(buffer.data);
+    zphoto_trace_end();
 }
 
 void
@@ -134,7 +248,7 @@ zphoto_template_new (const char *file_name)
     template = zphoto_emalloc(sizeof(ZphotoTemplate));
     template->file_name = zphoto_strdup(file_name);
     template->alist = NULL;
-    template->content = read_file(template->file_name);
+    template->content = get_content(template->file_name);
     return template;
 }
 
@@ -0,0 +1,340 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Timeline of stages and per-photo operations for --trace.
+ *
+ * Spans are recorded with zphoto_trace_begin() and
+ * zphoto_trace_end() into the trace current on the calling
+ * thread, which is inherited by the worker threads of the
+ * job scheduler like the message function.  Spans are
+ * timed into the current metrics (see metrics.c) with or
+ * without a trace.  The trace is written in the Chrome
+ * trace event format, which chrome://tracing and Perfetto
+ * read.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zphoto.h>
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+typedef struct {
+    char        phase;      /* 'B'egin, 'E'nd or 'M'etadata */
+    int         tid;
+    double      time;       /* in seconds from the start */
+    const char  *category;  /* static */
+    char        *name;
+    char        *file_name; /* may be NULL */
+} Event;
+
+struct _ZphotoTrace {
+    double      start_time;
+    Event       *events;
+    int         nevents;
+    int         capacity;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t mutex;
+#endif
+};
+
+/*
+ * Spans nested deeper than this are not timed.
+ */
+#define MAX_SPANS 32
+
+typedef struct {
+    const char  *category;  /* static */
+    const char  *name;      /* static */
+    double      start_time;
+    int         traced_p;   /* 'B' event is added */
+} Span;
+
+typedef struct {
+    ZphotoTrace *trace;
+    int         tid;
+    int         depth;  /* open spans */
+    Span        spans[MAX_SPANS];
+} ThreadTrace;
+
+static int last_tid = 0;
+
+#ifdef HAVE_PTHREAD
+
+static pthread_key_t   thread_key;
+static pthread_once_t  thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t tid_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+create_thread_key (void)
+{
+    pthread_key_create(&thread_key, free);
+}
+
+static int
+new_tid (void)
+{
+    int tid;
+
+    pthread_mutex_lock(&tid_mutex);
+    tid = ++last_tid;
+    pthread_mutex_unlock(&tid_mutex);
+    return tid;
+}
+
+static ThreadTrace *
+get_thread_trace (void)
+{
+    ThreadTrace *thread;
+
+    pthread_once(&thread_key_once, create_thread_key);
+    thread = pthread_getspecific(thread_key);
+    if (thread == NULL) {
+        thread = zphoto_emalloc(sizeof(ThreadTrace));
+        thread->trace = NULL;
+        thread->tid   = new_tid();
+        thread->depth = 0;
+        pthread_setspecific(thread_key, thread);
+    }
+    return thread;
+}
+
+#else
+
+static ThreadTrace *
+get_thread_trace (void)
+{
+    static ThreadTrace thread;
+
+    if (thread.tid == 0)
+        thread.tid = ++last_tid;
+    return &thread;
+}
+
+#endif
+
+ZphotoTrace *
+zphoto_trace_new (void)
+{
+    ZphotoTrace *trace = zphoto_emalloc(sizeof(ZphotoTrace));
+
+    trace->start_time = zphoto_get_time();
+    trace->events   = NULL;
+    trace->nevents  = 0;
+    trace->capacity = 0;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&trace->mutex, NULL);
+#endif
+    return trace;
+}
+
+void
+zphoto_trace_destroy (ZphotoTrace *trace)
+{
+    int i;
+
+    for (i = 0; i < trace->nevents; i++) {
+        free(trace->events[i].name);
+        free(trace->events[i].file_name);
+    }
+    free(trace->events);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&trace->mutex);
+#endif
+    free(trace);
+}
+
+static void
+add_event (ZphotoTrace *trace, char phase, int tid,
+           const char *category, const char *name, const char *file_name)
+{
+    Event *event;
+    double now = zphoto_get_time();
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&trace->mutex);
+#endif
+    if (trace->nevents == trace->capacity) {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 1024;
+        trace->events = zphoto_erealloc(trace->events,
+                                        sizeof(Event) * trace->capacity);
+    }
+    event = trace->events + trace->nevents++;
+    event->phase     = phase;
+    event->tid       = tid;
+    event->time      = now - trace->start_time;
+    event->category  = category;
+    event->name      = name ? zphoto_strdup(name) : NULL;
+    event->file_name = file_name ? zphoto_strdup(file_name) : NULL;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&trace->mutex);
+#endif
+}
+
+/*
+ * Record spans on this thread into trace, or nowhere if
+ * NULL.
+ */
+void
+zphoto_trace_set_current (ZphotoTrace *trace)
+{
+    get_thread_trace()->trace = trace;
+}
+
+ZphotoTrace *
+zphoto_trace_get_current (void)
+{
+    return get_thread_trace()->trace;
+}
+
+/*
+ * Name this thread in the timeline.
+ */
+void
+zphoto_trace_set_thread_name (const char *name)
+{
+    ThreadTrace *thread = get_thread_trace();
+
+    if (thread->trace != NULL)
+        add_event(thread->trace, 'M', thread->tid, NULL, name, NULL);
+}
+
+/*
+ * Open a span.  file_name is the photo it works on, or
+ * NULL.  category and name should be static strings.
+ */
+void
+zphoto_trace_begin (const char *category, const char *name,
+                    const char *file_name)
+{
+    ThreadTrace *thread = get_thread_trace();
+
+    if (thread->depth < MAX_SPANS) {
+        Span *span = thread->spans + thread->depth;
+        span->category   = category;
+        span->name       = name;
+        span->start_time = zphoto_get_time();
+        span->traced_p   = thread->trace != NULL;
+    }
+    if (thread->trace != NULL)
+        add_event(thread->trace, 'B', thread->tid, category, name, file_name);
+    thread->depth++;
+}
+
+void
+zphoto_trace_end (void)
+{
+    ThreadTrace *thread = get_thread_trace();
+    int traced_p = thread->trace != NULL;
+
+    if (thread->depth == 0)
+        return;
+    thread->depth--;
+    if (thread->depth < MAX_SPANS) {
+        Span *span = thread->spans + thread->depth;
+        zphoto_metrics_record_span(span->category, span->name,
+                                   zphoto_get_time() - span->start_time);
+        traced_p = span->traced_p;
+    }
+    if (traced_p && thread->trace != NULL)
+        add_event(thread->trace, 'E', thread->tid, NULL, NULL, NULL);
+}
+
+/*
+ * Used with zphoto_trace_unwind() to close the spans left
+ * open by a job that failed.
+ */
+int
+zphoto_trace_get_depth (void)
+{
+    return get_thread_trace()->depth;
+}
+
+void
+zphoto_trace_unwind (int depth)
+{
+    while (zphoto_trace_get_depth() > depth)
+        zphoto_trace_end();
+}
+
+static void
+write_event (FILE *fp, Event *event)
+{
+    double ts = event->time * 1000000;  /* in microseconds */
+    char *name, *file_name;
+
+    switch (event->phase) {
+    case 'B':
+        name = zphoto_escape_json(event->name);
+        fprintf(fp, "{\"name\":%s,\"cat\":\"%s\",\"ph\":\"B\",\"ts\":%.1f,"
+                "\"pid\":1,\"tid\":%d",
+                name, event->category, ts, event->tid);
+        if (event->file_name != NULL) {
+            file_name = zphoto_escape_json(event->file_name);
+            fprintf(fp, ",\"args\":{\"file\":%s}", file_name);
+            free(file_name);
+        }
+        fprintf(fp, "}");
+        free(name);
+        break;
+    case 'E':
+        fprintf(fp, "{\"ph\":\"E\",\"ts\":%.1f,\"pid\":1,\"tid\":%d}",
+                ts, event->tid);
+        break;
+    case 'M':
+        name = zphoto_escape_json(event->name);
+        fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":%s}}", event->tid, name);
+        free(name);
+        break;
+    default:
+        assert(0);
+    }
+}
+
+void
+zphoto_trace_write (ZphotoTrace *trace, const char *file_name)
+{
+    int i;
+    FILE *fp = zphoto_efopen(file_name, "w");
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&trace->mutex);
+#endif
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (i = 0; i < trace->nevents; i++) {
+        write_event(fp, trace->events + i);
+        fprintf(fp, i < trace->nevents - 1 ? ",\n" : "\n");
+    }
+    fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&trace->mutex);
+#endif
+    if (fclose(fp) == EOF)
+        zphoto_eprintf("%s:", file_name);
+}
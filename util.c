@@ -28,14 +28,34 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <utime.h>
 #include <assert.h>
+#include <fcntl.h>
 #include <zphoto.h>
 #include "config.h"
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 static char *packagename = PACKAGE;
 
+#if defined(__NetBSD__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+/*
+ * They have the declaration of vasprintf in stdio.h
+ */
+#else
+extern int vasprintf (char **ptr, const char *fmt, ...);
+#endif
+
 static void
 xprintf_console (const char *fmt, va_list args)
 {
@@ -53,18 +73,146 @@ xprintf_console (const char *fmt, va_list args)
 
 ZphotoXprintfFunc xprintf = xprintf_console;
 
+/*
+ * Messages are passed to xprintf unless a message function
+ * is set for the calling thread.  Zphoto sets its own while
+ * running so that concurrent albums report separately.
+ */
+typedef struct {
+    ZphotoMessageFunc   func;
+    void                *data;
+} MessageHandler;
+
+#ifdef HAVE_PTHREAD
+
+static pthread_key_t  handler_key;
+static pthread_once_t handler_key_once = PTHREAD_ONCE_INIT;
+
+static void
+create_handler_key (void)
+{
+    pthread_key_create(&handler_key, free);
+}
+
+static MessageHandler *
+get_handler (int create_p)
+{
+    MessageHandler *handler;
+
+    pthread_once(&handler_key_once, create_handler_key);
+    handler = pthread_getspecific(handler_key);
+    if (handler == NULL && create_p) {
+        handler = zphoto_emalloc(sizeof(MessageHandler));
+        handler->func = NULL;
+        handler->data = NULL;
+        pthread_setspecific(handler_key, handler);
+    }
+    return handler;
+}
+
+#else
+
+static MessageHandler *
+get_handler (int create_p)
+{
+    static MessageHandler handler = { NULL, NULL };
+    return &handler;
+}
+
+#endif
+
 void
 zphoto_set_xprintf (ZphotoXprintfFunc func)
 {
     xprintf = func;
 }
 
+/*
+ * func is NULL to use xprintf.
+ */
+void
+zphoto_set_thread_message_func (ZphotoMessageFunc func, void *data)
+{
+    MessageHandler *handler = get_handler(func != NULL);
+
+    if (handler != NULL) {
+        handler->func = func;
+        handler->data = data;
+    }
+}
+
+ZphotoMessageFunc
+zphoto_get_thread_message_func (void **data)
+{
+    MessageHandler *handler = get_handler(0);
+
+    if (handler == NULL) {
+        *data = NULL;
+        return NULL;
+    }
+    *data = handler->data;
+    return handler->func;
+}
+
+/*
+ * Format the message as xprintf_console() does.
+ */
+static char *
+format_error (const char *fmt, va_list args)
+{
+    char *message, *new_message;
+    int saved_errno = errno;
+
+    if (vasprintf(&message, fmt, args) == -1)
+        message = zphoto_strdup(fmt);
+#ifdef ZPHOTO_MEMSTAT
+    else
+        zphoto_memstat_note_alloc(message);
+#endif
+    if (fmt[0] != '\0' && fmt[strlen(fmt)-1] == ':') {
+        new_message = zphoto_asprintf("%s %s", message, strerror(saved_errno));
+        free(message);
+        message = new_message;
+    }
+    return message;
+}
+
+static void
+report (const char *fmt, va_list args)
+{
+    void *data;
+    ZphotoMessageFunc func = zphoto_get_thread_message_func(&data);
+
+    if (func != NULL) {
+        char *message = format_error(fmt, args);
+        func(message, data);
+        free(message);
+    } else {
+        xprintf(fmt, args);
+    }
+}
+
+/*
+ * Print the error and exit.  Inside zphoto_limit_run(),
+ * only the job is abandoned and the message is returned
+ * from it instead.
+ */
 void
 zphoto_eprintf (const char *fmt, ...)
 {
     va_list args;
+
+    if (zphoto_limit_trapped_p()) {
+        char *message;
+
+        va_start(args, fmt);
+        message = format_error(fmt, args);
+        va_end(args);
+        zphoto_limit_fail(message);
+    }
+
     va_start(args, fmt);
-    xprintf(fmt, args);
+    report(fmt, args);
     va_end(args);
     exit(2);
 }
@@ -75,18 +223,10 @@ zphoto_wprintf (const char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
-    xprintf(fmt, args);
+    report(fmt, args);
     va_end(args);
 }
 
-#if defined(__NetBSD__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-/*
- * They have the declaration of vasprintf in stdio.h
- */
-#else
-extern int vasprintf (char **ptr, const char *fmt, ...);
-#endif
-
 char *
 zphoto_asprintf (const char *fmt, ...)
 {
@@ -100,15 +240,26 @@ zphoto_asprintf (const char *fmt, ...)
 
     if (val == -1)
 	zphoto_eprintf("vasprintf of %s failed:", fmt);
+#ifdef ZPHOTO_MEMSTAT
+    zphoto_memstat_note_alloc(str);
+#endif
 
     return str;
 }
 
 
+/*
+ * In-memory files (see memfile.c) are opened for reading.
+ */
 FILE *
 zphoto_efopen (const char *file_name, const char *mode)
 {
-    FILE *fp = fopen(file_name, mode);
+    FILE *fp = NULL;
+
+    if (mode[0] == 'r' && strchr(mode, '+') == NULL)
+        fp = zphoto_memfile_open(file_name);
+    if (fp == NULL)
+        fp = fopen(file_name, mode);
     if (fp == NULL)
 	zphoto_eprintf("%s:", file_name);
     return fp;
@@ -120,9 +271,136 @@ zphoto_emalloc (size_t n)
     void *p = malloc(n);
     if (p == NULL)
 	zphoto_eprintf("malloc of %u bytes failed:", n);
+#ifdef ZPHOTO_MEMSTAT
+    zphoto_memstat_note_alloc(p);
+#endif
+    return p;
+}
+
+void *
+zphoto_erealloc (void *ptr, size_t n)
+{
+    void *p;
+
+#ifdef ZPHOTO_MEMSTAT
+    zphoto_memstat_note_free(ptr);
+#endif
+    p = realloc(ptr, n);
+    if (p == NULL)
+	zphoto_eprintf("realloc of %u bytes failed:", n);
+#ifdef ZPHOTO_MEMSTAT
+    zphoto_memstat_note_alloc(p);
+#endif
     return p;
 }
 
+/*
+ * Close fd and fail with the error that happened before.
+ */
+static void
+close_and_fail (int fd, const char *file_name)
+{
+    int saved_errno = errno;
+
+    close(fd);
+    errno = saved_errno;
+    zphoto_eprintf("%s:", file_name);
+}
+
+/*
+ * Map the whole file into memory for reading.  Falls back
+ * to reading it into a malloc'ed buffer where mmap is not
+ * available.  The bytes of in-memory files are returned as
+ * they are.  Release it with zphoto_unmap_file().
+ */
+void *
+zphoto_map_file (const char *file_name, size_t *size)
+{
+    struct stat st;
+    void *data;
+    const void *memory;
+    int fd;
+
+    if (zphoto_memfile_get(file_name, &memory, size, NULL)) {
+        if (*size == 0)
+            zphoto_eprintf("%s: empty file", file_name);
+        return (void *)memory;
+    }
+    fd = open(file_name, O_RDONLY | O_BINARY);
+
+    if (fd == -1)
+	zphoto_eprintf("%s:", file_name);
+    if (fstat(fd, &st) == -1)
+        close_and_fail(fd, file_name);
+    if (st.st_size == 0) {
+        close(fd);
+	zphoto_eprintf("%s: empty file", file_name);
+    }
+    *size = st.st_size;
+
+#ifdef HAVE_SYS_MMAN_H
+    data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        close_and_fail(fd, file_name);
+#ifdef MADV_SEQUENTIAL
+    madvise(data, *size, MADV_SEQUENTIAL);
+#endif
+#else
+    {
+        size_t n = 0;
+        data = zphoto_emalloc(*size);
+        while (n < *size) {
+            ssize_t nn = read(fd, (char *)data + n, *size - n);
+            if (nn <= 0) {
+                free(data);
+                close_and_fail(fd, file_name);
+            }
+            n += nn;
+        }
+    }
+#endif
+    close(fd);
+    return data;
+}
+
+void
+zphoto_unmap_file (void *data, size_t size)
+{
+    if (zphoto_memfile_data_p(data))
+        return;
+#ifdef HAVE_SYS_MMAN_H
+    munmap(data, size);
+#else
+    free(data);
+#endif
+}
+
+/*
+ * Write the data to the file with a single descriptor
+ * instead of going through stdio.
+ */
+void
+zphoto_write_file (const char *file_name, const void *data, size_t size)
+{
+    size_t n = 0;
+    int fd;
+
+    zphoto_trace_begin("io", "write", file_name);
+    fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd == -1)
+	zphoto_eprintf("%s:", file_name);
+    while (n < size) {
+        ssize_t nn = write(fd, (const char *)data + n, size - n);
+        if (nn <= 0)
+            close_and_fail(fd, file_name);
+        n += nn;
+    }
+    if (close(fd) == -1)
+	zphoto_eprintf("%s:", file_name);
+    zphoto_metrics_note_output(size);
+    zphoto_trace_end();
+}
+
 int
 zphoto_directory_p (const char *dir_name)
 {
@@ -134,6 +412,60 @@ zphoto_directory_p (const char *dir_name)
     }
 }
 
+/*
+ * Make dest refer to src: a hard link if possible, or a
+ * symbolic link otherwise.  In-memory files are copied.
+ * Returns 0 on failure.
+ */
+int
+zphoto_link_file (const char *src, const char *dest)
+{
+#ifdef __MINGW32__
+    return 0;
+#else
+    int ok;
+    char *path;
+
+    if (zphoto_memfile_get(src, NULL, NULL, NULL)) {
+        zphoto_copy_file(src, dest);
+        return 1;
+    }
+    if (link(src, dest) == 0)
+        return 1;
+    path = zphoto_expand_path(src, NULL);
+    ok = symlink(path, dest) == 0;
+    free(path);
+    return ok;
+#endif
+}
+
+/*
+ * Set the modification time of the file.  The access time
+ * is set to now.
+ */
+void
+zphoto_restore_mtime (const char *file_name, time_t mtime)
+{
+    struct utimbuf tb;
+
+    tb.actime  = time(NULL);
+    tb.modtime = mtime;
+    if (utime(file_name, &tb))
+	zphoto_eprintf("%s:", file_name);
+}
+
+/*
+ * Copy the contents of src to dest.
+ */
+void
+zphoto_copy_file (const char *src, const char *dest)
+{
+    size_t size;
+    void *data = zphoto_map_file(src, &size);
+
+    zphoto_write_file(dest, data, size);
+    zphoto_unmap_file(data, size);
+}
 
 #ifdef __MINGW32__
 #  define mkdir(dir_name, mode) mkdir(dir_name)
@@ -146,10 +478,72 @@ zphoto_mkdir (const char *dir_name)
 	    zphoto_eprintf("%s:", dir_name);
 }
 
+/*
+ * Make a new directory only we can use in $TMPDIR or /tmp.
+ * Free the result.
+ */
+char *
+zphoto_make_temp_dir (void)
+{
+    const char *tmp_dir = getenv("TMPDIR");
+    char *dir_name;
+
+    if (tmp_dir == NULL || tmp_dir[0] == '\0')
+        tmp_dir = "/tmp";
+#ifdef HAVE_MKDTEMP
+    dir_name = zphoto_asprintf("%s/zphoto.XXXXXX", tmp_dir);
+    if (mkdtemp(dir_name) == NULL)
+	zphoto_eprintf("%s:", dir_name);
+#else
+    dir_name = zphoto_asprintf("%s/zphoto.%d.%ld", tmp_dir, (int)getpid(),
+                               (long)time(NULL));
+    if (mkdir(dir_name, 0700) == -1)
+	zphoto_eprintf("%s:", dir_name);
+#endif
+    return dir_name;
+}
+
+#ifdef __MINGW32__
+#  define lstat(file_name, st) stat(file_name, st)
+#endif
+/*
+ * Remove the directory and everything in it.  Symbolic
+ * links are removed, not followed.
+ */
+void
+zphoto_remove_tree (const char *dir_name)
+{
+    DIR *dir = opendir(dir_name);
+    struct dirent *d;
+
+    if (dir == NULL)
+        return;
+    while ((d = readdir(dir))) {
+        char *d_name = zphoto_d_name_workaround(d);
+        char *file_name;
+        struct stat st;
+
+        if (strcmp(d_name, ".") == 0 || strcmp(d_name, "..") == 0)
+            continue;
+        file_name = zphoto_asprintf("%s/%s", dir_name, d_name);
+        if (lstat(file_name, &st) == 0 && S_ISDIR(st.st_mode))
+            zphoto_remove_tree(file_name);
+        else
+            remove(file_name);
+        free(file_name);
+    }
+    closedir(dir);
+    rmdir(dir_name);
+}
+
 time_t
 zphoto_get_mtime (const char *file_name)
 {
     struct stat sb;
+    time_t mtime;
+
+    if (zphoto_memfile_get(file_name, NULL, NULL, &mtime))
+        return mtime;
     if (stat(file_name, &sb))
 	zphoto_eprintf("%s:", file_name);
     return sb.st_mtime;
@@ -162,6 +556,9 @@ zphoto_strdup (const char *str)
     if (p == NULL) {
 	zphoto_eprintf("strdup failed:");
     }
+#ifdef ZPHOTO_MEMSTAT
+    zphoto_memstat_note_alloc(p);
+#endif
     return p;
 }
 
@@ -169,6 +566,8 @@ int
 zphoto_file_p (const char *file_name)
 {
     struct stat sb;
+    if (zphoto_memfile_get(file_name, NULL, NULL, NULL))
+        return 1;
     if (stat(file_name, &sb))
 	return 0;
     return S_ISREG(sb.st_mode);
@@ -199,14 +598,30 @@ zphoto_eopendir (const char *dir_name)
     return dir;
 }
 
+/*
+ * Returns a malloc'ed string of the local time formatted
+ * with strftime.
+ */
 char *
-zphoto_time_string (time_t time)
+zphoto_format_time (time_t time, const char *format)
 {
-    static char time_string[BUFSIZ];
+    char time_string[BUFSIZ];
     struct tm *tm;
-    tm = localtime(&time);
-    strftime(time_string, BUFSIZ, "%Y-%m-%d %H:%M:%S", tm);
-    return time_string;
+#ifdef HAVE_LOCALTIME_R
+    struct tm tm_buf;
+    tm = localtime_r(&time, &tm_buf);
+#else
+    tm = localtime(&time);  /* thread-local on Windows */
+#endif
+    if (tm == NULL || strftime(time_string, BUFSIZ, format, tm) == 0)
+        time_string[0] = '\0';
+    return zphoto_strdup(time_string);
+}
+
+char *
+zphoto_time_string (time_t time)
+{
+    return zphoto_format_time(time, "%Y-%m-%d %H:%M:%S");
 }
 
 char *
@@ -478,6 +893,8 @@ int
 zphoto_path_exist_p (const char *file_name)
 {
     struct stat st;
+    if (zphoto_memfile_get(file_name, NULL, NULL, NULL))
+        return 1;
     if (stat(file_name, &st) == 0) {
         return 1;
     } else {
@@ -778,6 +1195,31 @@ zphoto_expand_path (const char *path, const char *dir_name)
     }
 }
 
+/*
+ * Returns the supported files in dir_name, not hidden, as
+ * "DIR/NAME" in no particular order.
+ */
+char **
+zphoto_list_supported_files (const char *dir_name, int *nfiles)
+{
+    DIR *dir = zphoto_eopendir(dir_name);
+    struct dirent *d;
+    char **file_names = NULL;
+
+    *nfiles = 0;
+    while ((d = readdir(dir))) {
+        char *d_name = zphoto_d_name_workaround(d);
+
+        if (zphoto_dot_file_p(d_name) || !zphoto_supported_file_p(d_name))
+            continue;
+        file_names = zphoto_erealloc(file_names,
+                                     sizeof(char *) * (*nfiles + 1));
+        file_names[(*nfiles)++] = zphoto_asprintf("%s/%s", dir_name, d_name);
+    }
+    closedir(dir);
+    return file_names;
+}
+
 int
 zphoto_directory_empty_p (const char *dir_name)
 {
@@ -815,4 +1257,133 @@ zphoto_escape_url (const char *url)
     return new_url;
 }
 
+/*
+ * Returns str quoted as a JSON string.
+ */
+char *
+zphoto_escape_json (const char *str)
+{
+    const char *p;
+    char *new_str = zphoto_emalloc(strlen(str) * 6 + 3), *pp = new_str;
+
+    *pp++ = '"';
+    for (p = str; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\') {
+            *pp++ = '\\';
+            *pp++ = *p;
+        } else if ((unsigned char)*p < 0x20) {
+            sprintf(pp, "\\u%04x", (unsigned char)*p);
+            pp += 6;
+        } else {
+            *pp++ = *p;
+        }
+    }
+    *pp++ = '"';
+    *pp = '\0';
+    return new_str;
+}
+
+
+
+/*
+ * Wall-clock time in seconds.
+ */
+double
+zphoto_get_time (void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    if (x != y)
+        return x < y ? -1 : 1;
+    return 0;
+}
 
+void
+zphoto_sort_doubles (double *values, int n)
+{
+    qsort(values, n, sizeof(double), compare_doubles);
+}
+
+/*
+ * Nearest-rank p-th percentile (0-100) of n sorted values,
+ * or 0 if n is 0.
+ */
+double
+zphoto_percentile (const double *sorted, int n, double p)
+{
+    int rank;
+
+    if (n == 0)
+        return 0.0;
+    rank = (int)(p / 100 * n + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+    return sorted[rank - 1];
+}
+
+int
+zphoto_get_ncpus (void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0)
+        return n;
+#endif
+    return 1;
+}
+
+/*
+ * Returns 0 if unknown.
+ */
+size_t
+zphoto_get_physical_memory (void)
+{
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+    long npages    = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (npages > 0 && page_size > 0) {
+        double size = (double)npages * page_size;
+        return size < (double)(size_t)-1 ? (size_t)size : (size_t)-1;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Parse a size such as "512M" or "8G" (K, M, G and T are
+ * powers of 1024).  Returns 0 for an invalid string.
+ */
+size_t
+zphoto_parse_size (const char *str)
+{
+    char *end;
+    double size = strtod(str, &end);
+
+    if (end == str || size <= 0)
+        return 0;
+
+    switch (toupper((unsigned char)*end)) {
+    case 'T': size *= 1024.0;
+    case 'G': size *= 1024.0;
+    case 'M': size *= 1024.0;
+    case 'K': size *= 1024.0;
+        end++;
+        break;
+    }
+    if (toupper((unsigned char)*end) == 'B')
+        end++;
+    if (*end != '\0')
+        return 0;
+
+    return size < (double)(size_t)-1 ? (size_t)size : (size_t)-1;
+}
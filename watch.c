@@ -0,0 +1,340 @@
+/*
+ * zphoto - a zooming photo album generator.
+ *
+ * Copyright (C) 2002-2004  Satoru Takabayashi <satoru@namazu.org>
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Keep the album of a directory up to date for --watch.
+ *
+ * The album is made again whenever photos in the directory
+ * are added, changed or removed.  Changes are noticed with
+ * inotify where available, or by polling otherwise, and a
+ * burst of them is waited out (--watch-delay) before the
+ * album is made.  Most of the work is not done again:
+ * previews and thumbnails of unchanged photos come from the
+ * cache (DIR/.zphoto-cache unless --cache-dir is given),
+ * templates are read once and HTML files of the same
+ * contents are not rewritten.  The Flash movie is made
+ * again as a whole.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zphoto.h>
+#include "config.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <sys/select.h>
+#endif
+
+typedef struct {
+    char        *file_name;
+    time_t      mtime;
+    off_t       size;
+} Entry;
+
+/*
+ * Supported files in the directory and the caption file,
+ * in the order of file names.
+ */
+typedef struct {
+    Entry       *entries;
+    int         nentries;
+} Snapshot;
+
+static int
+compare_entries (const void *a, const void *b)
+{
+    const Entry *x = a, *y = b;
+    return strcmp(x->file_name, y->file_name);
+}
+
+static void
+add_entry (Snapshot *snapshot, char *file_name)
+{
+    struct stat st;
+    Entry *entry;
+
+    if (stat(file_name, &st) == -1 || !S_ISREG(st.st_mode)) {
+        free(file_name);  /* removed meanwhile */
+        return;
+    }
+    snapshot->entries = zphoto_erealloc(snapshot->entries, sizeof(Entry) *
+                                        (snapshot->nentries + 1));
+    entry = snapshot->entries + snapshot->nentries++;
+    entry->file_name = file_name;
+    entry->mtime     = st.st_mtime;
+    entry->size      = st.st_size;
+}
+
+static void
+take_snapshot (Snapshot *snapshot, ZphotoConfig *config)
+{
+    char **file_names;
+    int i, nfiles;
+
+    snapshot->entries  = NULL;
+    snapshot->nentries = 0;
+    file_names = zphoto_list_supported_files(config->watch, &nfiles);
+    for (i = 0; i < nfiles; i++)
+        add_entry(snapshot, file_names[i]);
+    free(file_names);
+
+    if (config->caption_file[0] != '\0')
+        add_entry(snapshot, zphoto_strdup(config->caption_file));
+    qsort(snapshot->entries, snapshot->nentries, sizeof(Entry),
+          compare_entries);
+}
+
+static void
+free_snapshot (Snapshot *snapshot)
+{
+    int i;
+
+    for (i = 0; i < snapshot->nentries; i++)
+        free(snapshot->entries[i].file_name);
+    free(snapshot->entries);
+    snapshot->entries  = NULL;
+    snapshot->nentries = 0;
+}
+
+static int
+same_snapshot_p (Snapshot *a, Snapshot *b)
+{
+    int i;
+
+    if (a->nentries != b->nentries)
+        return 0;
+    for (i = 0; i < a->nentries; i++) {
+        Entry *x = a->entries + i, *y = b->entries + i;
+        if (strcmp(x->file_name, y->file_name) != 0 ||
+            x->mtime != y->mtime || x->size != y->size)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Returns true if a file in a was changed or is not in b.
+ */
+static int
+files_gone_p (Snapshot *a, Snapshot *b)
+{
+    int i;
+
+    for (i = 0; i < a->nentries; i++) {
+        Entry *found = bsearch(a->entries + i, b->entries, b->nentries,
+                               sizeof(Entry), compare_entries);
+        if (found == NULL || found->mtime != a->entries[i].mtime ||
+            found->size != a->entries[i].size)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Make the album of the photos in snapshot.  previous, the
+ * album made last time, is destroyed.
+ */
+static Zphoto *
+update_album (ZphotoConfig *config, Snapshot *snapshot, Snapshot *built,
+              Zphoto *previous)
+{
+    Zphoto *zphoto;
+    char **file_names;
+    int i, nfiles = 0;
+    double start_time = zphoto_get_time();
+
+    /*
+     * zip adds and replaces the entries but does not
+     * delete them.
+     */
+    if (files_gone_p(built, snapshot)) {
+        char *zip_file_name = zphoto_asprintf("%s/%s", config->output_dir,
+                                              config->zip_filename);
+        remove(zip_file_name);
+        free(zip_file_name);
+    }
+
+    file_names = zphoto_emalloc(sizeof(char *) * (snapshot->nentries + 1));
+    for (i = 0; i < snapshot->nentries; i++) {
+        if (strcmp(snapshot->entries[i].file_name, config->caption_file) != 0)
+            file_names[nfiles++] = snapshot->entries[i].file_name;
+    }
+
+    zphoto = zphoto_new(config);
+    zphoto_add_file_names(zphoto, file_names, nfiles);
+    zphoto_make_all(zphoto);
+    if (previous != NULL) {
+        zphoto_remove_stale_files(zphoto, previous);
+        zphoto_destroy(previous);
+    }
+    free(file_names);
+
+    if (!config->quiet)
+        printf("%s: %d files, %.1f seconds\n", config->output_dir,
+               nfiles, zphoto_get_time() - start_time);
+    fflush(stdout);
+    return zphoto;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+static int
+open_watcher (const char *dir_name)
+{
+    int fd = inotify_init();
+
+    if (fd == -1)
+        zphoto_eprintf("inotify_init:");
+    if (inotify_add_watch(fd, dir_name,
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                          IN_DELETE | IN_ATTRIB |
+                          IN_DELETE_SELF | IN_MOVE_SELF) == -1)
+        zphoto_eprintf("%s:", dir_name);
+    return fd;
+}
+
+/*
+ * Returns true if an event on a file but hidden ones comes
+ * within timeout seconds, or forever if negative.
+ */
+static int
+read_events (int fd, const char *dir_name, double timeout)
+{
+    union {
+        struct inotify_event event;  /* for the alignment */
+        char bytes[BUFSIZ * 4];
+    } buf;
+    struct timeval tv;
+    fd_set fds;
+    ssize_t n;
+    int i, changed_p = 0;
+
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    tv.tv_sec  = (long)timeout;
+    tv.tv_usec = (long)((timeout - tv.tv_sec) * 1000000);
+    if (select(fd + 1, &fds, NULL, NULL, timeout < 0 ? NULL : &tv) <= 0)
+        return 0;
+
+    n = read(fd, buf.bytes, sizeof(buf.bytes));
+    if (n == -1) {
+        if (errno == EINTR)
+            return 0;
+        zphoto_eprintf("inotify:");
+    }
+    for (i = 0; i < n; ) {
+        struct inotify_event *event = (struct inotify_event *)(buf.bytes + i);
+
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+            zphoto_eprintf("%s: removed", dir_name);
+        if (event->len > 0 && event->name[0] != '.')
+            changed_p = 1;
+        i += sizeof(struct inotify_event) + event->len;
+    }
+    return changed_p;
+}
+
+static void
+wait_for_changes (int fd, ZphotoConfig *config, Snapshot *built)
+{
+    while (!read_events(fd, config->watch, -1))
+        ;
+    while (read_events(fd, config->watch, config->watch_delay))
+        ;
+}
+
+#else
+
+static int
+open_watcher (const char *dir_name)
+{
+    return -1;
+}
+
+/*
+ * Wait until the directory differs from built and stays
+ * the same for the delay, while the files are written.
+ */
+static void
+wait_for_changes (int fd, ZphotoConfig *config, Snapshot *built)
+{
+    Snapshot last, current;
+    unsigned int delay = config->watch_delay < 1 ? 1 : config->watch_delay;
+
+    take_snapshot(&last, config);
+    for (;;) {
+        sleep(delay);
+        take_snapshot(&current, config);
+        if (same_snapshot_p(&current, &last) &&
+            !same_snapshot_p(&current, built))
+            break;
+        free_snapshot(&last);
+        last = current;
+    }
+    free_snapshot(&current);
+    free_snapshot(&last);
+}
+
+#endif
+
+/*
+ * Never returns.
+ */
+void
+zphoto_watch (ZphotoConfig *config)
+{
+    Snapshot built = { NULL, 0 };
+    Zphoto *zphoto = NULL;
+    int fd;
+
+    if (!zphoto_path_exist_p(config->watch))
+        zphoto_eprintf("%s:", config->watch);
+    if (config->output_tar[0] != '\0')
+        zphoto_eprintf("--output-tar cannot be used with --watch");
+    if (config->cache_dir[0] == '\0') {
+        char *cache_dir = zphoto_asprintf("%s/.zphoto-cache", config->watch);
+
+        zphoto_config_set(config, "cache_dir", cache_dir);
+        free(cache_dir);
+    }
+    fd = open_watcher(config->watch);
+
+    for (;;) {
+        Snapshot current;
+
+        take_snapshot(&current, config);
+        if (!same_snapshot_p(&current, &built)) {
+            zphoto = update_album(config, &current, &built, zphoto);
+            free_snapshot(&built);
+            built = current;
+        } else {
+            free_snapshot(&current);
+        }
+        wait_for_changes(fd, config, &built);
+    }
+}
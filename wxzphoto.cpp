@@ -774,12 +774,14 @@ void wxZphotoInfoContentLabel::Update(wxZphotoSubject* subject)
 
         time_t time = zphoto_image_get_time(filename.c_str(),
                                             no_exif);
+        char *time_string = zphoto_time_string(time);
         char *info = zphoto_asprintf("%dx%d\n%s", 
                                      size.GetWidth(), size.GetHeight(), 
-                                     zphoto_time_string(time));
+                                     time_string);
         SetLabel(info);
         Show();
         free(info);
+        free(time_string);
     } else {
         Hide();
     }
@@ -1107,19 +1109,18 @@ void wxZphotoPanel::ClearPreview(wxDC &dc)
     dc.DrawRectangle(0, 0, previewWidth, previewHeight);
 }
 
-wxBitmap* wxZphotoPanel::ResizeImage(wxBitmap bitmap)
+wxBitmap* wxZphotoPanel::ResizeImage(wxImage image)
 {
     int resizedWidth, resizedHeight;
-    if (bitmap.GetWidth() > bitmap.GetHeight()) {
-        double scale  = (double)previewWidth / bitmap.GetWidth();
+    if (image.GetWidth() > image.GetHeight()) {
+        double scale  = (double)previewWidth / image.GetWidth();
         resizedWidth  = previewWidth;
-        resizedHeight = (int)((double)bitmap.GetHeight() * scale);
+        resizedHeight = (int)((double)image.GetHeight() * scale);
     } else {
-        double scale  = (double)previewHeight / bitmap.GetHeight();
-        resizedWidth  = (int)((double)bitmap.GetWidth() * scale);
+        double scale  = (double)previewHeight / image.GetHeight();
+        resizedWidth  = (int)((double)image.GetWidth() * scale);
         resizedHeight = previewHeight;
     }
-    wxImage image = bitmap.ConvertToImage();
     return new wxBitmap(image.Scale(resizedWidth, resizedHeight));
 }
 
@@ -1160,16 +1161,16 @@ wxSize wxZphotoPanel::GetOriginalSize()
     return *size;
 }
 
-wxBitmap GetBitmap (wxString filename)
+// The image is scaled before it is converted to a bitmap.
+wxImage GetImage (wxString filename)
 {
     if (zphoto_movie_file_p(filename.c_str())) {
         int width, height;
         unsigned char *bare_bitmap = 
             zphoto_image_get_bitmap(filename.c_str(), &width, &height);
-        wxImage image = wxImage(width, height, bare_bitmap, FALSE);
-        return wxBitmap(image);
+        return wxImage(width, height, bare_bitmap, FALSE);
     } else {
-        return wxBitmap(filename, wxBITMAP_TYPE_ANY);
+        return wxImage(filename, wxBITMAP_TYPE_ANY);
     }
 }
 
@@ -1183,11 +1184,11 @@ void wxZphotoPanel::OnPaint(wxPaintEvent &event)
         if (thumbnail == NULL) {
             wxString filename = GetInputFileName();
             DrawLoadingMessage(dc);
-            wxBitmap bitmap = GetBitmap(filename);
-            thumbnail = ResizeImage(bitmap);
+            wxImage image = GetImage(filename);
+            thumbnail = ResizeImage(image);
             thumbnails.Put(filename.c_str(), thumbnail);
 
-            wxSize *size = new wxSize(bitmap.GetWidth(), bitmap.GetHeight());
+            wxSize *size = new wxSize(image.GetWidth(), image.GetHeight());
             originalSizes.Put(filename.c_str(), (wxObject *)size);
         }
         ClearPreview(dc);
@@ -1684,6 +1685,8 @@ progress_gui (ZphotoProgress *progress)
 {
     wxZphotoProgressDialog *dialog =
         (wxZphotoProgressDialog *)progress->data;
+    if (progress->event == ZPHOTO_PROGRESS_ERROR)  /* shown as a warning */
+        return;
     dialog->UpdateStatus(progress);
     wxTheApp->Yield();
 }
@@ -172,7 +172,7 @@ public:
     void SetPreviewSize(int width, int height);
     void ClearPreview(wxDC &dc);
     void DrawLoadingMessage(wxDC &dc);
-    wxBitmap* ResizeImage(wxBitmap bitmap);
+    wxBitmap* ResizeImage(wxImage image);
     bool IsInputFileSelected();
     wxString GetInputFileName();
     wxBitmap* GetThumbnail();
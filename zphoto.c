@@ -32,9 +32,21 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <zphoto.h>
-#include <setjmp.h>
 #include "config.h"
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * A photo skipped because of an error.
+ */
+typedef struct {
+    char        *file_name;
+    const char  *stage;
+    char        *reason;
+} Failure;
+
 struct _Zphoto {
     ZphotoConfig *config;
 
@@ -43,28 +55,527 @@ struct _Zphoto {
     char        **output_photos;
     char        **original_photos;
     time_t      *time_stamps;
+    uint64_t    *hashes;       /* of the contents, 0 if not hashed */
+    int         *content_ids;  /* shared by photos of the same contents */
     char        **thumbnails;
     char        **html_file_names;
     char        **photo_captions;
     char        **html_captions;
 
     ZphotoProgress *progress;
+    size_t      memory_limit;
+    ZphotoCache *cache;        /* NULL if not used */
+    ZphotoTrace *trace;        /* NULL if not used */
+    ZphotoMetrics *metrics;
+    double      last_progress_time;  /* of the last jsonl event */
+
+    int         nfailures;
+    Failure     *failures;
+
+    ZphotoMemfiles *memfiles;  /* NULL if no photos are in memory */
+    char        **made_files;  /* the rest of the outputs */
+    int         nmade_files;
+    ZphotoSinkFunc sink_func;
+    void        *sink_data;
+    int         sending_p;     /* zphoto_make_all() is passing the files */
+    unsigned char *sent_p;     /* the files of the photo are passed */
+    int         *preview_widths;   /* of the previews removed once passed */
+    int         *preview_heights;
+    ZphotoTar   *tar;          /* NULL unless --output-tar */
+    char        *scratch_dir;  /* where the files are made for the tar */
+    const char  *output_dir;   /* of the config, or the scratch dir */
+
+    unsigned char *file_states;  /* of zphoto_make_file() */
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t file_mutex;
+    pthread_cond_t  file_cond;
+#endif
+
+    ZphotoMessageFunc message_func;
+    void        *message_data;
 };
 
+/*
+ * Per-thread settings saved while an album is working.
+ */
+typedef struct {
+    ZphotoMessageFunc   message_func;
+    void                *message_data;
+    volatile int        *cancel_flag;
+    ZphotoTrace         *trace;
+    ZphotoMetrics       *metrics;
+    ZphotoMemfiles      *memfiles;
+    int                 max_movie_frames;
+    int                 huge_pages_p;
+} ThreadState;
+
+/*
+ * Used if the physical memory size is unknown.
+ */
+#define DEFAULT_MEMORY_LIMIT (256 * 1024 * 1024)
+
+typedef struct {
+    Zphoto              *zphoto;
+    ZphotoImageCopier   *copier;
+    char                **output_file_names;
+    char                **progress_file_names;
+    const char          *stage;
+    char                **failures;  /* reasons of skipped photos */
+    int                 *primaries;  /* the first of the same contents */
+    uint64_t            *cache_keys; /* 0 if not cached */
+    int                 send_p;      /* pass the photos as they are done */
+    int                 ndone;
+} CopyJobs;
+
 static void
-make_flash (Zphoto *zphoto)
+copy_image (int i, void *data)
+{
+    CopyJobs *jobs = data;
+    Zphoto *zphoto = jobs->zphoto;
+    const char *dest = jobs->output_file_names[i];
+    uint64_t key = jobs->cache_keys[i];
+
+    if (jobs->primaries[i] != i)  /* done with the primary */
+        return;
+    zphoto_trace_begin("photo", jobs->stage, zphoto->input_photos[i]);
+    if (key != 0 &&
+        zphoto_cache_fetch(zphoto->cache, key, zphoto_get_suffix(dest), dest))
+    {
+        zphoto_restore_mtime(dest, zphoto->time_stamps[i]);
+        zphoto_metrics_note_backend("cache");
+        zphoto_trace_end();
+        return;
+    }
+
+    zphoto_image_copier_copy(jobs->copier, zphoto->input_photos[i], dest,
+                             zphoto->time_stamps[i]);
+    if (key != 0 && !zphoto_limit_pending_p())
+        zphoto_cache_store(zphoto->cache, key, zphoto_get_suffix(dest), dest);
+    zphoto_trace_end();
+}
+
+static void
+copy_job (int i, void *data)
+{
+    CopyJobs *jobs = data;
+    Zphoto *zphoto = jobs->zphoto;
+
+    if (jobs->primaries[i] != i)  /* done with the primary */
+        return;
+    zphoto_metrics_begin_photo(zphoto->input_photos[i], jobs->stage);
+    jobs->failures[i] = zphoto_limit_run(zphoto->config->max_decode_time,
+                                         copy_image, i, data);
+    zphoto_metrics_end_photo(jobs->failures[i] != NULL);
+}
+
+static void send_made_photo (Zphoto *zphoto, int i);
+
+static int
+copy_job_done (int i, void *data)
+{
+    CopyJobs *jobs = data;
+    ZphotoProgress *progress = jobs->zphoto->progress;
+
+    /*
+     * The running jobs stop by themselves.  No more jobs
+     * are admitted.
+     */
+    if (progress->abort_p)
+        return 0;
+
+    if (jobs->send_p && jobs->primaries[i] == i && jobs->failures[i] == NULL)
+        send_made_photo(jobs->zphoto, i);
+    jobs->ndone++;
+    return zphoto_progress_set(progress, jobs->ndone,
+                               zphoto_basename(jobs->progress_file_names[i]));
+}
+
+/*
+ * While the album is working, the messages on this thread
+ * are routed to the album's message function, zphoto_abort()
+ * cancels the jobs through the cancellation flag, the
+ * spans are recorded in the album's trace and metrics, its
+ * in-memory files are looked up and its limits on movie
+ * frames and huge pages apply.  The job scheduler passes
+ * them on to the worker threads.
+ */
+static void
+enter_album (Zphoto *zphoto, ThreadState *saved)
+{
+    saved->message_func = 
+        zphoto_get_thread_message_func(&saved->message_data);
+    saved->cancel_flag = zphoto_limit_get_cancel_flag();
+    saved->trace = zphoto_trace_get_current();
+    saved->metrics = zphoto_metrics_get_current();
+    saved->memfiles = zphoto_memfiles_get_current();
+    saved->max_movie_frames = zphoto_limit_get_movie_frames();
+    saved->huge_pages_p = zphoto_pool_get_huge_pages();
+    if (zphoto->message_func != NULL)
+        zphoto_set_thread_message_func(zphoto->message_func,
+                                       zphoto->message_data);
+    zphoto_limit_set_cancel_flag(&zphoto->progress->abort_p);
+    zphoto_trace_set_current(zphoto->trace);
+    zphoto_trace_set_thread_name("main");
+    zphoto_metrics_set_current(zphoto->metrics);
+    zphoto_memfiles_set_current(zphoto->memfiles);
+    zphoto_limit_set_movie_frames(zphoto->config->max_movie_frames);
+    zphoto_pool_set_huge_pages(zphoto->config->huge_pages);
+}
+
+static void
+leave_album (ThreadState *saved)
+{
+    zphoto_set_thread_message_func(saved->message_func, saved->message_data);
+    zphoto_limit_set_cancel_flag(saved->cancel_flag);
+    zphoto_trace_set_current(saved->trace);
+    zphoto_metrics_set_current(saved->metrics);
+    zphoto_memfiles_set_current(saved->memfiles);
+    zphoto_limit_set_movie_frames(saved->max_movie_frames);
+    zphoto_pool_set_huge_pages(saved->huge_pages_p);
+}
+
+/*
+ * The lock of the files being made by zphoto_make_file()
+ * and of the list of made files.
+ */
+static void
+lock_files (Zphoto *zphoto)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&zphoto->file_mutex);
+#endif
+}
+
+static void
+unlock_files (Zphoto *zphoto)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&zphoto->file_mutex);
+#endif
+}
+
+/*
+ * Report a skipped file, record it for --failure-report
+ * and link it into the quarantine directory if specified.
+ */
+static void
+skip_file (Zphoto *zphoto,
+           const char *file_name,
+           const char *stage,
+           const char *reason)
+{
+    ZphotoConfig *config = zphoto->config;
+    Failure *failure;
+    char *quarantined_file_name;
+
+    zphoto_wprintf("%s: %s; skipped", file_name, reason);
+    zphoto_progress_error(zphoto->progress, file_name, reason);
+
+    zphoto->failures = zphoto_erealloc(zphoto->failures, sizeof(Failure) *
+                                       (zphoto->nfailures + 1));
+    failure = zphoto->failures + zphoto->nfailures;
+    failure->file_name = zphoto_strdup(file_name);
+    failure->stage     = stage;
+    failure->reason    = zphoto_strdup(reason);
+    zphoto->nfailures++;
+
+    if (config->quarantine_dir[0] == '\0')
+        return;
+
+    zphoto_mkdir(config->quarantine_dir);
+    quarantined_file_name = zphoto_asprintf("%s/%s", config->quarantine_dir,
+                                            zphoto_basename(file_name));
+    if (!zphoto_path_exist_p(quarantined_file_name) &&
+        !zphoto_link_file(file_name, quarantined_file_name))
+        zphoto_wprintf("%s: cannot quarantine", file_name);
+    free(quarantined_file_name);
+}
+
+static void
+remove_item (void *array, size_t size, int i, int n)
+{
+    char *p = array;
+    memmove(p + size * i, p + size * (i + 1), size * (n - i - 1));
+}
+
+/*
+ * Remove the i-th photo from the album with the files
+ * already made for it.
+ */
+static void
+remove_photo (Zphoto *zphoto, int i)
+{
+    int n = zphoto->nphotos;
+
+    remove(zphoto->output_photos[i]);
+    remove(zphoto->thumbnails[i]);
+    if (zphoto->config->include_original)
+        remove(zphoto->original_photos[i]);
+
+    free(zphoto->input_photos[i]);
+    free(zphoto->output_photos[i]);
+    free(zphoto->original_photos[i]);
+    free(zphoto->thumbnails[i]);
+    free(zphoto->html_file_names[i]);
+    free(zphoto->photo_captions[i]);
+    free(zphoto->html_captions[i]);
+
+    remove_item(zphoto->input_photos,    sizeof(char *), i, n);
+    remove_item(zphoto->output_photos,   sizeof(char *), i, n);
+    remove_item(zphoto->original_photos, sizeof(char *), i, n);
+    remove_item(zphoto->thumbnails,      sizeof(char *), i, n);
+    remove_item(zphoto->html_file_names, sizeof(char *), i, n);
+    remove_item(zphoto->photo_captions,  sizeof(char *), i, n);
+    remove_item(zphoto->html_captions,   sizeof(char *), i, n);
+    remove_item(zphoto->time_stamps,     sizeof(time_t), i, n);
+    remove_item(zphoto->content_ids,     sizeof(int),    i, n);
+    remove_item(zphoto->hashes,          sizeof(uint64_t), i, n);
+    remove_item(zphoto->sent_p,          sizeof(unsigned char), i, n);
+    remove_item(zphoto->preview_widths,  sizeof(int),    i, n);
+    remove_item(zphoto->preview_heights, sizeof(int),    i, n);
+    zphoto->nphotos--;
+}
+
+/*
+ * Returns the index of the first photo of the same
+ * contents for each photo.
+ */
+static int *
+find_primaries (Zphoto *zphoto)
+{
+    int i, max_id = 0;
+    int *primaries = zphoto_emalloc(sizeof(int) * zphoto->nphotos);
+    int *firsts;
+
+    for (i = 0; i < zphoto->nphotos; i++) {
+        if (zphoto->content_ids[i] > max_id)
+            max_id = zphoto->content_ids[i];
+    }
+    firsts = zphoto_emalloc(sizeof(int) * (max_id + 1));
+    for (i = 0; i <= max_id; i++)
+        firsts[i] = -1;
+    for (i = 0; i < zphoto->nphotos; i++) {
+        int id = zphoto->content_ids[i];
+        if (firsts[id] == -1)
+            firsts[id] = i;
+        primaries[i] = firsts[id];
+    }
+    free(firsts);
+    return primaries;
+}
+
+/*
+ * Make dest the same file as src: a hard link if possible,
+ * or a copy otherwise.
+ */
+static void
+share_output (const char *src, const char *dest)
+{
+    if (strcmp(src, dest) == 0)
+        return;
+    remove(dest);
+#ifndef __MINGW32__
+    if (link(src, dest) == 0)
+        return;
+#endif
+    zphoto_copy_file(src, dest);
+}
+
+/*
+ * Returns the key of the output in the cache, or 0 if it
+ * is not to be cached.
+ */
+static uint64_t
+get_cache_key (Zphoto *zphoto, ZphotoImageCopier *copier, int i,
+               const char *dest)
+{
+    char *description;
+    uint64_t key;
+
+    if (zphoto->cache == NULL || zphoto->hashes[i] == 0 ||
+        zphoto_get_suffix(dest) == NULL)
+        return 0;
+    description = zphoto_image_copier_describe(copier,
+                                               zphoto->input_photos[i], dest);
+    if (description == NULL)  /* a plain copy */
+        return 0;
+    key = zphoto_hash(description, strlen(description), zphoto->hashes[i]);
+    free(description);
+    return key;
+}
+
+/*
+ * Copy the input photos to output_file_names concurrently.
+ * The peak memory of each job is estimated from the image
+ * header and the jobs are admitted within the memory limit.
+ * Photos that fail or exceed the per-file limits are
+ * removed from the album.  With send_p, the files of each
+ * photo are passed to the sink as soon as it is done.
+ */
+static void
+copy_images (Zphoto *zphoto,
+             ZphotoImageCopier *copier,
+             char **output_file_names,
+             char **progress_file_names,
+             const char *stage,
+             int send_p)
+{
+    int i;
+    CopyJobs jobs;
+    size_t *costs = zphoto_emalloc(sizeof(size_t) * zphoto->nphotos);
+    ZphotoScheduler *scheduler = 
+        zphoto_scheduler_new(zphoto_get_ncpus(), zphoto->memory_limit);
+
+    jobs.primaries  = find_primaries(zphoto);
+    jobs.cache_keys = zphoto_emalloc(sizeof(uint64_t) * zphoto->nphotos);
+    for (i = 0; i < zphoto->nphotos; i++) {
+        jobs.cache_keys[i] = get_cache_key(zphoto, copier, i,
+                                           output_file_names[i]);
+        if (jobs.primaries[i] != i)
+            costs[i] = 0;
+        else if (jobs.cache_keys[i] != 0 &&
+                 zphoto_cache_lookup(zphoto->cache, jobs.cache_keys[i],
+                                     zphoto_get_suffix(output_file_names[i])))
+            costs[i] = BUFSIZ;
+        else
+            costs[i] = zphoto_image_copier_estimate_memory(
+                copier, zphoto->input_photos[i], output_file_names[i]);
+    }
+    jobs.zphoto = zphoto;
+    jobs.copier = copier;
+    jobs.output_file_names   = output_file_names;
+    jobs.progress_file_names = progress_file_names;
+    jobs.stage  = stage;
+    jobs.send_p = send_p;
+    jobs.failures = zphoto_emalloc(sizeof(char *) * zphoto->nphotos);
+    jobs.ndone  = 0;
+    memset(jobs.failures, 0, sizeof(char *) * zphoto->nphotos);
+
+    zphoto_scheduler_run(scheduler, zphoto->nphotos, costs,
+                         copy_job, copy_job_done, &jobs);
+    zphoto_scheduler_destroy(scheduler);
+    free(costs);
+    free(jobs.cache_keys);
+    zphoto_pool_trim();  /* worker threads release theirs on exit */
+
+    if (zphoto->progress->abort_p) {  /* cancelled, not failed */
+        for (i = 0; i < zphoto->nphotos; i++)
+            free(jobs.failures[i]);
+        free(jobs.failures);
+        free(jobs.primaries);
+        return;
+    }
+
+    /*
+     * Photos of the same contents share the outputs of the
+     * first one, or its failure.
+     */
+    for (i = 0; i < zphoto->nphotos; i++) {
+        int primary = jobs.primaries[i];
+        if (primary == i)
+            continue;
+        if (jobs.failures[primary] != NULL) {
+            jobs.failures[i] = zphoto_strdup(jobs.failures[primary]);
+        } else {
+            share_output(output_file_names[primary], output_file_names[i]);
+            if (send_p)
+                send_made_photo(zphoto, i);
+        }
+    }
+    free(jobs.primaries);
+
+    /*
+     * Backward to keep the indices of the rest valid.  The
+     * failures are recorded in reverse order.
+     */
+    for (i = zphoto->nphotos - 1; i >= 0; i--) {
+        if (jobs.failures[i] != NULL) {
+            skip_file(zphoto, zphoto->input_photos[i], stage,
+                      jobs.failures[i]);
+            remove_photo(zphoto, i);
+            free(jobs.failures[i]);
+        }
+    }
+    free(jobs.failures);
+}
+
+static void
+check_thumbnail (int i, void *data)
+{
+    Zphoto *zphoto = data;
+    int width, height;
+
+    if (!zphoto_image_read_header(zphoto->thumbnails[i], &width, &height))
+        zphoto_eprintf("%s: broken thumbnail", zphoto->thumbnails[i]);
+}
+
+/*
+ * The flash movie is laid out for the number of photos, so
+ * photos whose thumbnails cannot be loaded are removed
+ * before making it.
+ */
+static void
+check_thumbnails (Zphoto *zphoto)
+{
+    int i;
+
+    for (i = zphoto->nphotos - 1; i >= 0; i--) {
+        char *reason = zphoto_limit_run(0, check_thumbnail, i, zphoto);
+        if (reason != NULL) {
+            skip_file(zphoto, zphoto->input_photos[i], "flash", reason);
+            remove_photo(zphoto, i);
+            free(reason);
+        }
+    }
+}
+
+/*
+ * Record file_name, an output other than those of the
+ * photos, for the sink.  Takes file_name.
+ */
+static void
+add_made_file (Zphoto *zphoto, char *file_name)
+{
+    int i;
+
+    lock_files(zphoto);
+    for (i = 0; i < zphoto->nmade_files; i++) {
+        if (strcmp(zphoto->made_files[i], file_name) == 0) {
+            free(file_name);  /* made again by zphoto_make_step() */
+            unlock_files(zphoto);
+            return;
+        }
+    }
+    zphoto->made_files = zphoto_erealloc(zphoto->made_files, sizeof(char *) *
+                                         (zphoto->nmade_files + 1));
+    zphoto->made_files[zphoto->nmade_files++] = file_name;
+    unlock_files(zphoto);
+}
+
+/*
+ * Make the flash movie of the photos given, which may be
+ * a part of the album.
+ */
+static void
+make_flash_of (Zphoto *zphoto,
+               char **output_photos,
+               char **thumbnails,
+               char **html_file_names,
+               char **photo_captions,
+               time_t *time_stamps,
+               int nphotos)
 {
     ZphotoConfig *config = zphoto->config;
     char *output_file_name = zphoto_asprintf("%s/%s",
-					     config->output_dir,
+					     zphoto->output_dir,
 					     config->flash_filename);
     ZphotoFlashMaker *maker = zphoto_flash_maker_new(
-        zphoto->output_photos,
-        zphoto->thumbnails, 
-        zphoto->html_file_names,
-        zphoto->photo_captions,
-        zphoto->time_stamps,
-        zphoto->nphotos,
+        output_photos,
+        thumbnails, 
+        html_file_names,
+        photo_captions,
+        time_stamps,
+        nphotos,
         config->movie_nsamples,
         config->flash_width,
         config->flash_height,
@@ -93,42 +604,40 @@ make_flash (Zphoto *zphoto)
 
     zphoto_flash_maker_make(maker, output_file_name, zphoto->progress);
     zphoto_flash_maker_destroy(maker);
-    free(output_file_name);
+    add_made_file(zphoto, output_file_name);
 }
 
 static void
-make_thumbnails (Zphoto *zphoto)
+make_flash (Zphoto *zphoto)
+{
+    make_flash_of(zphoto, zphoto->output_photos, zphoto->thumbnails,
+                  zphoto->html_file_names, zphoto->photo_captions,
+                  zphoto->time_stamps, zphoto->nphotos);
+}
+
+static ZphotoImageCopier *
+new_thumbnail_copier (ZphotoConfig *config)
 {
-    ZphotoConfig *config = zphoto->config;
-    int i;
     ZphotoImageCopier *copier = zphoto_image_copier_new();
-    zphoto_progress_start(zphoto->progress, "thumbnail", 
-                          N_("Creating thumbnails..."),
-                          zphoto->nphotos);
 
     zphoto_image_copier_set_width(copier, config->thumbnail_width);
     if (config->gamma != 1.0)
 	zphoto_image_copier_set_gamma(copier, config->gamma);
-
-    for (i = 0; i < zphoto->nphotos; i++) {
-	zphoto_progress_set(zphoto->progress, i,
-                            zphoto_basename(zphoto->thumbnails[i]));
-	zphoto_image_copier_copy(copier,
-				 zphoto->input_photos[i],
-				 zphoto->thumbnails[i],
-				 zphoto->time_stamps[i]);
-	
-    }
-    zphoto_progress_finish(zphoto->progress);
-    zphoto_image_copier_destroy(copier);
+    return copier;
 }
 
-static char *
-int_to_str (int n)
+static void
+make_thumbnails (Zphoto *zphoto)
 {
-    static char str[BUFSIZ];
-    sprintf(str, "%d", n);
-    return str;
+    ZphotoImageCopier *copier = new_thumbnail_copier(zphoto->config);
+    zphoto_progress_start(zphoto->progress, "thumbnail", 
+                          N_("Creating thumbnails..."),
+                          zphoto->nphotos);
+
+    copy_images(zphoto, copier, zphoto->thumbnails, zphoto->thumbnails,
+                "thumbnail", zphoto->sending_p);
+    zphoto_progress_finish(zphoto->progress);
+    zphoto_image_copier_destroy(copier);
 }
 
 static char *
@@ -139,6 +648,22 @@ concat (char *src, const char *dest)
     return new;
 }
 
+/*
+ * The thumbnails made by zphoto_make_file() may not be made
+ * yet or be being written, so theirs are of the proportions
+ * of the photo, or square if unknown.
+ */
+static void
+get_thumbnail_size (Zphoto *zphoto, int i, int *width, int *height)
+{
+    if (zphoto->file_states == NULL) {
+        zphoto_image_get_size(zphoto->thumbnails[i], width, height);
+    } else if (!zphoto_image_read_header(zphoto->input_photos[i],
+                                         width, height)) {
+        *width = *height = 1;
+    }
+}
+
 static char *
 make_html_album (Zphoto *zphoto)
 {
@@ -156,7 +681,7 @@ make_html_album (Zphoto *zphoto)
         image_url = 
             zphoto_escape_url(zphoto_basename(zphoto->thumbnails[i]));
         
-        zphoto_image_get_size(zphoto->thumbnails[i], &width, &height);
+        get_thumbnail_size(zphoto, i, &width, &height);
         thumbnail_height = 
             height * ((double)config->html_thumbnail_width / width);
 
@@ -179,22 +704,23 @@ static void
 add_common_substitutions (ZphotoConfig *config, 
                           ZphotoTemplate *template)
 {
-    time_t now = time(NULL);
-    char *flash_file_name, *zip_file_name;
+    char *date, *flash_file_name, *zip_file_name;
+    char *flash_width, *flash_height;
 
+    date = zphoto_format_time(time(NULL), "%a %b %d %H:%M:%S %Y\n");
     flash_file_name = zphoto_escape_url(config->flash_filename);
     zip_file_name = zphoto_escape_url(config->zip_filename);
+    flash_width  = zphoto_asprintf("%d", config->flash_width);
+    flash_height = zphoto_asprintf("%d", config->flash_height);
 
     zphoto_template_add_subst(template, "title", config->title);
-    zphoto_template_add_subst(template, "date", ctime(&now));
+    zphoto_template_add_subst(template, "date", date);
     zphoto_template_add_subst(template, "flash_file_name", 
 			      flash_file_name);
     zphoto_template_add_subst(template, "zip_file_name", 
 			      zip_file_name);
-    zphoto_template_add_subst(template, "flash_width", 
-			      int_to_str(config->flash_width));
-    zphoto_template_add_subst(template, "flash_height", 
-			      int_to_str(config->flash_height));
+    zphoto_template_add_subst(template, "flash_width", flash_width);
+    zphoto_template_add_subst(template, "flash_height", flash_height);
     zphoto_template_add_subst(template, "zphoto_url", 
 			      config->zphoto_url);
     if (zphoto_support_zip_p() && !config->no_zip) {
@@ -230,8 +756,11 @@ add_common_substitutions (ZphotoConfig *config,
      * It is safe to free them because template uses strdup
      * to hold key/value pairs.
      */
+    free(date);
     free(flash_file_name);
     free(zip_file_name);
+    free(flash_width);
+    free(flash_height);
 }
 
 static void
@@ -278,6 +807,20 @@ escape_html (const char *file_name)
     return new_file_name;
 }
 
+/*
+ * The previews passed into the tar may be gone by now.
+ */
+static void
+get_preview_size (Zphoto *zphoto, int i, int *width, int *height)
+{
+    if (zphoto->preview_widths[i] > 0) {
+        *width  = zphoto->preview_widths[i];
+        *height = zphoto->preview_heights[i];
+    } else {
+        zphoto_image_get_size(zphoto->output_photos[i], width, height);
+    }
+}
+
 static void
 add_photo_substitutions (Zphoto *zphoto, 
                          ZphotoTemplate *template,
@@ -288,7 +831,7 @@ add_photo_substitutions (Zphoto *zphoto,
         *prev_html_file_name, *next_html_file_name, *next_file_name,
         *escaped_file_name;
     int w, h;
-    char *width, *height;
+    char *width, *height, *time_string;
 
     file_name = 
         zphoto_escape_url(zphoto_basename(zphoto->output_photos[id]));
@@ -317,7 +860,7 @@ add_photo_substitutions (Zphoto *zphoto,
     next_html_file_name = zphoto_escape_url(next_html_file_name);
     next_file_name = zphoto_escape_url(next_file_name);
 
-    zphoto_image_get_size(zphoto->output_photos[id], &w, &h);
+    get_preview_size(zphoto, id, &w, &h);
     width  = zphoto_asprintf("%d", w);
     height = zphoto_asprintf("%d", h);
 
@@ -348,8 +891,8 @@ add_photo_substitutions (Zphoto *zphoto,
 
     zphoto_template_add_subst(template, "width",  width);
     zphoto_template_add_subst(template, "height", height);
-    zphoto_template_add_subst(template, "time", 
-                              zphoto_time_string(zphoto->time_stamps[id]));
+    time_string = zphoto_time_string(zphoto->time_stamps[id]);
+    zphoto_template_add_subst(template, "time", time_string);
 
     zphoto_template_add_subst(template, "prev_html_file_name", 
                               prev_html_file_name);
@@ -380,6 +923,17 @@ add_photo_substitutions (Zphoto *zphoto,
     free(escaped_file_name);
     free(width);
     free(height);
+    free(time_string);
+}
+
+static void
+make_photo_html_file (Zphoto *zphoto, const char *template_file_name, int i)
+{
+    ZphotoTemplate *template = zphoto_template_new(template_file_name);
+
+    add_photo_substitutions(zphoto, template, i);
+    zphoto_template_write(template, zphoto->html_file_names[i]);
+    zphoto_template_destroy(template);
 }
 
 static void
@@ -394,14 +948,10 @@ make_photo_html_files (Zphoto *zphoto)
                           N_("Creating HTML files..."),
                           zphoto->nphotos);
     for (i = 0; i < zphoto->nphotos; i++) {
-        ZphotoTemplate *template;
-	zphoto_progress_set(zphoto->progress, i, 
-                            zphoto_basename(zphoto->html_file_names[i]));
-
-        template = zphoto_template_new(template_file_name);
-        add_photo_substitutions(zphoto, template, i);
-        zphoto_template_write(template, zphoto->html_file_names[i]);
-        zphoto_template_destroy(template);
+	if (!zphoto_progress_set(zphoto->progress, i, 
+                                 zphoto_basename(zphoto->html_file_names[i])))
+            break;
+        make_photo_html_file(zphoto, template_file_name, i);
     }
     free(template_file_name);
     zphoto_progress_finish(zphoto->progress);
@@ -427,14 +977,14 @@ make_index_html_files (Zphoto *zphoto)
 					  d_name);
 	if (zphoto_web_file_p(file_name) && !zphoto_dot_file_p(d_name)) {
             char *output_file_name = zphoto_asprintf("%s/%s", 
-                                                     config->output_dir,
+                                                     zphoto->output_dir,
                                                      d_name);
             ZphotoTemplate *template = zphoto_template_new(file_name);
             add_index_substitutions(config, template, html_album);
 
             zphoto_template_write(template, output_file_name);
             zphoto_template_destroy(template);
-            free(output_file_name);
+            add_made_file(zphoto, output_file_name);
 	}
 	free(file_name);
     }
@@ -471,19 +1021,21 @@ make_zip_file (Zphoto *zphoto)
                           zphoto->nphotos);
 
     zip_command = escape_unix(config->zip_command);
-    tmp = zphoto_asprintf("%s/%s", config->output_dir, config->zip_filename);
+    tmp = zphoto_asprintf("%s/%s", zphoto->output_dir, config->zip_filename);
     output_zip_file_name  = escape_unix(tmp);
-    free(tmp);
+    add_made_file(zphoto, tmp);
 
     for (i = 0; i < zphoto->nphotos; i++) {
-        char *photo_file_name = escape_unix(zphoto->original_photos[i]);
-        char *command = zphoto_asprintf("%s \"%s\" \"%s\"",
-                                        zip_command,
-                                        output_zip_file_name,
-                                        photo_file_name);
-
-	zphoto_progress_set(zphoto->progress, i,
-                            zphoto_basename(zphoto->input_photos[i]));
+        char *photo_file_name, *command;
+
+	if (!zphoto_progress_set(zphoto->progress, i,
+                                 zphoto_basename(zphoto->input_photos[i])))
+            break;
+        photo_file_name = escape_unix(zphoto->original_photos[i]);
+        command = zphoto_asprintf("%s \"%s\" \"%s\"",
+                                  zip_command,
+                                  output_zip_file_name,
+                                  photo_file_name);
         system(command);
         free(command);
         free(photo_file_name);
@@ -493,32 +1045,60 @@ make_zip_file (Zphoto *zphoto)
     free(zip_command);
 }
 
+/*
+ * Only copies without resizing are affected.
+ */
+static void
+set_jpeg_optimization (ZphotoImageCopier *copier, ZphotoConfig *config)
+{
+    int flags = 0;
+
+    if (config->progressive_jpeg)
+        flags |= ZPHOTO_JPEG_PROGRESSIVE;
+    if (config->strip_metadata)
+        flags |= ZPHOTO_JPEG_STRIP_METADATA;
+    if (config->optimize_jpeg || flags != 0)
+        zphoto_image_copier_set_jpeg_optimization(copier, flags);
+}
+
+static ZphotoImageCopier *
+new_preview_copier (ZphotoConfig *config)
+{
+    ZphotoImageCopier *copier = zphoto_image_copier_new();
+
+    if (config->photo_width > 0)
+	zphoto_image_copier_set_width(copier, config->photo_width);
+    if (config->gamma != 1.0)
+	zphoto_image_copier_set_gamma(copier, config->gamma);
+    set_jpeg_optimization(copier, config);
+    return copier;
+}
+
+static ZphotoImageCopier *
+new_original_copier (ZphotoConfig *config)
+{
+    ZphotoImageCopier *copier = zphoto_image_copier_new();
+
+    set_jpeg_optimization(copier, config);
+    return copier;
+}
+
 static void
 copy_photos (Zphoto *zphoto)
 {
     ZphotoConfig *config = zphoto->config;
-    int i;
-    ZphotoImageCopier *copier = zphoto_image_copier_new();
+    ZphotoImageCopier *copier = new_preview_copier(config);
     char *task = "copy";
     char *task_long = N_("Copying images...");
 
     if (config->photo_width > 0) {
-	zphoto_image_copier_set_width(copier, config->photo_width);
         task = "resize";
         task_long = N_("Resizing images...");
     }
-    if (config->gamma != 1.0)
-	zphoto_image_copier_set_gamma(copier, config->gamma);
 
     zphoto_progress_start(zphoto->progress, task, task_long, zphoto->nphotos);
-    for (i = 0; i < zphoto->nphotos; i++) {
-	zphoto_progress_set(zphoto->progress, i, 
-                            zphoto_basename(zphoto->output_photos[i]));
-	zphoto_image_copier_copy(copier,
-				 zphoto->input_photos[i],
-				 zphoto->output_photos[i],
-                                 zphoto->time_stamps[i]);
-    }
+    copy_images(zphoto, copier, zphoto->output_photos, zphoto->output_photos,
+                task, 0);
     zphoto_progress_finish(zphoto->progress);
     zphoto_image_copier_destroy(copier);
 }
@@ -526,63 +1106,212 @@ copy_photos (Zphoto *zphoto)
 static void
 include_photos (Zphoto *zphoto)
 {
-    int i;
-    ZphotoImageCopier *copier = zphoto_image_copier_new();
+    ZphotoImageCopier *copier = new_original_copier(zphoto->config);
 
     zphoto_progress_start(zphoto->progress, "include",
                           N_("Including originals..."),
                           zphoto->nphotos);
-    for (i = 0; i < zphoto->nphotos; i++) {
-	zphoto_progress_set(zphoto->progress, i, 
-                            zphoto_basename(zphoto->input_photos[i]));
-	zphoto_image_copier_copy(copier,
-				 zphoto->input_photos[i],
-				 zphoto->original_photos[i],
-                                 zphoto->time_stamps[i]);
-    }
+    copy_images(zphoto, copier, zphoto->original_photos, zphoto->input_photos,
+                "include", 0);
     zphoto_progress_finish(zphoto->progress);
     zphoto_image_copier_destroy(copier);
 }
 
+/*
+ * Written at once so that lines from concurrent albums do
+ * not interleave.
+ */
+static void
+write_progress (Zphoto *zphoto, const char *str)
+{
+    size_t len = strlen(str);
+
+    while (len > 0) {
+        ssize_t n = write(zphoto->config->progress_fd, str, len);
+        if (n <= 0)
+            return;  /* the reader is gone; keep working */
+        str += n;
+        len -= n;
+    }
+}
+
 static void
 progress_bar (ZphotoProgress *progress)
 {
+    Zphoto *zphoto = progress->data;
     char bar[]  = "oooooooooooooooooooooooooooooooooo";
     int scale = sizeof(bar) - 1;
-    int bar_len   = (double)progress->current * scale / progress->total;
-
-    fprintf(stderr, "%-10s |%.*s%*s| %-20s [%d/%d]\r", 
-	    progress->task,
-	    bar_len, bar, scale - bar_len, "", 
-	    progress->file_name, 
-	    progress->current, progress->total);
-    if (progress->is_finished)
-	fprintf(stderr, "\n");
-    else
-	fprintf(stderr, "\r");
-    fflush(stderr);
+    int bar_len;
+    char *line;
+
+    if (progress->event == ZPHOTO_PROGRESS_ERROR)  /* warned already */
+        return;
+    bar_len = progress->total > 0 ?
+        (double)progress->current * scale / progress->total : scale;
+    line = zphoto_asprintf("%-10s |%.*s%*s| %-20s [%d/%d]%s", 
+                           progress->task,
+                           bar_len, bar, scale - bar_len, "", 
+                           progress->file_name, 
+                           progress->current, progress->total,
+                           progress->is_finished ? "\n" : "\r");
+    write_progress(zphoto, line);
+    free(line);
 }
 
-Zphoto *
-zphoto_new (ZphotoConfig *config)
+/*
+ * One JSON object per line for --progress-format=jsonl.
+ * Photo events are written at most once per
+ * --progress-interval; the rest are always written.
+ */
+static void
+progress_jsonl (ZphotoProgress *progress)
 {
-    Zphoto *zphoto;
-    zphoto = zphoto_emalloc(sizeof(Zphoto));
-    zphoto->config  = config;
+    static const char *events[] = { "start", "photo", "finish", "error" };
+    Zphoto *zphoto = progress->data;
+    char *stage, *file_name, *line, *extra;
+    double now = zphoto_get_time();
+
+    if (progress->event == ZPHOTO_PROGRESS_STEP &&
+        progress->current < progress->total &&
+        now - zphoto->last_progress_time <
+        zphoto->config->progress_interval)
+        return;
+    zphoto->last_progress_time = now;
+
+    stage = progress->task ? zphoto_escape_json(progress->task) :
+        zphoto_strdup("null");
+    file_name = zphoto_escape_json(progress->file_name);
+    if (progress->event == ZPHOTO_PROGRESS_ERROR) {
+        char *reason = zphoto_escape_json(progress->reason);
+        extra = zphoto_asprintf(", \"file\": %s, \"reason\": %s",
+                                file_name, reason);
+        free(reason);
+    } else if (progress->event == ZPHOTO_PROGRESS_STEP) {
+        extra = zphoto_asprintf(", \"file\": %s, \"rate\": %.3f, "
+                                "\"eta\": %.3f", file_name,
+                                progress->rate, progress->eta);
+    } else if (progress->event == ZPHOTO_PROGRESS_FINISH) {
+        extra = zphoto_asprintf(", \"rate\": %.3f", progress->rate);
+    } else {
+        extra = zphoto_strdup("");
+    }
+    line = zphoto_asprintf("{\"event\": \"%s\", \"stage\": %s, "
+                           "\"done\": %d, \"total\": %d, "
+                           "\"elapsed\": %.3f%s}\n",
+                           events[progress->event], stage,
+                           progress->current, progress->total,
+                           progress->elapsed, extra);
+    write_progress(zphoto, line);
+    free(line);
+    free(extra);
+    free(file_name);
+    free(stage);
+}
 
-    zphoto->nphotos = 0;
-    zphoto->input_photos = NULL;
+/*
+ * Ming, the zip command and the templates write files by
+ * names, so the album is made in a scratch directory in
+ * place of the output directory and then streamed into the
+ * archive by the sink.
+ */
+static void
+open_output_tar (Zphoto *zphoto)
+{
+    ZphotoConfig *config = zphoto->config;
+
+    zphoto->tar = zphoto_tar_new(config->output_tar);
+    zphoto->scratch_dir = zphoto_make_temp_dir();
+    zphoto->output_dir = zphoto->scratch_dir;
+    zphoto_set_sink(zphoto, zphoto_tar_sink, zphoto->tar);
+}
+
+static void
+close_output_tar (Zphoto *zphoto)
+{
+    if (zphoto->tar == NULL)
+        return;
+    zphoto_tar_close(zphoto->tar);
+    zphoto->tar = NULL;
+    zphoto->sink_func = NULL;
+}
+
+Zphoto *
+zphoto_new (ZphotoConfig *config)
+{
+    Zphoto *zphoto;
+    zphoto = zphoto_emalloc(sizeof(Zphoto));
+    zphoto->config  = config;
+
+    zphoto->nphotos = 0;
+    zphoto->input_photos = NULL;
     zphoto->output_photos = NULL;
     zphoto->original_photos = NULL;
     zphoto->thumbnails = NULL;
     zphoto->html_file_names = NULL;
     zphoto->photo_captions = NULL;
     zphoto->html_captions = NULL;
+    zphoto->content_ids = NULL;
+    zphoto->hashes = NULL;
+    zphoto->cache = NULL;
+    zphoto->trace = NULL;
+    zphoto->nfailures = 0;
+    zphoto->failures = NULL;
+    zphoto->memfiles = NULL;
+    zphoto->made_files = NULL;
+    zphoto->nmade_files = 0;
+    zphoto->sink_func = NULL;
+    zphoto->sink_data = NULL;
+    zphoto->tar = NULL;
+    zphoto->scratch_dir = NULL;
+    zphoto->output_dir = config->output_dir;
+    zphoto->file_states = NULL;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&zphoto->file_mutex, NULL);
+    pthread_cond_init(&zphoto->file_cond, NULL);
+#endif
+    zphoto->message_func = NULL;
+    zphoto->message_data = NULL;
 
     zphoto->progress = zphoto_progress_new();
-    if (!config->quiet)
+    zphoto_progress_set_data(zphoto->progress, zphoto);
+    zphoto->last_progress_time = 0.0;
+    if (strcmp(config->progress_format, "jsonl") == 0)
+        zphoto_progress_set_func(zphoto->progress, progress_jsonl);
+    else if (strcmp(config->progress_format, "bar") != 0)
+        zphoto_eprintf("unknown progress format: %s", config->progress_format);
+    else if (!config->quiet)
         zphoto_progress_set_func(zphoto->progress, progress_bar);
 
+    if (config->memory_limit[0] != '\0') {
+        zphoto->memory_limit = zphoto_parse_size(config->memory_limit);
+        if (zphoto->memory_limit == 0)
+            zphoto_eprintf("invalid memory limit: %s", config->memory_limit);
+    } else {
+        /*
+         * Leave the other half for the rest of the system.
+         */
+        zphoto->memory_limit = zphoto_get_physical_memory() / 2;
+        if (zphoto->memory_limit == 0)
+            zphoto->memory_limit = DEFAULT_MEMORY_LIMIT;
+    }
+    if (config->cache_dir[0] != '\0') {
+        size_t cache_size = 0;
+
+        if (config->cache_size[0] != '\0') {
+            cache_size = zphoto_parse_size(config->cache_size);
+            if (cache_size == 0)
+                zphoto_eprintf("invalid cache size: %s", config->cache_size);
+        }
+        zphoto->cache = zphoto_cache_new(config->cache_dir, cache_size);
+    }
+    if (config->trace[0] != '\0')
+        zphoto->trace = zphoto_trace_new();
+    zphoto->metrics = zphoto_metrics_new();
+    if (config->profile[0] != '\0')
+        zphoto_profile_start();
+    if (config->output_tar[0] != '\0')
+        open_output_tar(zphoto);
+
     return zphoto;
 }
 
@@ -591,12 +1320,20 @@ swap (Zphoto *zphoto, int a, int b)
 {
     char  *tmp_name = zphoto->input_photos[a];
     time_t tmp_time = zphoto->time_stamps[a];
+    int    tmp_id   = zphoto->content_ids[a];
+    uint64_t tmp_hash = zphoto->hashes[a];
 
     zphoto->input_photos[a] = zphoto->input_photos[b];
     zphoto->input_photos[b] = tmp_name;
 
     zphoto->time_stamps[a] = zphoto->time_stamps[b];
     zphoto->time_stamps[b] = tmp_time;
+
+    zphoto->content_ids[a] = zphoto->content_ids[b];
+    zphoto->content_ids[b] = tmp_id;
+
+    zphoto->hashes[a] = zphoto->hashes[b];
+    zphoto->hashes[b] = tmp_hash;
 }
 
 static void
@@ -631,8 +1368,8 @@ same_files_p (const char *file_name1, const char *file_name2)
 {
     struct stat st1, st2;
 
-    stat(file_name1, &st1);
-    stat(file_name2, &st2);
+    if (stat(file_name1, &st1) == -1 || stat(file_name2, &st2) == -1)
+        return 0;  /* in memory, or not made yet */
 
     if (zphoto_platform_w32_p()) {
          /* 
@@ -668,36 +1405,36 @@ set_file_names (Zphoto *zphoto, int i)
 
     if (config->sequential) {
         output_file_name = zphoto_asprintf("%s/%s%06d.%s", 
-                                           config->output_dir, 
+                                           zphoto->output_dir, 
                                            preview_prefix,
                                            i + 1,
                                            suffix);
         original_file_name = zphoto_asprintf("%s/%06d.%s", 
-                                             config->output_dir, 
+                                             zphoto->output_dir, 
                                              i + 1, 
                                              suffix);
         thumbnail_file_name = zphoto_asprintf("%s/%s%06d.jpg",
-                                              config->output_dir,
+                                              zphoto->output_dir,
                                               config->thumbnail_prefix,
                                               i + 1);
         html_file_name = zphoto_asprintf("%s/%06d.html%s",
-                                         config->output_dir,
+                                         zphoto->output_dir,
                                          i + 1,
                                          config->html_suffix);
     } else {
         output_file_name = zphoto_asprintf("%s/%s%s",
-                                           config->output_dir,
+                                           zphoto->output_dir,
                                            preview_prefix,
                                            base);
         original_file_name = zphoto_asprintf("%s/%s",
-                                             config->output_dir,
+                                             zphoto->output_dir,
                                              base);
         thumbnail_file_name = zphoto_asprintf("%s/%s%s.jpg",
-                                              config->output_dir,
+                                              zphoto->output_dir,
                                               config->thumbnail_prefix,
                                               nosuffix);
         html_file_name = zphoto_asprintf("%s/%s.html%s",
-                                         config->output_dir,
+                                         zphoto->output_dir,
                                          nosuffix,
                                          config->html_suffix);
     }
@@ -729,7 +1466,7 @@ set_caption (Zphoto *zphoto, ZphotoAlist *caption_table, int i)
     } else if (config->caption_by_filename) {
         caption = zphoto_strdup(zphoto_basename(zphoto->input_photos[i]));
     } else {
-        caption = zphoto_strdup(zphoto_time_string(zphoto->time_stamps[i]));
+        caption = zphoto_time_string(zphoto->time_stamps[i]);
     }
 
     zphoto->photo_captions[i] = caption;
@@ -774,26 +1511,148 @@ read_caption_table (const char* file_name)
     return alist;
 }
 
+/*
+ * Checked with the image header before decoding anything.
+ */
+static int
+too_many_pixels_p (ZphotoConfig *config, const char *file_name)
+{
+    int width, height;
+
+    return config->max_pixels > 0 &&
+        zphoto_image_read_header(file_name, &width, &height) &&
+        (double)width * height > config->max_pixels;
+}
+
+/*
+ * Content hashes are used for finding duplicates and as
+ * the cache keys.
+ */
+static int
+hash_needed_p (Zphoto *zphoto)
+{
+    return !zphoto->config->no_dedup || zphoto->cache != NULL;
+}
+
+/*
+ * Read the time stamp and the content hash of a photo.
+ */
+static void
+scan_file (int i, void *data)
+{
+    Zphoto *zphoto = data;
+
+    zphoto_trace_begin("photo", "scan", zphoto->input_photos[i]);
+    if (hash_needed_p(zphoto))
+        zphoto->hashes[i] = zphoto_hash_file(zphoto->input_photos[i]);
+    zphoto->time_stamps[i] = zphoto_image_get_time(zphoto->input_photos[i],
+                                                   zphoto->config->no_exif);
+    zphoto_trace_end();
+}
+
+typedef struct {
+    uint64_t    hash;
+    int         index;
+} HashedPhoto;
+
+static int
+compare_by_hash (const void *a, const void *b)
+{
+    const HashedPhoto *x = a, *y = b;
+
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return x->index - y->index;
+}
+
+/*
+ * Give photos of the same contents the same content id,
+ * the index of the first of them.  Equal hashes are
+ * confirmed by comparing the files.
+ */
+static void
+find_duplicates (Zphoto *zphoto)
+{
+    int i, j, start;
+    HashedPhoto *order;
+
+    for (i = 0; i < zphoto->nphotos; i++)
+        zphoto->content_ids[i] = i;
+    if (zphoto->config->no_dedup)
+        return;
+
+    order = zphoto_emalloc(sizeof(HashedPhoto) * zphoto->nphotos);
+    for (i = 0; i < zphoto->nphotos; i++) {
+        order[i].hash  = zphoto->hashes[i];
+        order[i].index = i;
+    }
+    qsort(order, zphoto->nphotos, sizeof(HashedPhoto), compare_by_hash);
+    for (start = 0; start < zphoto->nphotos; start = i) {
+        for (i = start + 1; i < zphoto->nphotos &&
+                 order[i].hash == order[start].hash; i++) {
+            int k = order[i].index;
+            if (order[i].hash == 0)  /* not hashed */
+                continue;
+            for (j = start; j < i; j++) {
+                int primary = order[j].index;
+                if (zphoto->content_ids[primary] == primary &&
+                    zphoto_same_contents_p(zphoto->input_photos[primary],
+                                           zphoto->input_photos[k])) {
+                    zphoto->content_ids[k] = primary;
+                    break;
+                }
+            }
+        }
+    }
+    free(order);
+}
+
+/*
+ * Keep only the first of the photos of the same contents.
+ */
+static void
+collapse_duplicates (Zphoto *zphoto)
+{
+    int i, j;
+
+    for (i = j = 0; i < zphoto->nphotos; i++) {
+        if (zphoto->content_ids[i] != i) {
+            free(zphoto->input_photos[i]);
+            continue;
+        }
+        zphoto->input_photos[j] = zphoto->input_photos[i];
+        zphoto->time_stamps[j]  = zphoto->time_stamps[i];
+        zphoto->hashes[j]       = zphoto->hashes[i];
+        zphoto->content_ids[j]  = j;
+        j++;
+    }
+    zphoto->nphotos = j;
+}
 
 void
 zphoto_add_file_names (Zphoto *zphoto, char **file_names, int nfile_names)
 {
     ZphotoConfig *config = zphoto->config;
     ZphotoAlist *caption_table = NULL;
+    ThreadState saved_state;
+    char **reasons;
     int i, j;
 
     /*
      * FIXME: repeated call is not supported yet.
      */
     assert(zphoto->input_photos == NULL);
+    enter_album(zphoto, &saved_state);
 
     zphoto->input_photos = zphoto_emalloc(sizeof(char *) * nfile_names);
     for (i = j = 0; i < nfile_names ; i++) {
-        if (zphoto_supported_file_p(file_names[i])) {
+        if (!zphoto_supported_file_p(file_names[i])) {
+            zphoto_wprintf("%s: not a supported file", file_names[i]);
+        } else if (too_many_pixels_p(config, file_names[i])) {
+            skip_file(zphoto, file_names[i], "add", "too many pixels");
+        } else {
             zphoto->input_photos[j] = zphoto_strdup(file_names[i]);
             j++;
-        } else {
-            zphoto_wprintf("%s: not a supported file", file_names[i]);
         }
     }
     zphoto->nphotos = j;
@@ -805,13 +1664,55 @@ zphoto_add_file_names (Zphoto *zphoto, char **file_names, int nfile_names)
     zphoto->time_stamps     = zphoto_emalloc(sizeof(time_t) * zphoto->nphotos);
     zphoto->html_file_names = zphoto_emalloc(sizeof(char *) * zphoto->nphotos);
     zphoto->photo_captions  = zphoto_emalloc(sizeof(char *) * zphoto->nphotos);
-
+    zphoto->content_ids     = zphoto_emalloc(sizeof(int) * zphoto->nphotos);
+    zphoto->sent_p          = zphoto_emalloc(zphoto->nphotos);
+    zphoto->preview_widths  = zphoto_emalloc(sizeof(int) * zphoto->nphotos);
+    zphoto->preview_heights = zphoto_emalloc(sizeof(int) * zphoto->nphotos);
+    memset(zphoto->sent_p, 0, zphoto->nphotos);
+    memset(zphoto->preview_widths, 0, sizeof(int) * zphoto->nphotos);
+
+    zphoto->hashes          = zphoto_emalloc(sizeof(uint64_t) * zphoto->nphotos);
+    memset(zphoto->hashes, 0, sizeof(uint64_t) * zphoto->nphotos);
+
+    reasons = zphoto_emalloc(sizeof(char *) * zphoto->nphotos);
+    zphoto_trace_begin("stage", "scan", NULL);
 #pragma omp parallel for
     for (i = 0; i < zphoto->nphotos; i++) {
-        time_t time = zphoto_image_get_time(zphoto->input_photos[i], 
-                                            config->no_exif);
-	zphoto->time_stamps[i] = time;
+        /*
+         * OpenMP threads do not inherit the trace, the
+         * metrics, the in-memory files, the stage and the
+         * limit on movie frames.
+         */
+        ZphotoTrace *saved_trace = zphoto_trace_get_current();
+        ZphotoMetrics *saved_metrics = zphoto_metrics_get_current();
+        ZphotoMemfiles *saved_memfiles = zphoto_memfiles_get_current();
+        const char *saved_stage = zphoto_memstat_get_stage();
+        int saved_frames = zphoto_limit_get_movie_frames();
+        zphoto_trace_set_current(zphoto->trace);
+        zphoto_metrics_set_current(zphoto->metrics);
+        zphoto_memfiles_set_current(zphoto->memfiles);
+        zphoto_memstat_set_stage("scan");
+        zphoto_limit_set_movie_frames(zphoto->config->max_movie_frames);
+        reasons[i] = zphoto_limit_run(0, scan_file, i, zphoto);
+        zphoto_trace_set_current(saved_trace);
+        zphoto_metrics_set_current(saved_metrics);
+        zphoto_memfiles_set_current(saved_memfiles);
+        zphoto_memstat_set_stage(saved_stage);
+        zphoto_limit_set_movie_frames(saved_frames);
+    }
+    zphoto_trace_end();
+    for (i = 0; i < zphoto->nphotos; i++) {
+        if (reasons[i] != NULL) {  /* broken EXIF */
+            zphoto_wprintf("%s; using the file's time", reasons[i]);
+            zphoto->time_stamps[i] = zphoto_get_mtime(zphoto->input_photos[i]);
+            free(reasons[i]);
+        }
     }
+    free(reasons);
+
+    find_duplicates(zphoto);
+    if (config->collapse_duplicates)
+        collapse_duplicates(zphoto);
 
     if (config->sort_by_filename) {
         sort_by_filename(zphoto);
@@ -828,6 +1729,88 @@ zphoto_add_file_names (Zphoto *zphoto, char **file_names, int nfile_names)
     }
 
     zphoto_alist_destroy(caption_table);
+    leave_album(&saved_state);
+}
+
+/*
+ * Add photos held in memory.  Their bytes are read in
+ * place, and must be kept until zphoto_destroy().  The
+ * names are used as the file names of
+ * zphoto_add_file_names().
+ */
+void
+zphoto_add_buffers (Zphoto *zphoto, const ZphotoBuffer *buffers, int nbuffers)
+{
+    char **file_names = zphoto_emalloc(sizeof(char *) * (nbuffers + 1));
+    int i;
+
+    assert(zphoto->memfiles == NULL);
+    zphoto->memfiles = zphoto_memfiles_new();
+    for (i = 0; i < nbuffers; i++) {
+        zphoto_memfiles_add(zphoto->memfiles, buffers[i].name,
+                            buffers[i].data, buffers[i].size,
+                            buffers[i].mtime);
+        file_names[i] = (char *)buffers[i].name;
+    }
+    zphoto_add_file_names(zphoto, file_names, nbuffers);
+    free(file_names);
+}
+
+/*
+ * Add photos read from file descriptors, named file_names.
+ * Regular files are mapped; pipes and sockets are read to
+ * the end here.  The descriptors are not closed.
+ */
+void
+zphoto_add_fds (Zphoto *zphoto, char **file_names, const int *fds, int nfds)
+{
+    int i;
+
+    assert(zphoto->memfiles == NULL);
+    zphoto->memfiles = zphoto_memfiles_new();
+    for (i = 0; i < nfds; i++)
+        zphoto_memfiles_add_fd(zphoto->memfiles, file_names[i], fds[i]);
+    zphoto_add_file_names(zphoto, file_names, nfds);
+}
+
+static int
+compare_strings (const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Remove the files made for previous, an earlier album of
+ * the same config, that zphoto does not have, e.g. those of
+ * removed photos.
+ */
+void
+zphoto_remove_stale_files (Zphoto *zphoto, Zphoto *previous)
+{
+    char **file_names, **old_file_names[4];
+    int i, j, n = 0;
+
+    file_names = zphoto_emalloc(sizeof(char *) * zphoto->nphotos * 4 + 1);
+    for (i = 0; i < zphoto->nphotos; i++) {
+        file_names[n++] = zphoto->output_photos[i];
+        file_names[n++] = zphoto->original_photos[i];
+        file_names[n++] = zphoto->thumbnails[i];
+        file_names[n++] = zphoto->html_file_names[i];
+    }
+    qsort(file_names, n, sizeof(char *), compare_strings);
+
+    old_file_names[0] = previous->output_photos;
+    old_file_names[1] = previous->original_photos;
+    old_file_names[2] = previous->thumbnails;
+    old_file_names[3] = previous->html_file_names;
+    for (j = 0; j < 4; j++) {
+        for (i = 0; i < previous->nphotos; i++) {
+            if (bsearch(&old_file_names[j][i], file_names, n,
+                        sizeof(char *), compare_strings) == NULL)
+                remove(old_file_names[j][i]);
+        }
+    }
+    free(file_names);
 }
 
 void
@@ -860,10 +1843,44 @@ zphoto_destroy (Zphoto *zphoto)
     free(zphoto->output_photos);
     free(zphoto->thumbnails);
     free(zphoto->time_stamps);
+    free(zphoto->content_ids);
+    free(zphoto->hashes);
+    free(zphoto->sent_p);
+    free(zphoto->preview_widths);
+    free(zphoto->preview_heights);
+    if (zphoto->cache != NULL)
+        zphoto_cache_destroy(zphoto->cache);
+    if (zphoto->trace != NULL)
+        zphoto_trace_destroy(zphoto->trace);
+    zphoto_metrics_destroy(zphoto->metrics);
+    if (zphoto->config->profile[0] != '\0')
+        zphoto_profile_stop();
     free(zphoto->html_file_names);
     free(zphoto->photo_captions);
     free(zphoto->html_captions);
 
+    for (i = 0; i < zphoto->nfailures; i++) {
+        free(zphoto->failures[i].file_name);
+        free(zphoto->failures[i].reason);
+    }
+    free(zphoto->failures);
+
+    for (i = 0; i < zphoto->nmade_files; i++)
+        free(zphoto->made_files[i]);
+    free(zphoto->made_files);
+    close_output_tar(zphoto);
+    if (zphoto->scratch_dir != NULL) {
+        zphoto_remove_tree(zphoto->scratch_dir);
+        free(zphoto->scratch_dir);
+    }
+    if (zphoto->memfiles != NULL)
+        zphoto_memfiles_destroy(zphoto->memfiles);
+    free(zphoto->file_states);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&zphoto->file_mutex);
+    pthread_cond_destroy(&zphoto->file_cond);
+#endif
+
     free(zphoto);
 }
 
@@ -891,26 +1908,599 @@ zphoto_get_nsteps (Zphoto *zphoto)
     return nsteps;
 }
 
+static void
+write_failure_report (Zphoto *zphoto, const char *file_name)
+{
+    int i;
+    FILE *fp = zphoto_efopen(file_name, "w");
+
+    fprintf(fp, "{\n  \"nphotos\": %d,\n  \"nfailures\": %d,\n"
+            "  \"failures\": [", zphoto->nphotos, zphoto->nfailures);
+    for (i = 0; i < zphoto->nfailures; i++) {
+        Failure *failure = zphoto->failures + i;
+        char *escaped_file_name = zphoto_escape_json(failure->file_name);
+        char *escaped_reason    = zphoto_escape_json(failure->reason);
+
+        fprintf(fp, "%s\n    {\"file\": %s, \"stage\": \"%s\", "
+                "\"reason\": %s}", i > 0 ? "," : "",
+                escaped_file_name, failure->stage, escaped_reason);
+        free(escaped_file_name);
+        free(escaped_reason);
+    }
+    fprintf(fp, "%s]\n}\n", zphoto->nfailures > 0 ? "\n  " : "");
+    fclose(fp);
+}
+
+/*
+ * The Prometheus text file is renamed into place so that
+ * the collector never reads a partial one.
+ */
+static void
+write_metrics (Zphoto *zphoto)
+{
+    ZphotoConfig *config = zphoto->config;
+    FILE *fp;
+
+    if (config->metrics[0] != '\0') {
+        char *temporary_file_name = zphoto_asprintf("%s.tmp", config->metrics);
+
+        fp = zphoto_efopen(temporary_file_name, "w");
+        zphoto_metrics_write_prometheus(zphoto->metrics, fp);
+        if (fclose(fp) == EOF)
+            zphoto_eprintf("%s:", temporary_file_name);
+        if (rename(temporary_file_name, config->metrics) == -1)
+            zphoto_eprintf("%s:", config->metrics);
+        free(temporary_file_name);
+    }
+    if (config->metrics_json[0] != '\0') {
+        fp = zphoto_efopen(config->metrics_json, "w");
+        zphoto_metrics_write_json(zphoto->metrics, fp, config->slowest);
+        if (fclose(fp) == EOF)
+            zphoto_eprintf("%s:", config->metrics_json);
+    }
+}
+
+/*
+ * Returns true if the next step should be taken.  All
+ * photos may have been skipped, or the album cancelled.
+ */
+static int
+continue_p (Zphoto *zphoto)
+{
+    return zphoto->nphotos > 0 && !zphoto->progress->abort_p;
+}
+
+typedef void (*StepFunc) (Zphoto *zphoto);
+
+typedef struct {
+    const char  *name;
+    StepFunc    func;
+} Step;
+
+/*
+ * In the order of zphoto_make_all().
+ */
+static const Step steps[] = {
+    { "copy",      copy_photos },
+    { "include",   include_photos },
+    { "thumbnail", make_thumbnails },
+    { "check",     check_thumbnails },
+    { "flash",     make_flash },
+    { "html",      make_photo_html_files },
+    { "index",     make_index_html_files },
+    { "zip",       make_zip_file },
+    { NULL,        NULL }
+};
+
+static int
+step_enabled_p (Zphoto *zphoto, const Step *step)
+{
+    if (strcmp(step->name, "include") == 0)
+        return zphoto->config->include_original;
+    if (strcmp(step->name, "zip") == 0)
+        return create_zip_file_p(zphoto->config);
+    return 1;
+}
+
+static void
+run_step (Zphoto *zphoto, const Step *step)
+{
+    if (!continue_p(zphoto))
+        return;
+    zphoto_trace_begin("stage", step->name, NULL);
+    zphoto_memstat_set_stage(step->name);
+    step->func(zphoto);
+    zphoto_memstat_set_stage(NULL);
+    zphoto_trace_end();
+}
+
+/*
+ * Run the step called name alone, for benchmarks and
+ * incremental builds.  The steps it depends on must have
+ * been made.  Returns 0 if there is no such step or it is
+ * disabled by the config.  The reports are written by
+ * zphoto_make_all() only.
+ */
+int
+zphoto_make_step (Zphoto *zphoto, const char *name)
+{
+    ThreadState saved_state;
+    const Step *step;
+    assert(zphoto->input_photos != NULL);
+
+    for (step = steps; step->name != NULL; step++) {
+        if (strcmp(step->name, name) == 0)
+            break;
+    }
+    if (step->name == NULL || !step_enabled_p(zphoto, step))
+        return 0;
+
+    enter_album(zphoto, &saved_state);
+    if (continue_p(zphoto))
+        zphoto_mkdir(zphoto->output_dir);
+    run_step(zphoto, step);
+    leave_album(&saved_state);
+    return 1;
+}
+
+/*
+ * The files made by zphoto_make_file(): those of each
+ * photo, numbered by i * NFILE_KINDS + kind, followed by
+ * the flash movie and the index files.
+ */
+enum {
+    FILE_PREVIEW,
+    FILE_ORIGINAL,
+    FILE_THUMBNAIL,
+    FILE_HTML,
+    NFILE_KINDS
+};
+
+#define FLASH_FILE_ID(zphoto) ((zphoto)->nphotos * NFILE_KINDS)
+#define INDEX_FILE_ID(zphoto) ((zphoto)->nphotos * NFILE_KINDS + 1)
+
+enum {
+    FILE_NONE,
+    FILE_MAKING,
+    FILE_DONE,
+    FILE_FAILED
+};
+
+typedef struct {
+    Zphoto              *zphoto;
+    ZphotoImageCopier   *copier;
+    const char          *dest;
+    char                *template_file_name;
+} FileJob;
+
+typedef struct {
+    Zphoto      *zphoto;
+    int         *made_p;
+    char        **output_photos;
+    char        **thumbnails;
+    char        **html_file_names;
+    char        **photo_captions;
+    time_t      *time_stamps;
+} FlashJob;
+
+static int make_file_of (Zphoto *zphoto, int id);
+
+/*
+ * Returns the id of the file called name, relative to the
+ * output directory, or -1 if it is not of the album.  The
+ * index files are those of the templates.
+ */
+static int
+find_file (Zphoto *zphoto, const char *name)
+{
+    ZphotoConfig *config = zphoto->config;
+    char *file_name = zphoto_asprintf("%s/%s", zphoto->output_dir, name);
+    int i, id = -1;
+
+    for (i = 0; i < zphoto->nphotos && id == -1; i++) {
+        if (strcmp(file_name, zphoto->output_photos[i]) == 0)
+            id = i * NFILE_KINDS + FILE_PREVIEW;
+        else if (config->include_original &&
+                 strcmp(file_name, zphoto->original_photos[i]) == 0)
+            id = i * NFILE_KINDS + FILE_ORIGINAL;
+        else if (strcmp(file_name, zphoto->thumbnails[i]) == 0)
+            id = i * NFILE_KINDS + FILE_THUMBNAIL;
+        else if (strcmp(file_name, zphoto->html_file_names[i]) == 0)
+            id = i * NFILE_KINDS + FILE_HTML;
+    }
+    free(file_name);
+    if (id == -1 && strcmp(name, config->flash_filename) == 0)
+        id = FLASH_FILE_ID(zphoto);
+    if (id == -1 && config->template_dir != NULL &&
+        strchr(name, '/') == NULL && !zphoto_dot_file_p(name)) {
+        char *template_file_name = zphoto_asprintf("%s/%s",
+                                                   config->template_dir, name);
+        if (zphoto_web_file_p(template_file_name) &&
+            zphoto_file_p(template_file_name))
+            id = INDEX_FILE_ID(zphoto);
+        free(template_file_name);
+    }
+    return id;
+}
+
+static void
+make_image_job (int i, void *data)
+{
+    FileJob *job = data;
+    Zphoto *zphoto = job->zphoto;
+
+    zphoto_image_copier_copy(job->copier, zphoto->input_photos[i], job->dest,
+                             zphoto->time_stamps[i]);
+}
+
+static void
+make_html_job (int i, void *data)
+{
+    FileJob *job = data;
+
+    make_photo_html_file(job->zphoto, job->template_file_name, i);
+}
+
+static void
+make_index_job (int unused, void *data)
+{
+    make_index_html_files(data);
+}
+
+static void
+make_flash_photo (int i, void *data)
+{
+    FlashJob *job = data;
+
+    job->made_p[i] =
+        make_file_of(job->zphoto, i * NFILE_KINDS + FILE_PREVIEW) &&
+        make_file_of(job->zphoto, i * NFILE_KINDS + FILE_THUMBNAIL);
+}
+
+static int
+make_flash_photo_done (int i, void *data)
+{
+    FlashJob *job = data;
+    return !job->zphoto->progress->abort_p;
+}
+
+static void
+make_flash_job (int nphotos, void *data)
+{
+    FlashJob *job = data;
+
+    make_flash_of(job->zphoto, job->output_photos, job->thumbnails,
+                  job->html_file_names, job->photo_captions,
+                  job->time_stamps, nphotos);
+}
+
+/*
+ * The previews and thumbnails are made concurrently as in
+ * zphoto_make_all(), and the movie is made of the photos
+ * whose files are made.
+ */
+static char *
+make_flash_file (Zphoto *zphoto)
+{
+    int i, n = 0;
+    FlashJob job;
+    char *reason = NULL;
+    size_t *costs = zphoto_emalloc(sizeof(size_t) * (zphoto->nphotos + 1));
+    ZphotoImageCopier *copier = new_preview_copier(zphoto->config);
+    ZphotoScheduler *scheduler = 
+        zphoto_scheduler_new(zphoto_get_ncpus(), zphoto->memory_limit);
+
+    for (i = 0; i < zphoto->nphotos; i++)
+        costs[i] = zphoto_image_copier_estimate_memory(
+            copier, zphoto->input_photos[i], zphoto->output_photos[i]);
+    zphoto_image_copier_destroy(copier);
+
+    job.zphoto = zphoto;
+    job.made_p = zphoto_emalloc(sizeof(int) * (zphoto->nphotos + 1));
+    memset(job.made_p, 0, sizeof(int) * (zphoto->nphotos + 1));
+    zphoto_scheduler_run(scheduler, zphoto->nphotos, costs,
+                         make_flash_photo, make_flash_photo_done, &job);
+    zphoto_scheduler_destroy(scheduler);
+    free(costs);
+
+    job.output_photos   = zphoto_emalloc(sizeof(char *) * (zphoto->nphotos + 1));
+    job.thumbnails      = zphoto_emalloc(sizeof(char *) * (zphoto->nphotos + 1));
+    job.html_file_names = zphoto_emalloc(sizeof(char *) * (zphoto->nphotos + 1));
+    job.photo_captions  = zphoto_emalloc(sizeof(char *) * (zphoto->nphotos + 1));
+    job.time_stamps     = zphoto_emalloc(sizeof(time_t) * (zphoto->nphotos + 1));
+    for (i = 0; i < zphoto->nphotos; i++) {
+        if (!job.made_p[i])
+            continue;
+        job.output_photos[n]   = zphoto->output_photos[i];
+        job.thumbnails[n]      = zphoto->thumbnails[i];
+        job.html_file_names[n] = zphoto->html_file_names[i];
+        job.photo_captions[n]  = zphoto->photo_captions[i];
+        job.time_stamps[n]     = zphoto->time_stamps[i];
+        n++;
+    }
+    if (n == 0)
+        reason = zphoto_strdup("no photos");
+    else
+        reason = zphoto_limit_run(0, make_flash_job, n, &job);
+
+    free(job.made_p);
+    free(job.output_photos);
+    free(job.thumbnails);
+    free(job.html_file_names);
+    free(job.photo_captions);
+    free(job.time_stamps);
+    return reason;
+}
+
+/*
+ * Make the file of the id and returns NULL, or the reason
+ * of the failure.  The page of a photo shows the size of
+ * the preview.
+ */
+static char *
+run_file_job (Zphoto *zphoto, int id)
+{
+    ZphotoConfig *config = zphoto->config;
+    int i = id / NFILE_KINDS;
+    FileJob job;
+    char *reason;
+
+    if (id == FLASH_FILE_ID(zphoto))
+        return make_flash_file(zphoto);
+    if (id == INDEX_FILE_ID(zphoto))
+        return zphoto_limit_run(0, make_index_job, 0, zphoto);
+
+    job.zphoto = zphoto;
+    switch (id % NFILE_KINDS) {
+    case FILE_PREVIEW:
+        job.copier = new_preview_copier(config);
+        job.dest   = zphoto->output_photos[i];
+        break;
+    case FILE_ORIGINAL:
+        job.copier = new_original_copier(config);
+        job.dest   = zphoto->original_photos[i];
+        break;
+    case FILE_THUMBNAIL:
+        job.copier = new_thumbnail_copier(config);
+        job.dest   = zphoto->thumbnails[i];
+        break;
+    default:
+        if (!make_file_of(zphoto, i * NFILE_KINDS + FILE_PREVIEW))
+            return zphoto_strdup("no preview");
+        job.template_file_name = zphoto_asprintf("%s/.photo.html",
+                                                 config->template_dir);
+        reason = zphoto_limit_run(0, make_html_job, i, &job);
+        free(job.template_file_name);
+        return reason;
+    }
+    reason = zphoto_limit_run(config->max_decode_time, make_image_job, i,
+                              &job);
+    zphoto_image_copier_destroy(job.copier);
+    return reason;
+}
+
+/*
+ * Returns true if the file of the id is made.  A file is
+ * made once; the callers for the file being made wait for
+ * it.
+ */
+static int
+make_file_of (Zphoto *zphoto, int id)
+{
+    int state, made_p;
+    char *reason;
+
+    lock_files(zphoto);
+#ifdef HAVE_PTHREAD
+    while (zphoto->file_states[id] == FILE_MAKING)
+        pthread_cond_wait(&zphoto->file_cond, &zphoto->file_mutex);
+#endif
+    state = zphoto->file_states[id];
+    if (state == FILE_NONE)
+        zphoto->file_states[id] = FILE_MAKING;
+    unlock_files(zphoto);
+    if (state != FILE_NONE)
+        return state == FILE_DONE;
+
+    reason = run_file_job(zphoto, id);
+    made_p = reason == NULL;
+    if (reason != NULL) {
+        if (id < FLASH_FILE_ID(zphoto))
+            zphoto_wprintf("%s: %s", zphoto->input_photos[id / NFILE_KINDS],
+                           reason);
+        else
+            zphoto_wprintf("%s", reason);
+    }
+
+    lock_files(zphoto);
+    zphoto->file_states[id] = made_p ? FILE_DONE : FILE_FAILED;
+#ifdef HAVE_PTHREAD
+    pthread_cond_broadcast(&zphoto->file_cond);
+#endif
+    unlock_files(zphoto);
+    free(reason);
+    return made_p;
+}
+
+/*
+ * Make the file called name, relative to the output
+ * directory, and what it needs, unless made already, to
+ * preview the album without making all of it.  Photos that
+ * fail are not removed from the album.  May be called from
+ * many threads at once.  Returns the file name, to be
+ * freed, or NULL if the file is not of the album or cannot
+ * be made.
+ */
+char *
+zphoto_make_file (Zphoto *zphoto, const char *name)
+{
+    ThreadState saved_state;
+    int id, made_p;
+    assert(zphoto->input_photos != NULL);
+
+    lock_files(zphoto);
+    if (zphoto->file_states == NULL) {
+        int n = zphoto->nphotos * NFILE_KINDS + 2;
+        zphoto->file_states = zphoto_emalloc(n);
+        memset(zphoto->file_states, FILE_NONE, n);
+        zphoto_mkdir(zphoto->output_dir);
+    }
+    unlock_files(zphoto);
+
+    id = find_file(zphoto, name);
+    if (id == -1)
+        return NULL;
+    enter_album(zphoto, &saved_state);
+    made_p = make_file_of(zphoto, id);
+    leave_album(&saved_state);
+    if (!made_p)
+        return NULL;
+    return zphoto_asprintf("%s/%s", zphoto->output_dir, name);
+}
+
+/*
+ * Pass file_name to the sink with the name relative to the
+ * output directory.
+ */
+static void
+send_file (Zphoto *zphoto, const char *file_name)
+{
+    const char *output_dir = zphoto->output_dir;
+    size_t len = strlen(output_dir);
+    const char *name = file_name;
+    struct stat st;
+    void *data;
+    size_t size;
+
+    if (stat(file_name, &st) == -1 || !S_ISREG(st.st_mode))
+        return;  /* not made for the config */
+    if (strncmp(file_name, output_dir, len) == 0 && file_name[len] == '/')
+        name = file_name + len + 1;
+    if (st.st_size == 0) {
+        zphoto->sink_func(name, "", 0, zphoto->sink_data);
+        return;
+    }
+    data = zphoto_map_file(file_name, &size);
+    zphoto->sink_func(name, data, size, zphoto->sink_data);
+    zphoto_unmap_file(data, size);
+}
+
+/*
+ * Pass the preview, the original and the thumbnail of the
+ * i-th photo.  The files written into the tar are removed
+ * from the scratch directory unless made into the movie
+ * or the zip file later.  The thumbnails are kept for the
+ * movie and the index.
+ */
+static void
+send_photo (Zphoto *zphoto, int i)
+{
+    const char *preview = zphoto->output_photos[i];
+    const char *original = zphoto->original_photos[i];
+    int remove_p = zphoto->scratch_dir != NULL;
+
+    send_file(zphoto, preview);
+    if (remove_p && !zphoto_movie_file_p(preview)) {
+        zphoto_image_get_size(preview, &zphoto->preview_widths[i],
+                              &zphoto->preview_heights[i]);
+        remove(preview);
+    }
+    if (zphoto->config->include_original) {
+        send_file(zphoto, original);
+        if (remove_p && !create_zip_file_p(zphoto->config))
+            remove(original);
+    }
+    send_file(zphoto, zphoto->thumbnails[i]);
+    zphoto->sent_p[i] = 1;
+}
+
+/*
+ * Called on the calling thread of the jobs as each
+ * thumbnail is made.  Photos with broken thumbnails are
+ * left to check_thumbnails() and not passed.
+ */
+static void
+send_made_photo (Zphoto *zphoto, int i)
+{
+    char *reason;
+
+    if (zphoto->sent_p[i])
+        return;
+    reason = zphoto_limit_run(0, check_thumbnail, i, zphoto);
+    if (reason != NULL) {
+        free(reason);
+        return;
+    }
+    send_photo(zphoto, i);
+}
+
+/*
+ * The files of the photos not passed yet first, in the
+ * order of the album, and then the rest in the order made.
+ */
+static void
+send_outputs (Zphoto *zphoto)
+{
+    int i;
+
+    for (i = 0; i < zphoto->nphotos; i++) {
+        if (!zphoto->sent_p[i])
+            send_photo(zphoto, i);
+        send_file(zphoto, zphoto->html_file_names[i]);
+    }
+    for (i = 0; i < zphoto->nmade_files; i++)
+        send_file(zphoto, zphoto->made_files[i]);
+}
+
+/*
+ * Photos failing at any step are skipped and the album is
+ * made with the rest.  If aborted, each step stops soon and
+ * releases what it holds, and the rest are skipped.
+ */
 void
 zphoto_make_all (Zphoto *zphoto)
 {
     ZphotoConfig *config = zphoto->config;
+    ThreadState saved_state;
+    const Step *step;
     assert(zphoto->input_photos != NULL);
-    if (zphoto->nphotos == 0)
-        return;
 
-    if (setjmp(zphoto->progress->jmpbuf) == 0) {
-        zphoto_mkdir(config->output_dir);
-        copy_photos(zphoto);
-        if (config->include_original)
-            include_photos(zphoto);
-        make_thumbnails(zphoto);
-        make_flash(zphoto);
-        make_photo_html_files(zphoto);
-        make_index_html_files(zphoto);
-        if (create_zip_file_p(config))
-            make_zip_file(zphoto);
+    enter_album(zphoto, &saved_state);
+    if (continue_p(zphoto))
+        zphoto_mkdir(zphoto->output_dir);
+    zphoto->sending_p = zphoto->sink_func != NULL;
+    for (step = steps; step->name != NULL; step++) {
+        if (step_enabled_p(zphoto, step))
+            run_step(zphoto, step);
     }
+    if (zphoto->sending_p && continue_p(zphoto))
+        send_outputs(zphoto);
+    zphoto->sending_p = 0;
+    close_output_tar(zphoto);
+
+    if (config->codec_report)
+        zphoto_codec_write_report(stderr);
+    if (config->memory_report)
+        zphoto_memstat_write_report(stderr);
+    if (config->failure_report[0] != '\0')
+        write_failure_report(zphoto, config->failure_report);
+    if (zphoto->cache != NULL)
+        zphoto_cache_trim(zphoto->cache);
+    if (zphoto->trace != NULL)
+        zphoto_trace_write(zphoto->trace, config->trace);
+    if (config->profile[0] != '\0')
+        zphoto_profile_write(config->profile);
+    write_metrics(zphoto);
+    leave_album(&saved_state);
+}
+
+/*
+ * The metrics of the photos made so far.
+ */
+ZphotoMetrics *
+zphoto_get_metrics (Zphoto *zphoto)
+{
+    return zphoto->metrics;
 }
 
 void
@@ -920,6 +2510,37 @@ zphoto_set_progress (Zphoto *zphoto, ZphotoProgressFunc func, void *data)
     zphoto_progress_set_data(zphoto->progress, data);
 }
 
+/*
+ * Messages of the album are passed to func instead of the
+ * function set by zphoto_set_xprintf().  Messages of
+ * errors are followed by exit(2) unless the photo at fault
+ * can be skipped.
+ */
+void
+zphoto_set_message_func (Zphoto *zphoto, ZphotoMessageFunc func, void *data)
+{
+    zphoto->message_func = func;
+    zphoto->message_data = data;
+}
+
+/*
+ * Pass each file of the album to func from zphoto_make_all(),
+ * e.g. to upload or archive it.  The preview, the original
+ * and the thumbnail of a photo are passed on the calling
+ * thread as soon as its thumbnail is made, and the HTML
+ * files, the movie and the zip file at the end.  The output
+ * directory is still where the files are made; in the
+ * scratch directory of --output-tar, the previews and the
+ * originals are removed once passed unless the movie or
+ * the zip file is made of them.
+ */
+void
+zphoto_set_sink (Zphoto *zphoto, ZphotoSinkFunc func, void *data)
+{
+    zphoto->sink_func = func;
+    zphoto->sink_data = data;
+}
+
 void
 zphoto_abort (Zphoto *zphoto)
 {
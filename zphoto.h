@@ -6,7 +6,7 @@
 #include <dirent.h>
 #include <popt.h>
 #include <stdarg.h> /* for va_list */
-#include <setjmp.h> /* for jmp_buf */
+#include <stdint.h> /* for uint64_t */
 
 /*
  * For xgettext.
@@ -15,6 +15,16 @@
     #define N_(Text) Text
 #endif
 
+/*
+ * For functions that exit or jump out, so that the
+ * compiler knows the code after them is not reached.
+ */
+#ifdef __GNUC__
+    #define ZPHOTO_NORETURN __attribute__((noreturn))
+#else
+    #define ZPHOTO_NORETURN
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -25,14 +35,83 @@ typedef struct _ZphotoFlashMaker       ZphotoFlashMaker;
 typedef struct _ZphotoImageCopier      ZphotoImageCopier;
 typedef struct _ZphotoTemplate         ZphotoTemplate;
 typedef struct _ZphotoProgress         ZphotoProgress;
+typedef struct _ZphotoResampler        ZphotoResampler;
+typedef struct _ZphotoScheduler        ZphotoScheduler;
+typedef struct _ZphotoCache            ZphotoCache;
+typedef struct _ZphotoTrace            ZphotoTrace;
+typedef struct _ZphotoMetrics          ZphotoMetrics;
+typedef struct _ZphotoMemfiles         ZphotoMemfiles;
+typedef struct _ZphotoTar              ZphotoTar;
 typedef struct _ZphotoAlist {
     char *key;
     char *value;
     struct _ZphotoAlist *next;
 } ZphotoAlist;
 
+typedef struct _ZphotoBitmap {
+    int                 width;
+    int                 height;
+    int                 channels;  /* gray, gray+alpha, RGB or RGBA */
+    unsigned char       *data;     /* packed rows from the buffer pool */
+} ZphotoBitmap;
+
+enum {
+    ZPHOTO_CODEC_READ  = 1,
+    ZPHOTO_CODEC_WRITE = 2
+};
+
+/*
+ * Events passed to ZphotoProgressFunc in progress->event.
+ */
+enum {
+    ZPHOTO_PROGRESS_START,   /* a stage starts */
+    ZPHOTO_PROGRESS_STEP,    /* an item is done */
+    ZPHOTO_PROGRESS_FINISH,  /* the stage is finished */
+    ZPHOTO_PROGRESS_ERROR    /* file_name is skipped for reason */
+};
+
+/*
+ * Flags for zphoto_jpeg_optimize().
+ */
+enum {
+    ZPHOTO_JPEG_PROGRESSIVE    = 1,
+    ZPHOTO_JPEG_STRIP_METADATA = 2
+};
+
+/*
+ * A photo held in memory for zphoto_add_buffers().  name is
+ * used as its file name, and mtime as its time without EXIF.
+ */
+typedef struct _ZphotoBuffer {
+    const char          *name;
+    const void          *data;
+    size_t              size;
+    time_t              mtime;
+} ZphotoBuffer;
+
+typedef struct _ZphotoCodec {
+    const char          *name;
+    int                 reentrant_p;
+    int                 (*probe)         (const char *file_name, int mode);
+    ZphotoBitmap*       (*decode)        (const char *file_name);
+    ZphotoBitmap*       (*decode_scaled) (const char *file_name, 
+                                          int min_width);
+    int                 (*encode)        (ZphotoBitmap *bitmap,
+                                          const char *file_name);
+} ZphotoCodec;
+
 typedef void    (*ZphotoProgressFunc)   (ZphotoProgress *progress);
 typedef void    (*ZphotoXprintfFunc)    (const char *fmt, va_list args);
+typedef void    (*ZphotoMessageFunc)    (const char *message, void *data);
+typedef void    (*ZphotoResamplerFunc)  (const unsigned char *row, 
+                                         int y,
+                                         void *data);
+typedef void    (*ZphotoJobFunc)        (int id, void *data);
+typedef void    (*ZphotoCleanupFunc)    (void *data);
+typedef int     (*ZphotoJobDoneFunc)    (int id, void *data);
+typedef void    (*ZphotoSinkFunc)       (const char *file_name,
+                                         const void *data, size_t size,
+                                         void *sink_data);
 
 struct _ZphotoProgress {
     char                *task;
@@ -46,8 +125,13 @@ struct _ZphotoProgress {
     ZphotoProgressFunc  func;
     void                *data;
     const char          *file_name;
-    jmp_buf             jmpbuf;
-    int                 abort_p;
+    volatile int        abort_p;
+    int                 event;       /* ZPHOTO_PROGRESS_* */
+    const char          *reason;     /* of ZPHOTO_PROGRESS_ERROR */
+    double              start_seconds;
+    double              elapsed;     /* in seconds */
+    double              rate;        /* items per second so far */
+    double              eta;         /* in seconds, -1 if unknown */
 };
 
 typedef struct _MetaConfig {
@@ -64,6 +148,7 @@ typedef struct _MetaConfig {
 struct _ZphotoConfig {
     MetaConfig  *meta;
     poptContext popcon;
+    int         copy_p;  /* owns all its strings */
     char        *zphoto_url;
     char        *zip_command;
     int         html_thumbnail_width;
@@ -100,6 +185,36 @@ struct _ZphotoConfig {
     int         movie_nsamples;
     int         no_fade;
     int         quiet;
+    int         huge_pages;
+    int         codec_report;
+    int         memory_report;
+    int         optimize_jpeg;
+    int         progressive_jpeg;
+    int         strip_metadata;
+    int         no_dedup;
+    int         collapse_duplicates;
+    int         max_pixels;
+    float       max_decode_time;
+    int         max_movie_frames;
+    char        *quarantine_dir;
+    char        *failure_report;
+    char        *cache_dir;
+    char        *cache_size;
+    char        *trace;
+    char        *metrics;
+    char        *metrics_json;
+    int         slowest;
+    char        *profile;
+    char        *watch;
+    float       watch_delay;
+    char        *batch;
+    int         batch_jobs;
+    char        *output_tar;
+    int         serve;
+    int         progress_fd;
+    char        *progress_format;
+    float       progress_interval;
+    char        *memory_limit;
 
     char        *background_color;
     char        *border_inactive_color;
@@ -132,12 +247,32 @@ Zphoto*         zphoto_new               (ZphotoConfig *config);
 void            zphoto_add_file_names    (Zphoto *zphoto, 
                                           char **file_names,
                                           int nfile_names);
+void            zphoto_add_buffers       (Zphoto *zphoto,
+                                          const ZphotoBuffer *buffers,
+                                          int nbuffers);
+void            zphoto_add_fds           (Zphoto *zphoto,
+                                          char **file_names,
+                                          const int *fds,
+                                          int nfds);
 void            zphoto_destroy           (Zphoto *zphoto);
+void            zphoto_remove_stale_files (Zphoto *zphoto,
+                                           Zphoto *previous);
 int             zphoto_get_nsteps        (Zphoto *zphoto);
 void            zphoto_make_all          (Zphoto *zphoto);
+int             zphoto_make_step         (Zphoto *zphoto,
+                                          const char *name);
+char*           zphoto_make_file         (Zphoto *zphoto,
+                                          const char *name);
+ZphotoMetrics*  zphoto_get_metrics       (Zphoto *zphoto);
 void		zphoto_set_progress      (Zphoto *zphoto, 
                                           ZphotoProgressFunc func,
                                           void *data);
+void            zphoto_set_message_func  (Zphoto *zphoto,
+                                          ZphotoMessageFunc func,
+                                          void *data);
+void            zphoto_set_sink          (Zphoto *zphoto,
+                                          ZphotoSinkFunc func,
+                                          void *data);
 void            zphoto_abort             (Zphoto *zphoto);
 char*           zphoto_get_output_dir    (Zphoto *zphoto);
 
@@ -146,6 +281,7 @@ char*           zphoto_get_output_dir    (Zphoto *zphoto);
  */
 ZphotoConfig*   zphoto_config_new                (void);
 ZphotoConfig*   zphoto_config_read_rcfile        (ZphotoConfig *config);
+ZphotoConfig*   zphoto_config_copy               (ZphotoConfig *config);
 void            zphoto_config_destroy            (ZphotoConfig *config);
 void            zphoto_config_parse              (ZphotoConfig *config, 
                                                   int argc, char **argv);
@@ -153,6 +289,13 @@ void            zphoto_config_write               (ZphotoConfig *config, FILE *f
 void            zphoto_config_save_rcfile        (ZphotoConfig *config);
 void            zphoto_config_reset_flash_colors (ZphotoConfig *config);
 void            zphoto_config_reset_css_colors   (ZphotoConfig *config);
+void            zphoto_config_reset_title        (ZphotoConfig *config);
+int             zphoto_config_set                (ZphotoConfig *config,
+                                                  const char *key,
+                                                  const char *value);
+int             zphoto_config_split_line         (char *line,
+                                                  char **key,
+                                                  char **value);
 
 
 /*
@@ -223,6 +366,10 @@ void                    zphoto_image_copier_set_width   (ZphotoImageCopier
 void                    zphoto_image_copier_set_gamma   (ZphotoImageCopier 
                                                          *copier, 
                                                          double gamma);
+void                    zphoto_image_copier_set_jpeg_optimization
+                                                        (ZphotoImageCopier
+                                                         *copier,
+                                                         int flags);
 
 void                    zphoto_image_copier_set_prefix  (ZphotoImageCopier 
                                                          *copier, 
@@ -244,6 +391,369 @@ time_t                  zphoto_image_get_time           (const char *file_name,
                                                          int no_exif);
 unsigned char *         zphoto_image_get_bitmap         (const char* file_name, 
                                                          int *width, int *height);
+const ZphotoCodec*      zphoto_image_get_codec          (void);
+void                    zphoto_image_push_context       (void);
+void                    zphoto_image_pop_context        (void);
+size_t                  zphoto_image_copier_estimate_memory
+                                                        (ZphotoImageCopier
+                                                         *copier,
+                                                         const char *src,
+                                                         const char *dest);
+char*                   zphoto_image_copier_describe    (ZphotoImageCopier
+                                                         *copier,
+                                                         const char *src,
+                                                         const char *dest);
+
+/*
+ * header.c
+ */
+int                     zphoto_image_read_header        (const char 
+                                                         *file_name,
+                                                         int *width,
+                                                         int *height);
+
+/*
+ * resample.c
+ */
+ZphotoResampler*        zphoto_resampler_new            (int src_width, 
+                                                         int src_height,
+                                                         int dst_width,
+                                                         int dst_height,
+                                                         int channels,
+                                                         ZphotoResamplerFunc
+                                                         func,
+                                                         void *data);
+void                    zphoto_resampler_set_gamma      (ZphotoResampler
+                                                         *resampler,
+                                                         double gamma);
+void                    zphoto_resampler_push_row       (ZphotoResampler
+                                                         *resampler,
+                                                         const unsigned char
+                                                         *row);
+void                    zphoto_resampler_destroy        (ZphotoResampler
+                                                         *resampler);
+
+/*
+ * bitmap.c
+ */
+ZphotoBitmap*           zphoto_bitmap_new               (int width, 
+                                                         int height,
+                                                         int channels);
+void                    zphoto_bitmap_destroy           (ZphotoBitmap
+                                                         *bitmap);
+ZphotoBitmap*           zphoto_bitmap_resize            (ZphotoBitmap
+                                                         *bitmap,
+                                                         int width,
+                                                         int height,
+                                                         double gamma);
+
+/*
+ * codec.c
+ */
+void                    zphoto_codec_register           (const ZphotoCodec
+                                                         *codec);
+const ZphotoCodec*      zphoto_codec_find               (const char 
+                                                         *file_name,
+                                                         int mode);
+ZphotoBitmap*           zphoto_codec_decode             (const char
+                                                         *file_name,
+                                                         int min_width);
+void                    zphoto_codec_encode             (ZphotoBitmap
+                                                         *bitmap,
+                                                         const char
+                                                         *file_name);
+void                    zphoto_codec_record             (const char 
+                                                         *codec_name,
+                                                         const char
+                                                         *file_name,
+                                                         const char
+                                                         *operation,
+                                                         double seconds);
+void                    zphoto_codec_write_report       (FILE *fp);
+void                    zphoto_backend_lock             (void);
+void                    zphoto_backend_unlock           (void);
+
+/*
+ * jpeg.c
+ */
+int                     zphoto_jpeg_stream_copy         (const char 
+                                                         *input_file_name,
+                                                         const char
+                                                         *output_file_name,
+                                                         int max_width,
+                                                         double gamma);
+ZphotoBitmap*           zphoto_jpeg_decode              (const char
+                                                         *file_name,
+                                                         int min_width);
+int                     zphoto_jpeg_encode              (ZphotoBitmap
+                                                         *bitmap,
+                                                         const char
+                                                         *file_name);
+size_t                  zphoto_jpeg_estimate_parallel_memory
+                                                        (int width,
+                                                         int height);
+int                     zphoto_jpeg_optimize            (const char
+                                                         *input_file_name,
+                                                         const char
+                                                         *output_file_name,
+                                                         int flags);
+
+/*
+ * png.c
+ */
+ZphotoBitmap*           zphoto_png_decode               (const char
+                                                         *file_name);
+int                     zphoto_png_encode               (ZphotoBitmap
+                                                         *bitmap,
+                                                         const char
+                                                         *file_name);
+
+/*
+ * sched.c
+ */
+ZphotoScheduler*        zphoto_scheduler_new            (int nworkers,
+                                                         size_t memory_limit);
+void                    zphoto_scheduler_destroy        (ZphotoScheduler
+                                                         *scheduler);
+int                     zphoto_scheduler_run            (ZphotoScheduler
+                                                         *scheduler,
+                                                         int njobs,
+                                                         const size_t *costs,
+                                                         ZphotoJobFunc func,
+                                                         ZphotoJobDoneFunc 
+                                                         done,
+                                                         void *data);
+int                     zphoto_scheduler_get_nbusy      (void);
+
+/*
+ * limit.c
+ */
+char*                   zphoto_limit_run                (double max_seconds,
+                                                         ZphotoJobFunc func,
+                                                         int id,
+                                                         void *data);
+void                    zphoto_limit_violate            (const char *reason);
+int                     zphoto_limit_pending_p          (void);
+void                    zphoto_limit_check              (void);
+int                     zphoto_limit_trapped_p          (void);
+void                    zphoto_limit_fail               (char *message)
+                                                        ZPHOTO_NORETURN;
+void                    zphoto_limit_note_lock          (int delta);
+double                  zphoto_limit_get_remaining      (void);
+void                    zphoto_limit_push_cleanup       (ZphotoCleanupFunc
+                                                         func,
+                                                         void *data);
+void                    zphoto_limit_pop_cleanup        (void);
+void                    zphoto_limit_set_cancel_flag    (volatile int *flag);
+volatile int*           zphoto_limit_get_cancel_flag    (void);
+void                    zphoto_limit_set_movie_frames   (int nframes);
+int                     zphoto_limit_get_movie_frames   (void);
+
+/*
+ * hash.c
+ */
+uint64_t                zphoto_hash                     (const void *data,
+                                                         size_t size,
+                                                         uint64_t seed);
+uint64_t                zphoto_hash_file                (const char *file_name);
+int                     zphoto_same_contents_p          (const char *file_name1,
+                                                         const char *file_name2);
+
+/*
+ * cache.c
+ */
+ZphotoCache*            zphoto_cache_new                (const char *dir_name,
+                                                         size_t max_size);
+void                    zphoto_cache_destroy            (ZphotoCache *cache);
+int                     zphoto_cache_lookup             (ZphotoCache *cache,
+                                                         uint64_t key,
+                                                         const char *suffix);
+int                     zphoto_cache_fetch              (ZphotoCache *cache,
+                                                         uint64_t key,
+                                                         const char *suffix,
+                                                         const char *dest);
+void                    zphoto_cache_store              (ZphotoCache *cache,
+                                                         uint64_t key,
+                                                         const char *suffix,
+                                                         const char *src);
+void                    zphoto_cache_trim               (ZphotoCache *cache);
+
+/*
+ * trace.c
+ */
+ZphotoTrace*            zphoto_trace_new                (void);
+void                    zphoto_trace_destroy            (ZphotoTrace *trace);
+void                    zphoto_trace_write              (ZphotoTrace *trace,
+                                                         const char *file_name);
+void                    zphoto_trace_set_current        (ZphotoTrace *trace);
+ZphotoTrace*            zphoto_trace_get_current        (void);
+void                    zphoto_trace_set_thread_name    (const char *name);
+void                    zphoto_trace_begin              (const char *category,
+                                                         const char *name,
+                                                         const char *file_name);
+void                    zphoto_trace_end                (void);
+int                     zphoto_trace_get_depth          (void);
+void                    zphoto_trace_unwind             (int depth);
+
+/*
+ * metrics.c
+ */
+ZphotoMetrics*          zphoto_metrics_new              (void);
+void                    zphoto_metrics_destroy          (ZphotoMetrics
+                                                         *metrics);
+void                    zphoto_metrics_set_current      (ZphotoMetrics
+                                                         *metrics);
+ZphotoMetrics*          zphoto_metrics_get_current      (void);
+void                    zphoto_metrics_record_span      (const char *category,
+                                                         const char *name,
+                                                         double seconds);
+void                    zphoto_metrics_note_backend     (const char *backend);
+void                    zphoto_metrics_begin_photo      (const char *file_name,
+                                                         const char *stage);
+void                    zphoto_metrics_note_input       (size_t bytes,
+                                                         int width,
+                                                         int height);
+void                    zphoto_metrics_note_output      (size_t bytes);
+void                    zphoto_metrics_end_photo        (int failed_p);
+void                    zphoto_metrics_merge            (ZphotoMetrics
+                                                         *metrics,
+                                                         ZphotoMetrics *src);
+double                  zphoto_metrics_get_percentile   (ZphotoMetrics
+                                                         *metrics,
+                                                         const char *category,
+                                                         const char *name,
+                                                         double p);
+int                     zphoto_metrics_get_count        (ZphotoMetrics
+                                                         *metrics,
+                                                         const char *category,
+                                                         const char *name);
+int                     zphoto_metrics_get_nphotos      (ZphotoMetrics
+                                                         *metrics);
+void                    zphoto_metrics_write_prometheus (ZphotoMetrics
+                                                         *metrics,
+                                                         FILE *fp);
+void                    zphoto_metrics_write_json       (ZphotoMetrics
+                                                         *metrics,
+                                                         FILE *fp,
+                                                         int ntop);
+
+/*
+ * memstat.c
+ */
+void                    zphoto_memstat_set_stage        (const char *stage);
+const char*             zphoto_memstat_get_stage        (void);
+void                    zphoto_memstat_note_alloc       (void *ptr);
+void                    zphoto_memstat_note_free        (void *ptr);
+void                    zphoto_memstat_free             (void *ptr);
+void                    zphoto_memstat_write_report     (FILE *fp);
+
+/*
+ * profile.c
+ */
+void                    zphoto_profile_start            (void);
+void                    zphoto_profile_stop             (void);
+void                    zphoto_profile_set_stage        (const char *stage);
+const char*             zphoto_profile_get_stage        (void);
+void                    zphoto_profile_write            (const char *file_name);
+
+/*
+ * memfile.c
+ */
+ZphotoMemfiles*         zphoto_memfiles_new             (void);
+void                    zphoto_memfiles_destroy         (ZphotoMemfiles
+                                                         *memfiles);
+void                    zphoto_memfiles_add             (ZphotoMemfiles
+                                                         *memfiles,
+                                                         const char *file_name,
+                                                         const void *data,
+                                                         size_t size,
+                                                         time_t mtime);
+void                    zphoto_memfiles_add_fd          (ZphotoMemfiles
+                                                         *memfiles,
+                                                         const char *file_name,
+                                                         int fd);
+void                    zphoto_memfiles_set_current     (ZphotoMemfiles
+                                                         *memfiles);
+ZphotoMemfiles*         zphoto_memfiles_get_current     (void);
+int                     zphoto_memfile_get              (const char *file_name,
+                                                         const void **data,
+                                                         size_t *size,
+                                                         time_t *mtime);
+int                     zphoto_memfile_data_p           (const void *data);
+FILE*                   zphoto_memfile_open             (const char
+                                                         *file_name);
+char*                   zphoto_memfile_spill            (const char
+                                                         *file_name);
+
+/*
+ * tar.c
+ */
+ZphotoTar*              zphoto_tar_new                  (const char
+                                                         *file_name);
+void                    zphoto_tar_add                  (ZphotoTar *tar,
+                                                         const char *name,
+                                                         const void *data,
+                                                         size_t size);
+void                    zphoto_tar_sink                 (const char *file_name,
+                                                         const void *data,
+                                                         size_t size,
+                                                         void *sink_data);
+void                    zphoto_tar_close                (ZphotoTar *tar);
+
+/*
+ * batch.c
+ */
+void                    zphoto_batch                    (ZphotoConfig
+                                                         *config);
+
+/*
+ * watch.c
+ */
+void                    zphoto_watch                    (ZphotoConfig
+                                                         *config);
+
+/*
+ * serve.c
+ */
+void                    zphoto_serve                    (ZphotoConfig
+                                                         *config);
+
+/*
+ * pool.c
+ */
+void*                   zphoto_pool_alloc               (size_t size);
+void                    zphoto_pool_free                (void *ptr);
+void                    zphoto_pool_trim                (void);
+void                    zphoto_pool_set_huge_pages      (int huge_pages_p);
+int                     zphoto_pool_get_huge_pages      (void);
+
+/*
+ * pixel.c
+ */
+void                    zphoto_pixel_bgr_to_argb        (const unsigned char
+                                                         *src,
+                                                         unsigned int *dest,
+                                                         size_t n);
+void                    zphoto_pixel_rgb_to_argb        (const unsigned char
+                                                         *src,
+                                                         unsigned int *dest,
+                                                         size_t n);
+void                    zphoto_pixel_rgba_to_argb       (const unsigned char
+                                                         *src,
+                                                         unsigned int *dest,
+                                                         size_t n);
+void                    zphoto_pixel_argb_to_rgb        (const unsigned int
+                                                         *src,
+                                                         unsigned char *dest,
+                                                         size_t n);
+void                    zphoto_pixel_argb_to_rgba       (const unsigned int
+                                                         *src,
+                                                         unsigned char *dest,
+                                                         size_t n);
+void                    zphoto_pixel_swap_rb            (const unsigned char
+                                                         *src,
+                                                         unsigned char *dest,
+                                                         size_t n);
 
 /*
  * template.c
@@ -274,7 +784,7 @@ void            zphoto_progress_finish          (ZphotoProgress *progress);
                                                 
 void            zphoto_progress_destroy         (ZphotoProgress *progress);
 
-void            zphoto_progress_set             (ZphotoProgress *progress, 
+int             zphoto_progress_set             (ZphotoProgress *progress, 
                                                  int count,
                                                  const char *file_name);
 void            zphoto_progress_set_func        (ZphotoProgress *progress,
@@ -282,6 +792,9 @@ void            zphoto_progress_set_func        (ZphotoProgress *progress,
 void            zphoto_progress_set_data        (ZphotoProgress *progress,
                                                  void *data);
 void            zphoto_progress_abort           (ZphotoProgress *progress);
+void            zphoto_progress_error           (ZphotoProgress *progress,
+                                                 const char *file_name,
+                                                 const char *reason);
 
 /*
  * alist.c
@@ -296,20 +809,32 @@ void            zphoto_alist_destroy    (ZphotoAlist *alist);
 /*
  * util.c
  */
-void    zphoto_eprintf                  (const char *fmt, ...);
+void    zphoto_eprintf                  (const char *fmt, ...)
+                                        ZPHOTO_NORETURN;
 void    zphoto_wprintf                  (const char *fmt, ...);
 void	zphoto_set_xprintf              (ZphotoXprintfFunc func);
+void    zphoto_set_thread_message_func  (ZphotoMessageFunc func, void *data);
+ZphotoMessageFunc zphoto_get_thread_message_func (void **data);
 
 char*   zphoto_asprintf                 (const char *fmt, ...);
 FILE*   zphoto_efopen                   (const char *file_name, 
                                          const char *mode);
 void*   zphoto_emalloc                  (size_t n);
+void*   zphoto_erealloc                 (void *ptr, size_t n);
+void*   zphoto_map_file                 (const char *file_name, 
+                                         size_t *size);
+void    zphoto_unmap_file               (void *data, size_t size);
+void    zphoto_write_file               (const char *file_name,
+                                         const void *data, size_t size);
 void    zphoto_mkdir                    (const char *dir_name);
+char*   zphoto_make_temp_dir            (void);
+void    zphoto_remove_tree              (const char *dir_name);
 time_t  zphoto_get_mtime                (const char *file_name);
 char*   zphoto_strdup                   (const char *str);
 int     zphoto_file_p                   (const char *file_name);
 DIR*    zphoto_eopendir                 (const char *dir_name);
 char*   zphoto_time_string              (time_t mtime);
+char*   zphoto_format_time              (time_t time, const char *format);
 char*   zphoto_get_suffix               (const char *file_name);
 char*   zphoto_suppress_suffix          (char *file_name);
 char*   zphoto_modify_suffix            (const char *file_name, 
@@ -323,6 +848,8 @@ int     zphoto_image_file_p             (const char *file_name);
 int     zphoto_movie_file_p             (const char *file_name);
 int     zphoto_web_file_p               (const char *file_name);
 int     zphoto_dot_file_p               (const char *file_name);
+char**  zphoto_list_supported_files     (const char *dir_name,
+                                         int *nfiles);
 int     zphoto_path_exist_p             (const char *file_name);
 int     zphoto_support_movie_p          (void);
 int     zphoto_support_image_p          (void);
@@ -348,9 +875,20 @@ char*   zphoto_expand_path              (const char *path, const char *dir_name)
 int     zphoto_directory_p              (const char *dir_name);
 int     zphoto_directory_empty_p        (const char *dir_name);
 char*	zphoto_escape_url		(const char *url);
+char*   zphoto_escape_json              (const char *str);
 char*	zphoto_get_program_file_name    (void);
 char**  zphoto_get_image_suffixes       (void);
 char**  zphoto_get_movie_suffixes       (void);
+double  zphoto_get_time                 (void);
+void    zphoto_sort_doubles             (double *values, int n);
+double  zphoto_percentile               (const double *sorted, int n,
+                                         double p);
+int     zphoto_get_ncpus                (void);
+size_t  zphoto_get_physical_memory      (void);
+size_t  zphoto_parse_size               (const char *str);
+int     zphoto_link_file                (const char *src, const char *dest);
+void    zphoto_copy_file                (const char *src, const char *dest);
+void    zphoto_restore_mtime            (const char *file_name, time_t mtime);
 
 
 #define ZPHOTO_BACKGROUND_COLOR           "#ffffff"